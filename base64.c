@@ -47,7 +47,8 @@
 #endif
 
 /* c */
-#include <ctype.h>
+#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -55,6 +56,8 @@
 #include "base64.h"
 
 static const char Base64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char Base64URL[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 static const char Pad64 = '=';
 
@@ -121,163 +124,277 @@ static const char Pad64 = '=';
 	   characters followed by one "=" padding character.
    */
 
+/* Decoding looks every character up once.  The low six bits of an entry hold
+ * its value; the high bits classify everything that is not a plain letter or
+ * digit, so a single mask test tells whether a quantum needs a closer look.
+ */
+#define TAG_STD		0x0100	/* '+' and '/' */
+#define TAG_URL		0x0200	/* '-' and '_' */
+#define TAG_SPACE	0x0400
+#define TAG_PAD		0x0800
+#define TAG_INVALID	0x1000
+#define TAG_ALL		(TAG_STD | TAG_URL | TAG_SPACE | TAG_PAD | TAG_INVALID)
+
+static const uint16_t Decode64[256] = {
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x0400, 0x0400, 0x0400, 0x0400, 0x0400, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x0400, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x013e, 0x1000, 0x023e, 0x1000, 0x013f,
+	0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003a, 0x003b,
+	0x003c, 0x003d, 0x1000, 0x1000, 0x1000, 0x0800, 0x1000, 0x1000,
+	0x1000, 0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006,
+	0x0007, 0x0008, 0x0009, 0x000a, 0x000b, 0x000c, 0x000d, 0x000e,
+	0x000f, 0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016,
+	0x0017, 0x0018, 0x0019, 0x1000, 0x1000, 0x1000, 0x1000, 0x023f,
+	0x1000, 0x001a, 0x001b, 0x001c, 0x001d, 0x001e, 0x001f, 0x0020,
+	0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027, 0x0028,
+	0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f, 0x0030,
+	0x0031, 0x0032, 0x0033, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+	0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000,
+};
+
 int
-b64_ntop(src, srclength, target, targsize)
-	unsigned char const *src;
-	size_t srclength;
-	char *target;
-	size_t targsize;
+b64_encode(const unsigned char *src, size_t srclength,
+    char *target, size_t targsize, unsigned flags)
 {
-	size_t datalength = 0;
-	unsigned char input[3];
-	unsigned char output[4];
+	const char *alphabet = (flags & B64_STD) ? Base64 : Base64URL;
+	const size_t whole = srclength / 3 * 3;
+	size_t datalength = srclength / 3 * 4;
+	uint32_t v;
 	size_t i;
 
-	while (2 < srclength) {
-		input[0] = *src++;
-		input[1] = *src++;
-		input[2] = *src++;
-		srclength -= 3;
-
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
-		output[3] = input[2] & 0x3f;
+	if (srclength % 3)
+		datalength += (flags & B64_PADDED) ? 4 : srclength % 3 + 1;
+	/* Checked once up front, with room for the NUL. */
+	if (datalength + !(flags & B64_UNTERMINATED) > targsize)
+		return (-1);
 
-		if (datalength + 4 > targsize)
-			return (-1);
-		target[datalength++] = Base64[output[0]];
-		target[datalength++] = Base64[output[1]];
-		target[datalength++] = Base64[output[2]];
-		target[datalength++] = Base64[output[3]];
+	for (i = 0; i < whole; i += 3) {
+		v = ((uint32_t)src[i] << 16) | ((uint32_t)src[i + 1] << 8) | src[i + 2];
+		*target++ = alphabet[(v >> 18) & 0x3f];
+		*target++ = alphabet[(v >> 12) & 0x3f];
+		*target++ = alphabet[(v >> 6) & 0x3f];
+		*target++ = alphabet[v & 0x3f];
 	}
-    
-	/* Now we worry about padding. */
-	if (0 != srclength) {
-		/* Get what's left. */
-		input[0] = input[1] = input[2] = '\0';
-		for (i = 0; i < srclength; i++)
-			input[i] = *src++;
-	
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
-
-		if (datalength + 4 > targsize)
-			return (-1);
-		target[datalength++] = Base64[output[0]];
-		target[datalength++] = Base64[output[1]];
-        if (srclength != 1)
-			target[datalength++] = Base64[output[2]];
+
+	if (whole != srclength) {
+		v = (uint32_t)src[whole] << 16;
+		if (srclength - whole == 2)
+			v |= (uint32_t)src[whole + 1] << 8;
+		*target++ = alphabet[(v >> 18) & 0x3f];
+		*target++ = alphabet[(v >> 12) & 0x3f];
+		if (srclength - whole == 2)
+			*target++ = alphabet[(v >> 6) & 0x3f];
+		else if (flags & B64_PADDED)
+			*target++ = Pad64;
+		if (flags & B64_PADDED)
+			*target++ = Pad64;
 	}
-	if (datalength >= targsize)
-		return (-1);
-	target[datalength] = '\0';	/* Returned value doesn't count \0. */
+
+	if (!(flags & B64_UNTERMINATED))
+		*target = '\0';	/* Returned value doesn't count \0. */
 	return (datalength);
 }
 
-/* skips all whitespace anywhere.
-   converts characters, four at a time, starting at (or after)
-   src from base - 64 numbers into three 8 bit bytes in the target area.
-   it returns the number of data bytes stored at the target, or -1 on error.
- */
-
 int
-b64_pton(src, target, targsize)
-	char const *src;
-	unsigned char *target;
-	size_t targsize;
+b64_ntop(const unsigned char *src, size_t srclength,
+    char *target, size_t targsize)
 {
-    size_t tarindex;
-	int state, ch;
-	unsigned char nextbyte;
-	char *pos;
-
-	state = 0;
-	tarindex = 0;
-
-	while ((ch = (unsigned char)*src++) != '\0') {
-		if (isspace(ch))	/* Skip whitespace anywhere. */
-			continue;
+	return b64_encode(src, srclength, target, targsize, B64_URL);
+}
 
-		if (ch == Pad64)
-			break;
+/* Decoding proceeds a quantum of four characters at a time while they are
+ * plain, and falls back to one character at a time around whitespace,
+ * padding, and anything malformed.
+ */
+int
+b64_decode(const char *src, size_t srclength,
+    unsigned char *target, size_t targsize, unsigned flags)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	const unsigned char *const end = s + srclength;
+	const int tolerant = (flags & B64_TOLERANT) != 0;
+	unsigned reject = TAG_ALL;
+	size_t tarindex = 0;
+	uint32_t bits = 0;
+	unsigned n = 0;
+	unsigned pads = 0;
+	unsigned t;
 
-		if (ch == '+')
-			ch = '-';
+	assert(target);
 
-		if (ch == '/')
-			ch = '_';
+	if (tolerant || (flags & B64_STD))
+		reject &= ~TAG_STD;
+	if (tolerant || (flags & B64_URL))
+		reject &= ~TAG_URL;
 
-		pos = strchr(Base64, ch);
-		if (pos == 0) 		/* A non-base64 character. */
-			return (-1);
+	while (s < end) {
+		if (n == 0 && end - s >= 4) {
+			const unsigned a = Decode64[s[0]];
+			const unsigned b = Decode64[s[1]];
+			const unsigned c = Decode64[s[2]];
+			const unsigned d = Decode64[s[3]];
 
-		switch (state) {
-		case 0:
-			if (target) {
-				if (tarindex >= targsize)
-					return (-1);
-				target[tarindex] = (pos - Base64) << 2;
-			}
-			state = 1;
-			break;
-		case 1:
-			if (target) {
-				if (tarindex >= targsize)
-					return (-1);
-				target[tarindex]   |=  (pos - Base64) >> 4;
-				nextbyte = ((pos - Base64) & 0x0f) << 4;
-				if (tarindex + 1 < targsize)
-					target[tarindex+1] = nextbyte;
-				else if (nextbyte)
+			if (((a | b | c | d) & reject) == 0) {
+				if (targsize - tarindex < 3)
 					return (-1);
+				bits = ((a & 0x3f) << 18) | ((b & 0x3f) << 12) |
+				    ((c & 0x3f) << 6) | (d & 0x3f);
+				target[tarindex++] = bits >> 16;
+				target[tarindex++] = bits >> 8;
+				target[tarindex++] = bits;
+				bits = 0;
+				s += 4;
+				continue;
 			}
-			tarindex++;
-			state = 2;
-			break;
-		case 2:
-			if (target) {
-				if (tarindex >= targsize)
-					return (-1);
-				target[tarindex]   |=  (pos - Base64) >> 2;
-				nextbyte = ((pos - Base64) & 0x03) << 6;
-				if (tarindex + 1 < targsize)
-					target[tarindex+1] = nextbyte;
-				else if (nextbyte)
-					return (-1);
-			}
-			tarindex++;
-			state = 3;
-			break;
-		case 3:
-			if (target) {
-				if (tarindex >= targsize)
-					return (-1);
-				target[tarindex] |= (pos - Base64);
+		}
+
+		t = Decode64[*s];
+
+		if (t & reject) {
+			if (tolerant && *s == '\0')
+				break;
+			if (tolerant && (t & TAG_SPACE)) {
+				++s;
+				continue;
 			}
-			tarindex++;
-			state = 0;
+			if (!(t & TAG_PAD))
+				return (-1);
 			break;
-        default:
-            break;
 		}
+
+		bits = (bits << 6) | (t & 0x3f);
+		++s;
+
+		if (++n == 4) {
+			if (targsize - tarindex < 3)
+				return (-1);
+			target[tarindex++] = bits >> 16;
+			target[tarindex++] = bits >> 8;
+			target[tarindex++] = bits;
+			bits = 0;
+			n = 0;
+		}
+	}
+
+	/* Skip padding, and in tolerant mode whitespace, to the end. */
+	for (; s < end && (!tolerant || *s != '\0'); ++s) {
+		t = Decode64[*s];
+		if (t & TAG_PAD)
+			++pads;
+		else if (!tolerant || !(t & TAG_SPACE))
+			return (-1);
 	}
 
-	/* Skip padding and whitespace */
-	if (ch == Pad64) {
-		while (*src != '\0') {
-			if (!isspace(*src) && *src != Pad64) {
+	if (!tolerant) {
+		if (flags & B64_PADDED) {
+			if (n != 0 && pads != 4 - n)
 				return (-1);
-			}
-			++src;
+			if (n == 0 && pads != 0)
+				return (-1);
+		} else if (pads != 0) {
+			return (-1);
 		}
 	}
 
-	if (target && tarindex < targsize &&
-	    target[tarindex] != 0 && state != 0) {
+	switch (n) {
+	case 0:
+		break;
+	case 1:
+		/* A lone zero character is ignored, as it always has been. */
+		if (tolerant && bits == 0 && tarindex < targsize)
+			break;
 		return (-1);
+	case 2:
+		if ((bits & 0xf) != 0 || targsize - tarindex < 1)
+			return (-1);
+		target[tarindex++] = bits >> 4;
+		break;
+	case 3:
+		if ((bits & 0x3) != 0 || targsize - tarindex < 2)
+			return (-1);
+		target[tarindex++] = bits >> 10;
+		target[tarindex++] = bits >> 2;
+		break;
+	default:
+		abort();
 	}
 
 	return (tarindex);
 }
+
+int
+b64_decode_quantum(const char *src, size_t srclength,
+    unsigned char *target, unsigned flags)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned reject = TAG_ALL;
+	uint32_t bits = 0;
+	unsigned t = 0;
+	size_t i;
+
+	if (flags & B64_STD)
+		reject &= ~TAG_STD;
+	if (flags & B64_URL)
+		reject &= ~TAG_URL;
+	if (srclength < 2 || srclength > 4)
+		return (-1);
+
+	for (i = 0; i < srclength; ++i) {
+		t |= Decode64[s[i]];
+		bits = (bits << 6) | (Decode64[s[i]] & 0x3f);
+	}
+
+	/* The spare bits of a partial quantum must be zero. */
+	bits <<= 6 * (4 - srclength);
+	if ((t & reject) || (bits & (0xffffffU >> (8 * (srclength - 1)))))
+		return (-1);
+
+	target[0] = bits >> 16;
+	target[1] = bits >> 8;
+	target[2] = bits;
+	return (srclength - 1);
+}
+
+unsigned
+b64_class(char ch)
+{
+	const unsigned t = Decode64[(unsigned char)ch];
+
+	if (t & TAG_SPACE)
+		return (B64_CLASS_SPACE);
+	if (t & TAG_PAD)
+		return (B64_CLASS_PAD);
+	if (t & TAG_INVALID)
+		return (B64_CLASS_INVALID);
+	return (B64_CLASS_VALUE);
+}
+
+/* skips all whitespace anywhere.
+   converts characters, four at a time, starting at (or after)
+   src from base - 64 numbers into three 8 bit bytes in the target area.
+   it returns the number of data bytes stored at the target, or -1 on error.
+ */
+
+int
+b64_pton(char const *src, unsigned char *target, size_t targsize)
+{
+	return b64_decode(src, strlen(src), target, targsize, B64_TOLERANT);
+}
@@ -29,10 +29,60 @@
 #ifndef macaroons_base64_h_
 #define macaroons_base64_h_
 
+/* C */
+#include <stddef.h>
+
+/* accept (decode) or emit (encode) the standard alphabet's '+' and '/' */
+#define B64_STD 1U
+/* accept (decode) or emit (encode) the URL-safe alphabet's '-' and '_';
+ * encoding uses it unless B64_STD is given */
+#define B64_URL 2U
+/* require (decode) or emit (encode) '=' padding to a multiple of four */
+#define B64_PADDED 4U
+/* decode what b64_pton always has: skip whitespace anywhere, accept either
+ * alphabet, optional padding, and stop at a NUL; other flags are ignored */
+#define B64_TOLERANT 8U
+/* encode without the NUL, so targsize need only hold the characters; src may
+ * then be the last srclength bytes of target, as each quantum is read before
+ * it is overwritten (not with B64_PADDED) */
+#define B64_UNTERMINATED 16U
+
+/* encode srclength bytes and NUL-terminate unless B64_UNTERMINATED; returns
+ * the length without the NUL, or -1 if target is too small */
+int
+b64_encode(const unsigned char* src, size_t srclength,
+           char* target, size_t targsize, unsigned flags);
+
+/* decode srclength characters; without B64_TOLERANT the input must be exactly
+ * base64 in the chosen alphabets with no trailing bits set; returns the number
+ * of bytes written, or -1 */
+int
+b64_decode(const char* src, size_t srclength,
+           unsigned char* target, size_t targsize, unsigned flags);
+
+/* decode a single quantum of two to four characters, without padding or
+ * whitespace, into the three bytes at target; returns the number of bytes it
+ * holds, or -1 if malformed */
+int
+b64_decode_quantum(const char* src, size_t srclength,
+                   unsigned char* target, unsigned flags);
+
+/* how b64_decode with B64_TOLERANT treats a character: a value in either
+ * alphabet, whitespace it skips, padding, or anything else (including NUL) */
+#define B64_CLASS_VALUE 0U
+#define B64_CLASS_SPACE 1U
+#define B64_CLASS_PAD 2U
+#define B64_CLASS_INVALID 3U
+
+unsigned
+b64_class(char ch);
+
+/* URL-safe and unpadded */
 int
 b64_ntop(const unsigned char* src, size_t srclength,
          char* target, size_t targsize);
 
+/* tolerant decoding of a NUL-terminated string */
 int
 b64_pton(const char* src,
          unsigned char* target, size_t targsize);
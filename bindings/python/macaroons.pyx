@@ -59,6 +59,17 @@ cdef extern from "macaroons.h":
     macaroon* macaroon_add_third_party_caveat(const macaroon* M, const unsigned char* location, size_t location_sz, const unsigned char* key, size_t key_sz, const unsigned char* id, size_t id_sz, macaroon_returncode* err)
     unsigned macaroon_num_third_party_caveats(const macaroon* M)
     int macaroon_third_party_caveat(const macaroon* M, unsigned which, const unsigned char** location, size_t* location_sz, const unsigned char** identifier, size_t* identifier_sz)
+    cdef struct macaroon_caveat:
+        const unsigned char* cid
+        size_t cid_sz
+        const unsigned char* vid
+        size_t vid_sz
+        const unsigned char* cl
+        size_t cl_sz
+    cdef struct macaroon_caveat_cursor:
+        pass
+    void macaroon_caveat_cursor_init(macaroon_caveat_cursor* C, const macaroon* M)
+    int macaroon_caveat_cursor_next(macaroon_caveat_cursor* C, macaroon_caveat* caveat)
     macaroon* macaroon_prepare_for_request(const macaroon* M, const macaroon* D, macaroon_returncode* err)
     macaroon_verifier* macaroon_verifier_create()
     void macaroon_verifier_destroy(macaroon_verifier* V)
@@ -77,6 +88,8 @@ cdef extern from "macaroons.h":
         MACAROON_V1
         MACAROON_V2
         MACAROON_V2J
+        MACAROON_V2D
+        MACAROON_V2_B64URL
     cdef macaroon_format MACAROON_LATEST
     cdef macaroon_format MACAROON_LATEST_JSON
     size_t macaroon_serialize_size_hint(const macaroon* M, macaroon_format f)
@@ -206,19 +219,26 @@ cdef class Macaroon:
         M.assert_not_null()
         return macaroon_cmp(self._M, M._M) == 0
 
+    def first_party_caveats(self):
+        self.assert_not_null()
+        cdef macaroon_caveat_cursor C
+        cdef macaroon_caveat caveat
+        predicates = []
+        macaroon_caveat_cursor_init(&C, self._M)
+        while macaroon_caveat_cursor_next(&C, &caveat) == 0:
+            if caveat.vid_sz == 0:
+                predicates.append(caveat.cid[:caveat.cid_sz])
+        return predicates
+
     def third_party_caveats(self):
         self.assert_not_null()
-        cdef const unsigned char* location = NULL
-        cdef size_t location_sz = 0
-        cdef const unsigned char* identifier = NULL
-        cdef size_t identifier_sz = 0
-        cdef unsigned num = macaroon_num_third_party_caveats(self._M)
+        cdef macaroon_caveat_cursor C
+        cdef macaroon_caveat caveat
         ids = []
-        for i in range(num):
-            if macaroon_third_party_caveat(self._M, i,
-                    &location, &location_sz, &identifier, &identifier_sz) < 0:
-                raise_error(MACAROON_INVALID)
-            ids.append((location[:location_sz], identifier[:identifier_sz]))
+        macaroon_caveat_cursor_init(&C, self._M)
+        while macaroon_caveat_cursor_next(&C, &caveat) == 0:
+            if caveat.vid_sz > 0 and caveat.cl_sz > 0:
+                ids.append((caveat.cl[:caveat.cl_sz], caveat.cid[:caveat.cid_sz]))
         return ids
 
     def prepare_for_request(self, Macaroon D):
@@ -0,0 +1,223 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* C */
+#include <assert.h>
+#include <string.h>
+
+/* macaroons */
+#include "constants.h"
+#include "macaroons.h"
+#include "macaroons-inner.h"
+#include "port.h"
+
+struct request_cache_entry
+{
+    unsigned char root[MACAROON_HASH_BYTES];
+    unsigned char discharge[MACAROON_HASH_BYTES];
+    struct macaroon* bound;
+    unsigned char* data;
+    size_t data_sz;
+};
+
+struct macaroon_request_cache
+{
+    enum macaroon_format format;
+    size_t num_entries;
+    struct request_cache_entry entries[1];
+};
+
+MACAROON_API struct macaroon_request_cache*
+macaroon_request_cache_create(size_t num_entries, enum macaroon_format f)
+{
+    struct macaroon_request_cache* C = NULL;
+    size_t sz = 0;
+
+    if (num_entries == 0)
+    {
+        return NULL;
+    }
+
+    sz = sizeof(struct macaroon_request_cache)
+       + (num_entries - 1) * sizeof(struct request_cache_entry);
+    C = macaroon_alloc(NULL, sz);
+
+    if (!C)
+    {
+        return NULL;
+    }
+
+    memset(C, 0, sz);
+    C->format = f;
+    C->num_entries = num_entries;
+    return C;
+}
+
+static void
+request_cache_evict(struct request_cache_entry* E)
+{
+    macaroon_destroy(E->bound);
+    macaroon_dealloc(NULL, E->data);
+    memset(E, 0, sizeof(struct request_cache_entry));
+}
+
+MACAROON_API void
+macaroon_request_cache_destroy(struct macaroon_request_cache* C)
+{
+    size_t i;
+
+    if (!C)
+    {
+        return;
+    }
+
+    for (i = 0; i < C->num_entries; ++i)
+    {
+        request_cache_evict(&C->entries[i]);
+    }
+
+    macaroon_dealloc(NULL, C);
+}
+
+/* B is D as bound by an earlier call, so only their signatures may differ.
+ * The HMAC covers neither a discharge's location nor its caveats' locations,
+ * so two discharges with the same signature may still differ there.
+ */
+static int
+request_cache_same_discharge(const struct macaroon* B, const struct macaroon* D)
+{
+    struct caveat_walk BW;
+    struct caveat_walk DW;
+    const struct caveat* BC;
+    const struct caveat* DC;
+    struct caveat btmp;
+    struct caveat dtmp;
+    int same = 0;
+
+    if (B->num_caveats != D->num_caveats ||
+        slice_cmp(&B->location, &D->location) != 0 ||
+        slice_cmp(&B->identifier, &D->identifier) != 0)
+    {
+        return 0;
+    }
+
+    caveat_walk_init(&BW, B);
+    caveat_walk_init(&DW, D);
+    same = 1;
+
+    while (same && (BC = caveat_walk_next(&BW, &btmp)) &&
+                   (DC = caveat_walk_next(&DW, &dtmp)))
+    {
+        same = slice_cmp(&BC->cid, &DC->cid) == 0 &&
+               slice_cmp(&BC->vid, &DC->vid) == 0 &&
+               slice_cmp(&BC->cl, &DC->cl) == 0;
+    }
+
+    caveat_walk_done(&BW);
+    caveat_walk_done(&DW);
+    return same;
+}
+
+MACAROON_API int
+macaroon_request_cache_get(struct macaroon_request_cache* C,
+                           const struct macaroon* M,
+                           const struct macaroon* D,
+                           const struct macaroon** bound,
+                           const unsigned char** data, size_t* data_sz,
+                           enum macaroon_returncode* err)
+{
+    struct request_cache_entry* E = NULL;
+    size_t idx = 0;
+    size_t sz = 0;
+    unsigned i;
+
+    assert(C);
+
+    if (M->signature.size != MACAROON_HASH_BYTES ||
+        D->signature.size != MACAROON_HASH_BYTES)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    /* signatures are HMAC outputs, so any of their bytes make a good hash */
+    for (i = 0; i < sizeof(size_t); ++i)
+    {
+        idx = (idx << 8) | (M->signature.data[i] ^ D->signature.data[i]);
+    }
+
+    E = &C->entries[idx % C->num_entries];
+
+    if (!E->bound ||
+        macaroon_memcmp(E->root, M->signature.data, MACAROON_HASH_BYTES) != 0 ||
+        macaroon_memcmp(E->discharge, D->signature.data, MACAROON_HASH_BYTES) != 0 ||
+        !request_cache_same_discharge(E->bound, D))
+    {
+        request_cache_evict(E);
+        E->bound = macaroon_prepare_for_request(M, D, err);
+
+        if (!E->bound)
+        {
+            return -1;
+        }
+
+        sz = macaroon_serialize_size_hint(E->bound, C->format);
+        E->data = macaroon_alloc(NULL, sz);
+
+        if (!E->data)
+        {
+            request_cache_evict(E);
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
+        }
+
+        E->data_sz = macaroon_serialize(E->bound, C->format, E->data, sz, err);
+
+        if (E->data_sz == 0)
+        {
+            request_cache_evict(E);
+            return -1;
+        }
+
+        memmove(E->root, M->signature.data, MACAROON_HASH_BYTES);
+        memmove(E->discharge, D->signature.data, MACAROON_HASH_BYTES);
+    }
+
+    if (bound)
+    {
+        *bound = E->bound;
+    }
+
+    *data = E->data;
+    *data_sz = E->data_sz;
+    return 0;
+}
@@ -0,0 +1,365 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* C */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "macaroons-inner.h"
+#include "dictionary.h"
+
+/* Loaded dictionaries are never freed: a version, once loaded, is fixed for
+ * the life of the process, so readers need no locks.
+ */
+static const struct macaroon_dictionary* dictionaries[256];
+static const struct macaroon_dictionary* current;
+static pthread_mutex_t dictionaries_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+const struct macaroon_dictionary*
+macaroon_dictionary_current(void)
+{
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+const struct macaroon_dictionary*
+macaroon_dictionary_find(unsigned version)
+{
+    return version < 256 ? __atomic_load_n(&dictionaries[version], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* lexicographic, so that a prefix sorts before everything it begins */
+static int
+dictionary_cmp(const void* lhs, const void* rhs)
+{
+    const struct slice* l = lhs;
+    const struct slice* r = rhs;
+    const size_t sz = l->size < r->size ? l->size : r->size;
+    int cmp = memcmp(l->data, r->data, sz);
+
+    if (cmp != 0 || l->size == r->size)
+    {
+        return cmp;
+    }
+
+    return l->size < r->size ? -1 : 1;
+}
+
+static int
+dictionary_is_prefix(const struct slice* prefix, const struct slice* f)
+{
+    return prefix->size <= f->size && memcmp(prefix->data, f->data, prefix->size) == 0;
+}
+
+size_t
+macaroon_dictionary_match(const struct macaroon_dictionary* D, const struct slice* f)
+{
+    size_t lo = 0;
+    size_t hi = D->num_entries;
+    size_t mid;
+    size_t i;
+
+    /* Every entry that prefixes f sorts between itself and f, and so is also
+     * a prefix of the last entry not after f; walk that entry's prefixes. */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+
+        if (dictionary_cmp(&D->entries[mid], f) <= 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    for (i = lo > 0 ? lo - 1 : DICTIONARY_NONE; i != DICTIONARY_NONE; i = D->parent[i])
+    {
+        if (dictionary_is_prefix(&D->entries[i], f))
+        {
+            return i;
+        }
+    }
+
+    return DICTIONARY_NONE;
+}
+
+static unsigned char*
+dictionary_read(const char* path, size_t* sz)
+{
+    unsigned char* buf = NULL;
+    unsigned char* tmp = NULL;
+    size_t cap = 0;
+    size_t amt = 0;
+    FILE* fp = fopen(path, "rb");
+
+    *sz = 0;
+
+    if (!fp)
+    {
+        return NULL;
+    }
+
+    do
+    {
+        if (*sz == cap)
+        {
+            cap = cap ? 2 * cap : 4096;
+            tmp = macaroon_realloc(NULL, buf, cap);
+
+            if (!tmp)
+            {
+                break;
+            }
+
+            buf = tmp;
+        }
+
+        amt = fread(buf + *sz, 1, cap - *sz, fp);
+        *sz += amt;
+    } while (amt > 0);
+
+    if (!tmp || ferror(fp))
+    {
+        macaroon_dealloc(NULL, buf);
+        buf = NULL;
+    }
+
+    fclose(fp);
+    return buf;
+}
+
+/* Split the file into lines, skipping blank lines and # comments.  The first
+ * line is "version N"; the rest are the entries.
+ */
+static int
+dictionary_parse(struct macaroon_dictionary* D, size_t bytes_sz)
+{
+    const unsigned char* ptr = D->bytes;
+    const unsigned char* const end = D->bytes + bytes_sz;
+    const unsigned char* nl = NULL;
+    struct slice line;
+    char version[16];
+    unsigned long v = 0;
+    char* v_end = NULL;
+    int have_version = 0;
+
+    while (ptr < end)
+    {
+        nl = memchr(ptr, '\n', end - ptr);
+        nl = nl ? nl : end;
+        line.data = ptr;
+        line.size = nl - ptr;
+        ptr = nl < end ? nl + 1 : end;
+
+        if (line.size > 0 && line.data[line.size - 1] == '\r')
+        {
+            --line.size;
+        }
+
+        if (line.size == 0 || line.data[0] == '#')
+        {
+            continue;
+        }
+
+        if (have_version)
+        {
+            D->entries[D->num_entries++] = line;
+            continue;
+        }
+
+        if (line.size < 9 || line.size >= 8 + sizeof(version) ||
+            memcmp(line.data, "version ", 8) != 0)
+        {
+            return -1;
+        }
+
+        memcpy(version, line.data + 8, line.size - 8);
+        version[line.size - 8] = '\0';
+        v = strtoul(version, &v_end, 10);
+
+        if (*v_end != '\0' || v == 0 || v > 255)
+        {
+            return -1;
+        }
+
+        D->version = v;
+        have_version = 1;
+    }
+
+    return have_version ? 0 : -1;
+}
+
+static int
+dictionary_equal(const struct macaroon_dictionary* lhs, const struct macaroon_dictionary* rhs)
+{
+    size_t i;
+
+    if (lhs->num_entries != rhs->num_entries)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < lhs->num_entries; ++i)
+    {
+        if (dictionary_cmp(&lhs->entries[i], &rhs->entries[i]) != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+dictionary_destroy(struct macaroon_dictionary* D)
+{
+    macaroon_dealloc(NULL, D->entries);
+    macaroon_dealloc(NULL, D->parent);
+    macaroon_dealloc(NULL, D->bytes);
+    macaroon_dealloc(NULL, D);
+}
+
+static struct macaroon_dictionary*
+dictionary_create(const char* path, enum macaroon_returncode* err)
+{
+    struct macaroon_dictionary* D = NULL;
+    size_t bytes_sz = 0;
+    size_t lines = 1;
+    size_t i;
+    size_t j;
+
+    D = macaroon_alloc(NULL, sizeof(struct macaroon_dictionary));
+
+    if (!D)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    memset(D, 0, sizeof(struct macaroon_dictionary));
+    D->bytes = dictionary_read(path, &bytes_sz);
+
+    for (i = 0; D->bytes && i < bytes_sz; ++i)
+    {
+        lines += D->bytes[i] == '\n';
+    }
+
+    D->entries = D->bytes ? macaroon_alloc(NULL, lines * sizeof(struct slice)) : NULL;
+    D->parent = D->bytes ? macaroon_alloc(NULL, lines * sizeof(size_t)) : NULL;
+
+    if (!D->entries || !D->parent || dictionary_parse(D, bytes_sz) < 0)
+    {
+        *err = MACAROON_INVALID;
+        goto fail;
+    }
+
+    qsort(D->entries, D->num_entries, sizeof(struct slice), dictionary_cmp);
+
+    /* drop duplicates, then link each entry to its longest prefix, which is on
+     * the chain of prefixes of the entry before it */
+    for (i = 0, j = 0; i < D->num_entries; ++i)
+    {
+        if (j == 0 || dictionary_cmp(&D->entries[j - 1], &D->entries[i]) != 0)
+        {
+            D->entries[j++] = D->entries[i];
+        }
+    }
+
+    D->num_entries = j;
+
+    for (i = 0; i < D->num_entries; ++i)
+    {
+        j = i > 0 ? i - 1 : DICTIONARY_NONE;
+
+        while (j != DICTIONARY_NONE && !dictionary_is_prefix(&D->entries[j], &D->entries[i]))
+        {
+            j = D->parent[j];
+        }
+
+        D->parent[i] = j;
+    }
+
+    return D;
+
+fail:
+    dictionary_destroy(D);
+    return NULL;
+}
+
+MACAROON_API int
+macaroon_dictionary_load(const char* path, enum macaroon_returncode* err)
+{
+    struct macaroon_dictionary* D = dictionary_create(path, err);
+    int ret = -1;
+
+    if (!D)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dictionaries_mtx);
+
+    if (!dictionaries[D->version])
+    {
+        __atomic_store_n(&dictionaries[D->version], D, __ATOMIC_RELEASE);
+        __atomic_store_n(&current, D, __ATOMIC_RELEASE);
+        ret = D->version;
+        D = NULL;
+    }
+    else if (dictionary_equal(dictionaries[D->version], D))
+    {
+        __atomic_store_n(&current, dictionaries[D->version], __ATOMIC_RELEASE);
+        ret = D->version;
+    }
+
+    pthread_mutex_unlock(&dictionaries_mtx);
+
+    /* a version cannot change once loaded, but loading it again makes it the
+     * one written with */
+    if (ret < 0)
+    {
+        *err = MACAROON_INVALID;
+    }
+
+    if (D)
+    {
+        dictionary_destroy(D);
+    }
+
+    return ret;
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef macaroons_dictionary_h_
+#define macaroons_dictionary_h_
+
+/* C */
+#include <stdlib.h>
+
+/* macaroons */
+#include "slice.h"
+
+/* A shared dictionary for MACAROON_V2D.  Entries are sorted lexicographically,
+ * so both sides number them identically, and parent[i] is the longest entry
+ * that is a proper prefix of entry i, or DICTIONARY_NONE.
+ */
+#define DICTIONARY_NONE ((size_t)-1)
+
+struct macaroon_dictionary
+{
+    unsigned version;
+    size_t num_entries;
+    struct slice* entries;
+    size_t* parent;
+    unsigned char* bytes;
+};
+
+/* the most recently loaded dictionary, or NULL */
+const struct macaroon_dictionary*
+macaroon_dictionary_current(void);
+
+/* the loaded dictionary with the version, or NULL */
+const struct macaroon_dictionary*
+macaroon_dictionary_find(unsigned version);
+
+/* the index of the longest entry that is a prefix of f, or DICTIONARY_NONE */
+size_t
+macaroon_dictionary_match(const struct macaroon_dictionary* D, const struct slice* f);
+
+#endif /* macaroons_dictionary_h_ */
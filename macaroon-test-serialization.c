@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 /* macaroons */
 #include "macaroons.h"
@@ -49,6 +50,243 @@ struct parsed_macaroon
     enum macaroon_format F;
 };
 
+/* deserialize_into agrees with deserialize, and fails short of the size */
+static int
+check_into(const struct macaroon* M, const unsigned char* buf, size_t buf_sz)
+{
+    enum macaroon_returncode err;
+    size_t into_sz = macaroon_deserialize_size(buf, buf_sz, &err);
+    void* into = into_sz ? malloc(into_sz) : NULL;
+    struct macaroon* N = NULL;
+    int ret = 0;
+
+    if (!into)
+    {
+        fprintf(stderr, "could not size macaroon: %s\n", macaroon_error(err));
+        return -1;
+    }
+
+    if (macaroon_deserialize_into(buf, buf_sz, into, into_sz - 1, &err) ||
+        err != MACAROON_BUF_TOO_SMALL)
+    {
+        fprintf(stderr, "deserialized into a short buffer\n");
+        ret = -1;
+    }
+
+    N = macaroon_deserialize_into(buf, buf_sz, into, into_sz, &err);
+
+    if (!N || macaroon_cmp(M, N) != 0)
+    {
+        fprintf(stderr, "deserialize_into does not match deserialize\n");
+        ret = -1;
+    }
+
+    macaroon_destroy(N);
+    free(into);
+    return ret;
+}
+
+/* a V2 view matches and borrows from buf */
+static int
+check_view(const struct macaroon* M, const unsigned char* buf, size_t buf_sz)
+{
+    enum macaroon_returncode err;
+    struct macaroon* V = macaroon_deserialize_view(buf, buf_sz, &err);
+    const unsigned char* id = NULL;
+    size_t id_sz = 0;
+    int ret = 0;
+
+    if (V)
+    {
+        macaroon_identifier(V, &id, &id_sz);
+    }
+
+    if (!V || macaroon_cmp(M, V) != 0 || id < buf || id + id_sz > buf + buf_sz)
+    {
+        fprintf(stderr, "view does not borrow a matching macaroon\n");
+        ret = -1;
+    }
+
+    macaroon_destroy(V);
+    return ret;
+}
+
+/* V2 is sized exactly and reproduces buf */
+static int
+check_exact(const struct macaroon* M, const unsigned char* buf, size_t buf_sz)
+{
+    enum macaroon_returncode err;
+    size_t out_sz = 0;
+    unsigned char* out = macaroon_serialize_alloc(M, MACAROON_V2, &out_sz, &err);
+    int ret = 0;
+
+    if (!out || out_sz != macaroon_serialize_size_hint(M, MACAROON_V2) ||
+        out_sz != buf_sz || memcmp(out, buf, out_sz) != 0 ||
+        macaroon_serialize(M, MACAROON_V2, out, out_sz - 1, &err) ||
+        err != MACAROON_BUF_TOO_SMALL)
+    {
+        fprintf(stderr, "exactly sized serialization does not round trip\n");
+        ret = -1;
+    }
+
+    macaroon_free(out);
+    return ret;
+}
+
+/* the iovecs, sized by a first call, concatenate to buf */
+static int
+check_iov(const struct macaroon* M, const unsigned char* buf, size_t buf_sz)
+{
+    enum macaroon_returncode err;
+    size_t iov_sz = 0;
+    size_t scratch_sz = 0;
+    struct iovec* iov = NULL;
+    unsigned char* scratch = NULL;
+    size_t off = 0;
+    size_t k;
+    int ret = 0;
+
+    if (macaroon_serialize_iov(M, MACAROON_V2, NULL, &iov_sz, NULL, &scratch_sz, &err) == 0 ||
+        err != MACAROON_BUF_TOO_SMALL ||
+        !(iov = malloc(iov_sz * sizeof(struct iovec))) ||
+        !(scratch = malloc(scratch_sz)) ||
+        macaroon_serialize_iov(M, MACAROON_V2, iov, &iov_sz, scratch, &scratch_sz, &err) < 0)
+    {
+        fprintf(stderr, "could not serialize to an iovec\n");
+        ret = -1;
+        iov_sz = 0;
+    }
+
+    for (k = 0; k < iov_sz; ++k)
+    {
+        if (off + iov[k].iov_len > buf_sz ||
+            memcmp(buf + off, iov[k].iov_base, iov[k].iov_len) != 0)
+        {
+            break;
+        }
+
+        off += iov[k].iov_len;
+    }
+
+    if (off != buf_sz)
+    {
+        fprintf(stderr, "iovec serialization does not round trip\n");
+        ret = -1;
+    }
+
+    free(iov);
+    free(scratch);
+    return ret;
+}
+
+/* formats other than V2 need not reproduce buf, but must read back */
+static int
+check_round_trip(const struct macaroon* M, enum macaroon_format format)
+{
+    enum macaroon_returncode err;
+    size_t out_sz = 0;
+    unsigned char* out = macaroon_serialize_alloc(M, format, &out_sz, &err);
+    struct macaroon* N = out ? macaroon_deserialize(out, out_sz, &err) : NULL;
+    int ret = 0;
+
+    if (!N || macaroon_cmp(M, N) != 0)
+    {
+        fprintf(stderr, "serialization does not round trip\n");
+        ret = -1;
+    }
+
+    macaroon_destroy(N);
+    macaroon_free(out);
+    return ret;
+}
+
+/* the lazy header and the macaroon it materializes match M */
+static int
+check_lazy(const struct macaroon* M, const unsigned char* buf, size_t buf_sz)
+{
+    enum macaroon_returncode err;
+    struct macaroon_lazy* L = macaroon_lazy_deserialize(buf, buf_sz, &err);
+    const unsigned char* lhs;
+    size_t lhs_sz;
+    const unsigned char* rhs;
+    size_t rhs_sz;
+    int ret = 0;
+
+    if (!L)
+    {
+        fprintf(stderr, "could not lazily deserialize macaroon: %s\n", macaroon_error(err));
+        return -1;
+    }
+
+    macaroon_lazy_location(L, &lhs, &lhs_sz);
+    macaroon_location(M, &rhs, &rhs_sz);
+
+    if (lhs_sz != rhs_sz || memcmp(lhs, rhs, lhs_sz) != 0)
+    {
+        fprintf(stderr, "lazy location does not match\n");
+        ret = -1;
+    }
+
+    macaroon_lazy_identifier(L, &lhs, &lhs_sz);
+    macaroon_identifier(M, &rhs, &rhs_sz);
+
+    if (lhs_sz != rhs_sz || memcmp(lhs, rhs, lhs_sz) != 0)
+    {
+        fprintf(stderr, "lazy identifier does not match\n");
+        ret = -1;
+    }
+
+    if (!macaroon_lazy_macaroon(L, &err) ||
+        macaroon_cmp(M, macaroon_lazy_macaroon(L, &err)) != 0)
+    {
+        fprintf(stderr, "lazy macaroon does not match\n");
+        ret = -1;
+    }
+
+    macaroon_lazy_destroy(L);
+    return ret;
+}
+
+/* every check that applies to the format, whether or not the others pass */
+static int
+check(const struct macaroon* M, enum macaroon_format format,
+      const unsigned char* buf, size_t buf_sz)
+{
+    int ret = 0;
+
+    if (format != MACAROON_V2J && check_into(M, buf, buf_sz) < 0)
+    {
+        ret = -1;
+    }
+
+    if (format == MACAROON_V2 && check_view(M, buf, buf_sz) < 0)
+    {
+        ret = -1;
+    }
+
+    if (format == MACAROON_V2 && check_exact(M, buf, buf_sz) < 0)
+    {
+        ret = -1;
+    }
+
+    if (format == MACAROON_V2 && check_iov(M, buf, buf_sz) < 0)
+    {
+        ret = -1;
+    }
+
+    if (format != MACAROON_V2 && check_round_trip(M, format) < 0)
+    {
+        ret = -1;
+    }
+
+    if (check_lazy(M, buf, buf_sz) < 0)
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
 int
 main(int argc, const char* argv[])
 {
@@ -144,6 +382,11 @@ main(int argc, const char* argv[])
             goto fail;
         }
 
+        if (check(M, format, buf, rc) < 0)
+        {
+            ret = EXIT_FAILURE;
+        }
+
         ++macaroons_sz;
         tmp = realloc(macaroons, macaroons_sz * sizeof(struct parsed_macaroon));
 
@@ -158,8 +401,6 @@ main(int argc, const char* argv[])
         macaroons[macaroons_sz - 1].B = buf;
     }
 
-    ret = EXIT_SUCCESS;
-
     for (i = 0; i < macaroons_sz; ++i)
     {
         for (j = i + 1; j < macaroons_sz; ++j)
@@ -47,6 +47,85 @@
 #define EXACT "exact "
 #define GENERAL "general "
 
+/* counts allocations so that leaks through the allocator hooks are caught */
+struct counting_allocator
+{
+    size_t live;
+    size_t total;
+};
+
+static void*
+counting_alloc(void* ctx, size_t sz)
+{
+    struct counting_allocator* C = ctx;
+    void* ptr = malloc(sz);
+
+    if (ptr)
+    {
+        ++C->live;
+        ++C->total;
+    }
+
+    return ptr;
+}
+
+static void*
+counting_realloc(void* ctx, void* ptr, size_t sz)
+{
+    struct counting_allocator* C = ctx;
+    void* tmp = NULL;
+
+    if (!ptr)
+    {
+        return counting_alloc(ctx, sz);
+    }
+
+    tmp = realloc(ptr, sz);
+
+    if (tmp)
+    {
+        ++C->total;
+    }
+
+    return tmp;
+}
+
+static void
+counting_free(void* ctx, void* ptr)
+{
+    struct counting_allocator* C = ctx;
+
+    if (ptr)
+    {
+        --C->live;
+        free(ptr);
+    }
+}
+
+static int
+check_allocator(const char* name, const struct counting_allocator* C)
+{
+    if (C->live != 0)
+    {
+        fprintf(stderr, "%s allocator: %lu allocations leaked\n", name, (unsigned long)C->live);
+        return -1;
+    }
+
+    if (C->total == 0)
+    {
+        fprintf(stderr, "%s allocator: never used\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct counting_allocator global_counts;
+static struct counting_allocator local_counts;
+static const struct macaroon_allocator local_allocator = {
+    counting_alloc, counting_realloc, counting_free, &local_counts
+};
+
 int
 parse_version(const char* line)
 {
@@ -126,7 +205,7 @@ parse_macaroon(const char* line, struct macaroon*** macaroons, size_t* macaroons
     }
 
     enum macaroon_returncode err;
-    struct macaroon* M = macaroon_deserialize(buf, rc, &err);
+    struct macaroon* M = macaroon_deserialize_with_allocator(buf, rc, &local_allocator, &err);
     free(buf);
 
     if (!M)
@@ -161,6 +240,10 @@ main(int argc, const char* argv[])
     size_t macaroons_sz = 0;
     size_t i = 0;
     int ret = EXIT_SUCCESS;
+    struct macaroon_allocator global_allocator = {
+        counting_alloc, counting_realloc, counting_free, &global_counts
+    };
+    macaroon_set_allocator(&global_allocator);
 
     if (!(V = macaroon_verifier_create()))
     {
@@ -291,6 +374,14 @@ exit:
         macaroon_verifier_destroy(V);
     }
 
+    if (check_allocator("global", &global_counts) < 0 ||
+        check_allocator("per-call", &local_counts) < 0)
+    {
+        ret = EXIT_FAILURE;
+    }
+
+    macaroon_set_allocator(NULL);
+
     (void) argc;
     (void) argv;
     return ret;
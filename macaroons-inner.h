@@ -29,7 +29,11 @@
 #ifndef macaroons_inner_h_
 #define macaroons_inner_h_
 
+/* C */
+#include <stdint.h>
+
 /* macaroons */
+#include "macaroons.h"
 #include "slice.h"
 
 #ifdef PARANOID_MACAROONS
@@ -47,8 +51,27 @@ struct caveat
     struct slice cl;
 };
 
+/* the macaroon lives in caller-provided memory and is never freed */
+#define MACAROON_FLAG_UNOWNED 1U
+/* caveats are packed as struct caveat16/caveat32 rather than struct caveat */
+#define MACAROON_FLAG_COMPACT16 2U
+#define MACAROON_FLAG_COMPACT32 4U
+/* caveats below parent->num_caveats live in the parent, which is kept alive */
+#define MACAROON_FLAG_SHARED 8U
+/* lives inside the parent's allocation and holds one of its references */
+#define MACAROON_FLAG_ARENA 16U
+#define MACAROON_FLAG_REPRESENTATION (MACAROON_FLAG_COMPACT16 | MACAROON_FLAG_COMPACT32 | MACAROON_FLAG_SHARED)
+
 struct macaroon
 {
+    /* NULL selects the global allocator */
+    const struct macaroon_allocator* allocator;
+    unsigned flags;
+    /* references beyond the first; updated atomically */
+    size_t refs;
+    /* with MACAROON_FLAG_SHARED or MACAROON_FLAG_ARENA, holds one of the
+     * parent's references */
+    struct macaroon* parent;
     struct slice location;
     struct slice identifier;
     struct slice signature;
@@ -57,12 +80,144 @@ struct macaroon
     struct caveat caveats[1];
 };
 
+/* Compact caveats hold (offset, length) pairs into a body that directly follows
+ * the num_caveats packed entries.  caveat16 is used when the whole body fits in
+ * 16 bits.
+ */
+struct caveat16
+{
+    uint16_t cid[2];
+    uint16_t vid[2];
+    uint16_t cl[2];
+};
+
+struct caveat32
+{
+    uint32_t cid[2];
+    uint32_t vid[2];
+    uint32_t cl[2];
+};
+
+const struct caveat*
+macaroon_caveat_unpack(const struct macaroon* M, size_t i, struct caveat* C);
+
+/* Caveat i of M in any representation.  Returns a pointer into M, or C filled
+ * in from a packed form.  Every read of a caveat goes through here.
+ */
+static inline const struct caveat*
+macaroon_caveat(const struct macaroon* M, size_t i, struct caveat* C)
+{
+    if (!(M->flags & MACAROON_FLAG_REPRESENTATION))
+    {
+        return &M->caveats[i];
+    }
+
+    return macaroon_caveat_unpack(M, i, C);
+}
+
+/* Walks the caveats of M in order.  The chain of shared macaroons behind M is
+ * collected once, so a walk is linear in the caveats however deep the chain
+ * is; if that takes memory that cannot be had, it falls back to
+ * macaroon_caveat per caveat.  Each walk ends with caveat_walk_done.
+ */
+#define CAVEAT_WALK_INLINE 16
+
+struct caveat_walk
+{
+    const struct macaroon* M;
+    /* segments of the chain, newest first and taken from the back */
+    const struct macaroon** chain;
+    size_t chain_sz;
+    const struct macaroon* chain_inline[CAVEAT_WALK_INLINE];
+    /* the segment holding caveats [begin, end) */
+    const struct macaroon* S;
+    size_t begin;
+    size_t end;
+    size_t idx;
+};
+
+void
+caveat_walk_init(struct caveat_walk* W, const struct macaroon* M);
+void
+caveat_walk_done(struct caveat_walk* W);
+
+/* the next caveat, as for macaroon_caveat, or NULL after the last */
+static inline const struct caveat*
+caveat_walk_next(struct caveat_walk* W, struct caveat* C)
+{
+    const struct macaroon* S;
+
+    while (W->idx >= W->end)
+    {
+        if (W->idx >= W->M->num_caveats)
+        {
+            return NULL;
+        }
+
+        if (W->chain_sz == 0)
+        {
+            return macaroon_caveat(W->M, W->idx++, C);
+        }
+
+        S = W->S = W->chain[--W->chain_sz];
+        W->begin = (S->flags & MACAROON_FLAG_SHARED) ? S->parent->num_caveats : 0;
+        W->end = S->num_caveats;
+    }
+
+    S = W->S;
+    ++W->idx;
+
+    if (S->flags & MACAROON_FLAG_SHARED)
+    {
+        return &S->caveats[W->idx - 1 - W->begin];
+    }
+
+    return macaroon_caveat(S, W->idx - 1, C);
+}
+
+/* allocate through A, or through the global allocator if A is NULL */
+void*
+macaroon_alloc(const struct macaroon_allocator* A, size_t sz);
+void*
+macaroon_realloc(const struct macaroon_allocator* A, void* ptr, size_t sz);
+void
+macaroon_dealloc(const struct macaroon_allocator* A, void* ptr);
+
+/* bytes needed for a macaroon with num_caveats caveats and body_data bytes */
+size_t
+macaroon_size(const size_t num_caveats, const size_t body_data);
+
 struct macaroon*
-macaroon_malloc(const size_t num_caveats,
+macaroon_place(void* buf,
+               const size_t num_caveats,
+               unsigned char** _ptr);
+
+struct macaroon*
+macaroon_malloc(const struct macaroon_allocator* A,
+                const size_t num_caveats,
                 const size_t body_data,
                 unsigned char** _ptr);
 
+/* macaroon_size rounded up so that another macaroon may follow it */
+size_t
+macaroon_arena_size(size_t num_caveats, size_t body_sz);
+
 size_t
 macaroon_body_size(const struct macaroon* M);
 
+/* Size a V1 or V2 macaroon without allocating, then fill M, laid out with the
+ * measured sizes.  JSON cannot be measured and fails with
+ * MACAROON_UNSUPPORTED_FORMAT (or MACAROON_NO_JSON_SUPPORT).
+ */
+int
+macaroon_deserialize_measure(const unsigned char* data, size_t data_sz,
+                             size_t* num_caveats, size_t* body_sz,
+                             enum macaroon_returncode* err);
+
+int
+macaroon_deserialize_fill(const unsigned char* data, size_t data_sz,
+                          struct macaroon* M, size_t num_caveats,
+                          unsigned char* body, size_t body_sz,
+                          enum macaroon_returncode* err);
+
 #endif /* macaroons_inner_h_ */
@@ -32,6 +32,8 @@
 
 /* C */
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #ifdef HAVE_BSD_STDLIB_H
@@ -54,9 +56,11 @@
 #include "macaroons.h"
 #include "macaroons-inner.h"
 #include "port.h"
+#include "slab.h"
 #include "slice.h"
 #include "v1.h"
 #include "v2.h"
+#include "varint.h"
 
 #if MACAROON_HASH_BYTES != MACAROON_SECRET_KEY_BYTES
 #error bad constants
@@ -85,6 +89,7 @@ struct verifier_callback
 
 struct macaroon_verifier
 {
+    const struct macaroon_allocator* allocator;
     struct predicate* predicates;
     size_t predicates_sz;
     size_t predicates_cap;
@@ -93,6 +98,34 @@ struct macaroon_verifier
     size_t verifier_callbacks_cap;
 };
 
+struct macaroon_builder
+{
+    const struct macaroon_allocator* allocator;
+    /* caveats_cap slots; slices point into body */
+    struct macaroon* M;
+    size_t caveats_cap;
+    unsigned char* body;
+    size_t body_sz;
+    size_t body_cap;
+    unsigned char signature[MACAROON_HASH_BYTES];
+};
+
+struct macaroon_lazy
+{
+    const unsigned char* data;
+    size_t data_sz;
+    struct slice location;
+    struct slice identifier;
+    /* V2 caveats begin this far into data */
+    size_t caveats_off;
+    /* V1 caveats are read on from here, after hdr_sz decoded header bytes */
+    struct v1_reader r;
+    size_t hdr_sz;
+    /* materialized on first use */
+    struct macaroon* M;
+    /* decoded V1 header packets follow */
+};
+
 MACAROON_API const char*
 macaroon_error(enum macaroon_returncode err)
 {
@@ -113,58 +146,274 @@ macaroon_error(enum macaroon_returncode err)
     }
 }
 
+static void*
+macaroon_default_alloc(void* ctx, size_t sz)
+{
+    (void) ctx;
+    return macaroon_slab_alloc(sz);
+}
+
+static void*
+macaroon_default_realloc(void* ctx, void* ptr, size_t sz)
+{
+    (void) ctx;
+    return macaroon_slab_realloc(ptr, sz);
+}
+
+static void
+macaroon_default_free(void* ctx, void* ptr)
+{
+    (void) ctx;
+    macaroon_slab_free(ptr);
+}
+
+static struct macaroon_allocator macaroon_global_allocator = {
+    macaroon_default_alloc,
+    macaroon_default_realloc,
+    macaroon_default_free,
+    NULL
+};
+
+MACAROON_API void
+macaroon_set_allocator(const struct macaroon_allocator* A)
+{
+    if (A)
+    {
+        macaroon_global_allocator = *A;
+    }
+    else
+    {
+        macaroon_global_allocator.alloc = macaroon_default_alloc;
+        macaroon_global_allocator.realloc = macaroon_default_realloc;
+        macaroon_global_allocator.free = macaroon_default_free;
+        macaroon_global_allocator.ctx = NULL;
+    }
+}
+
+void*
+macaroon_alloc(const struct macaroon_allocator* A, size_t sz)
+{
+    A = A ? A : &macaroon_global_allocator;
+    return A->alloc(A->ctx, sz);
+}
+
+void*
+macaroon_realloc(const struct macaroon_allocator* A, void* ptr, size_t sz)
+{
+    A = A ? A : &macaroon_global_allocator;
+    return A->realloc(A->ctx, ptr, sz);
+}
+
+void
+macaroon_dealloc(const struct macaroon_allocator* A, void* ptr)
+{
+    A = A ? A : &macaroon_global_allocator;
+
+    if (ptr)
+    {
+        A->free(A->ctx, ptr);
+    }
+}
+
+size_t
+macaroon_size(const size_t num_caveats, const size_t body_data)
+{
+    const size_t additional_caveats = (num_caveats > 0) ? num_caveats - 1 : 0;
+    return sizeof(struct macaroon) + body_data
+         + additional_caveats * sizeof(struct caveat);
+}
+
+struct macaroon_alignment
+{
+    char c;
+    struct macaroon m;
+};
+
+/* Lay out a macaroon with "num_caveats" caveats in the caller's memory "buf",
+ * which must also hold the body the caller writes via _ptr; macaroon_size
+ * gives the total.  Only the header and caveats are zeroed.
+ */
+struct macaroon*
+macaroon_place(void* buf,
+               const size_t num_caveats,
+               unsigned char** _ptr)
+{
+    struct macaroon* M = buf;
+    const size_t sz = macaroon_size(num_caveats, 0);
+    macaroon_memzero(M, sz);
+    M->flags = MACAROON_FLAG_UNOWNED;
+    *_ptr = (unsigned char*)M + sz;
+    return M;
+}
+
 /* Allocate a new macaroon with space for "num_caveats" caveats and a body of
  * "body_data" bytes.  Returns via _ptr a contiguous set of "body_data" bytes to
- * which the callee may write.
+ * which the callee may write.  The macaroon remembers A for its destruction and
+ * for anything derived from it.
  */
 struct macaroon*
-macaroon_malloc(const size_t num_caveats,
+macaroon_malloc(const struct macaroon_allocator* A,
+                const size_t num_caveats,
                 const size_t body_data,
                 unsigned char** _ptr)
 {
-    unsigned char* ptr = NULL;
     struct macaroon* M = NULL;
-    const size_t additional_caveats = (num_caveats > 0) ? num_caveats - 1 : 0;
-    const size_t sz = sizeof(struct macaroon) + body_data
-                    + additional_caveats * sizeof(struct caveat);
-    M = malloc(sz);
+    M = macaroon_alloc(A, macaroon_size(num_caveats, body_data));
 
     if (!M)
     {
         return NULL;
     }
 
-    macaroon_memzero(M, sz);
-    ptr  = (unsigned char*) M;
-    ptr += sizeof(struct macaroon);
-    ptr += additional_caveats * sizeof(struct caveat);
-    *_ptr = ptr;
+    /* the body is written in full by the caller */
+    memset(M, 0, macaroon_size(num_caveats, 0));
+    M->allocator = A;
+    *_ptr = (unsigned char*)M + macaroon_size(num_caveats, 0);
     return M;
 }
 
+const struct caveat*
+macaroon_caveat_unpack(const struct macaroon* M, size_t i, struct caveat* C)
+{
+#define MACAROON_UNPACK(T) \
+    do { \
+        const T* packed = (const T*)M->caveats; \
+        const unsigned char* body = (const unsigned char*)(packed + M->num_caveats); \
+        C->cid.data = body + packed[i].cid[0]; \
+        C->cid.size = packed[i].cid[1]; \
+        C->vid.data = body + packed[i].vid[0]; \
+        C->vid.size = packed[i].vid[1]; \
+        C->cl.data = body + packed[i].cl[0]; \
+        C->cl.size = packed[i].cl[1]; \
+    } while (0)
+
+    assert(i < M->num_caveats);
+
+    /* iterative, so long chains of shared attenuations cannot blow the stack */
+    while (M->flags & MACAROON_FLAG_SHARED)
+    {
+        if (i >= M->parent->num_caveats)
+        {
+            return &M->caveats[i - M->parent->num_caveats];
+        }
+
+        M = M->parent;
+    }
+
+    if (M->flags & MACAROON_FLAG_COMPACT16)
+    {
+        MACAROON_UNPACK(struct caveat16);
+        return C;
+    }
+
+    if (M->flags & MACAROON_FLAG_COMPACT32)
+    {
+        MACAROON_UNPACK(struct caveat32);
+        return C;
+    }
+#undef MACAROON_UNPACK
+
+    return &M->caveats[i];
+}
+
+void
+caveat_walk_init(struct caveat_walk* W, const struct macaroon* M)
+{
+    const struct macaroon* S;
+    size_t depth = 1;
+
+    W->M = M;
+    W->chain = W->chain_inline;
+    W->chain_sz = 0;
+    W->S = NULL;
+    W->begin = 0;
+    W->end = 0;
+    W->idx = 0;
+
+    for (S = M; S->flags & MACAROON_FLAG_SHARED; S = S->parent)
+    {
+        ++depth;
+    }
+
+    if (depth > CAVEAT_WALK_INLINE)
+    {
+        W->chain = macaroon_alloc(M->allocator, depth * sizeof(*W->chain));
+
+        if (!W->chain)
+        {
+            W->chain = W->chain_inline;
+            return;
+        }
+    }
+
+    for (S = M; S->flags & MACAROON_FLAG_SHARED; S = S->parent)
+    {
+        W->chain[W->chain_sz++] = S;
+    }
+
+    W->chain[W->chain_sz++] = S;
+}
+
+void
+caveat_walk_done(struct caveat_walk* W)
+{
+    if (W->chain != W->chain_inline)
+    {
+        macaroon_dealloc(W->M->allocator, W->chain);
+    }
+}
+
 /* cumulative slice size, excluding the signature slice */
 size_t
 macaroon_body_size(const struct macaroon* M)
 {
-    size_t i = 0;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat tmp;
     size_t sz = M->location.size
               + M->identifier.size;
 
-    for (i = 0; i < M->num_caveats; ++i)
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &tmp)))
     {
-        sz += M->caveats[i].cid.size;
-        sz += M->caveats[i].vid.size;
-        sz += M->caveats[i].cl.size;
+        sz += C->cid.size;
+        sz += C->vid.size;
+        sz += C->cl.size;
     }
 
+    caveat_walk_done(&W);
     return sz;
 }
 
-MACAROON_API struct macaroon*
-macaroon_create_raw(const unsigned char* location, size_t location_sz,
-                    const unsigned char* key, size_t key_sz,
-                    const unsigned char* id, size_t id_sz,
-                    enum macaroon_returncode* err)
+/* copy every caveat of N into "to", with the bytes going to ptr */
+static unsigned char*
+copy_caveats(const struct macaroon* N, struct caveat* to, unsigned char* ptr)
+{
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat tmp;
+
+    caveat_walk_init(&W, N);
+
+    while ((C = caveat_walk_next(&W, &tmp)))
+    {
+        ptr = copy_slice(&C->cid, &to->cid, ptr);
+        ptr = copy_slice(&C->vid, &to->vid, ptr);
+        ptr = copy_slice(&C->cl,  &to->cl,  ptr);
+        ++to;
+    }
+
+    caveat_walk_done(&W);
+    return ptr;
+}
+
+static struct macaroon*
+macaroon_create_inner(const unsigned char* location, size_t location_sz,
+                      const unsigned char* key, size_t key_sz,
+                      const unsigned char* id, size_t id_sz,
+                      const struct macaroon_allocator* A,
+                      enum macaroon_returncode* err)
 {
     unsigned char hash[MACAROON_HASH_BYTES];
     size_t sz;
@@ -181,7 +430,7 @@ macaroon_create_raw(const unsigned char* location, size_t location_sz,
     }
 
     sz = location_sz + id_sz + MACAROON_HASH_BYTES;
-    M = macaroon_malloc(0, sz, &ptr);
+    M = macaroon_malloc(A, 0, sz, &ptr);
 
     if (!M)
     {
@@ -196,6 +445,15 @@ macaroon_create_raw(const unsigned char* location, size_t location_sz,
     return M;
 }
 
+MACAROON_API struct macaroon*
+macaroon_create_raw(const unsigned char* location, size_t location_sz,
+                    const unsigned char* key, size_t key_sz,
+                    const unsigned char* id, size_t id_sz,
+                    enum macaroon_returncode* err)
+{
+    return macaroon_create_inner(location, location_sz, key, key_sz, id, id_sz, NULL, err);
+}
+
 #define MACAROON_KEY_GENERATOR "macaroons-key-generator"
 
 static int
@@ -211,10 +469,11 @@ generate_derived_key(const unsigned char* variable_key,
 }
 
 MACAROON_API struct macaroon*
-macaroon_create(const unsigned char* location, size_t location_sz,
-                const unsigned char* key, size_t key_sz,
-                const unsigned char* id, size_t id_sz,
-                enum macaroon_returncode* err)
+macaroon_create_with_allocator(const unsigned char* location, size_t location_sz,
+                               const unsigned char* key, size_t key_sz,
+                               const unsigned char* id, size_t id_sz,
+                               const struct macaroon_allocator* A,
+                               enum macaroon_returncode* err)
 {
     unsigned char derived_key[MACAROON_HASH_BYTES];
 
@@ -224,18 +483,64 @@ macaroon_create(const unsigned char* location, size_t location_sz,
         return NULL;
     }
 
-    return macaroon_create_raw(location, location_sz, derived_key, MACAROON_HASH_BYTES, id, id_sz, err);
+    return macaroon_create_inner(location, location_sz, derived_key, MACAROON_HASH_BYTES, id, id_sz, A, err);
+}
+
+MACAROON_API struct macaroon*
+macaroon_create(const unsigned char* location, size_t location_sz,
+                const unsigned char* key, size_t key_sz,
+                const unsigned char* id, size_t id_sz,
+                enum macaroon_returncode* err)
+{
+    return macaroon_create_with_allocator(location, location_sz, key, key_sz, id, id_sz, NULL, err);
 }
 
 MACAROON_API void
 macaroon_destroy(struct macaroon* M)
 {
-    if (M)
+    struct macaroon* P = NULL;
+
+    while (M && !(M->flags & MACAROON_FLAG_UNOWNED))
+    {
+        if (__atomic_fetch_sub(&M->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        {
+            return;
+        }
+
+        P = (M->flags & (MACAROON_FLAG_SHARED | MACAROON_FLAG_ARENA)) ? M->parent : NULL;
+
+        if (!(M->flags & MACAROON_FLAG_ARENA))
+        {
+            macaroon_dealloc(M->allocator, M);
+        }
+
+        M = P;
+    }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+
+MACAROON_API const struct macaroon*
+macaroon_retain(const struct macaroon* M)
+{
+    if (M && !(M->flags & MACAROON_FLAG_UNOWNED))
     {
-        free(M);
+        /* the count is the one mutable field of an immutable macaroon */
+        __atomic_add_fetch(&((struct macaroon*)M)->refs, 1, __ATOMIC_RELAXED);
     }
+
+    return M;
+}
+
+MACAROON_API void
+macaroon_release(const struct macaroon* M)
+{
+    macaroon_destroy((struct macaroon*)M);
 }
 
+#pragma GCC diagnostic pop
+
 MACAROON_API int
 macaroon_validate(const struct macaroon* M)
 {
@@ -259,7 +564,6 @@ macaroon_add_first_party_caveat(const struct macaroon* N,
                                 enum macaroon_returncode* err)
 {
     unsigned char hash[MACAROON_HASH_BYTES];
-    size_t i;
     size_t sz;
     struct macaroon* M;
     unsigned char* ptr;
@@ -284,7 +588,7 @@ macaroon_add_first_party_caveat(const struct macaroon* N,
     }
 
     sz = macaroon_body_size(N) + predicate_sz + MACAROON_HASH_BYTES;
-    M = macaroon_malloc(N->num_caveats + 1, sz, &ptr);
+    M = macaroon_malloc(N->allocator, N->num_caveats + 1, sz, &ptr);
 
     if (!M)
     {
@@ -296,12 +600,7 @@ macaroon_add_first_party_caveat(const struct macaroon* N,
     ptr = copy_slice(&N->location, &M->location, ptr);
     ptr = copy_slice(&N->identifier, &M->identifier, ptr);
 
-    for (i = 0; i < N->num_caveats; ++i)
-    {
-        ptr = copy_slice(&N->caveats[i].cid, &M->caveats[i].cid, ptr);
-        ptr = copy_slice(&N->caveats[i].vid, &M->caveats[i].vid, ptr);
-        ptr = copy_slice(&N->caveats[i].cl,  &M->caveats[i].cl,  ptr);
-    }
+    ptr = copy_caveats(N, M->caveats, ptr);
 
     ptr = copy_to_slice(predicate, predicate_sz,
                         &M->caveats[M->num_caveats - 1].cid, ptr);
@@ -310,55 +609,21 @@ macaroon_add_first_party_caveat(const struct macaroon* N,
     return M;
 }
 
-static int
-macaroon_hash2(const unsigned char* key,
-               const unsigned char* data1,
-               size_t data1_sz,
-               const unsigned char* data2,
-               size_t data2_sz,
-               unsigned char* hash)
-{
-    int rc = 0;
-    unsigned char tmp[2 * MACAROON_HASH_BYTES];
-    rc |= macaroon_hmac(key, MACAROON_HASH_BYTES, data1, data1_sz, tmp);
-    rc |= macaroon_hmac(key, MACAROON_HASH_BYTES, data2, data2_sz, tmp + MACAROON_HASH_BYTES);
-    rc |= macaroon_hmac(key, MACAROON_HASH_BYTES, tmp, 2 * MACAROON_HASH_BYTES, hash);
-    return rc;
-}
-
-#define SECRET_BOX_OVERHEAD \
-    (MACAROON_SECRET_TEXT_ZERO_BYTES \
-     - MACAROON_SECRET_BOX_ZERO_BYTES)
-
-#define VID_NONCE_KEY_SZ \
-    (MACAROON_SECRET_NONCE_BYTES \
-     + MACAROON_HASH_BYTES \
-     + SECRET_BOX_OVERHEAD)
-
-#if MACAROON_SECRET_TEXT_ZERO_BYTES < MACAROON_SECRET_BOX_ZERO_BYTES
-#error bad constants
-#endif
-
 MACAROON_API struct macaroon*
-macaroon_add_third_party_caveat_raw(const struct macaroon* N,
-                                    const unsigned char* location, size_t location_sz,
-                                    const unsigned char* key, size_t key_sz,
-                                    const unsigned char* id, size_t id_sz,
-                                    enum macaroon_returncode* err)
+macaroon_add_first_party_caveat_shared(const struct macaroon* N,
+                                       const unsigned char* predicate, size_t predicate_sz,
+                                       enum macaroon_returncode* err)
 {
-    unsigned char new_sig[MACAROON_HASH_BYTES];
-    unsigned char enc_nonce[MACAROON_SECRET_NONCE_BYTES];
-    unsigned char enc_plaintext[MACAROON_SECRET_TEXT_ZERO_BYTES + MACAROON_HASH_BYTES];
-    unsigned char enc_ciphertext[MACAROON_SECRET_BOX_ZERO_BYTES + MACAROON_HASH_BYTES];
-    unsigned char vid[VID_NONCE_KEY_SZ];
-    size_t i;
-    size_t sz;
+    unsigned char hash[MACAROON_HASH_BYTES];
     struct macaroon* M;
     unsigned char* ptr;
-    assert(location_sz < MACAROON_MAX_STRLEN);
-    assert(id_sz < MACAROON_MAX_STRLEN);
-    assert(key_sz == MACAROON_SUGGESTED_SECRET_LENGTH);
-    VALIDATE(N);
+    assert(predicate_sz < MACAROON_MAX_STRLEN);
+
+    /* nothing to keep alive for memory the library does not own */
+    if (N->flags & MACAROON_FLAG_UNOWNED)
+    {
+        return macaroon_add_first_party_caveat(N, predicate, predicate_sz, err);
+    }
 
     if (N->num_caveats + 1 > MACAROON_MAX_CAVEATS)
     {
@@ -366,52 +631,19 @@ macaroon_add_third_party_caveat_raw(const struct macaroon* N,
         return NULL;
     }
 
-    /*
-     * note that MACAROON_HASH_BYTES is necessarily the same as
-     * MACAROON_SECRET_KEY_BYTES, so the signature is also good to use
-      * as an encoding key
-     */
     if (!N->signature.data || N->signature.size != MACAROON_HASH_BYTES)
     {
         *err = MACAROON_INVALID;
         return NULL;
     }
 
-    macaroon_randombytes(enc_nonce, sizeof(enc_nonce));
-    macaroon_memzero(enc_plaintext, sizeof(enc_plaintext));
-    macaroon_memzero(enc_ciphertext, sizeof(enc_ciphertext));
-
-    /* now encrypt the key to give us vid */
-    memmove(enc_plaintext + MACAROON_SECRET_TEXT_ZERO_BYTES, key,
-            key_sz < MACAROON_HASH_BYTES ? key_sz : MACAROON_HASH_BYTES);
-
-    if (macaroon_secretbox(N->signature.data, enc_nonce, enc_plaintext,
-                MACAROON_SECRET_TEXT_ZERO_BYTES + MACAROON_HASH_BYTES,
-                enc_ciphertext) < 0)
-    {
-        *err = MACAROON_HASH_FAILED;
-        return NULL;
-    }
-
-    /* copy the (nonce, vid) pair into vid */
-    memmove(vid, enc_nonce, MACAROON_SECRET_NONCE_BYTES);
-    memmove(vid           + MACAROON_SECRET_NONCE_BYTES,
-            enc_ciphertext + MACAROON_SECRET_BOX_ZERO_BYTES,
-            VID_NONCE_KEY_SZ - MACAROON_SECRET_NONCE_BYTES);
-
-    /* calculate the new signature */
-    if (macaroon_hash2(N->signature.data, vid, VID_NONCE_KEY_SZ, id, id_sz, new_sig) < 0)
+    if (macaroon_hash1(N->signature.data, predicate, predicate_sz, hash) < 0)
     {
         *err = MACAROON_HASH_FAILED;
         return NULL;
     }
 
-    sz = macaroon_body_size(N)
-       + id_sz
-       + VID_NONCE_KEY_SZ
-       + location_sz
-       + MACAROON_HASH_BYTES;
-    M = macaroon_malloc(N->num_caveats + 1, sz, &ptr);
+    M = macaroon_malloc(N->allocator, 1, predicate_sz + MACAROON_HASH_BYTES, &ptr);
 
     if (!M)
     {
@@ -419,624 +651,2153 @@ macaroon_add_third_party_caveat_raw(const struct macaroon* N,
         return NULL;
     }
 
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    M->parent = (struct macaroon*)macaroon_retain(N);
+#pragma GCC diagnostic pop
+    M->flags = MACAROON_FLAG_SHARED;
     M->num_caveats = N->num_caveats + 1;
-    ptr = copy_slice(&N->location, &M->location, ptr);
-    ptr = copy_slice(&N->identifier, &M->identifier, ptr);
-
-    for (i = 0; i < N->num_caveats; ++i)
-    {
-        ptr = copy_slice(&N->caveats[i].cid, &M->caveats[i].cid, ptr);
-        ptr = copy_slice(&N->caveats[i].vid, &M->caveats[i].vid, ptr);
-        ptr = copy_slice(&N->caveats[i].cl,  &M->caveats[i].cl,  ptr);
-    }
-
-    ptr = copy_to_slice(id, id_sz, &M->caveats[M->num_caveats - 1].cid, ptr);
-    ptr = copy_to_slice(vid, VID_NONCE_KEY_SZ, &M->caveats[M->num_caveats - 1].vid, ptr);
-    ptr = copy_to_slice(location, location_sz, &M->caveats[M->num_caveats - 1].cl, ptr);
-    ptr = copy_to_slice(new_sig, MACAROON_HASH_BYTES, &M->signature, ptr);
+    M->location = N->location;
+    M->identifier = N->identifier;
+    ptr = copy_to_slice(predicate, predicate_sz, &M->caveats[0].cid, ptr);
+    ptr = copy_to_slice(hash, MACAROON_HASH_BYTES, &M->signature, ptr);
     VALIDATE(M);
     return M;
 }
 
 MACAROON_API struct macaroon*
-macaroon_add_third_party_caveat(const struct macaroon* N,
-                                const unsigned char* location, size_t location_sz,
-                                const unsigned char* key, size_t key_sz,
-                                const unsigned char* id, size_t id_sz,
-                                enum macaroon_returncode* err)
+macaroon_add_first_party_caveats(const struct macaroon* N,
+                                 const unsigned char* const* predicates,
+                                 const size_t* predicate_szs,
+                                 size_t num_predicates,
+                                 enum macaroon_returncode* err)
 {
-    unsigned char derived_key[MACAROON_HASH_BYTES];
+    unsigned char hash[MACAROON_HASH_BYTES];
+    size_t i;
+    size_t sz;
+    struct macaroon* M;
+    unsigned char* ptr;
 
-    if (generate_derived_key(key, key_sz, derived_key) < 0)
+    if (N->num_caveats + num_predicates > MACAROON_MAX_CAVEATS)
     {
-        *err = MACAROON_HASH_FAILED;
+        *err = MACAROON_TOO_MANY_CAVEATS;
         return NULL;
     }
 
-    return macaroon_add_third_party_caveat_raw(N, location, location_sz, derived_key, MACAROON_HASH_BYTES, id, id_sz, err);
-}
-
-static int
-macaroon_bind(const unsigned char* Msig,
-              const unsigned char* MPsig,
-              unsigned char* bound)
-{
-    unsigned char key[MACAROON_HASH_BYTES];
-    macaroon_memzero(key, MACAROON_HASH_BYTES);
-    return macaroon_hash2(key, Msig, MACAROON_HASH_BYTES,
-                          MPsig, MACAROON_HASH_BYTES, bound);
-}
+    if (!N->signature.data || N->signature.size != MACAROON_HASH_BYTES)
+    {
+        *err = MACAROON_INVALID;
+        return NULL;
+    }
 
-MACAROON_API unsigned
-macaroon_num_third_party_caveats(const struct macaroon* M)
-{
-    size_t idx = 0;
-    unsigned count = 0;
-    VALIDATE(M);
+    memmove(hash, N->signature.data, MACAROON_HASH_BYTES);
+    sz = macaroon_body_size(N) + MACAROON_HASH_BYTES;
 
-    for (idx = 0; idx < M->num_caveats; ++idx)
+    for (i = 0; i < num_predicates; ++i)
     {
-        if (M->caveats[idx].vid.size > 0 && M->caveats[idx].cl.size > 0)
+        assert(predicate_szs[i] < MACAROON_MAX_STRLEN);
+
+        /* hash1 copies the key before writing the output, so the chain may
+         * be computed in place */
+        if (macaroon_hash1(hash, predicates[i], predicate_szs[i], hash) < 0)
         {
-            ++count;
+            *err = MACAROON_HASH_FAILED;
+            return NULL;
         }
+
+        sz += predicate_szs[i];
     }
 
-    return count;
+    M = macaroon_malloc(N->allocator, N->num_caveats + num_predicates, sz, &ptr);
+
+    if (!M)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    M->num_caveats = N->num_caveats + num_predicates;
+    ptr = copy_slice(&N->location, &M->location, ptr);
+    ptr = copy_slice(&N->identifier, &M->identifier, ptr);
+
+    ptr = copy_caveats(N, M->caveats, ptr);
+
+    for (i = 0; i < num_predicates; ++i)
+    {
+        ptr = copy_to_slice(predicates[i], predicate_szs[i],
+                            &M->caveats[N->num_caveats + i].cid, ptr);
+    }
+
+    ptr = copy_to_slice(hash, MACAROON_HASH_BYTES, &M->signature, ptr);
+    VALIDATE(M);
+    return M;
 }
 
-MACAROON_API int
-macaroon_third_party_caveat(const struct macaroon* M, unsigned which,
-                            const unsigned char** location, size_t* location_sz,
-                            const unsigned char** identifier, size_t* identifier_sz)
+static int
+macaroon_hash2(const unsigned char* key,
+               const unsigned char* data1,
+               size_t data1_sz,
+               const unsigned char* data2,
+               size_t data2_sz,
+               unsigned char* hash)
 {
-    size_t idx = 0;
-    unsigned count = 0;
-    VALIDATE(M);
+    int rc = 0;
+    unsigned char tmp[2 * MACAROON_HASH_BYTES];
+    rc |= macaroon_hmac(key, MACAROON_HASH_BYTES, data1, data1_sz, tmp);
+    rc |= macaroon_hmac(key, MACAROON_HASH_BYTES, data2, data2_sz, tmp + MACAROON_HASH_BYTES);
+    rc |= macaroon_hmac(key, MACAROON_HASH_BYTES, tmp, 2 * MACAROON_HASH_BYTES, hash);
+    return rc;
+}
+
+#define SECRET_BOX_OVERHEAD \
+    (MACAROON_SECRET_TEXT_ZERO_BYTES \
+     - MACAROON_SECRET_BOX_ZERO_BYTES)
+
+#define VID_NONCE_KEY_SZ \
+    (MACAROON_SECRET_NONCE_BYTES \
+     + MACAROON_HASH_BYTES \
+     + SECRET_BOX_OVERHEAD)
+
+#if MACAROON_SECRET_TEXT_ZERO_BYTES < MACAROON_SECRET_BOX_ZERO_BYTES
+#error bad constants
+#endif
+
+/* Encrypt key under sig to produce the (nonce, ciphertext) vid of a third-party
+ * caveat, and chain sig through (vid, id) to produce new_sig.
+ */
+static int
+macaroon_third_party_vid(const unsigned char* sig,
+                         const unsigned char* key, size_t key_sz,
+                         const unsigned char* id, size_t id_sz,
+                         unsigned char* vid,
+                         unsigned char* new_sig,
+                         enum macaroon_returncode* err)
+{
+    unsigned char enc_nonce[MACAROON_SECRET_NONCE_BYTES];
+    unsigned char enc_plaintext[MACAROON_SECRET_TEXT_ZERO_BYTES + MACAROON_HASH_BYTES];
+    unsigned char enc_ciphertext[MACAROON_SECRET_BOX_ZERO_BYTES + MACAROON_HASH_BYTES + SECRET_BOX_OVERHEAD];
+
+    macaroon_randombytes(enc_nonce, sizeof(enc_nonce));
+    macaroon_memzero(enc_plaintext, sizeof(enc_plaintext));
+    macaroon_memzero(enc_ciphertext, sizeof(enc_ciphertext));
+
+    /* now encrypt the key to give us vid */
+    memmove(enc_plaintext + MACAROON_SECRET_TEXT_ZERO_BYTES, key,
+            key_sz < MACAROON_HASH_BYTES ? key_sz : MACAROON_HASH_BYTES);
 
-    for (idx = 0; idx < M->num_caveats; ++idx)
+    if (macaroon_secretbox(sig, enc_nonce, enc_plaintext,
+                MACAROON_SECRET_TEXT_ZERO_BYTES + MACAROON_HASH_BYTES,
+                enc_ciphertext) < 0)
     {
-        if (M->caveats[idx].vid.size > 0 && M->caveats[idx].cl.size > 0)
-        {
-            if (count == which)
-            {
-                unstruct_slice(&M->caveats[idx].cid, identifier, identifier_sz);
-                unstruct_slice(&M->caveats[idx].cl, location, location_sz);
-                return 0;
-            }
+        *err = MACAROON_HASH_FAILED;
+        return -1;
+    }
 
-            ++count;
-        }
+    /* copy the (nonce, vid) pair into vid */
+    memmove(vid, enc_nonce, MACAROON_SECRET_NONCE_BYTES);
+    memmove(vid           + MACAROON_SECRET_NONCE_BYTES,
+            enc_ciphertext + MACAROON_SECRET_BOX_ZERO_BYTES,
+            VID_NONCE_KEY_SZ - MACAROON_SECRET_NONCE_BYTES);
+
+    /* calculate the new signature */
+    if (macaroon_hash2(sig, vid, VID_NONCE_KEY_SZ, id, id_sz, new_sig) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        return -1;
     }
 
-    return -1;
+    return 0;
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wcast-qual"
-
 MACAROON_API struct macaroon*
-macaroon_prepare_for_request(const struct macaroon* M,
-                             const struct macaroon* D,
-                             enum macaroon_returncode* err)
+macaroon_add_third_party_caveat_raw(const struct macaroon* N,
+                                    const unsigned char* location, size_t location_sz,
+                                    const unsigned char* key, size_t key_sz,
+                                    const unsigned char* id, size_t id_sz,
+                                    enum macaroon_returncode* err)
 {
-    struct macaroon* B;
-    unsigned char hash[MACAROON_HASH_BYTES];
+    unsigned char new_sig[MACAROON_HASH_BYTES];
+    unsigned char vid[VID_NONCE_KEY_SZ];
+    size_t sz;
+    struct macaroon* M;
+    unsigned char* ptr;
+    assert(location_sz < MACAROON_MAX_STRLEN);
+    assert(id_sz < MACAROON_MAX_STRLEN);
+    assert(key_sz == MACAROON_SUGGESTED_SECRET_LENGTH);
+    VALIDATE(N);
 
-    VALIDATE(M);
-    VALIDATE(D);
+    if (N->num_caveats + 1 > MACAROON_MAX_CAVEATS)
+    {
+        *err = MACAROON_TOO_MANY_CAVEATS;
+        return NULL;
+    }
 
-    if (!M->signature.data || M->signature.size != MACAROON_HASH_BYTES ||
-        !D->signature.data || D->signature.size != MACAROON_HASH_BYTES)
+    /*
+     * note that MACAROON_HASH_BYTES is necessarily the same as
+     * MACAROON_SECRET_KEY_BYTES, so the signature is also good to use
+      * as an encoding key
+     */
+    if (!N->signature.data || N->signature.size != MACAROON_HASH_BYTES)
     {
         *err = MACAROON_INVALID;
         return NULL;
     }
 
-    if (macaroon_bind(M->signature.data, D->signature.data, hash) < 0)
+    if (macaroon_third_party_vid(N->signature.data, key, key_sz,
+                                 id, id_sz, vid, new_sig, err) < 0)
     {
-        *err = MACAROON_HASH_FAILED;
         return NULL;
     }
 
-    B = macaroon_copy(D, err);
+    sz = macaroon_body_size(N)
+       + id_sz
+       + VID_NONCE_KEY_SZ
+       + location_sz
+       + MACAROON_HASH_BYTES;
+    M = macaroon_malloc(N->allocator, N->num_caveats + 1, sz, &ptr);
 
-    if (!B)
+    if (!M)
     {
+        *err = MACAROON_OUT_OF_MEMORY;
         return NULL;
     }
 
-    memmove((unsigned char*)B->signature.data, hash, MACAROON_HASH_BYTES);
-    VALIDATE(B);
-    return B;
-}
+    M->num_caveats = N->num_caveats + 1;
+    ptr = copy_slice(&N->location, &M->location, ptr);
+    ptr = copy_slice(&N->identifier, &M->identifier, ptr);
 
-#pragma GCC diagnostic pop
+    ptr = copy_caveats(N, M->caveats, ptr);
 
-MACAROON_API struct macaroon_verifier*
-macaroon_verifier_create()
+    ptr = copy_to_slice(id, id_sz, &M->caveats[M->num_caveats - 1].cid, ptr);
+    ptr = copy_to_slice(vid, VID_NONCE_KEY_SZ, &M->caveats[M->num_caveats - 1].vid, ptr);
+    ptr = copy_to_slice(location, location_sz, &M->caveats[M->num_caveats - 1].cl, ptr);
+    ptr = copy_to_slice(new_sig, MACAROON_HASH_BYTES, &M->signature, ptr);
+    VALIDATE(M);
+    return M;
+}
+
+MACAROON_API struct macaroon*
+macaroon_add_third_party_caveat(const struct macaroon* N,
+                                const unsigned char* location, size_t location_sz,
+                                const unsigned char* key, size_t key_sz,
+                                const unsigned char* id, size_t id_sz,
+                                enum macaroon_returncode* err)
 {
-    struct macaroon_verifier* V;
-    V = malloc(sizeof(struct macaroon_verifier));
+    unsigned char derived_key[MACAROON_HASH_BYTES];
 
-    if (!V)
+    if (generate_derived_key(key, key_sz, derived_key) < 0)
     {
+        *err = MACAROON_HASH_FAILED;
         return NULL;
     }
 
-    memset(V, 0, sizeof(struct macaroon_verifier));
-    V->predicates = NULL;
-    V->predicates_sz = 0;
-    V->predicates_cap = 0;
-    return V;
+    return macaroon_add_third_party_caveat_raw(N, location, location_sz, derived_key, MACAROON_HASH_BYTES, id, id_sz, err);
 }
 
-MACAROON_API void
-macaroon_verifier_destroy(struct macaroon_verifier* V)
+/* The builder keeps a macaroon whose slices point into a separately allocated,
+ * growable body.  Both the caveat array and the body grow geometrically, so
+ * appending n caveats costs O(n) copying rather than the O(n^2) of repeatedly
+ * calling macaroon_add_*_caveat.
+ */
+static int
+macaroon_builder_reserve(struct macaroon_builder* B,
+                         size_t caveats, size_t body,
+                         enum macaroon_returncode* err)
 {
-    size_t idx = 0;
+    struct macaroon* M = NULL;
+    unsigned char* ptr = NULL;
+    unsigned char* old = NULL;
+    size_t cap = 0;
+    size_t i = 0;
 
-    if (V)
+    if (B->M->num_caveats + caveats > B->caveats_cap)
     {
-        for (idx = 0; idx < V->predicates_sz; ++idx)
-        {
-            if (V->predicates[idx].alloc)
-            {
-                free(V->predicates[idx].alloc);
-            }
-        }
-
-        if (V->predicates)
-        {
-            free(V->predicates);
-        }
+        cap = B->caveats_cap < 8 ? 8 : B->caveats_cap + (B->caveats_cap >> 1);
+        cap = cap < B->M->num_caveats + caveats ? B->M->num_caveats + caveats : cap;
+        M = macaroon_realloc(B->allocator, B->M,
+                             sizeof(struct macaroon) + (cap - 1) * sizeof(struct caveat));
 
-        if (V->verifier_callbacks)
+        if (!M)
         {
-            free(V->verifier_callbacks);
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
         }
 
-        free(V);
+        B->M = M;
+        B->caveats_cap = cap;
     }
-}
-
-MACAROON_API int
-macaroon_verifier_satisfy_exact(struct macaroon_verifier* V,
-                                const unsigned char* predicate, size_t predicate_sz,
-                                enum macaroon_returncode* err)
-{
-    struct predicate* tmp = NULL;
 
-    if (V->predicates_sz == V->predicates_cap)
+    if (!B->body || B->body_sz + body > B->body_cap)
     {
-        V->predicates_cap = V->predicates_cap < 8 ? 8 :
-                            V->predicates_cap + (V->predicates_cap >> 1);
-        tmp = realloc(V->predicates, V->predicates_cap * sizeof(struct predicate));
+        cap = B->body_cap < 256 ? 256 : B->body_cap + (B->body_cap >> 1);
+        cap = cap < B->body_sz + body ? B->body_sz + body : cap;
+        ptr = macaroon_alloc(B->allocator, cap);
 
-        if (!tmp)
+        if (!ptr)
         {
             *err = MACAROON_OUT_OF_MEMORY;
             return -1;
         }
 
-        V->predicates = tmp;
-    }
+        old = B->body;
+        B->body = ptr;
+        B->body_cap = cap;
+        M = B->M;
+        ptr = copy_slice(&M->location, &M->location, ptr);
+        ptr = copy_slice(&M->identifier, &M->identifier, ptr);
 
-    assert(V->predicates_sz < V->predicates_cap);
-    tmp = &V->predicates[V->predicates_sz];
-    tmp->data = tmp->alloc = malloc(sizeof(unsigned char) * predicate_sz);
-    tmp->size = predicate_sz;
+        for (i = 0; i < M->num_caveats; ++i)
+        {
+            ptr = copy_slice(&M->caveats[i].cid, &M->caveats[i].cid, ptr);
+            ptr = copy_slice(&M->caveats[i].vid, &M->caveats[i].vid, ptr);
+            ptr = copy_slice(&M->caveats[i].cl,  &M->caveats[i].cl,  ptr);
+        }
 
-    if (!tmp->data)
-    {
-        *err = MACAROON_OUT_OF_MEMORY;
-        return -1;
+        assert(ptr == B->body + B->body_sz);
+        macaroon_dealloc(B->allocator, old);
     }
 
-    memmove(tmp->alloc, predicate, predicate_sz);
-    ++V->predicates_sz;
-    assert(V->predicates_sz <= V->predicates_cap);
     return 0;
 }
 
-MACAROON_API int
-macaroon_verifier_satisfy_general(struct macaroon_verifier* V,
-                                  int (*general_check)(void* f, const unsigned char* pred, size_t pred_sz),
+static struct macaroon_builder*
+macaroon_builder_alloc(const struct macaroon_allocator* A,
+                       size_t caveats, size_t body,
+                       enum macaroon_returncode* err)
+{
+    struct macaroon_builder* B = NULL;
+    unsigned char* ptr = NULL;
+    B = macaroon_alloc(A, sizeof(struct macaroon_builder));
+
+    if (!B)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    memset(B, 0, sizeof(struct macaroon_builder));
+    B->allocator = A;
+    B->M = macaroon_malloc(A, 0, 0, &ptr);
+    B->caveats_cap = 1;
+
+    if (!B->M || macaroon_builder_reserve(B, caveats, body, err) < 0)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        macaroon_builder_destroy(B);
+        return NULL;
+    }
+
+    B->M->signature.data = B->signature;
+    B->M->signature.size = MACAROON_HASH_BYTES;
+    return B;
+}
+
+MACAROON_API struct macaroon_builder*
+macaroon_builder_create(const unsigned char* location, size_t location_sz,
+                        const unsigned char* key, size_t key_sz,
+                        const unsigned char* id, size_t id_sz,
+                        enum macaroon_returncode* err)
+{
+    unsigned char derived_key[MACAROON_HASH_BYTES];
+    struct macaroon_builder* B = NULL;
+    unsigned char* ptr = NULL;
+    assert(location_sz < MACAROON_MAX_STRLEN);
+    assert(id_sz < MACAROON_MAX_STRLEN);
+
+    if (generate_derived_key(key, key_sz, derived_key) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        return NULL;
+    }
+
+    B = macaroon_builder_alloc(NULL, 0, location_sz + id_sz, err);
+
+    if (!B)
+    {
+        return NULL;
+    }
+
+    if (macaroon_hmac(derived_key, MACAROON_HASH_BYTES, id, id_sz, B->signature) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        macaroon_builder_destroy(B);
+        return NULL;
+    }
+
+    ptr = B->body;
+    ptr = copy_to_slice(location, location_sz, &B->M->location, ptr);
+    ptr = copy_to_slice(id, id_sz, &B->M->identifier, ptr);
+    B->body_sz = ptr - B->body;
+    return B;
+}
+
+MACAROON_API struct macaroon_builder*
+macaroon_builder_from(const struct macaroon* N,
+                      enum macaroon_returncode* err)
+{
+    struct macaroon_builder* B = NULL;
+    unsigned char* ptr = NULL;
+
+    assert(N);
+    VALIDATE(N);
+
+    if (!N->signature.data || N->signature.size != MACAROON_HASH_BYTES)
+    {
+        *err = MACAROON_INVALID;
+        return NULL;
+    }
+
+    B = macaroon_builder_alloc(N->allocator, N->num_caveats, macaroon_body_size(N), err);
+
+    if (!B)
+    {
+        return NULL;
+    }
+
+    ptr = B->body;
+    ptr = copy_slice(&N->location, &B->M->location, ptr);
+    ptr = copy_slice(&N->identifier, &B->M->identifier, ptr);
+
+    ptr = copy_caveats(N, B->M->caveats, ptr);
+
+    B->M->num_caveats = N->num_caveats;
+    B->body_sz = ptr - B->body;
+    memmove(B->signature, N->signature.data, MACAROON_HASH_BYTES);
+    return B;
+}
+
+MACAROON_API void
+macaroon_builder_destroy(struct macaroon_builder* B)
+{
+    if (B)
+    {
+        macaroon_memzero(B->signature, MACAROON_HASH_BYTES);
+        macaroon_dealloc(B->allocator, B->body);
+        macaroon_dealloc(B->allocator, B->M);
+        macaroon_dealloc(B->allocator, B);
+    }
+}
+
+MACAROON_API int
+macaroon_builder_add_first_party_caveat(struct macaroon_builder* B,
+                                        const unsigned char* predicate, size_t predicate_sz,
+                                        enum macaroon_returncode* err)
+{
+    unsigned char hash[MACAROON_HASH_BYTES];
+    struct caveat* C = NULL;
+    assert(predicate_sz < MACAROON_MAX_STRLEN);
+
+    if (B->M->num_caveats + 1 > MACAROON_MAX_CAVEATS)
+    {
+        *err = MACAROON_TOO_MANY_CAVEATS;
+        return -1;
+    }
+
+    if (macaroon_hash1(B->signature, predicate, predicate_sz, hash) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        return -1;
+    }
+
+    if (macaroon_builder_reserve(B, 1, predicate_sz, err) < 0)
+    {
+        return -1;
+    }
+
+    C = &B->M->caveats[B->M->num_caveats];
+    memset(C, 0, sizeof(struct caveat));
+    B->body_sz = copy_to_slice(predicate, predicate_sz, &C->cid,
+                               B->body + B->body_sz) - B->body;
+    ++B->M->num_caveats;
+    memmove(B->signature, hash, MACAROON_HASH_BYTES);
+    return 0;
+}
+
+MACAROON_API int
+macaroon_builder_add_third_party_caveat(struct macaroon_builder* B,
+                                        const unsigned char* location, size_t location_sz,
+                                        const unsigned char* key, size_t key_sz,
+                                        const unsigned char* id, size_t id_sz,
+                                        enum macaroon_returncode* err)
+{
+    unsigned char derived_key[MACAROON_HASH_BYTES];
+    unsigned char new_sig[MACAROON_HASH_BYTES];
+    unsigned char vid[VID_NONCE_KEY_SZ];
+    struct caveat* C = NULL;
+    unsigned char* ptr = NULL;
+    assert(location_sz < MACAROON_MAX_STRLEN);
+    assert(id_sz < MACAROON_MAX_STRLEN);
+
+    if (B->M->num_caveats + 1 > MACAROON_MAX_CAVEATS)
+    {
+        *err = MACAROON_TOO_MANY_CAVEATS;
+        return -1;
+    }
+
+    if (generate_derived_key(key, key_sz, derived_key) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        return -1;
+    }
+
+    if (macaroon_third_party_vid(B->signature, derived_key, MACAROON_HASH_BYTES,
+                                 id, id_sz, vid, new_sig, err) < 0)
+    {
+        return -1;
+    }
+
+    if (macaroon_builder_reserve(B, 1, id_sz + VID_NONCE_KEY_SZ + location_sz, err) < 0)
+    {
+        return -1;
+    }
+
+    C = &B->M->caveats[B->M->num_caveats];
+    ptr = B->body + B->body_sz;
+    ptr = copy_to_slice(id, id_sz, &C->cid, ptr);
+    ptr = copy_to_slice(vid, VID_NONCE_KEY_SZ, &C->vid, ptr);
+    ptr = copy_to_slice(location, location_sz, &C->cl, ptr);
+    B->body_sz = ptr - B->body;
+    ++B->M->num_caveats;
+    memmove(B->signature, new_sig, MACAROON_HASH_BYTES);
+    return 0;
+}
+
+MACAROON_API struct macaroon*
+macaroon_builder_finalize(const struct macaroon_builder* B,
+                          enum macaroon_returncode* err)
+{
+    return macaroon_copy(B->M, err);
+}
+
+MACAROON_API size_t
+macaroon_builder_serialize_size_hint(const struct macaroon_builder* B,
+                                     enum macaroon_format f)
+{
+    return macaroon_serialize_size_hint(B->M, f);
+}
+
+MACAROON_API size_t
+macaroon_builder_serialize(const struct macaroon_builder* B,
+                           enum macaroon_format f,
+                           unsigned char* buf, size_t buf_sz,
+                           enum macaroon_returncode* err)
+{
+    return macaroon_serialize(B->M, f, buf, buf_sz, err);
+}
+
+static int
+macaroon_bind(const unsigned char* Msig,
+              const unsigned char* MPsig,
+              unsigned char* bound)
+{
+    unsigned char key[MACAROON_HASH_BYTES];
+    macaroon_memzero(key, MACAROON_HASH_BYTES);
+    return macaroon_hash2(key, Msig, MACAROON_HASH_BYTES,
+                          MPsig, MACAROON_HASH_BYTES, bound);
+}
+
+/* How many steps back along M's chain of shared macaroons lies the one whose
+ * own caveats hold caveat i.  Only shared macaroons defer to a parent.
+ */
+static size_t
+segment_distance(const struct macaroon* M, size_t i)
+{
+    size_t d = 0;
+
+    while ((M->flags & MACAROON_FLAG_SHARED) && i < M->parent->num_caveats)
+    {
+        M = M->parent;
+        ++d;
+    }
+
+    return d;
+}
+
+static const struct macaroon*
+segment_ancestor(const struct macaroon* M, size_t d)
+{
+    while (d-- > 0)
+    {
+        M = M->parent;
+    }
+
+    return M;
+}
+
+static void
+segment_caveat(const struct macaroon* S, size_t begin, size_t i,
+               struct macaroon_caveat* caveat)
+{
+    const struct caveat* C;
+    struct caveat tmp;
+
+    C = (S->flags & MACAROON_FLAG_SHARED) ? &S->caveats[i - begin]
+                                          : macaroon_caveat(S, i, &tmp);
+    unstruct_slice(&C->cid, &caveat->cid, &caveat->cid_sz);
+    unstruct_slice(&C->vid, &caveat->vid, &caveat->vid_sz);
+    unstruct_slice(&C->cl, &caveat->cl, &caveat->cl_sz);
+}
+
+MACAROON_API size_t
+macaroon_num_caveats(const struct macaroon* M)
+{
+    VALIDATE(M);
+    return M->num_caveats;
+}
+
+/* The private side of struct macaroon_caveat_cursor.  The stack holds segments
+ * newer than the one being read, each about halfway from the one below it to
+ * the next segment needed.  Finding that segment walks from the top and
+ * pushes the midpoint until they meet, so reading a chain of n segments takes
+ * O(n log n) steps and log2(n) + 1 entries.  A chain too deep for the stack,
+ * which takes tens of millions of shared macaroons, is walked from the top.
+ */
+#define CAVEAT_CURSOR_DEPTH 26
+
+struct caveat_cursor
+{
+    const struct macaroon* M;
+    const struct macaroon* segment;
+    size_t segment_begin;
+    size_t segment_end;
+    size_t idx;
+    size_t stack_sz;
+    const struct macaroon* stack[CAVEAT_CURSOR_DEPTH];
+};
+
+typedef char caveat_cursor_fits[sizeof(struct caveat_cursor) <=
+                                sizeof(struct macaroon_caveat_cursor) ? 1 : -1];
+
+MACAROON_API void
+macaroon_caveat_cursor_init(struct macaroon_caveat_cursor* cursor,
+                            const struct macaroon* M)
+{
+    struct caveat_cursor* C = (struct caveat_cursor*)cursor->opaque;
+    VALIDATE(M);
+    C->M = M;
+    C->segment = NULL;
+    C->segment_begin = 0;
+    C->segment_end = 0;
+    C->idx = 0;
+    C->stack[0] = M;
+    C->stack_sz = 1;
+}
+
+MACAROON_API int
+macaroon_caveat_cursor_next(struct macaroon_caveat_cursor* cursor,
+                            struct macaroon_caveat* caveat)
+{
+    struct caveat_cursor* C = (struct caveat_cursor*)cursor->opaque;
+    const struct macaroon* S;
+    size_t d;
+
+    if (C->idx >= C->M->num_caveats)
+    {
+        return -1;
+    }
+
+    if (C->idx >= C->segment_end)
+    {
+        /* M is at the bottom and holds idx, so this stops before it */
+        while (C->stack[C->stack_sz - 1]->num_caveats <= C->idx)
+        {
+            --C->stack_sz;
+        }
+
+        while ((d = segment_distance(C->stack[C->stack_sz - 1], C->idx)) > 0 &&
+               C->stack_sz < CAVEAT_CURSOR_DEPTH)
+        {
+            C->stack[C->stack_sz] = segment_ancestor(C->stack[C->stack_sz - 1], (d + 1) / 2);
+            ++C->stack_sz;
+        }
+
+        S = segment_ancestor(C->stack[C->stack_sz - 1], d);
+        C->segment = S;
+        C->segment_begin = (S->flags & MACAROON_FLAG_SHARED) ? S->parent->num_caveats : 0;
+        C->segment_end = S->num_caveats;
+    }
+
+    segment_caveat(C->segment, C->segment_begin, C->idx, caveat);
+    ++C->idx;
+    return 0;
+}
+
+MACAROON_API size_t
+macaroon_caveats(const struct macaroon* M, size_t first,
+                 struct macaroon_caveat* caveats, size_t caveats_sz)
+{
+    const struct macaroon* S = M;
+    size_t begin = 0;
+    size_t end;
+    size_t i;
+    VALIDATE(M);
+
+    if (first >= M->num_caveats)
+    {
+        return 0;
+    }
+
+    end = M->num_caveats - first < caveats_sz ? M->num_caveats : first + caveats_sz;
+
+    /* newest segment first, so each shared macaroon is visited once */
+    while (1)
+    {
+        begin = (S->flags & MACAROON_FLAG_SHARED) ? S->parent->num_caveats : 0;
+
+        for (i = begin > first ? begin : first; i < end && i < S->num_caveats; ++i)
+        {
+            segment_caveat(S, begin, i, &caveats[i - first]);
+        }
+
+        if (begin <= first)
+        {
+            break;
+        }
+
+        S = S->parent;
+    }
+
+    return end - first;
+}
+
+MACAROON_API unsigned
+macaroon_num_third_party_caveats(const struct macaroon* M)
+{
+    struct macaroon_caveat_cursor C;
+    struct macaroon_caveat caveat;
+    unsigned count = 0;
+
+    macaroon_caveat_cursor_init(&C, M);
+
+    while (macaroon_caveat_cursor_next(&C, &caveat) == 0)
+    {
+        if (caveat.vid_sz > 0 && caveat.cl_sz > 0)
+        {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+MACAROON_API int
+macaroon_third_party_caveat(const struct macaroon* M, unsigned which,
+                            const unsigned char** location, size_t* location_sz,
+                            const unsigned char** identifier, size_t* identifier_sz)
+{
+    struct macaroon_caveat_cursor C;
+    struct macaroon_caveat caveat;
+    unsigned count = 0;
+
+    macaroon_caveat_cursor_init(&C, M);
+
+    while (macaroon_caveat_cursor_next(&C, &caveat) == 0)
+    {
+        if (caveat.vid_sz > 0 && caveat.cl_sz > 0)
+        {
+            if (count == which)
+            {
+                *identifier = caveat.cid;
+                *identifier_sz = caveat.cid_sz;
+                *location = caveat.cl;
+                *location_sz = caveat.cl_sz;
+                return 0;
+            }
+
+            ++count;
+        }
+    }
+
+    return -1;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+
+static int
+macaroon_bound_signature(const struct macaroon* M,
+                         const struct macaroon* D,
+                         unsigned char* hash,
+                         enum macaroon_returncode* err)
+{
+    VALIDATE(M);
+    VALIDATE(D);
+
+    if (!M->signature.data || M->signature.size != MACAROON_HASH_BYTES ||
+        !D->signature.data || D->signature.size != MACAROON_HASH_BYTES)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    if (macaroon_bind(M->signature.data, D->signature.data, hash) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* bytes a flattened, bound copy of D takes within a batch */
+size_t
+macaroon_arena_size(size_t num_caveats, size_t body_sz)
+{
+    const size_t align = offsetof(struct macaroon_alignment, m);
+    const size_t sz = macaroon_size(num_caveats, body_sz);
+    return (sz + align - 1) / align * align;
+}
+
+static size_t
+macaroon_batch_size(const struct macaroon* D)
+{
+    return macaroon_arena_size(D->num_caveats, macaroon_body_size(D) + MACAROON_HASH_BYTES);
+}
+
+MACAROON_API struct macaroon*
+macaroon_prepare_for_request(const struct macaroon* M,
+                             const struct macaroon* D,
+                             enum macaroon_returncode* err)
+{
+    struct macaroon* B = NULL;
+
+    if (macaroon_prepare_for_request_batch(M, &D, 1, &B, err) < 0)
+    {
+        return NULL;
+    }
+
+    return B;
+}
+
+MACAROON_API int
+macaroon_prepare_for_request_batch(const struct macaroon* M,
+                                   const struct macaroon* const* D, size_t n,
+                                   struct macaroon** out,
+                                   enum macaroon_returncode* err)
+{
+    const struct macaroon_allocator* A = NULL;
+    unsigned char hash[MACAROON_HASH_BYTES];
+    unsigned char* block = NULL;
+    unsigned char* next = NULL;
+    unsigned char* ptr = NULL;
+    struct macaroon* B = NULL;
+    size_t sz = 0;
+    size_t i;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        sz += macaroon_batch_size(D[i]);
+    }
+
+    A = D[0]->allocator;
+    block = macaroon_alloc(A, sz);
+
+    if (!block)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return -1;
+    }
+
+    for (i = 0, next = block; i < n; ++i)
+    {
+        B = (struct macaroon*)next;
+        next += macaroon_batch_size(D[i]);
+        sz = macaroon_size(D[i]->num_caveats, 0);
+        macaroon_memzero(B, sz);
+        out[i] = B;
+
+        if (macaroon_bound_signature(M, D[i], hash, err) < 0)
+        {
+            macaroon_dealloc(A, block);
+            return -1;
+        }
+
+        ptr = (unsigned char*)B + sz;
+        B->allocator = A;
+        B->num_caveats = D[i]->num_caveats;
+        ptr = copy_slice(&D[i]->location, &B->location, ptr);
+        ptr = copy_slice(&D[i]->identifier, &B->identifier, ptr);
+        ptr = copy_caveats(D[i], B->caveats, ptr);
+        ptr = copy_to_slice(hash, MACAROON_HASH_BYTES, &B->signature, ptr);
+
+        /* the first owns the block; the rest each hold a reference on it */
+        if (i > 0)
+        {
+            B->flags = MACAROON_FLAG_ARENA;
+            B->parent = out[0];
+        }
+
+        VALIDATE(B);
+    }
+
+    out[0]->refs = n - 1;
+    return 0;
+}
+
+MACAROON_API size_t
+macaroon_serialize_for_request(const struct macaroon* M,
+                               const struct macaroon* D,
+                               enum macaroon_format f,
+                               unsigned char* buf, size_t buf_sz,
+                               enum macaroon_returncode* err)
+{
+    unsigned char hash[MACAROON_HASH_BYTES];
+    struct macaroon B;
+
+    if (macaroon_bound_signature(M, D, hash, err) < 0)
+    {
+        return 0;
+    }
+
+    /* a header on the stack that reads D's caveats and carries the bound
+     * signature; nothing of D is copied */
+    macaroon_memzero(&B, sizeof(B));
+    B.flags = MACAROON_FLAG_SHARED;
+    B.parent = (struct macaroon*)D;
+    B.num_caveats = D->num_caveats;
+    B.location = D->location;
+    B.identifier = D->identifier;
+    B.signature.data = hash;
+    B.signature.size = MACAROON_HASH_BYTES;
+    return macaroon_serialize(&B, f, buf, buf_sz, err);
+}
+
+/* the i'th macaroon of a bundle: M, then the discharges */
+static const struct macaroon*
+bundle_member(const struct macaroon* M, const struct macaroon* const* D, size_t i)
+{
+    return i == 0 ? M : D[i - 1];
+}
+
+/* Locations shorter than this cost no more written out than referenced. */
+#define BUNDLE_MIN_SHARED 4
+
+/* Pick the locations that appear more than once across the bundle, sorted with
+ * bundle_string_cmp.  The slices point into the macaroons.
+ */
+static int
+bundle_strings(const struct macaroon* M,
+               const struct macaroon* const* D, size_t n,
+               struct slice* strings, size_t* strings_sz,
+               enum macaroon_returncode* err)
+{
+    const struct macaroon* X = NULL;
+    const struct caveat* C = NULL;
+    struct caveat tmp;
+    struct caveat_walk W;
+    struct slice* all = NULL;
+    size_t all_sz = 0;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i <= n; ++i)
+    {
+        all_sz += 1 + bundle_member(M, D, i)->num_caveats;
+    }
+
+    all = macaroon_alloc(NULL, all_sz * sizeof(struct slice));
+
+    if (!all)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return -1;
+    }
+
+    for (i = 0, all_sz = 0; i <= n; ++i)
+    {
+        X = bundle_member(M, D, i);
+
+        if (X->location.size >= BUNDLE_MIN_SHARED)
+        {
+            all[all_sz++] = X->location;
+        }
+
+        caveat_walk_init(&W, X);
+
+        while ((C = caveat_walk_next(&W, &tmp)))
+        {
+            if (C->cl.size >= BUNDLE_MIN_SHARED)
+            {
+                all[all_sz++] = C->cl;
+            }
+        }
+
+        caveat_walk_done(&W);
+    }
+
+    qsort(all, all_sz, sizeof(struct slice), bundle_string_cmp);
+    *strings_sz = 0;
+
+    for (i = 0; i < all_sz && *strings_sz < MACAROON_BUNDLE_MAX_STRINGS; i = j)
+    {
+        for (j = i + 1; j < all_sz && bundle_string_cmp(&all[i], &all[j]) == 0; ++j)
+            ;
+
+        if (j - i > 1)
+        {
+            strings[(*strings_sz)++] = all[i];
+        }
+    }
+
+    macaroon_dealloc(NULL, all);
+    return 0;
+}
+
+static size_t
+bundle_size(const struct macaroon* M,
+            const struct macaroon* const* D, size_t n,
+            const struct slice* strings, size_t strings_sz)
+{
+    size_t sz = 1 + varint_length(strings_sz) + varint_length(n + 1);
+    size_t member_sz;
+    size_t i;
+
+    for (i = 0; i < strings_sz; ++i)
+    {
+        sz += varint_length(strings[i].size) + strings[i].size;
+    }
+
+    for (i = 0; i <= n; ++i)
+    {
+        member_sz = macaroon_serialize_size_bundled_v2(bundle_member(M, D, i), strings, strings_sz);
+        sz += varint_length(member_sz) + member_sz;
+    }
+
+    return sz;
+}
+
+MACAROON_API size_t
+macaroon_bundle_serialize_size_hint(const struct macaroon* M,
+                                    const struct macaroon* const* D, size_t n)
+{
+    struct slice strings[MACAROON_BUNDLE_MAX_STRINGS];
+    size_t strings_sz = 0;
+    enum macaroon_returncode err;
+
+    if (bundle_strings(M, D, n, strings, &strings_sz, &err) < 0)
+    {
+        return 0;
+    }
+
+    return bundle_size(M, D, n, strings, strings_sz);
+}
+
+MACAROON_API size_t
+macaroon_bundle_serialize(const struct macaroon* M,
+                          const struct macaroon* const* D, size_t n,
+                          unsigned char* buf, size_t buf_sz,
+                          enum macaroon_returncode* err)
+{
+    struct slice strings[MACAROON_BUNDLE_MAX_STRINGS];
+    size_t strings_sz = 0;
+    const struct macaroon* X = NULL;
+    unsigned char* ptr = buf;
+    size_t sz;
+    size_t i;
+
+    if (bundle_strings(M, D, n, strings, &strings_sz, err) < 0)
+    {
+        return 0;
+    }
+
+    sz = bundle_size(M, D, n, strings, strings_sz);
+
+    if (buf_sz < sz)
+    {
+        *err = MACAROON_BUF_TOO_SMALL;
+        return 0;
+    }
+
+    *ptr++ = MACAROON_BUNDLE_VERSION;
+    ptr = packvarint(strings_sz, ptr);
+
+    for (i = 0; i < strings_sz; ++i)
+    {
+        ptr = packvarint(strings[i].size, ptr);
+        memmove(ptr, strings[i].data, strings[i].size);
+        ptr += strings[i].size;
+    }
+
+    ptr = packvarint(n + 1, ptr);
+
+    for (i = 0; i <= n; ++i)
+    {
+        X = bundle_member(M, D, i);
+        ptr = packvarint(macaroon_serialize_size_bundled_v2(X, strings, strings_sz), ptr);
+        ptr = macaroon_serialize_bundled_v2(X, strings, strings_sz, ptr);
+    }
+
+    assert(ptr == buf + sz);
+    return sz;
+}
+
+/* read a varint length and the bytes it frames */
+static const unsigned char*
+bundle_frame(const unsigned char* ptr, const unsigned char* end, struct slice* s)
+{
+    uint64_t sz = 0;
+    ptr = ptr ? unpackvarint(ptr, end, &sz) : NULL;
+
+    if (!ptr || sz > (uint64_t)(end - ptr))
+    {
+        return NULL;
+    }
+
+    s->data = ptr;
+    s->size = sz;
+    return ptr + sz;
+}
+
+MACAROON_API struct macaroon*
+macaroon_bundle_deserialize(const unsigned char* data, size_t data_sz,
+                            struct macaroon*** D, size_t* n,
+                            enum macaroon_returncode* err)
+{
+    const unsigned char* const end = data + data_sz;
+    struct slice strings[MACAROON_BUNDLE_MAX_STRINGS];
+    const unsigned char* members = NULL;
+    const unsigned char* ptr = NULL;
+    unsigned char* block = NULL;
+    unsigned char* next = NULL;
+    unsigned char* body = NULL;
+    struct macaroon** discharges = NULL;
+    struct macaroon* B = NULL;
+    struct slice member;
+    uint64_t strings_sz = 0;
+    uint64_t members_sz = 0;
+    size_t num_caveats = 0;
+    size_t body_sz = 0;
+    size_t arena_sz = 0;
+    size_t sz = 0;
+    size_t i;
+
+    *err = MACAROON_INVALID;
+
+    if (data_sz == 0 || data[0] != MACAROON_BUNDLE_VERSION)
+    {
+        return NULL;
+    }
+
+    ptr = unpackvarint(data + 1, end, &strings_sz);
+
+    if (!ptr || strings_sz > MACAROON_BUNDLE_MAX_STRINGS)
+    {
+        return NULL;
+    }
+
+    for (i = 0; ptr && i < strings_sz; ++i)
+    {
+        ptr = bundle_frame(ptr, end, &strings[i]);
+    }
+
+    ptr = ptr ? unpackvarint(ptr, end, &members_sz) : NULL;
+
+    /* every member takes at least a byte, which bounds the count */
+    if (!ptr || members_sz == 0 || members_sz > (uint64_t)(end - ptr))
+    {
+        return NULL;
+    }
+
+    members = ptr;
+
+    for (i = 0; i < members_sz; ++i)
+    {
+        ptr = bundle_frame(ptr, end, &member);
+
+        if (!ptr ||
+            macaroon_deserialize_measure_bundled_v2(member.data, member.size,
+                                                    strings, strings_sz,
+                                                    &num_caveats, &body_sz, err) < 0)
+        {
+            *err = MACAROON_INVALID;
+            return NULL;
+        }
+
+        sz += macaroon_arena_size(num_caveats, body_sz);
+    }
+
+    if (ptr != end)
+    {
+        return NULL;
+    }
+
+    /* the macaroons, then the discharge pointers, then the shared strings */
+    arena_sz = sz;
+    sz += (members_sz - 1) * sizeof(struct macaroon*);
+
+    for (i = 0; i < strings_sz; ++i)
+    {
+        sz += strings[i].size;
+    }
+
+    block = macaroon_alloc(NULL, sz);
+
+    if (!block)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    discharges = (struct macaroon**)(block + arena_sz);
+    next = (unsigned char*)(discharges + members_sz - 1);
+
+    for (i = 0; i < strings_sz; ++i)
+    {
+        next = copy_slice(&strings[i], &strings[i], next);
+    }
+
+    for (i = 0, ptr = members, next = block; i < members_sz; ++i)
+    {
+        /* the first pass parsed these bytes, but data may have changed since,
+         * so nothing may go beyond what it measured */
+        ptr = bundle_frame(ptr, end, &member);
+
+        if (!ptr ||
+            macaroon_deserialize_measure_bundled_v2(member.data, member.size,
+                                                    strings, strings_sz,
+                                                    &num_caveats, &body_sz, err) < 0 ||
+            macaroon_arena_size(num_caveats, body_sz) > arena_sz - (size_t)(next - block))
+        {
+            macaroon_dealloc(NULL, block);
+            *err = MACAROON_INVALID;
+            return NULL;
+        }
+
+        B = (struct macaroon*)next;
+        next += macaroon_arena_size(num_caveats, body_sz);
+        macaroon_memzero(B, macaroon_size(num_caveats, 0));
+        body = (unsigned char*)B + macaroon_size(num_caveats, 0);
+
+        if (macaroon_deserialize_fill_bundled_v2(member.data, member.size,
+                                                 strings, strings_sz,
+                                                 B, num_caveats, body, body_sz, err) < 0)
+        {
+            macaroon_dealloc(NULL, block);
+            return NULL;
+        }
+
+        /* the root owns the block; each discharge holds a reference on it */
+        if (i > 0)
+        {
+            B->flags = MACAROON_FLAG_ARENA;
+            B->parent = (struct macaroon*)block;
+            discharges[i - 1] = B;
+        }
+
+        VALIDATE(B);
+    }
+
+    B = (struct macaroon*)block;
+    B->refs = members_sz - 1;
+    *D = members_sz > 1 ? discharges : NULL;
+    *n = members_sz - 1;
+    *err = MACAROON_SUCCESS;
+    return B;
+}
+
+#pragma GCC diagnostic pop
+
+MACAROON_API struct macaroon_verifier*
+macaroon_verifier_create_with_allocator(const struct macaroon_allocator* A)
+{
+    struct macaroon_verifier* V;
+    V = macaroon_alloc(A, sizeof(struct macaroon_verifier));
+
+    if (!V)
+    {
+        return NULL;
+    }
+
+    memset(V, 0, sizeof(struct macaroon_verifier));
+    V->allocator = A;
+    V->predicates = NULL;
+    V->predicates_sz = 0;
+    V->predicates_cap = 0;
+    return V;
+}
+
+MACAROON_API struct macaroon_verifier*
+macaroon_verifier_create()
+{
+    return macaroon_verifier_create_with_allocator(NULL);
+}
+
+MACAROON_API void
+macaroon_verifier_destroy(struct macaroon_verifier* V)
+{
+    size_t idx = 0;
+
+    if (V)
+    {
+        for (idx = 0; idx < V->predicates_sz; ++idx)
+        {
+            macaroon_dealloc(V->allocator, V->predicates[idx].alloc);
+        }
+
+        macaroon_dealloc(V->allocator, V->predicates);
+        macaroon_dealloc(V->allocator, V->verifier_callbacks);
+        macaroon_dealloc(V->allocator, V);
+    }
+}
+
+MACAROON_API int
+macaroon_verifier_satisfy_exact(struct macaroon_verifier* V,
+                                const unsigned char* predicate, size_t predicate_sz,
+                                enum macaroon_returncode* err)
+{
+    struct predicate* tmp = NULL;
+
+    if (V->predicates_sz == V->predicates_cap)
+    {
+        V->predicates_cap = V->predicates_cap < 8 ? 8 :
+                            V->predicates_cap + (V->predicates_cap >> 1);
+        tmp = macaroon_realloc(V->allocator, V->predicates,
+                               V->predicates_cap * sizeof(struct predicate));
+
+        if (!tmp)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
+        }
+
+        V->predicates = tmp;
+    }
+
+    assert(V->predicates_sz < V->predicates_cap);
+    tmp = &V->predicates[V->predicates_sz];
+    tmp->data = tmp->alloc = macaroon_alloc(V->allocator, sizeof(unsigned char) * predicate_sz);
+    tmp->size = predicate_sz;
+
+    if (!tmp->data)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return -1;
+    }
+
+    memmove(tmp->alloc, predicate, predicate_sz);
+    ++V->predicates_sz;
+    assert(V->predicates_sz <= V->predicates_cap);
+    return 0;
+}
+
+MACAROON_API int
+macaroon_verifier_satisfy_general(struct macaroon_verifier* V,
+                                  int (*general_check)(void* f, const unsigned char* pred, size_t pred_sz),
                                   void* f, enum macaroon_returncode* err)
 {
-    struct verifier_callback* tmp = NULL;
+    struct verifier_callback* tmp = NULL;
+
+    if (V->verifier_callbacks_sz == V->verifier_callbacks_cap)
+    {
+        V->verifier_callbacks_cap = V->verifier_callbacks_cap < 8 ? 8 :
+                                    V->verifier_callbacks_cap +
+                                    (V->verifier_callbacks_cap >> 1);
+        tmp = macaroon_realloc(V->allocator, V->verifier_callbacks,
+                               V->verifier_callbacks_cap * sizeof(struct verifier_callback));
+
+        if (!tmp)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
+        }
+
+        V->verifier_callbacks = tmp;
+    }
+
+    assert(V->verifier_callbacks_sz < V->verifier_callbacks_cap);
+    tmp = &V->verifier_callbacks[V->verifier_callbacks_sz];
+    tmp->func = general_check;
+    tmp->ptr = f;
+    ++V->verifier_callbacks_sz;
+    assert(V->verifier_callbacks_sz <= V->verifier_callbacks_cap);
+    return 0;
+}
+
+static int
+macaroon_verify_inner(const struct macaroon_verifier* V,
+                      const struct macaroon* M,
+                      const struct macaroon* TM,
+                      const unsigned char* key, size_t key_sz,
+                      struct macaroon** MS, size_t MS_sz,
+                      enum macaroon_returncode* err,
+                      size_t* tree, size_t tree_idx);
+
+static int
+macaroon_verify_inner_1st(const struct macaroon_verifier* V,
+                          const struct caveat* C)
+{
+    int fail = 0;
+    int found = 0;
+    size_t sz = 0;
+    size_t idx = 0;
+    struct predicate pred;
+    struct predicate* poss;
+    struct verifier_callback* vcb;
+
+    pred.data = NULL;
+    pred.size = 0;
+    unstruct_slice(&C->cid, &pred.data, &pred.size);
+
+    for (idx = 0; idx < V->predicates_sz; ++idx)
+    {
+        poss = &V->predicates[idx];
+        sz = pred.size < poss->size ?  pred.size : poss->size;
+        found |= macaroon_memcmp(pred.data, poss->data, sz) == 0 &&
+                 pred.size == poss->size;
+    }
+
+    for (idx = 0; idx < V->verifier_callbacks_sz; ++idx)
+    {
+        vcb = &V->verifier_callbacks[idx];
+        found |= vcb->func(vcb->ptr, pred.data, pred.size) == 0;
+    }
+
+    return (!fail && found) ? 0 : -1;
+}
+
+static int
+macaroon_verify_inner_3rd(const struct macaroon_verifier* V,
+                          const struct caveat* C,
+                          const unsigned char* sig,
+                          const struct macaroon* TM,
+                          struct macaroon** MS, size_t MS_sz,
+                          enum macaroon_returncode* err,
+                          size_t* tree, size_t tree_idx)
+{
+    unsigned char enc_key[MACAROON_SECRET_KEY_BYTES];
+    const unsigned char *enc_nonce;
+    unsigned char enc_plaintext[MACAROON_SECRET_TEXT_ZERO_BYTES + MACAROON_HASH_BYTES];
+    unsigned char enc_ciphertext[MACAROON_SECRET_BOX_ZERO_BYTES + MACAROON_HASH_BYTES + SECRET_BOX_OVERHEAD];
+    unsigned char vid_data[VID_NONCE_KEY_SZ];
+
+    int fail = 0;
+    int inner = -1;
+    size_t midx = 0;
+    size_t tidx = 0;
+    struct predicate cav;
+    struct predicate vid;
+    struct predicate mac;
+    size_t sz;
+
+    cav.data = NULL;
+    cav.size = 0;
+    unstruct_slice(&C->cid, &cav.data, &cav.size);
+    tree[tree_idx] = MS_sz;
+
+    for (midx = 0; midx < MS_sz; ++midx)
+    {
+        mac.data = NULL;
+        mac.size = 0;
+        unstruct_slice(&MS[midx]->identifier, &mac.data, &mac.size);
+        sz = cav.size < mac.size ? cav.size : mac.size;
+
+        if (macaroon_memcmp(cav.data, mac.data, sz) == 0 && cav.size == mac.size)
+        {
+            tree[tree_idx] = midx;
+            /* zero everything */
+            macaroon_memzero(enc_key, sizeof(enc_key));
+            macaroon_memzero(enc_plaintext, sizeof(enc_plaintext));
+            macaroon_memzero(enc_ciphertext, sizeof(enc_ciphertext));
+
+            vid.data = vid_data;
+            vid.size = sizeof(vid_data);
+            unstruct_slice(&C->vid, &vid.data, &vid.size);
+            assert(vid.size == VID_NONCE_KEY_SZ);
+            /*
+             * the nonce is in the first MACAROON_SECRET_NONCE_BYTES
+             * of the vid; the ciphertext is in the rest of it.
+             */
+            enc_nonce = vid.data;
+            /* fill in the ciphertext */
+            memmove(enc_ciphertext + MACAROON_SECRET_BOX_ZERO_BYTES,
+                    vid.data + MACAROON_SECRET_NONCE_BYTES,
+                    vid.size - MACAROON_SECRET_NONCE_BYTES);
+            /* now get the plaintext */
+            fail |= macaroon_secretbox_open(sig, enc_nonce, enc_ciphertext,
+                                            sizeof(enc_ciphertext),
+                                            enc_plaintext);
+            inner &= macaroon_verify_inner(V, MS[tree[tree_idx]], TM,
+                                          enc_plaintext + MACAROON_SECRET_TEXT_ZERO_BYTES,
+                                          MACAROON_HASH_BYTES,
+                                          MS, MS_sz, err, tree, tree_idx + 1);
+        }
+
+        for (tidx = 0; tidx < tree_idx; ++tidx)
+        {
+            fail |= tree[tidx] == tree[tree_idx];
+        }
+    }
+
+    if (tree[tree_idx] >= MS_sz)
+    {
+        fail = -1;
+    }
+    else
+    {
+        fail |= inner;
+    }
+
+    return fail;
+}
+
+int
+macaroon_verify_inner(const struct macaroon_verifier* V,
+                      const struct macaroon* M,
+                      const struct macaroon* TM,
+                      const unsigned char* key, size_t key_sz,
+                      struct macaroon** MS, size_t MS_sz,
+                      enum macaroon_returncode* err,
+                      size_t* tree, size_t tree_idx)
+{
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
+    int tree_fail = 0;
+    const unsigned char* data = NULL;
+    size_t data_sz = 0;
+    const unsigned char* vdata = NULL;
+    size_t vdata_sz = 0;
+    unsigned char tmp[MACAROON_HASH_BYTES];
+    unsigned char csig[MACAROON_HASH_BYTES];
+
+    assert(M);
+    assert(TM);
+
+    if (macaroon_validate(M) < 0)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    if (tree_idx > MS_sz)
+    {
+        *err = MACAROON_CYCLE;
+        return -1;
+    }
+
+    tree_fail = 0;
+    tree_fail |= macaroon_hmac(key, key_sz, M->identifier.data, M->identifier.size, csig);
+
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
+    {
+        if (C->vid.size == 0)
+        {
+            tree_fail |= macaroon_verify_inner_1st(V, C);
+            /* move the signature and compute a new one */
+            memmove(tmp, csig, MACAROON_HASH_BYTES);
+            data = NULL;
+            data_sz = 0;
+            unstruct_slice(&C->cid, &data, &data_sz);
+            tree_fail |= macaroon_hash1(tmp, data, data_sz, csig);
+        }
+        else
+        {
+            tree_fail |= macaroon_verify_inner_3rd(V, C, csig, TM, MS, MS_sz, err, tree, tree_idx);
+            /* move the signature and compute a new one */
+            memmove(tmp, csig, MACAROON_HASH_BYTES);
+            data = NULL;
+            data_sz = 0;
+            unstruct_slice(&C->cid, &data, &data_sz);
+            vdata = NULL;
+            vdata_sz = 0;
+            unstruct_slice(&C->vid, &vdata, &vdata_sz);
+            tree_fail |= macaroon_hash2(tmp, vdata, vdata_sz, data, data_sz, csig);
+        }
+    }
+
+    caveat_walk_done(&W);
+
+    if (tree_idx > 0)
+    {
+        memmove(tmp, csig, MACAROON_HASH_BYTES);
+        data = TM->signature.data;
+        tree_fail |= TM->signature.size ^ MACAROON_HASH_BYTES;
+        tree_fail |= macaroon_bind(data, tmp, csig);
+    }
+
+    data = M->signature.data;
+    tree_fail |= M->signature.size ^ MACAROON_HASH_BYTES;
+    tree_fail |= macaroon_memcmp(data, csig, MACAROON_HASH_BYTES);
+    return tree_fail;
+}
+
+MACAROON_API int
+macaroon_verify_raw(const struct macaroon_verifier* V,
+                    const struct macaroon* M,
+                    const unsigned char* key, size_t key_sz,
+                    struct macaroon** MS, size_t MS_sz,
+                    enum macaroon_returncode* err)
+{
+    int rc = 0;
+    size_t i = 0;
+    size_t* tree = macaroon_alloc(V->allocator, (MS_sz + 1) * sizeof(size_t));
+
+    if (!tree)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return -1;
+    }
+
+    for (i = 0; i < MS_sz; ++i)
+    {
+        tree[i] = MS_sz;
+    }
+
+    tree[MS_sz] = MS_sz;
+
+    assert(key_sz == MACAROON_SUGGESTED_SECRET_LENGTH);
+    rc = macaroon_verify_inner(V, M, M, key, key_sz,
+                               MS, MS_sz, err, tree, 0);
+    if (rc)
+    {
+        *err = MACAROON_NOT_AUTHORIZED;
+    }
+
+    macaroon_dealloc(V->allocator, tree);
+    return rc;
+}
+
+MACAROON_API int
+macaroon_verify(const struct macaroon_verifier* V,
+                const struct macaroon* M,
+                const unsigned char* key, size_t key_sz,
+                struct macaroon** MS, size_t MS_sz,
+                enum macaroon_returncode* err)
+{
+    unsigned char derived_key[MACAROON_HASH_BYTES];
+
+    if (generate_derived_key(key, key_sz, derived_key) < 0)
+    {
+        *err = MACAROON_HASH_FAILED;
+        return -1;
+    }
+
+    return macaroon_verify_raw(V, M, derived_key, MACAROON_HASH_BYTES, MS, MS_sz, err);
+}
+
+MACAROON_API void
+macaroon_location(const struct macaroon* M,
+                  const unsigned char** location, size_t* location_sz)
+{
+    assert(M);
+    VALIDATE(M);
+    unstruct_slice(&M->location, location, location_sz);
+}
+
+MACAROON_API void
+macaroon_identifier(const struct macaroon* M,
+                    const unsigned char** identifier, size_t* identifier_sz)
+{
+    assert(M);
+    VALIDATE(M);
+    unstruct_slice(&M->identifier, identifier, identifier_sz);
+}
+
+MACAROON_API void
+macaroon_signature(const struct macaroon* M,
+                   const unsigned char** signature, size_t* signature_sz)
+{
+    assert(M);
+    VALIDATE(M);
+    unstruct_slice(&M->signature, signature, signature_sz);
+}
+
+MACAROON_API size_t
+macaroon_serialize_size_hint(const struct macaroon* M,
+                             enum macaroon_format f)
+{
+    switch (f)
+    {
+        case MACAROON_V1:
+            return macaroon_serialize_size_hint_v1(M);
+        case MACAROON_V2:
+            return macaroon_serialize_size_hint_v2(M);
+        case MACAROON_V2J:
+#ifdef MACAROONS_JSON
+            return macaroon_serialize_size_hint_v2j(M);
+#endif
+            return 0;
+        case MACAROON_V2D:
+            return macaroon_serialize_size_hint_v2d(M, 0);
+        case MACAROON_V2_B64URL:
+            return macaroon_serialize_size_hint_v2_b64(M);
+        default:
+            return 0;
+    }
+}
+
+MACAROON_API size_t
+macaroon_serialize(const struct macaroon* M,
+                   enum macaroon_format f,
+                   unsigned char* buf, size_t buf_sz,
+                   enum macaroon_returncode* err)
+{
+    switch (f)
+    {
+        case MACAROON_V1:
+            if (macaroon_serialize_v1(M, (char*)buf, buf_sz, err) < 0) return 0;
+            return strlen((char*)buf);
+        case MACAROON_V2:
+            return macaroon_serialize_v2(M, buf, buf_sz, err);
+        case MACAROON_V2J:
+#ifdef MACAROONS_JSON
+            return macaroon_serialize_v2j(M, buf, buf_sz, err);
+#else
+            *err = MACAROON_NO_JSON_SUPPORT;
+            return 0;
+#endif
+        case MACAROON_V2D:
+            return macaroon_serialize_v2d(M, 0, buf, buf_sz, err);
+        case MACAROON_V2_B64URL:
+            return macaroon_serialize_v2_b64(M, buf, buf_sz, err);
+        default:
+            *err = MACAROON_INVALID;
+            return 0;
+    }
+}
 
-    if (V->verifier_callbacks_sz == V->verifier_callbacks_cap)
+MACAROON_API size_t
+macaroon_serialize_size_hint_dictionary(const struct macaroon* M,
+                                        unsigned version)
+{
+    return version ? macaroon_serialize_size_hint_v2d(M, version) : 0;
+}
+
+MACAROON_API size_t
+macaroon_serialize_dictionary(const struct macaroon* M, unsigned version,
+                              unsigned char* buf, size_t buf_sz,
+                              enum macaroon_returncode* err)
+{
+    if (version == 0)
     {
-        V->verifier_callbacks_cap = V->verifier_callbacks_cap < 8 ? 8 :
-                                    V->verifier_callbacks_cap +
-                                    (V->verifier_callbacks_cap >> 1);
-        tmp = realloc(V->verifier_callbacks,
-                      V->verifier_callbacks_cap * sizeof(struct verifier_callback));
+        *err = MACAROON_UNSUPPORTED_FORMAT;
+        return 0;
+    }
 
-        if (!tmp)
-        {
-            *err = MACAROON_OUT_OF_MEMORY;
-            return -1;
-        }
+    return macaroon_serialize_v2d(M, version, buf, buf_sz, err);
+}
 
-        V->verifier_callbacks = tmp;
+MACAROON_API int
+macaroon_serialize_iov(const struct macaroon* M,
+                       enum macaroon_format f,
+                       struct iovec* iov, size_t* iov_sz,
+                       unsigned char* scratch, size_t* scratch_sz,
+                       enum macaroon_returncode* err)
+{
+    if (f != MACAROON_V2)
+    {
+        *err = MACAROON_UNSUPPORTED_FORMAT;
+        return -1;
+    }
+
+    if (macaroon_serialize_iov_v2(M, iov, iov_sz, scratch, scratch_sz) < 0)
+    {
+        *err = MACAROON_BUF_TOO_SMALL;
+        return -1;
     }
 
-    assert(V->verifier_callbacks_sz < V->verifier_callbacks_cap);
-    tmp = &V->verifier_callbacks[V->verifier_callbacks_sz];
-    tmp->func = general_check;
-    tmp->ptr = f;
-    ++V->verifier_callbacks_sz;
-    assert(V->verifier_callbacks_sz <= V->verifier_callbacks_cap);
     return 0;
 }
 
-static int
-macaroon_verify_inner(const struct macaroon_verifier* V,
-                      const struct macaroon* M,
-                      const struct macaroon* TM,
-                      const unsigned char* key, size_t key_sz,
-                      struct macaroon** MS, size_t MS_sz,
-                      enum macaroon_returncode* err,
-                      size_t* tree, size_t tree_idx);
+MACAROON_API unsigned char*
+macaroon_serialize_alloc(const struct macaroon* M,
+                         enum macaroon_format f,
+                         size_t* buf_sz,
+                         enum macaroon_returncode* err)
+{
+    const size_t sz = macaroon_serialize_size_hint(M, f);
+    unsigned char* buf = NULL;
 
-static int
-macaroon_verify_inner_1st(const struct macaroon_verifier* V,
-                          const struct caveat* C)
+    if (sz == 0)
+    {
+        /* reports why the format is unsupported */
+        macaroon_serialize(M, f, NULL, 0, err);
+        return NULL;
+    }
+
+    buf = macaroon_alloc(NULL, sz);
+
+    if (!buf)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    *buf_sz = macaroon_serialize(M, f, buf, sz, err);
+
+    if (*buf_sz == 0)
+    {
+        macaroon_dealloc(NULL, buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+MACAROON_API void
+macaroon_free(void* ptr)
 {
-    int fail = 0;
-    int found = 0;
-    size_t sz = 0;
-    size_t idx = 0;
-    struct predicate pred;
-    struct predicate* poss;
-    struct verifier_callback* vcb;
+    macaroon_dealloc(NULL, ptr);
+}
 
-    pred.data = NULL;
-    pred.size = 0;
-    unstruct_slice(&C->cid, &pred.data, &pred.size);
+static const char v1_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+/-_";
 
-    for (idx = 0; idx < V->predicates_sz; ++idx)
+int
+macaroon_deserialize_measure(const unsigned char* data, size_t data_sz,
+                             size_t* num_caveats, size_t* body_sz,
+                             enum macaroon_returncode* err)
+{
+    if (data_sz == 0)
     {
-        poss = &V->predicates[idx];
-        sz = pred.size < poss->size ?  pred.size : poss->size;
-        found |= macaroon_memcmp(pred.data, poss->data, sz) == 0 &&
-                 pred.size == poss->size;
+        *err = MACAROON_INVALID;
+        return -1;
     }
 
-    for (idx = 0; idx < V->verifier_callbacks_sz; ++idx)
+    if (data[0] == MACAROON_V2_B64URL_LEAD)
     {
-        vcb = &V->verifier_callbacks[idx];
-        found |= vcb->func(vcb->ptr, pred.data, pred.size) == 0;
+        return macaroon_deserialize_measure_v2_b64(data, data_sz,
+                                                   num_caveats, body_sz, err);
     }
 
-    return (!fail && found) ? 0 : -1;
+    if (strchr(v1_chars, data[0]))
+    {
+        return macaroon_deserialize_measure_v1((const char*)data, data_sz,
+                                               num_caveats, body_sz, err);
+    }
+
+    if (data[0] == '{')
+    {
+#ifdef MACAROONS_JSON
+        *err = MACAROON_UNSUPPORTED_FORMAT;
+#else
+        *err = MACAROON_NO_JSON_SUPPORT;
+#endif
+        return -1;
+    }
+    else if (data[0] == '\x02')
+    {
+        return macaroon_deserialize_measure_v2(data, data_sz,
+                                               num_caveats, body_sz, err);
+    }
+    else if (data[0] == MACAROON_V2D_VERSION)
+    {
+        return macaroon_deserialize_measure_v2d(data, data_sz,
+                                                num_caveats, body_sz, err);
+    }
+    else
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
 }
 
-static int
-macaroon_verify_inner_3rd(const struct macaroon_verifier* V,
-                          const struct caveat* C,
-                          const unsigned char* sig,
-                          const struct macaroon* TM,
-                          struct macaroon** MS, size_t MS_sz,
-                          enum macaroon_returncode* err,
-                          size_t* tree, size_t tree_idx)
+int
+macaroon_deserialize_fill(const unsigned char* data, size_t data_sz,
+                          struct macaroon* M, size_t num_caveats,
+                          unsigned char* body, size_t body_sz,
+                          enum macaroon_returncode* err)
 {
-    unsigned char enc_key[MACAROON_SECRET_KEY_BYTES];
-    const unsigned char *enc_nonce;
-    unsigned char enc_plaintext[MACAROON_SECRET_TEXT_ZERO_BYTES + MACAROON_HASH_BYTES];
-    unsigned char enc_ciphertext[MACAROON_SECRET_BOX_ZERO_BYTES + MACAROON_HASH_BYTES + SECRET_BOX_OVERHEAD];
-    unsigned char vid_data[VID_NONCE_KEY_SZ];
+    if (data[0] == MACAROON_V2_B64URL_LEAD)
+    {
+        return macaroon_deserialize_fill_v2_b64(data, data_sz,
+                                                M, num_caveats, body, body_sz, err);
+    }
 
-    int fail = 0;
-    int inner = -1;
-    size_t midx = 0;
-    size_t tidx = 0;
-    struct predicate cav;
-    struct predicate vid;
-    struct predicate mac;
-    size_t sz;
+    if (strchr(v1_chars, data[0]))
+    {
+        return macaroon_deserialize_fill_v1((const char*)data, data_sz,
+                                            M, num_caveats, body, body_sz, err);
+    }
 
-    cav.data = NULL;
-    cav.size = 0;
-    unstruct_slice(&C->cid, &cav.data, &cav.size);
-    tree[tree_idx] = MS_sz;
+    if (data[0] == MACAROON_V2D_VERSION)
+    {
+        return macaroon_deserialize_fill_v2d(data, data_sz,
+                                             M, num_caveats, body, body_sz, err);
+    }
 
-    for (midx = 0; midx < MS_sz; ++midx)
+    /* anything else changed since measure, and fails to parse as V2 */
+    return macaroon_deserialize_fill_v2(data, data_sz,
+                                        M, num_caveats, body, body_sz, err);
+}
+
+MACAROON_API struct macaroon*
+macaroon_deserialize_with_allocator(const unsigned char* data, size_t data_sz,
+                                    const struct macaroon_allocator* A,
+                                    enum macaroon_returncode* err)
+{
+    if (data_sz == 0)
     {
-        mac.data = NULL;
-        mac.size = 0;
-        unstruct_slice(&MS[midx]->identifier, &mac.data, &mac.size);
-        sz = cav.size < mac.size ? cav.size : mac.size;
+        *err = MACAROON_INVALID;
+        return NULL;
+    }
 
-        if (macaroon_memcmp(cav.data, mac.data, sz) == 0 && cav.size == mac.size)
-        {
-            tree[tree_idx] = midx;
-            /* zero everything */
-            macaroon_memzero(enc_key, sizeof(enc_key));
-            macaroon_memzero(enc_plaintext, sizeof(enc_plaintext));
-            macaroon_memzero(enc_ciphertext, sizeof(enc_ciphertext));
+    size_t num_caveats = 0;
+    size_t body_sz = 0;
+    unsigned char* ptr = NULL;
+    struct macaroon* M = NULL;
 
-            vid.data = vid_data;
-            vid.size = sizeof(vid_data);
-            unstruct_slice(&C->vid, &vid.data, &vid.size);
-            assert(vid.size == VID_NONCE_KEY_SZ);
-            /*
-             * the nonce is in the first MACAROON_SECRET_NONCE_BYTES
-             * of the vid; the ciphertext is in the rest of it.
-             */
-            enc_nonce = vid.data;
-            /* fill in the ciphertext */
-            memmove(enc_ciphertext + MACAROON_SECRET_BOX_ZERO_BYTES,
-                    vid.data + MACAROON_SECRET_NONCE_BYTES,
-                    vid.size - MACAROON_SECRET_NONCE_BYTES);
-            /* now get the plaintext */
-            fail |= macaroon_secretbox_open(sig, enc_nonce, enc_ciphertext,
-                                            sizeof(enc_ciphertext),
-                                            enc_plaintext);
-            inner &= macaroon_verify_inner(V, MS[tree[tree_idx]], TM,
-                                          enc_plaintext + MACAROON_SECRET_TEXT_ZERO_BYTES,
-                                          MACAROON_HASH_BYTES,
-                                          MS, MS_sz, err, tree, tree_idx + 1);
-        }
+#ifdef MACAROONS_JSON
+    if (data[0] == '{')
+    {
+        return macaroon_deserialize_v2j(data, data_sz, A, err);
+    }
+#endif
 
-        for (tidx = 0; tidx < tree_idx; ++tidx)
-        {
-            fail |= tree[tidx] == tree[tree_idx];
-        }
+    if (data[0] != MACAROON_V2_B64URL_LEAD && strchr(v1_chars, data[0]))
+    {
+        return macaroon_deserialize_v1((const char*)data, data_sz, A, err);
     }
 
-    if (tree[tree_idx] >= MS_sz)
+    if (macaroon_deserialize_measure(data, data_sz, &num_caveats, &body_sz, err) < 0)
     {
-        fail = -1;
+        return NULL;
     }
-    else
+
+    M = macaroon_malloc(A, num_caveats, body_sz, &ptr);
+
+    if (!M)
     {
-        fail |= inner;
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
     }
 
-    return fail;
+    if (macaroon_deserialize_fill(data, data_sz, M, num_caveats, ptr, body_sz, err) < 0)
+    {
+        macaroon_destroy(M);
+        return NULL;
+    }
+
+    return M;
 }
 
-int
-macaroon_verify_inner(const struct macaroon_verifier* V,
-                      const struct macaroon* M,
-                      const struct macaroon* TM,
-                      const unsigned char* key, size_t key_sz,
-                      struct macaroon** MS, size_t MS_sz,
-                      enum macaroon_returncode* err,
-                      size_t* tree, size_t tree_idx)
+MACAROON_API struct macaroon*
+macaroon_deserialize(const unsigned char* data, size_t data_sz,
+                     enum macaroon_returncode* err)
 {
-    size_t cidx = 0;
-    int tree_fail = 0;
-    const unsigned char* data = NULL;
-    size_t data_sz = 0;
-    const unsigned char* vdata = NULL;
-    size_t vdata_sz = 0;
-    unsigned char tmp[MACAROON_HASH_BYTES];
-    unsigned char csig[MACAROON_HASH_BYTES];
+    return macaroon_deserialize_with_allocator(data, data_sz, NULL, err);
+}
 
-    assert(M);
-    assert(TM);
+MACAROON_API struct macaroon*
+macaroon_deserialize_view(const unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err)
+{
+    size_t num_caveats = 0;
+    size_t body_sz = 0;
+    unsigned char* ptr = NULL;
+    struct macaroon* M = NULL;
 
-    if (macaroon_validate(M) < 0)
+    /* only V2 stores fields verbatim; the other formats must be decoded */
+    if (data_sz == 0 || data[0] != '\x02')
     {
-        *err = MACAROON_INVALID;
-        return -1;
+        return macaroon_deserialize(data, data_sz, err);
     }
 
-    if (tree_idx > MS_sz)
+    if (macaroon_deserialize_measure_v2(data, data_sz, &num_caveats, &body_sz, err) < 0)
     {
-        *err = MACAROON_CYCLE;
-        return -1;
+        return NULL;
     }
 
-    tree_fail = 0;
-    tree_fail |= macaroon_hmac(key, key_sz, M->identifier.data, M->identifier.size, csig);
+    M = macaroon_malloc(NULL, num_caveats, 0, &ptr);
 
-    for (cidx = 0; cidx < M->num_caveats; ++cidx)
+    if (!M)
     {
-        if (M->caveats[cidx].vid.size == 0)
-        {
-            tree_fail |= macaroon_verify_inner_1st(V, M->caveats + cidx);
-            /* move the signature and compute a new one */
-            memmove(tmp, csig, MACAROON_HASH_BYTES);
-            data = NULL;
-            data_sz = 0;
-            unstruct_slice(&M->caveats[cidx].cid, &data, &data_sz);
-            tree_fail |= macaroon_hash1(tmp, data, data_sz, csig);
-        }
-        else
-        {
-            tree_fail |= macaroon_verify_inner_3rd(V, M->caveats + cidx, csig, TM, MS, MS_sz, err, tree, tree_idx);
-            /* move the signature and compute a new one */
-            memmove(tmp, csig, MACAROON_HASH_BYTES);
-            data = NULL;
-            data_sz = 0;
-            unstruct_slice(&M->caveats[cidx].cid, &data, &data_sz);
-            vdata = NULL;
-            vdata_sz = 0;
-            unstruct_slice(&M->caveats[cidx].vid, &vdata, &vdata_sz);
-            tree_fail |= macaroon_hash2(tmp, vdata, vdata_sz, data, data_sz, csig);
-        }
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
     }
 
-    if (tree_idx > 0)
+    if (macaroon_deserialize_borrow_v2(data, data_sz, M, num_caveats, err) < 0)
     {
-        memmove(tmp, csig, MACAROON_HASH_BYTES);
-        data = TM->signature.data;
-        tree_fail |= TM->signature.size ^ MACAROON_HASH_BYTES;
-        tree_fail |= macaroon_bind(data, tmp, csig);
+        macaroon_destroy(M);
+        return NULL;
     }
 
-    data = M->signature.data;
-    tree_fail |= M->signature.size ^ MACAROON_HASH_BYTES;
-    tree_fail |= macaroon_memcmp(data, csig, MACAROON_HASH_BYTES);
-    return tree_fail;
+    return M;
 }
 
-MACAROON_API int
-macaroon_verify_raw(const struct macaroon_verifier* V,
-                    const struct macaroon* M,
-                    const unsigned char* key, size_t key_sz,
-                    struct macaroon** MS, size_t MS_sz,
-                    enum macaroon_returncode* err)
+MACAROON_API struct macaroon_lazy*
+macaroon_lazy_deserialize(const unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err)
 {
-    int rc = 0;
-    size_t i = 0;
-    size_t* tree = malloc((MS_sz + 1) * sizeof(size_t));
+    struct macaroon_lazy* L = NULL;
+    struct v1_reader r;
+    struct slice location;
+    struct slice identifier;
+    size_t hdr_sz = 0;
 
-    if (!tree)
+    if (data_sz == 0)
     {
-        *err = MACAROON_OUT_OF_MEMORY;
-        return -1;
+        *err = MACAROON_INVALID;
+        return NULL;
     }
 
-    for (i = 0; i < MS_sz; ++i)
+    if (data[0] != MACAROON_V2_B64URL_LEAD && strchr(v1_chars, data[0]))
     {
-        tree[i] = MS_sz;
+        /* the header packets are decoded once, behind L */
+        L = (struct macaroon_lazy*)macaroon_deserialize_header_v1((const char*)data, data_sz,
+                                                                  sizeof(struct macaroon_lazy),
+                                                                  &r, &hdr_sz,
+                                                                  &location, &identifier, err);
     }
+    else
+    {
+        L = macaroon_alloc(NULL, sizeof(struct macaroon_lazy));
 
-    tree[MS_sz] = MS_sz;
+        if (!L)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+        }
+    }
 
-    assert(key_sz == MACAROON_SUGGESTED_SECRET_LENGTH);
-    rc = macaroon_verify_inner(V, M, M, key, key_sz,
-                               MS, MS_sz, err, tree, 0);
-    if (rc)
+    if (!L)
     {
-        *err = MACAROON_NOT_AUTHORIZED;
+        return NULL;
     }
 
-    free(tree);
-    return rc;
-}
-
-MACAROON_API int
-macaroon_verify(const struct macaroon_verifier* V,
-                const struct macaroon* M,
-                const unsigned char* key, size_t key_sz,
-                struct macaroon** MS, size_t MS_sz,
-                enum macaroon_returncode* err)
-{
-    unsigned char derived_key[MACAROON_HASH_BYTES];
+    memset(L, 0, sizeof(struct macaroon_lazy));
+    L->data = data;
+    L->data_sz = data_sz;
 
-    if (generate_derived_key(key, key_sz, derived_key) < 0)
+    if (hdr_sz > 0)
     {
-        *err = MACAROON_HASH_FAILED;
-        return -1;
+        L->location = location;
+        L->identifier = identifier;
+        L->r = r;
+        L->hdr_sz = hdr_sz;
+    }
+    else if (data[0] == '\x02')
+    {
+        if (macaroon_deserialize_header_v2(data, data_sz,
+                                           &L->location, &L->identifier,
+                                           &L->caveats_off, err) < 0)
+        {
+            macaroon_lazy_destroy(L);
+            return NULL;
+        }
     }
+    else
+    {
+        /* JSON keys may come in any order, V2D locations need expanding, and
+         * base64 needs decoding; parse it all up front */
+        L->M = macaroon_deserialize(data, data_sz, err);
 
-    return macaroon_verify_raw(V, M, derived_key, MACAROON_HASH_BYTES, MS, MS_sz, err);
+        if (!L->M)
+        {
+            macaroon_lazy_destroy(L);
+            return NULL;
+        }
+
+        L->location = L->M->location;
+        L->identifier = L->M->identifier;
+    }
+
+    return L;
 }
 
 MACAROON_API void
-macaroon_location(const struct macaroon* M,
-                  const unsigned char** location, size_t* location_sz)
+macaroon_lazy_location(const struct macaroon_lazy* L,
+                       const unsigned char** location, size_t* location_sz)
 {
-    assert(M);
-    VALIDATE(M);
-    unstruct_slice(&M->location, location, location_sz);
+    assert(L);
+    unstruct_slice(&L->location, location, location_sz);
 }
 
 MACAROON_API void
-macaroon_identifier(const struct macaroon* M,
-                    const unsigned char** identifier, size_t* identifier_sz)
+macaroon_lazy_identifier(const struct macaroon_lazy* L,
+                         const unsigned char** identifier, size_t* identifier_sz)
 {
-    assert(M);
-    VALIDATE(M);
-    unstruct_slice(&M->identifier, identifier, identifier_sz);
+    assert(L);
+    unstruct_slice(&L->identifier, identifier, identifier_sz);
 }
 
-MACAROON_API void
-macaroon_signature(const struct macaroon* M,
-                   const unsigned char** signature, size_t* signature_sz)
+MACAROON_API const struct macaroon*
+macaroon_lazy_macaroon(struct macaroon_lazy* L,
+                       enum macaroon_returncode* err)
 {
-    assert(M);
-    VALIDATE(M);
-    unstruct_slice(&M->signature, signature, signature_sz);
+    assert(L);
+
+    /* pick up where macaroon_lazy_deserialize stopped */
+    if (!L->M && L->hdr_sz > 0)
+    {
+        L->M = macaroon_deserialize_resume_v1((const unsigned char*)(L + 1), L->hdr_sz,
+                                              &L->r, NULL, err);
+    }
+    else if (!L->M)
+    {
+        L->M = macaroon_deserialize_resume_v2(L->data, L->data_sz,
+                                              &L->location, &L->identifier,
+                                              L->caveats_off, err);
+    }
+
+    return L->M;
 }
 
-MACAROON_API size_t
-macaroon_serialize_size_hint(const struct macaroon* M,
-                             enum macaroon_format f)
+MACAROON_API void
+macaroon_lazy_destroy(struct macaroon_lazy* L)
 {
-    switch (f)
+    if (L)
     {
-        case MACAROON_V1:
-            return macaroon_serialize_size_hint_v1(M);
-        case MACAROON_V2:
-            return macaroon_serialize_size_hint_v2(M);
-        case MACAROON_V2J:
-#ifdef MACAROONS_JSON
-            return macaroon_serialize_size_hint_v2j(M);
-#endif
-        default:
-            return 0;
+        macaroon_destroy(L->M);
+        macaroon_dealloc(NULL, L);
     }
 }
 
 MACAROON_API size_t
-macaroon_serialize(const struct macaroon* M,
-                   enum macaroon_format f,
-                   unsigned char* buf, size_t buf_sz,
-                   enum macaroon_returncode* err)
+macaroon_deserialize_size(const unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err)
 {
-    switch (f)
+    size_t num_caveats = 0;
+    size_t body_sz = 0;
+
+    if (macaroon_deserialize_measure(data, data_sz, &num_caveats, &body_sz, err) < 0)
     {
-        case MACAROON_V1:
-            if (macaroon_serialize_v1(M, (char*)buf, buf_sz, err) < 0) return 0;
-            return strlen((char*)buf);
-        case MACAROON_V2:
-            return macaroon_serialize_v2(M, buf, buf_sz, err);
-        case MACAROON_V2J:
-#ifdef MACAROONS_JSON
-            return macaroon_serialize_v2j(M, buf, buf_sz, err);
-#else
-            *err = MACAROON_NO_JSON_SUPPORT;
-            return 0;
-#endif
-        default:
-            *err = MACAROON_INVALID;
-            return 0;
+        return 0;
     }
-}
 
-static const char v1_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+/-_";
+    return macaroon_size(num_caveats, body_sz);
+}
 
 MACAROON_API struct macaroon*
-macaroon_deserialize(const unsigned char* data, size_t data_sz,
-                     enum macaroon_returncode* err)
+macaroon_deserialize_into(const unsigned char* data, size_t data_sz,
+                          void* buf, size_t buf_sz,
+                          enum macaroon_returncode* err)
 {
-    if (data_sz == 0)
+    size_t num_caveats = 0;
+    size_t body_sz = 0;
+    unsigned char* ptr = NULL;
+    struct macaroon* M = NULL;
+
+    if ((uintptr_t)buf % offsetof(struct macaroon_alignment, m) != 0)
     {
         *err = MACAROON_INVALID;
         return NULL;
     }
 
-    if (strchr(v1_chars, data[0]))
+    if (macaroon_deserialize_measure(data, data_sz, &num_caveats, &body_sz, err) < 0)
     {
-        return macaroon_deserialize_v1((const char*)data, data_sz, err);
+        return NULL;
     }
 
-    if (data[0] == '{')
-    {
-#ifdef MACAROONS_JSON
-        return macaroon_deserialize_v2j(data, data_sz, err);
-#else
-        *err = MACAROON_NO_JSON_SUPPORT;
-        return 0;
-#endif
-    }
-    else if (data[0] == '\x02')
+    if (buf_sz < macaroon_size(num_caveats, body_sz))
     {
-        return macaroon_deserialize_v2(data, data_sz, err);
+        *err = MACAROON_BUF_TOO_SMALL;
+        return NULL;
     }
-    else
+
+    M = macaroon_place(buf, num_caveats, &ptr);
+
+    if (macaroon_deserialize_fill(data, data_sz, M, num_caveats, ptr, body_sz, err) < 0)
     {
-        *err = MACAROON_INVALID;
         return NULL;
     }
+
+    return M;
 }
 
 MACAROON_API size_t
@@ -1054,10 +2815,10 @@ macaroon_inspect(const struct macaroon* M,
 }
 
 MACAROON_API struct macaroon*
-macaroon_copy(const struct macaroon* N,
-              enum macaroon_returncode* err)
+macaroon_copy_with_allocator(const struct macaroon* N,
+                             const struct macaroon_allocator* A,
+                             enum macaroon_returncode* err)
 {
-    size_t i;
     size_t sz;
     struct macaroon* M;
     unsigned char* ptr;
@@ -1066,7 +2827,59 @@ macaroon_copy(const struct macaroon* N,
     VALIDATE(N);
 
     sz  = macaroon_body_size(N) + MACAROON_HASH_BYTES;
-    M = macaroon_malloc(N->num_caveats, sz, &ptr);
+    M = macaroon_malloc(A, N->num_caveats, sz, &ptr);
+
+    if (!M)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    M->num_caveats = N->num_caveats;
+    ptr = copy_slice(&N->location, &M->location, ptr);
+    ptr = copy_slice(&N->identifier, &M->identifier, ptr);
+
+    ptr = copy_caveats(N, M->caveats, ptr);
+
+    ptr = copy_slice(&N->signature, &M->signature, ptr);
+    VALIDATE(M);
+    return M;
+}
+
+MACAROON_API struct macaroon*
+macaroon_copy(const struct macaroon* N,
+              enum macaroon_returncode* err)
+{
+    return macaroon_copy_with_allocator(N, N->allocator, err);
+}
+
+#define MACAROON_PACK(T, FIELD) \
+    do { \
+        T* packed = (T*)M->caveats; \
+        packed[i].FIELD[0] = ptr - body; \
+        packed[i].FIELD[1] = C->FIELD.size; \
+        ptr = copy_slice(&C->FIELD, &unused, ptr); \
+    } while (0)
+
+MACAROON_API struct macaroon*
+macaroon_compact(const struct macaroon* N,
+                 enum macaroon_returncode* err)
+{
+    const struct caveat* C;
+    struct caveat tmp;
+    struct slice unused;
+    struct macaroon* M = NULL;
+    unsigned char* body = NULL;
+    unsigned char* ptr = NULL;
+    const size_t body_sz = macaroon_body_size(N) + N->signature.size;
+    const int wide = body_sz > UINT16_MAX;
+    const size_t entry_sz = wide ? sizeof(struct caveat32) : sizeof(struct caveat16);
+    const size_t header_sz = offsetof(struct macaroon, caveats)
+                           + N->num_caveats * entry_sz;
+    struct caveat_walk W;
+    size_t i;
+
+    M = macaroon_alloc(N->allocator, header_sz + body_sz);
 
     if (!M)
     {
@@ -1074,27 +2887,51 @@ macaroon_copy(const struct macaroon* N,
         return NULL;
     }
 
+    macaroon_memzero(M, header_sz);
+    M->allocator = N->allocator;
+    M->flags = wide ? MACAROON_FLAG_COMPACT32 : MACAROON_FLAG_COMPACT16;
     M->num_caveats = N->num_caveats;
+    body = ptr = (unsigned char*)M + header_sz;
     ptr = copy_slice(&N->location, &M->location, ptr);
     ptr = copy_slice(&N->identifier, &M->identifier, ptr);
 
-    for (i = 0; i < N->num_caveats; ++i)
+    caveat_walk_init(&W, N);
+
+    for (i = 0; (C = caveat_walk_next(&W, &tmp)); ++i)
     {
-        ptr = copy_slice(&N->caveats[i].cid, &M->caveats[i].cid, ptr);
-        ptr = copy_slice(&N->caveats[i].vid, &M->caveats[i].vid, ptr);
-        ptr = copy_slice(&N->caveats[i].cl,  &M->caveats[i].cl,  ptr);
+        if (wide)
+        {
+            MACAROON_PACK(struct caveat32, cid);
+            MACAROON_PACK(struct caveat32, vid);
+            MACAROON_PACK(struct caveat32, cl);
+        }
+        else
+        {
+            MACAROON_PACK(struct caveat16, cid);
+            MACAROON_PACK(struct caveat16, vid);
+            MACAROON_PACK(struct caveat16, cl);
+        }
     }
 
+    caveat_walk_done(&W);
+
     ptr = copy_slice(&N->signature, &M->signature, ptr);
+    assert(ptr == body + body_sz);
     VALIDATE(M);
     return M;
 }
 
+#undef MACAROON_PACK
+
 MACAROON_API int
 macaroon_cmp(const struct macaroon* M, const struct macaroon* N)
 {
-    size_t i = 0;
-    size_t num_caveats = 0;
+    struct caveat_walk MW;
+    struct caveat_walk NW;
+    const struct caveat* MC;
+    const struct caveat* NC;
+    struct caveat mtmp;
+    struct caveat ntmp;
     unsigned long long ret = 0;
 
     assert(M);
@@ -1107,18 +2944,18 @@ macaroon_cmp(const struct macaroon* M, const struct macaroon* N)
     ret |= slice_cmp(&M->identifier, &N->identifier);
     ret |= slice_cmp(&M->signature, &N->signature);
 
-    num_caveats = M->num_caveats < N->num_caveats ?
-                  M->num_caveats : N->num_caveats;
+    caveat_walk_init(&MW, M);
+    caveat_walk_init(&NW, N);
 
-    for (i = 0; i < num_caveats; ++i)
+    while ((MC = caveat_walk_next(&MW, &mtmp)) &&
+           (NC = caveat_walk_next(&NW, &ntmp)))
     {
-        ret |= slice_cmp(&M->caveats[i].cid,
-                         &N->caveats[i].cid);
-        ret |= slice_cmp(&M->caveats[i].vid,
-                         &N->caveats[i].vid);
-        ret |= slice_cmp(&M->caveats[i].cl,
-                         &N->caveats[i].cl);
+        ret |= slice_cmp(&MC->cid, &NC->cid);
+        ret |= slice_cmp(&MC->vid, &NC->vid);
+        ret |= slice_cmp(&MC->cl, &NC->cl);
     }
 
+    caveat_walk_done(&MW);
+    caveat_walk_done(&NW);
     return ret;
 }
@@ -49,6 +49,8 @@ extern "C"
 /* Opaque type whose internals are private to libmacaroons */
 struct macaroon;
 struct macaroon_verifier;
+struct macaroon_builder;
+struct macaroon_lazy;
 
 enum macaroon_returncode
 {
@@ -67,6 +69,34 @@ enum macaroon_returncode
 const char*
 macaroon_error(enum macaroon_returncode err);
 
+/* Memory allocation hooks.
+ *
+ * Every allocation the library makes goes through an allocator.  Semantics
+ * match malloc/realloc/free; ctx is passed through untouched.  realloc may be
+ * called with ptr == NULL, and free with ptr == NULL.
+ */
+struct macaroon_allocator
+{
+    void* (*alloc)(void* ctx, size_t sz);
+    void* (*realloc)(void* ctx, void* ptr, size_t sz);
+    void (*free)(void* ctx, void* ptr);
+    void* ctx;
+};
+
+/* Replace the global allocator, which is used whenever no per-call allocator
+ * is given.  NULL restores the default allocator.  The allocator is copied.
+ * Change it only while no objects allocated by the library are alive.
+ */
+void
+macaroon_set_allocator(const struct macaroon_allocator* A);
+
+/* Bound the bytes of freed memory that the default allocator keeps cached in
+ * each thread for reuse.  0 disables the cache.  Applies to later frees; the
+ * default is 256KB.
+ */
+void
+macaroon_set_slab_limit(size_t limit);
+
 /* Create a new macaroon.
  *  - location/location_sz is a hint to the target's location
  *  - key/key_sz is the key used as a secret for macaroon construction
@@ -79,10 +109,44 @@ macaroon_create(const unsigned char* location, size_t location_sz,
                 const unsigned char* id, size_t id_sz,
                 enum macaroon_returncode* err);
 
-/* Destroy a macaroon, freeing resources */
+/* Per-call allocators.
+ *
+ * Objects created by the *_with_allocator variants draw all of their memory
+ * from A, as does every object derived from them (caveated macaroons, copies,
+ * bound discharges, builders, and verification scratch).  A is referenced, not
+ * copied, and must outlive every such object.  A NULL allocator selects the
+ * global allocator.
+ */
+struct macaroon*
+macaroon_create_with_allocator(const unsigned char* location, size_t location_sz,
+                               const unsigned char* key, size_t key_sz,
+                               const unsigned char* id, size_t id_sz,
+                               const struct macaroon_allocator* A,
+                               enum macaroon_returncode* err);
+
+/* Destroy a macaroon, dropping one reference and freeing resources with the
+ * last.  Equivalent to macaroon_release.
+ */
 void
 macaroon_destroy(struct macaroon* M);
 
+/* Take another reference to M and return it, so that one macaroon can be
+ * handed to many threads without a copy.
+ *
+ * A macaroon never changes after it is created: every routine that derives a
+ * macaroon from another leaves its input untouched, so any number of threads
+ * may read a retained macaroon concurrently.  The reference count is atomic.
+ * Each macaroon_retain is paired with one macaroon_release, and the macaroon is
+ * freed with the last reference, whichever thread drops it.  Macaroons placed
+ * in caller memory (macaroon_deserialize_into) are not counted, and views still
+ * borrow their input, which must outlive every reference.
+ */
+const struct macaroon*
+macaroon_retain(const struct macaroon* M);
+
+void
+macaroon_release(const struct macaroon* M);
+
 /* Check a macaroon's integrity
  *
  * This routine is used internally, and is exposed as part of the public API for
@@ -104,6 +168,34 @@ macaroon_add_first_party_caveat(const struct macaroon* M,
                                 const unsigned char* predicate, size_t predicate_sz,
                                 enum macaroon_returncode* err);
 
+/* As macaroon_add_first_party_caveat, but the new macaroon shares M's storage
+ * instead of copying it.
+ *
+ * The result holds only the new caveat and signature, plus a reference that
+ * keeps M alive; M may be destroyed at any time after.  Use it when deriving
+ * many short chains (e.g. per-user tokens from a per-tenant token): caveat
+ * access walks the chain, so long chains are better flattened by
+ * macaroon_copy.
+ */
+struct macaroon*
+macaroon_add_first_party_caveat_shared(const struct macaroon* M,
+                                       const unsigned char* predicate, size_t predicate_sz,
+                                       enum macaroon_returncode* err);
+
+/* Add num_predicates first party caveats, and return a new macaroon.
+ *  - predicates[i]/predicate_szs[i] is the i'th caveat, added in order
+ *
+ * Equivalent to calling macaroon_add_first_party_caveat once per predicate,
+ * but allocates and copies the macaroon only once.  Returns a new macaroon,
+ * leaving the original untouched.
+ */
+struct macaroon*
+macaroon_add_first_party_caveats(const struct macaroon* M,
+                                 const unsigned char* const* predicates,
+                                 const size_t* predicate_szs,
+                                 size_t num_predicates,
+                                 enum macaroon_returncode* err);
+
 /* Add a new third party caveat, and return a new macaroon.
  *  - location/location_sz is a hint to the third party's location
  *  - key/keys_sz is a secret shared shared between this macaroon and the third
@@ -133,16 +225,77 @@ macaroon_third_party_caveat(const struct macaroon* M, unsigned which,
                             const unsigned char** location, size_t* location_sz,
                             const unsigned char** identifier, size_t* identifier_sz);
 
+/* Read every caveat of a macaroon in order, without copying.
+ *
+ * The pointers in a struct macaroon_caveat borrow from M and are valid for as
+ * long as M is.  A first-party caveat has only cid, its predicate; a
+ * third-party caveat also has a non-empty vid and cl.
+ *
+ * Initialize a cursor on the stack and call next until it returns -1.  Each
+ * step takes constant time, except that moving into the caveats added by a
+ * macaroon_add_first_party_caveat_shared takes time logarithmic in the length
+ * of the chain of shared macaroons, amortized.  The cursor is opaque, and its
+ * size does not depend on the implementation.
+ *
+ * macaroon_caveats fills caveats with up to caveats_sz caveats, starting from
+ * caveat first, and returns how many it filled.  It visits each shared
+ * macaroon in a chain once.
+ */
+struct macaroon_caveat
+{
+    const unsigned char* cid;
+    size_t cid_sz;
+    const unsigned char* vid;
+    size_t vid_sz;
+    const unsigned char* cl;
+    size_t cl_sz;
+};
+
+struct macaroon_caveat_cursor
+{
+    void* opaque[32];
+};
+
+size_t
+macaroon_num_caveats(const struct macaroon* M);
+
+void
+macaroon_caveat_cursor_init(struct macaroon_caveat_cursor* C,
+                            const struct macaroon* M);
+
+int
+macaroon_caveat_cursor_next(struct macaroon_caveat_cursor* C,
+                            struct macaroon_caveat* caveat);
+
+size_t
+macaroon_caveats(const struct macaroon* M, size_t first,
+                 struct macaroon_caveat* caveats, size_t caveats_sz);
+
 /* Prepare the macaroon for a request */
 struct macaroon*
 macaroon_prepare_for_request(const struct macaroon* M,
                              const struct macaroon* D,
                              enum macaroon_returncode* err);
 
+/* Prepare n discharges for a request at once, binding each D[i] to M.
+ *
+ * The bound copies are laid out in a single allocation; out[i] receives the
+ * i'th.  Each is destroyed as usual, and the allocation is freed with the last
+ * of them.  Returns 0 on success, or -1 with out left undefined.
+ */
+int
+macaroon_prepare_for_request_batch(const struct macaroon* M,
+                                   const struct macaroon* const* D, size_t n,
+                                   struct macaroon** out,
+                                   enum macaroon_returncode* err);
+
 /* Verification tool for verifying macaroons */
 struct macaroon_verifier*
 macaroon_verifier_create();
 
+struct macaroon_verifier*
+macaroon_verifier_create_with_allocator(const struct macaroon_allocator* A);
+
 void
 macaroon_verifier_destroy(struct macaroon_verifier* V);
 
@@ -181,14 +334,36 @@ enum macaroon_format
 {
     MACAROON_V1,
     MACAROON_V2,
-    MACAROON_V2J
+    MACAROON_V2J,
+    /* experimental; see macaroon_dictionary_load */
+    MACAROON_V2D,
+    /* V2 in base64url, unpadded; deserialize accepts it with or without
+     * padding, and it is ready to go in an HTTP header */
+    MACAROON_V2_B64URL
 };
 #define MACAROON_LATEST MACAROON_V2
 #define MACAROON_LATEST_JSON MACAROON_V2J
 
+/* Load a shared dictionary for MACAROON_V2D from the file at path.
+ *
+ * The file holds a line "version N", with N from 1 to 255, and then one entry
+ * per line; blank lines and lines starting with # are skipped.  V2D writes
+ * caveat ids and locations that begin with an entry as the entry's index and
+ * the remaining bytes, and reading expands them to the original bytes, so
+ * signatures are unaffected.  Both sides must load the same dictionary.
+ *
+ * Tokens name the version they were written with and can be read while it is
+ * loaded.  MACAROON_V2D writes with the dictionary loaded last, counting a
+ * version loaded again; macaroon_serialize_dictionary names the version
+ * instead.  A version cannot be replaced by a different dictionary.  Returns
+ * the version, or -1.
+ */
+int
+macaroon_dictionary_load(const char* path, enum macaroon_returncode* err);
+
 /* a return value of 0 indicates an unsupported format
  * a return value >0 indicates the number of bytes necessary to serialize M
- * using format f
+ * using format f; for MACAROON_V2 it is exactly the serialized size
  */
 size_t
 macaroon_serialize_size_hint(const struct macaroon* M,
@@ -203,10 +378,369 @@ macaroon_serialize(const struct macaroon* M,
                    unsigned char* buf, size_t buf_sz,
                    enum macaroon_returncode* err);
 
+/* As for MACAROON_V2D, written with the loaded dictionary of the given version
+ * rather than the one loaded last.  Both return 0 if that version is not
+ * loaded, macaroon_serialize_dictionary with MACAROON_UNSUPPORTED_FORMAT.
+ */
+size_t
+macaroon_serialize_size_hint_dictionary(const struct macaroon* M,
+                                        unsigned version);
+
+size_t
+macaroon_serialize_dictionary(const struct macaroon* M, unsigned version,
+                              unsigned char* buf, size_t buf_sz,
+                              enum macaroon_returncode* err);
+
+/* Serialize M as a scatter-gather list, ready for writev or sendmsg.
+ *
+ * Only the varint headers and markers are written, into scratch; the other
+ * iovecs point straight at M's location, identifier, caveats and signature, so
+ * M must outlive the write.  On entry *iov_sz and *scratch_sz hold the
+ * capacities of iov and scratch; on success they hold the amounts used, and
+ * with MACAROON_BUF_TOO_SMALL the amounts needed, so a first call with zero
+ * capacities sizes the second.  Returns 0 on success.  Only MACAROON_V2 is
+ * supported, as V1 and V2J encode every byte.
+ */
+struct iovec;
+
+int
+macaroon_serialize_iov(const struct macaroon* M,
+                       enum macaroon_format f,
+                       struct iovec* iov, size_t* iov_sz,
+                       unsigned char* scratch, size_t* scratch_sz,
+                       enum macaroon_returncode* err);
+
+/* Serialize M into a newly allocated buffer of macaroon_serialize_size_hint
+ * bytes, which is exact for MACAROON_V2 and MACAROON_V2_B64URL.  The number
+ * of bytes written goes to buf_sz.  Free the buffer with macaroon_free.
+ */
+unsigned char*
+macaroon_serialize_alloc(const struct macaroon* M,
+                         enum macaroon_format f,
+                         size_t* buf_sz,
+                         enum macaroon_returncode* err);
+
+/* free memory that the library allocated for the caller */
+void
+macaroon_free(void* ptr);
+
+/* Serialize D as bound to M, without preparing a copy of it.
+ *
+ * Writes exactly what macaroon_serialize would write for
+ * macaroon_prepare_for_request(M, D), in at most
+ * macaroon_serialize_size_hint(D, f) bytes.
+ */
+size_t
+macaroon_serialize_for_request(const struct macaroon* M,
+                               const struct macaroon* D,
+                               enum macaroon_format f,
+                               unsigned char* buf, size_t buf_sz,
+                               enum macaroon_returncode* err);
+
+/* Bundles carry a root macaroon and its discharges as one token.
+ *
+ * Each macaroon is written as V2 framed by its length, and locations that
+ * repeat across the bundle are written once to a shared table and referenced
+ * from there.  D holds the n discharges, already bound to M for a request.
+ * The size hint is exact; it is 0 only if memory runs out.
+ */
+size_t
+macaroon_bundle_serialize_size_hint(const struct macaroon* M,
+                                    const struct macaroon* const* D, size_t n);
+
+size_t
+macaroon_bundle_serialize(const struct macaroon* M,
+                          const struct macaroon* const* D, size_t n,
+                          unsigned char* buf, size_t buf_sz,
+                          enum macaroon_returncode* err);
+
+/* Parse a bundle into its root, which is returned, and *n discharges.
+ *
+ * Everything lives in a single allocation, including the array of discharges
+ * in *D, which is ready to pass to macaroon_verify as MS.  Destroy the root and
+ * each discharge as usual; the allocation is freed with the last of them, and
+ * *D with it.
+ */
+struct macaroon*
+macaroon_bundle_deserialize(const unsigned char* data, size_t data_sz,
+                            struct macaroon*** D, size_t* n,
+                            enum macaroon_returncode* err);
+
+/* A client-side cache of discharges bound for requests.
+ *
+ * Entries are keyed by the signatures of the root and the discharge, and a hit
+ * also compares the rest of the discharge, whose locations its signature does
+ * not cover, so a changed token of either kind simply misses.  The cache is
+ * direct-mapped with num_entries slots, and each slot holds the bound
+ * discharge and its serialization in format f.  It is not safe for concurrent
+ * use; give each thread its own.
+ */
+struct macaroon_request_cache;
+
+struct macaroon_request_cache*
+macaroon_request_cache_create(size_t num_entries, enum macaroon_format f);
+
+void
+macaroon_request_cache_destroy(struct macaroon_request_cache* C);
+
+/* Find D bound to M, preparing and serializing it on a miss.
+ *
+ * The results belong to the cache and stay valid until the next call on C;
+ * retain the bound macaroon to keep it for longer.  bound may be NULL.
+ */
+int
+macaroon_request_cache_get(struct macaroon_request_cache* C,
+                           const struct macaroon* M,
+                           const struct macaroon* D,
+                           const struct macaroon** bound,
+                           const unsigned char** data, size_t* data_sz,
+                           enum macaroon_returncode* err);
+
 struct macaroon*
 macaroon_deserialize(const unsigned char* data, size_t data_sz,
                      enum macaroon_returncode* err);
 
+struct macaroon*
+macaroon_deserialize_with_allocator(const unsigned char* data, size_t data_sz,
+                                    const struct macaroon_allocator* A,
+                                    enum macaroon_returncode* err);
+
+/* Deserialize into caller-provided memory.
+ *
+ * macaroon_deserialize_size returns the exact number of bytes
+ * macaroon_deserialize_into needs to hold the macaroon in data, or 0 on error;
+ * it does not allocate.  macaroon_deserialize_into builds the macaroon entirely
+ * within buf, which must be aligned as if returned by malloc.  The result must
+ * not outlive buf; macaroon_destroy on it is a no-op, and objects derived from
+ * it use the global allocator.  V1 and V2 are supported; V2J is not.
+ */
+size_t
+macaroon_deserialize_size(const unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err);
+
+struct macaroon*
+macaroon_deserialize_into(const unsigned char* data, size_t data_sz,
+                          void* buf, size_t buf_sz,
+                          enum macaroon_returncode* err);
+
+/* Deserialize a view that borrows data instead of copying it.
+ *
+ * For V2 input only the macaroon header and caveat index are allocated; every
+ * field points into data, which must stay valid and unmodified until the view
+ * is destroyed.  The view works with every API that takes a macaroon, and
+ * anything derived from it (copies, added caveats) owns its bytes.  V1 and V2J
+ * are encoded on the wire and are deserialized as by macaroon_deserialize.
+ */
+struct macaroon*
+macaroon_deserialize_view(const unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err);
+
+/* Deserialize a macaroon that arrives in pieces, as off a socket or pipe.
+ *
+ * Feed the parser chunks as they arrive.  It tracks where a V2 or V2J
+ * token ends across chunk boundaries, so macaroon_parser_feed returns 1 once
+ * the token is complete and sets *consumed to the bytes it took from data;
+ * any bytes past the end of the token are left for the caller.  It returns 0
+ * while it needs more input, and -1 on malformed input (MACAROON_INVALID),
+ * once the token grows beyond max_sz bytes (MACAROON_INVALID), or if it
+ * cannot buffer the token (MACAROON_OUT_OF_MEMORY).  V1 has no end marker, so
+ * it is complete only when the caller says so by calling
+ * macaroon_parser_finish.
+ *
+ * A failure is latched: every later feed returns -1 with the same error until
+ * macaroon_parser_finish.  macaroon_parser_finish returns the macaroon, or
+ * NULL if the token failed, is malformed or is incomplete, and readies the
+ * parser for the next token.
+ */
+struct macaroon_parser;
+
+struct macaroon_parser*
+macaroon_parser_create(size_t max_sz);
+
+void
+macaroon_parser_destroy(struct macaroon_parser* P);
+
+int
+macaroon_parser_feed(struct macaroon_parser* P,
+                     const unsigned char* data, size_t data_sz,
+                     size_t* consumed,
+                     enum macaroon_returncode* err);
+
+struct macaroon*
+macaroon_parser_finish(struct macaroon_parser* P,
+                       enum macaroon_returncode* err);
+
+/* Bulk reading and writing of token streams, for offline jobs.
+ *
+ * A stream holds one token per line (V1, V2J or V2_B64URL), or each token
+ * behind a varint length (any format).  macaroon_stream_read splits data, which may be a
+ * mapped file, into chunks that num_threads threads (0 for one per CPU)
+ * decode in batches of up to batch_sz.  Each batch is decoded into a single
+ * arena and handed to cb along with the offset in data at which its first
+ * token begins; tokens that fail to parse are NULL.  With
+ * MACAROON_STREAM_VIEWS, V2 tokens borrow data as macaroon_deserialize_view
+ * does.  The macaroons are valid only until cb returns; copy any to keep.
+ *
+ * cb runs concurrently on every thread and batches arrive in no particular
+ * order.  Returning nonzero stops the stream.  macaroon_stream_read returns
+ * 0 once every token has been delivered, 1 if a callback stopped it, and -1 on
+ * malformed framing or exhausted memory.
+ *
+ * macaroon_stream_write serializes MS on num_threads threads and hands the
+ * stream to cb in order, in pieces, one call at a time.  It returns as the
+ * reader does.
+ */
+enum macaroon_stream_framing
+{
+    MACAROON_STREAM_LINES,
+    MACAROON_STREAM_LENGTH
+};
+#define MACAROON_STREAM_VIEWS 1U
+
+int
+macaroon_stream_read(const unsigned char* data, size_t data_sz,
+                     enum macaroon_stream_framing framing,
+                     unsigned flags, size_t num_threads, size_t batch_sz,
+                     int (*cb)(void* arg, size_t offset, struct macaroon** MS, size_t MS_sz),
+                     void* arg,
+                     enum macaroon_returncode* err);
+
+int
+macaroon_stream_write(const struct macaroon* const* MS, size_t MS_sz,
+                      enum macaroon_format f,
+                      enum macaroon_stream_framing framing,
+                      size_t num_threads,
+                      int (*cb)(void* arg, const unsigned char* data, size_t data_sz),
+                      void* arg,
+                      enum macaroon_returncode* err);
+
+/* Lazily deserialize a macaroon.
+ *
+ * Only the location and identifier are parsed up front, which is all that is
+ * needed to route a request or pick a root key.  The caveats and signature are
+ * parsed the first time macaroon_lazy_macaroon is called; the returned
+ * macaroon belongs to L.  data must stay valid until L is destroyed.  V2J is
+ * parsed in full immediately because its keys may come in any order.
+ */
+struct macaroon_lazy*
+macaroon_lazy_deserialize(const unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err);
+
+void
+macaroon_lazy_location(const struct macaroon_lazy* L,
+                       const unsigned char** location, size_t* location_sz);
+
+void
+macaroon_lazy_identifier(const struct macaroon_lazy* L,
+                         const unsigned char** identifier, size_t* identifier_sz);
+
+/* NULL if the rest of the macaroon does not parse */
+const struct macaroon*
+macaroon_lazy_macaroon(struct macaroon_lazy* L,
+                       enum macaroon_returncode* err);
+
+void
+macaroon_lazy_destroy(struct macaroon_lazy* L);
+
+/* Build a macaroon incrementally.
+ *
+ * A builder appends caveats in place and tracks the running signature, so
+ * adding n caveats costs O(n) rather than the O(n^2) copying of repeated calls
+ * to macaroon_add_*_caveat.  Start from a fresh root (arguments as for
+ * macaroon_create) or from an existing macaroon.  The builder may be finalized
+ * or serialized at any point and remains usable afterwards.  It holds the
+ * current signature, so guard it like the macaroon itself.
+ */
+struct macaroon_builder*
+macaroon_builder_create(const unsigned char* location, size_t location_sz,
+                        const unsigned char* key, size_t key_sz,
+                        const unsigned char* id, size_t id_sz,
+                        enum macaroon_returncode* err);
+
+struct macaroon_builder*
+macaroon_builder_from(const struct macaroon* M,
+                      enum macaroon_returncode* err);
+
+void
+macaroon_builder_destroy(struct macaroon_builder* B);
+
+int
+macaroon_builder_add_first_party_caveat(struct macaroon_builder* B,
+                                        const unsigned char* predicate, size_t predicate_sz,
+                                        enum macaroon_returncode* err);
+
+int
+macaroon_builder_add_third_party_caveat(struct macaroon_builder* B,
+                                        const unsigned char* location, size_t location_sz,
+                                        const unsigned char* key, size_t key_sz,
+                                        const unsigned char* id, size_t id_sz,
+                                        enum macaroon_returncode* err);
+
+/* Return a new, exactly sized macaroon holding the builder's contents */
+struct macaroon*
+macaroon_builder_finalize(const struct macaroon_builder* B,
+                          enum macaroon_returncode* err);
+
+/* As macaroon_serialize_size_hint/macaroon_serialize, without materializing
+ * a macaroon first
+ */
+size_t
+macaroon_builder_serialize_size_hint(const struct macaroon_builder* B,
+                                     enum macaroon_format f);
+
+size_t
+macaroon_builder_serialize(const struct macaroon_builder* B,
+                           enum macaroon_format f,
+                           unsigned char* buf, size_t buf_sz,
+                           enum macaroon_returncode* err);
+
+/* An immutable file of macaroons indexed by identifier.
+ *
+ * A builder appends macaroons to the file at path, which holds a valid store
+ * only once macaroon_store_builder_finish writes its index; finish also frees
+ * the builder, whether or not it succeeds.  Failures of the underlying file
+ * operations leave MACAROON_INVALID in err and the reason in errno.
+ *
+ * macaroon_store_open maps the file, and macaroon_store_get finds the first
+ * macaroon added with the identifier id.  It returns a view into the mapping,
+ * which must be destroyed before the store is closed, or NULL with
+ * MACAROON_SUCCESS if there is no such macaroon.  Lookups are read-only and may
+ * run concurrently.
+ */
+struct macaroon_store_builder;
+struct macaroon_store;
+
+struct macaroon_store_builder*
+macaroon_store_builder_create(const char* path, enum macaroon_returncode* err);
+
+int
+macaroon_store_builder_add(struct macaroon_store_builder* B,
+                           const struct macaroon* M,
+                           enum macaroon_returncode* err);
+
+int
+macaroon_store_builder_finish(struct macaroon_store_builder* B,
+                              enum macaroon_returncode* err);
+
+/* abandon a builder without finishing the file */
+void
+macaroon_store_builder_destroy(struct macaroon_store_builder* B);
+
+struct macaroon_store*
+macaroon_store_open(const char* path, enum macaroon_returncode* err);
+
+void
+macaroon_store_close(struct macaroon_store* S);
+
+/* the number of macaroons in S */
+size_t
+macaroon_store_size(const struct macaroon_store* S);
+
+struct macaroon*
+macaroon_store_get(const struct macaroon_store* S,
+                   const unsigned char* id, size_t id_sz,
+                   enum macaroon_returncode* err);
+
 /* Human-readable representation *FOR DEBUGGING ONLY* */
 size_t
 macaroon_inspect_size_hint(const struct macaroon* M);
@@ -223,6 +757,25 @@ struct macaroon*
 macaroon_copy(const struct macaroon* M,
               enum macaroon_returncode* err);
 
+/* allocate a new copy of the macaroon from A, e.g. to move a cached macaroon
+ * into a per-request arena
+ */
+struct macaroon*
+macaroon_copy_with_allocator(const struct macaroon* M,
+                             const struct macaroon_allocator* A,
+                             enum macaroon_returncode* err);
+
+/* Allocate a compact copy of M for long-lived caches.
+ *
+ * Caveats are stored as 16-bit (offset, length) pairs into a single body, or
+ * 32-bit pairs once the body outgrows 64KB, instead of three pointer/size
+ * slices each.  The result works with every API that takes a macaroon;
+ * macaroons derived from it use the ordinary representation.
+ */
+struct macaroon*
+macaroon_compact(const struct macaroon* M,
+                 enum macaroon_returncode* err);
+
 /* 0 if equal; !0 if non-equal; no other comparison implied */
 int
 macaroon_cmp(const struct macaroon* M, const struct macaroon* N);
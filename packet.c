@@ -47,7 +47,7 @@ packet_memmove(unsigned char* ptr, const unsigned char* src, size_t sz)
     return ptr + sz;
 }
 
-static unsigned char*
+unsigned char*
 packet_header(size_t sz, unsigned char* ptr)
 {
     static const char hex[] = "0123456789abcdef";
@@ -60,35 +60,74 @@ packet_header(size_t sz, unsigned char* ptr)
     return ptr + PACKET_PREFIX;
 }
 
+/* the value of each lower-case hex digit; 0xff for everything else */
+static const unsigned char packet_hex[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+       0,    1,    2,    3,    4,    5,    6,    7,
+       8,    9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   10,   11,   12,   13,   14,   15, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+long
+parse_packet_prefix(const unsigned char* prefix)
+{
+    const unsigned a = packet_hex[prefix[0]];
+    const unsigned b = packet_hex[prefix[1]];
+    const unsigned c = packet_hex[prefix[2]];
+    const unsigned d = packet_hex[prefix[3]];
+    assert(PACKET_PREFIX == 4); /* modify above on failure */
+
+    if ((a | b | c | d) & 0xf0)
+    {
+        return -1;
+    }
+
+    return (a << 12) | (b << 8) | (c << 4) | d;
+}
+
 const unsigned char*
 parse_packet(const unsigned char* ptr,
              const unsigned char* const end,
              struct packet* pkt)
 {
-    static const char hex[] = "0123456789abcdef";
-    const char* tmp;
-    uint32_t sz = 0;
-    int i = 0;
+    long sz;
 
     if (end - ptr < PACKET_PREFIX)
     {
         return NULL;
     }
 
-    for (i = 0; i < PACKET_PREFIX; ++i)
-    {
-        sz <<= 4;
-        tmp = strchr(hex, ptr[i]);
-
-        if (!tmp)
-        {
-            return NULL;
-        }
-
-        sz |= tmp - hex;
-    }
+    sz = parse_packet_prefix(ptr);
 
-    if (end - ptr < sz)
+    if (sz < 0 || end - ptr < sz)
     {
         return NULL;
     }
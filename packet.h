@@ -48,6 +48,14 @@ struct packet
     size_t size;
 };
 
+/* write the hex prefix for a packet of sz bytes and return the end of it */
+unsigned char*
+packet_header(size_t sz, unsigned char* ptr);
+
+/* the size encoded by a packet's hex prefix, or -1 if it is not hex */
+long
+parse_packet_prefix(const unsigned char* prefix);
+
 const unsigned char*
 parse_packet(const unsigned char* ptr,
              const unsigned char* const end,
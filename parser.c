@@ -0,0 +1,409 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "macaroons-inner.h"
+#include "port.h"
+
+/* The parser buffers the token and runs just enough of each format's grammar
+ * over every chunk to know where the token ends; the buffered token is then
+ * deserialized in one go by macaroon_deserialize.
+ */
+
+#define V2_TYPE_SIGNATURE 6
+
+enum parser_format
+{
+    PARSER_UNKNOWN,
+    PARSER_V1,
+    PARSER_V2,
+    PARSER_V2J
+};
+
+enum parser_v2_state
+{
+    V2_VERSION,
+    V2_TYPE,
+    V2_LENGTH,
+    V2_PAYLOAD
+};
+
+enum parser_v2_section
+{
+    V2_HEADER,
+    V2_CAVEATS,
+    V2_SIGNATURE
+};
+
+struct macaroon_parser
+{
+    size_t max_sz;
+    unsigned char* buf;
+    size_t buf_sz;
+    size_t buf_cap;
+    enum parser_format format;
+    int done;
+    /* latched by a failed feed until macaroon_parser_finish */
+    enum macaroon_returncode error;
+
+    /* V2: the position within the current field and section */
+    enum parser_v2_state state;
+    enum parser_v2_section section;
+    size_t caveat_fields;
+    uint64_t varint;
+    unsigned varint_shift;
+    uint64_t type;
+    uint64_t remaining;
+
+    /* V2J: the nesting outside of strings */
+    size_t depth;
+    int in_string;
+    int escaped;
+};
+
+static void
+parser_reset(struct macaroon_parser* P)
+{
+    macaroon_memzero(P->buf, P->buf_sz);
+    P->buf_sz = 0;
+    P->format = PARSER_UNKNOWN;
+    P->done = 0;
+    P->error = MACAROON_SUCCESS;
+    P->state = V2_VERSION;
+    P->section = V2_HEADER;
+    P->caveat_fields = 0;
+    P->varint = 0;
+    P->varint_shift = 0;
+    P->type = 0;
+    P->remaining = 0;
+    P->depth = 0;
+    P->in_string = 0;
+    P->escaped = 0;
+}
+
+MACAROON_API struct macaroon_parser*
+macaroon_parser_create(size_t max_sz)
+{
+    struct macaroon_parser* P = macaroon_alloc(NULL, sizeof(struct macaroon_parser));
+
+    if (!P)
+    {
+        return NULL;
+    }
+
+    memset(P, 0, sizeof(struct macaroon_parser));
+    P->max_sz = max_sz;
+    parser_reset(P);
+    return P;
+}
+
+MACAROON_API void
+macaroon_parser_destroy(struct macaroon_parser* P)
+{
+    if (!P)
+    {
+        return;
+    }
+
+    parser_reset(P);
+    macaroon_dealloc(NULL, P->buf);
+    macaroon_dealloc(NULL, P);
+}
+
+/* a field or an EOS marker has been read in full */
+static int
+parser_v2_end_of_field(struct macaroon_parser* P)
+{
+    P->state = V2_TYPE;
+
+    switch (P->section)
+    {
+        case V2_HEADER:
+            if (P->type == 0) P->section = V2_CAVEATS;
+            return 0;
+        case V2_CAVEATS:
+            if (P->type != 0) ++P->caveat_fields;
+            else if (P->caveat_fields > 0) P->caveat_fields = 0;
+            else P->section = V2_SIGNATURE;
+            return 0;
+        case V2_SIGNATURE:
+            if (P->type != V2_TYPE_SIGNATURE) return -1;
+            P->done = 1;
+            return 0;
+        default:
+            abort();
+    }
+}
+
+/* returns the bytes of data that belong to the token, or -1 if malformed */
+static long
+parser_scan_v2(struct macaroon_parser* P, const unsigned char* data, size_t data_sz)
+{
+    size_t i = 0;
+    size_t amt;
+
+    while (i < data_sz && !P->done)
+    {
+        switch (P->state)
+        {
+            case V2_VERSION:
+                if (data[i++] != 2) return -1;
+                P->state = V2_TYPE;
+                break;
+            case V2_TYPE:
+            case V2_LENGTH:
+                if (P->varint_shift >= 64) return -1;
+                P->varint |= (uint64_t)(data[i] & 0x7f) << P->varint_shift;
+                P->varint_shift += 7;
+
+                if (data[i++] & 0x80)
+                {
+                    break;
+                }
+
+                if (P->state == V2_TYPE)
+                {
+                    P->type = P->varint;
+                    if (P->type > 0xff) return -1;
+                    P->state = P->type == 0 ? V2_TYPE : V2_LENGTH;
+                    if (P->type == 0 && parser_v2_end_of_field(P) < 0) return -1;
+                }
+                else
+                {
+                    /* refuse a length that could never fit, before buffering it */
+                    if (P->varint > P->max_sz) return -1;
+                    P->remaining = P->varint;
+                    P->state = V2_PAYLOAD;
+                    if (P->remaining == 0 && parser_v2_end_of_field(P) < 0) return -1;
+                }
+
+                P->varint = 0;
+                P->varint_shift = 0;
+                break;
+            case V2_PAYLOAD:
+                amt = data_sz - i;
+                amt = amt < P->remaining ? amt : P->remaining;
+                i += amt;
+                P->remaining -= amt;
+                if (P->remaining == 0 && parser_v2_end_of_field(P) < 0) return -1;
+                break;
+            default:
+                abort();
+        }
+    }
+
+    return i;
+}
+
+static long
+parser_scan_v2j(struct macaroon_parser* P, const unsigned char* data, size_t data_sz)
+{
+    size_t i;
+
+    for (i = 0; i < data_sz && !P->done; ++i)
+    {
+        const unsigned char c = data[i];
+
+        if (P->in_string)
+        {
+            if (P->escaped) P->escaped = 0;
+            else if (c == '\\') P->escaped = 1;
+            else if (c == '"') P->in_string = 0;
+        }
+        else if (c == '"')
+        {
+            P->in_string = 1;
+        }
+        else if (c == '{' || c == '[')
+        {
+            ++P->depth;
+        }
+        else if (c == '}' || c == ']')
+        {
+            if (P->depth == 0) return -1;
+            P->done = --P->depth == 0;
+        }
+    }
+
+    return i;
+}
+
+static int
+parser_append(struct macaroon_parser* P, const unsigned char* data, size_t data_sz,
+              enum macaroon_returncode* err)
+{
+    unsigned char* tmp;
+    size_t cap = P->buf_cap ? P->buf_cap : 256;
+
+    if (data_sz > P->max_sz - P->buf_sz)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    while (cap < P->buf_sz + data_sz)
+    {
+        cap *= 2;
+    }
+
+    cap = cap < P->max_sz ? cap : P->max_sz;
+
+    if (cap > P->buf_cap)
+    {
+        tmp = macaroon_alloc(NULL, cap);
+
+        if (!tmp)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
+        }
+
+        memmove(tmp, P->buf, P->buf_sz);
+        macaroon_memzero(P->buf, P->buf_sz);
+        macaroon_dealloc(NULL, P->buf);
+        P->buf = tmp;
+        P->buf_cap = cap;
+    }
+
+    memmove(P->buf + P->buf_sz, data, data_sz);
+    P->buf_sz += data_sz;
+    return 0;
+}
+
+MACAROON_API int
+macaroon_parser_feed(struct macaroon_parser* P,
+                     const unsigned char* data, size_t data_sz,
+                     size_t* consumed,
+                     enum macaroon_returncode* err)
+{
+    long amt = 0;
+
+    assert(P);
+    *consumed = 0;
+
+    if (P->error != MACAROON_SUCCESS)
+    {
+        *err = P->error;
+        return -1;
+    }
+
+    if (P->done || data_sz == 0)
+    {
+        return P->done;
+    }
+
+    if (P->format == PARSER_UNKNOWN)
+    {
+        if (data[0] == '\x02')
+        {
+            P->format = PARSER_V2;
+        }
+        else if (data[0] == '{')
+        {
+#ifdef MACAROONS_JSON
+            P->format = PARSER_V2J;
+#else
+            P->error = MACAROON_NO_JSON_SUPPORT;
+            *err = P->error;
+            return -1;
+#endif
+        }
+        else
+        {
+            P->format = PARSER_V1;
+        }
+    }
+
+    switch (P->format)
+    {
+        case PARSER_V1:
+            amt = data_sz;
+            break;
+        case PARSER_V2:
+            amt = parser_scan_v2(P, data, data_sz);
+            break;
+        case PARSER_V2J:
+            amt = parser_scan_v2j(P, data, data_sz);
+            break;
+        case PARSER_UNKNOWN:
+        default:
+            abort();
+    }
+
+    if (amt < 0)
+    {
+        *err = MACAROON_INVALID;
+    }
+
+    /* the scan has moved on, so the parser cannot take this chunk again */
+    if (amt < 0 || parser_append(P, data, amt, err) < 0)
+    {
+        P->error = *err;
+        return -1;
+    }
+
+    *consumed = amt;
+    return P->done;
+}
+
+MACAROON_API struct macaroon*
+macaroon_parser_finish(struct macaroon_parser* P,
+                       enum macaroon_returncode* err)
+{
+    struct macaroon* M = NULL;
+
+    assert(P);
+
+    if (P->error != MACAROON_SUCCESS)
+    {
+        *err = P->error;
+    }
+    else if (P->format == PARSER_UNKNOWN ||
+             (P->format != PARSER_V1 && !P->done))
+    {
+        *err = MACAROON_INVALID;
+    }
+    else
+    {
+        M = macaroon_deserialize(P->buf, P->buf_sz, err);
+    }
+
+    parser_reset(P);
+    return M;
+}
@@ -0,0 +1,259 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* C */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "macaroons-inner.h"
+#include "port.h"
+#include "slab.h"
+
+#define SLAB_CLASSES 8
+#define SLAB_LARGE SIZE_MAX
+
+#if (MACAROON_SLAB_MIN << (SLAB_CLASSES - 1)) != MACAROON_SLAB_MAX
+#error slab classes do not span MACAROON_SLAB_MIN to MACAROON_SLAB_MAX
+#endif
+
+/* precedes every block; the union keeps the block maximally aligned */
+union slab_header
+{
+    struct
+    {
+        size_t cls;
+        size_t cap;
+    } h;
+    union slab_header* next;
+    long double ld;
+    long long ll;
+    void* p;
+};
+
+struct slab_cache
+{
+    union slab_header* free[SLAB_CLASSES];
+    size_t cached;
+    int registered;
+};
+
+static __thread struct slab_cache slab_cache;
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static size_t slab_limit = MACAROON_SLAB_LIMIT;
+
+static size_t
+slab_class(size_t sz)
+{
+    size_t cls = 0;
+    size_t cap = MACAROON_SLAB_MIN;
+
+    if (sz > MACAROON_SLAB_MAX)
+    {
+        return SLAB_LARGE;
+    }
+
+    while (cap < sz)
+    {
+        cap <<= 1;
+        ++cls;
+    }
+
+    return cls;
+}
+
+/* return a dying thread's cached blocks to the system */
+static void
+slab_flush(void* arg)
+{
+    struct slab_cache* cache = arg;
+    union slab_header* H = NULL;
+    size_t i;
+
+    for (i = 0; i < SLAB_CLASSES; ++i)
+    {
+        while ((H = cache->free[i]))
+        {
+            cache->free[i] = H->next;
+            free(H);
+        }
+    }
+
+    cache->cached = 0;
+}
+
+static void
+slab_init(void)
+{
+    pthread_key_create(&slab_key, slab_flush);
+}
+
+void*
+macaroon_slab_alloc(size_t sz)
+{
+    union slab_header* H = NULL;
+    const size_t cls = slab_class(sz);
+    const size_t cap = cls == SLAB_LARGE ? sz : (size_t)MACAROON_SLAB_MIN << cls;
+
+    if (cls != SLAB_LARGE && slab_cache.free[cls])
+    {
+        H = slab_cache.free[cls];
+        slab_cache.free[cls] = H->next;
+        slab_cache.cached -= cap;
+    }
+    else
+    {
+        if (cap > SIZE_MAX - sizeof(union slab_header))
+        {
+            return NULL;
+        }
+
+        H = malloc(sizeof(union slab_header) + cap);
+
+        if (!H)
+        {
+            return NULL;
+        }
+    }
+
+    H->h.cls = cls;
+    H->h.cap = cap;
+    return H + 1;
+}
+
+void*
+macaroon_slab_realloc(void* ptr, size_t sz)
+{
+    union slab_header* H = NULL;
+    void* N = NULL;
+
+    if (!ptr)
+    {
+        return macaroon_slab_alloc(sz);
+    }
+
+    H = (union slab_header*)ptr - 1;
+
+    /* a block may keep up to half of its room unused */
+    if (sz <= H->h.cap && sz > H->h.cap / 2)
+    {
+        return ptr;
+    }
+
+    if (sz <= H->h.cap && H->h.cls == SLAB_LARGE)
+    {
+        /* the system keeps the prefix; scrub what it takes back */
+        macaroon_memzero((unsigned char*)ptr + sz, H->h.cap - sz);
+        N = realloc(H, sizeof(union slab_header) + sz);
+
+        if (!N)
+        {
+            return ptr;
+        }
+
+        H = N;
+        H->h.cap = sz;
+        return H + 1;
+    }
+
+    if (sz <= H->h.cap)
+    {
+        /* into a smaller class; failing that, the old block still serves */
+        N = macaroon_slab_alloc(sz);
+
+        if (!N)
+        {
+            return ptr;
+        }
+
+        memmove(N, ptr, sz);
+        macaroon_slab_free(ptr);
+        return N;
+    }
+
+    N = macaroon_slab_alloc(sz);
+
+    if (!N)
+    {
+        return NULL;
+    }
+
+    memmove(N, ptr, H->h.cap);
+    macaroon_slab_free(ptr);
+    return N;
+}
+
+void
+macaroon_slab_free(void* ptr)
+{
+    union slab_header* H = NULL;
+    size_t cls;
+    size_t cap;
+
+    if (!ptr)
+    {
+        return;
+    }
+
+    H = (union slab_header*)ptr - 1;
+    cls = H->h.cls;
+    cap = H->h.cap;
+    macaroon_memzero(ptr, cap);
+
+    if (cls == SLAB_LARGE ||
+        slab_cache.cached + cap > __atomic_load_n(&slab_limit, __ATOMIC_RELAXED))
+    {
+        free(H);
+        return;
+    }
+
+    if (!slab_cache.registered)
+    {
+        pthread_once(&slab_once, slab_init);
+        pthread_setspecific(slab_key, &slab_cache);
+        slab_cache.registered = 1;
+    }
+
+    H->next = slab_cache.free[cls];
+    slab_cache.free[cls] = H;
+    slab_cache.cached += cap;
+}
+
+MACAROON_API void
+macaroon_set_slab_limit(size_t limit)
+{
+    __atomic_store_n(&slab_limit, limit, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,53 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef macaroons_slab_h_
+#define macaroons_slab_h_
+
+/* C */
+#include <stddef.h>
+
+/* The default allocator.  Blocks of up to MACAROON_SLAB_MAX bytes come from
+ * per-thread free lists, one per power-of-two size class, and return there when
+ * freed, up to a per-thread limit of cached bytes.  Every block is scrubbed
+ * when it is freed, so callers need not zero memory when they allocate it.
+ * Reallocating to half a block's room or less moves it to a smaller class, or
+ * returns the excess of a large block to the system.
+ */
+#define MACAROON_SLAB_MIN 32
+#define MACAROON_SLAB_MAX 4096
+#define MACAROON_SLAB_LIMIT (256 * 1024)
+
+void*
+macaroon_slab_alloc(size_t sz);
+void*
+macaroon_slab_realloc(void* ptr, size_t sz);
+void
+macaroon_slab_free(void* ptr);
+
+#endif /* macaroons_slab_h_ */
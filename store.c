@@ -0,0 +1,456 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* POSIX */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* C */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "macaroons-inner.h"
+#include "v2.h"
+
+/* A store file is a header, the V2 records back to back, and an index of one
+ * entry per record sorted by the hash of its identifier, then by offset.  All
+ * integers are little-endian.
+ *
+ *     header: magic[8] num_records[8] index_offset[8]
+ *     entry:  hash[8] offset[8] length[8]
+ */
+#define STORE_MAGIC "MCRSTOR\x01"
+#define STORE_HEADER_SZ 24
+#define STORE_ENTRY_SZ 24
+
+struct store_entry
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* FNV-1a; collisions cost a comparison, never a wrong answer */
+static uint64_t
+store_hash(const unsigned char* data, size_t data_sz)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < data_sz; ++i)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static unsigned char*
+store_pack64(uint64_t v, unsigned char* ptr)
+{
+    unsigned i;
+
+    for (i = 0; i < 8; ++i)
+    {
+        *ptr++ = (unsigned char)(v >> (8 * i));
+    }
+
+    return ptr;
+}
+
+static uint64_t
+store_unpack64(const unsigned char* ptr)
+{
+    uint64_t v = 0;
+    unsigned i;
+
+    for (i = 0; i < 8; ++i)
+    {
+        v |= (uint64_t)ptr[i] << (8 * i);
+    }
+
+    return v;
+}
+
+static void
+store_header(uint64_t num_records, uint64_t index_offset, unsigned char* hdr)
+{
+    memmove(hdr, STORE_MAGIC, 8);
+    store_pack64(index_offset, store_pack64(num_records, hdr + 8));
+}
+
+struct macaroon_store_builder
+{
+    FILE* fp;
+    uint64_t offset;
+    struct store_entry* entries;
+    size_t entries_sz;
+    size_t entries_cap;
+    unsigned char* buf;
+    size_t buf_sz;
+};
+
+MACAROON_API struct macaroon_store_builder*
+macaroon_store_builder_create(const char* path, enum macaroon_returncode* err)
+{
+    unsigned char hdr[STORE_HEADER_SZ];
+    struct macaroon_store_builder* B = NULL;
+
+    B = macaroon_alloc(NULL, sizeof(struct macaroon_store_builder));
+
+    if (!B)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    memset(B, 0, sizeof(struct macaroon_store_builder));
+    B->fp = fopen(path, "wb");
+    B->offset = STORE_HEADER_SZ;
+
+    /* a placeholder, invalid until finish writes the real header */
+    memset(hdr, 0, sizeof(hdr));
+
+    if (!B->fp || fwrite(hdr, 1, sizeof(hdr), B->fp) != sizeof(hdr))
+    {
+        *err = MACAROON_INVALID;
+        macaroon_store_builder_destroy(B);
+        return NULL;
+    }
+
+    return B;
+}
+
+MACAROON_API void
+macaroon_store_builder_destroy(struct macaroon_store_builder* B)
+{
+    if (!B)
+    {
+        return;
+    }
+
+    if (B->fp)
+    {
+        fclose(B->fp);
+    }
+
+    macaroon_dealloc(NULL, B->entries);
+    macaroon_dealloc(NULL, B->buf);
+    macaroon_dealloc(NULL, B);
+}
+
+MACAROON_API int
+macaroon_store_builder_add(struct macaroon_store_builder* B,
+                           const struct macaroon* M,
+                           enum macaroon_returncode* err)
+{
+    const size_t sz = macaroon_serialize_size_hint_v2(M);
+    struct store_entry* entries = NULL;
+    unsigned char* buf = NULL;
+    size_t cap = 0;
+
+    if (B->entries_sz == B->entries_cap)
+    {
+        cap = B->entries_cap ? 2 * B->entries_cap : 64;
+        entries = macaroon_realloc(NULL, B->entries, cap * sizeof(struct store_entry));
+
+        if (!entries)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
+        }
+
+        B->entries = entries;
+        B->entries_cap = cap;
+    }
+
+    if (sz > B->buf_sz)
+    {
+        buf = macaroon_alloc(NULL, sz);
+
+        if (!buf)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+            return -1;
+        }
+
+        macaroon_dealloc(NULL, B->buf);
+        B->buf = buf;
+        B->buf_sz = sz;
+    }
+
+    if (macaroon_serialize_v2(M, B->buf, sz, err) != sz)
+    {
+        return -1;
+    }
+
+    if (fwrite(B->buf, 1, sz, B->fp) != sz)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    B->entries[B->entries_sz].hash = store_hash(M->identifier.data, M->identifier.size);
+    B->entries[B->entries_sz].offset = B->offset;
+    B->entries[B->entries_sz].length = sz;
+    ++B->entries_sz;
+    B->offset += sz;
+    return 0;
+}
+
+static int
+store_entry_cmp(const void* lhs, const void* rhs)
+{
+    const struct store_entry* l = lhs;
+    const struct store_entry* r = rhs;
+
+    if (l->hash != r->hash)
+    {
+        return l->hash < r->hash ? -1 : 1;
+    }
+
+    return l->offset < r->offset ? -1 : l->offset > r->offset;
+}
+
+MACAROON_API int
+macaroon_store_builder_finish(struct macaroon_store_builder* B,
+                              enum macaroon_returncode* err)
+{
+    unsigned char hdr[STORE_HEADER_SZ];
+    unsigned char entry[STORE_ENTRY_SZ];
+    unsigned char* ptr = NULL;
+    size_t i;
+    int ret = 0;
+
+    qsort(B->entries, B->entries_sz, sizeof(struct store_entry), store_entry_cmp);
+
+    for (i = 0; ret == 0 && i < B->entries_sz; ++i)
+    {
+        ptr = store_pack64(B->entries[i].hash, entry);
+        ptr = store_pack64(B->entries[i].offset, ptr);
+        store_pack64(B->entries[i].length, ptr);
+        ret = fwrite(entry, 1, sizeof(entry), B->fp) == sizeof(entry) ? 0 : -1;
+    }
+
+    store_header(B->entries_sz, B->offset, hdr);
+
+    if (ret < 0 ||
+        fseek(B->fp, 0, SEEK_SET) < 0 ||
+        fwrite(hdr, 1, sizeof(hdr), B->fp) != sizeof(hdr))
+    {
+        ret = -1;
+    }
+
+    if (fclose(B->fp) != 0)
+    {
+        ret = -1;
+    }
+
+    B->fp = NULL;
+    macaroon_store_builder_destroy(B);
+
+    if (ret < 0)
+    {
+        *err = MACAROON_INVALID;
+    }
+
+    return ret;
+}
+
+struct macaroon_store
+{
+    const unsigned char* data;
+    size_t data_sz;
+    const unsigned char* index;
+    size_t num_records;
+};
+
+MACAROON_API struct macaroon_store*
+macaroon_store_open(const char* path, enum macaroon_returncode* err)
+{
+    struct macaroon_store* S = NULL;
+    struct stat st;
+    void* data = MAP_FAILED;
+    uint64_t num_records;
+    uint64_t index_offset;
+    int fd = open(path, O_RDONLY);
+
+    *err = MACAROON_INVALID;
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size >= STORE_HEADER_SZ &&
+        (uint64_t)st.st_size <= SIZE_MAX)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    /* the mapping outlives the descriptor */
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    num_records = store_unpack64((const unsigned char*)data + 8);
+    index_offset = store_unpack64((const unsigned char*)data + 16);
+
+    if (memcmp(data, STORE_MAGIC, 8) != 0 ||
+        index_offset < STORE_HEADER_SZ ||
+        index_offset > (uint64_t)st.st_size ||
+        num_records != ((uint64_t)st.st_size - index_offset) / STORE_ENTRY_SZ ||
+        ((uint64_t)st.st_size - index_offset) % STORE_ENTRY_SZ != 0)
+    {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    S = macaroon_alloc(NULL, sizeof(struct macaroon_store));
+
+    if (!S)
+    {
+        munmap(data, st.st_size);
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    S->data = data;
+    S->data_sz = st.st_size;
+    S->index = S->data + index_offset;
+    S->num_records = num_records;
+    *err = MACAROON_SUCCESS;
+    return S;
+}
+
+MACAROON_API void
+macaroon_store_close(struct macaroon_store* S)
+{
+    if (!S)
+    {
+        return;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    munmap((void*)S->data, S->data_sz);
+#pragma GCC diagnostic pop
+    macaroon_dealloc(NULL, S);
+}
+
+MACAROON_API size_t
+macaroon_store_size(const struct macaroon_store* S)
+{
+    return S->num_records;
+}
+
+/* the bytes of the record in entry i, or NULL if they are out of bounds */
+static const unsigned char*
+store_record(const struct macaroon_store* S, size_t i, size_t* record_sz)
+{
+    const unsigned char* entry = S->index + i * STORE_ENTRY_SZ;
+    const uint64_t offset = store_unpack64(entry + 8);
+    const uint64_t length = store_unpack64(entry + 16);
+    const uint64_t limit = S->index - S->data;
+
+    if (offset < STORE_HEADER_SZ || offset > limit || length > limit - offset)
+    {
+        return NULL;
+    }
+
+    *record_sz = length;
+    return S->data + offset;
+}
+
+MACAROON_API struct macaroon*
+macaroon_store_get(const struct macaroon_store* S,
+                   const unsigned char* id, size_t id_sz,
+                   enum macaroon_returncode* err)
+{
+    const uint64_t hash = store_hash(id, id_sz);
+    const unsigned char* record = NULL;
+    struct slice location;
+    struct slice identifier;
+    size_t caveats_off = 0;
+    size_t record_sz = 0;
+    size_t lo = 0;
+    size_t hi = S->num_records;
+    size_t mid;
+
+    /* the first entry with the hash */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+
+        if (store_unpack64(S->index + mid * STORE_ENTRY_SZ) < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    for (; lo < S->num_records && store_unpack64(S->index + lo * STORE_ENTRY_SZ) == hash; ++lo)
+    {
+        record = store_record(S, lo, &record_sz);
+
+        if (!record ||
+            macaroon_deserialize_header_v2(record, record_sz, &location, &identifier,
+                                           &caveats_off, err) < 0)
+        {
+            *err = MACAROON_INVALID;
+            return NULL;
+        }
+
+        if (identifier.size == id_sz && memcmp(identifier.data, id, id_sz) == 0)
+        {
+            return macaroon_deserialize_resume_v2(record, record_sz, &location, &identifier,
+                                                  caveats_off, err);
+        }
+    }
+
+    *err = MACAROON_SUCCESS;
+    return NULL;
+}
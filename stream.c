@@ -0,0 +1,624 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* C */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "macaroons-inner.h"
+#include "v2.h"
+#include "varint.h"
+
+/* Readers split the input into chunks of about STREAM_CHUNK_SZ bytes, cut at
+ * token boundaries, and writers split their input into STREAM_WRITE_SZ
+ * macaroons; threads claim the chunks in order from a shared counter.
+ */
+#define STREAM_CHUNK_SZ (1U << 20)
+#define STREAM_WRITE_SZ 4096U
+
+static size_t
+stream_threads(size_t num_threads)
+{
+    long cpus;
+
+    if (num_threads > 0)
+    {
+        return num_threads;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+/* grow a scratch buffer; its contents are not kept */
+static int
+stream_reserve(unsigned char** buf, size_t* buf_sz, size_t sz)
+{
+    unsigned char* tmp = NULL;
+
+    if (sz <= *buf_sz)
+    {
+        return 0;
+    }
+
+    sz = sz > 2 * *buf_sz ? sz : 2 * *buf_sz;
+    tmp = macaroon_alloc(NULL, sz);
+
+    if (!tmp)
+    {
+        return -1;
+    }
+
+    macaroon_dealloc(NULL, *buf);
+    *buf = tmp;
+    *buf_sz = sz;
+    return 0;
+}
+
+/* Run fn on num_threads threads, the calling one included, and wait for all
+ * of them.  Threads that cannot be started leave the work to the others.
+ */
+static void
+stream_run(void* (*fn)(void*), void* arg, size_t num_threads)
+{
+    pthread_t* threads = NULL;
+    size_t started = 0;
+    size_t i;
+
+    if (num_threads > 1)
+    {
+        threads = macaroon_alloc(NULL, (num_threads - 1) * sizeof(pthread_t));
+    }
+
+    for (i = 0; threads && i + 1 < num_threads; ++i)
+    {
+        if (pthread_create(&threads[started], NULL, fn, arg) == 0)
+        {
+            ++started;
+        }
+    }
+
+    fn(arg);
+
+    for (i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    macaroon_dealloc(NULL, threads);
+}
+
+struct stream_reader
+{
+    const unsigned char* data;
+    size_t data_sz;
+    enum macaroon_stream_framing framing;
+    unsigned flags;
+    size_t batch_sz;
+    int (*cb)(void* arg, size_t offset, struct macaroon** MS, size_t MS_sz);
+    void* arg;
+    /* chunk k spans [bounds[k], bounds[k + 1]) */
+    size_t* bounds;
+    size_t bounds_sz;
+    /* claimed atomically */
+    size_t next;
+    /* 0 while running, 1 once a callback stops the stream, -1 on error */
+    int stop;
+    enum macaroon_returncode err;
+};
+
+/* the token at *ptr, advancing past it; 0 at the end of the chunk */
+static int
+stream_token(const struct stream_reader* R,
+             const unsigned char** ptr, const unsigned char* end,
+             struct slice* token)
+{
+    const unsigned char* nl = NULL;
+    uint64_t sz = 0;
+
+    if (R->framing == MACAROON_STREAM_LENGTH)
+    {
+        if (*ptr >= end)
+        {
+            return 0;
+        }
+
+        /* the framing was validated when the chunks were cut */
+        *ptr = unpackvarint(*ptr, end, &sz);
+        token->data = *ptr;
+        token->size = sz;
+        *ptr += sz;
+        return 1;
+    }
+
+    while (*ptr < end)
+    {
+        nl = memchr(*ptr, '\n', end - *ptr);
+        nl = nl ? nl : end;
+        token->data = *ptr;
+        token->size = nl - *ptr;
+        *ptr = nl < end ? nl + 1 : end;
+
+        if (token->size > 0 && token->data[token->size - 1] == '\r')
+        {
+            --token->size;
+        }
+
+        if (token->size > 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* cut the input into chunks that begin on token boundaries */
+static int
+stream_bounds(struct stream_reader* R)
+{
+    const unsigned char* const end = R->data + R->data_sz;
+    const unsigned char* ptr = R->data;
+    const unsigned char* nl = NULL;
+    size_t cut = 0;
+    uint64_t sz = 0;
+
+    R->bounds = macaroon_alloc(NULL, (R->data_sz / STREAM_CHUNK_SZ + 2) * sizeof(size_t));
+
+    if (!R->bounds)
+    {
+        R->err = MACAROON_OUT_OF_MEMORY;
+        return -1;
+    }
+
+    R->bounds[R->bounds_sz++] = 0;
+
+    if (R->framing == MACAROON_STREAM_LINES)
+    {
+        for (cut = STREAM_CHUNK_SZ; cut < R->data_sz; cut += STREAM_CHUNK_SZ)
+        {
+            /* the first line that starts at or after the cut */
+            nl = memchr(R->data + cut - 1, '\n', R->data_sz - cut + 1);
+
+            if (!nl || nl + 1 == end)
+            {
+                break;
+            }
+
+            if ((size_t)(nl + 1 - R->data) > R->bounds[R->bounds_sz - 1])
+            {
+                R->bounds[R->bounds_sz++] = nl + 1 - R->data;
+            }
+        }
+    }
+    else
+    {
+        for (cut = STREAM_CHUNK_SZ; ptr < end; )
+        {
+            if ((size_t)(ptr - R->data) >= cut)
+            {
+                R->bounds[R->bounds_sz++] = ptr - R->data;
+                cut = ptr - R->data + STREAM_CHUNK_SZ;
+            }
+
+            ptr = unpackvarint(ptr, end, &sz);
+
+            if (!ptr || sz > (uint64_t)(end - ptr))
+            {
+                R->err = MACAROON_INVALID;
+                return -1;
+            }
+
+            ptr += sz;
+        }
+    }
+
+    R->bounds[R->bounds_sz] = R->data_sz;
+    return 0;
+}
+
+struct stream_batch
+{
+    struct slice* tokens;
+    size_t* num_caveats;
+    size_t* body_sz;
+    struct macaroon** MS;
+    unsigned char* arena;
+    size_t arena_sz;
+};
+
+/* Decode a batch into one arena, falling back to a separate allocation for
+ * JSON, which cannot be measured first.  Tokens that fail are NULL.
+ */
+static int
+stream_decode(struct stream_reader* R, struct stream_batch* B, size_t n)
+{
+    enum macaroon_returncode err;
+    const struct slice* t = NULL;
+    unsigned char* body = NULL;
+    int view;
+    size_t sz = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        t = &B->tokens[i];
+        B->MS[i] = NULL;
+
+        if (macaroon_deserialize_measure(t->data, t->size, &B->num_caveats[i], &B->body_sz[i], &err) < 0)
+        {
+            B->body_sz[i] = SIZE_MAX;
+
+            if (err == MACAROON_UNSUPPORTED_FORMAT)
+            {
+                B->MS[i] = macaroon_deserialize(t->data, t->size, &err);
+            }
+
+            continue;
+        }
+
+        view = (R->flags & MACAROON_STREAM_VIEWS) && t->data[0] == '\x02';
+        sz += macaroon_arena_size(B->num_caveats[i], view ? 0 : B->body_sz[i]);
+    }
+
+    if (stream_reserve(&B->arena, &B->arena_sz, sz) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0, sz = 0; i < n; ++i)
+    {
+        t = &B->tokens[i];
+
+        if (B->body_sz[i] == SIZE_MAX)
+        {
+            continue;
+        }
+
+        /* fails only if data changed since it was measured */
+        view = (R->flags & MACAROON_STREAM_VIEWS) && t->data[0] == '\x02';
+        B->MS[i] = macaroon_place(B->arena + sz, B->num_caveats[i], &body);
+        sz += macaroon_arena_size(B->num_caveats[i], view ? 0 : B->body_sz[i]);
+
+        if (view
+            ? macaroon_deserialize_borrow_v2(t->data, t->size, B->MS[i], B->num_caveats[i], &err) < 0
+            : macaroon_deserialize_fill(t->data, t->size, B->MS[i], B->num_caveats[i],
+                                        body, B->body_sz[i], &err) < 0)
+        {
+            B->MS[i] = NULL;
+        }
+    }
+
+    return 0;
+}
+
+static int
+stream_deliver(struct stream_reader* R, struct stream_batch* B, size_t n)
+{
+    int ret = 0;
+    size_t i;
+
+    if (stream_decode(R, B, n) < 0)
+    {
+        return -1;
+    }
+
+    ret = R->cb(R->arg, B->tokens[0].data - R->data, B->MS, n);
+
+    /* a no-op for the macaroons in the arena */
+    for (i = 0; i < n; ++i)
+    {
+        macaroon_destroy(B->MS[i]);
+    }
+
+    return ret ? 1 : 0;
+}
+
+static void*
+stream_read_worker(void* arg)
+{
+    struct stream_reader* R = arg;
+    struct stream_batch B;
+    const unsigned char* ptr = NULL;
+    const unsigned char* end = NULL;
+    size_t n = 0;
+    size_t k;
+    int expected = 0;
+    int ret = 0;
+
+    macaroon_memzero(&B, sizeof(B));
+    B.tokens = macaroon_alloc(NULL, R->batch_sz * sizeof(struct slice));
+    B.num_caveats = macaroon_alloc(NULL, R->batch_sz * sizeof(size_t));
+    B.body_sz = macaroon_alloc(NULL, R->batch_sz * sizeof(size_t));
+    B.MS = macaroon_alloc(NULL, R->batch_sz * sizeof(struct macaroon*));
+
+    if (!B.tokens || !B.num_caveats || !B.body_sz || !B.MS)
+    {
+        ret = -1;
+    }
+
+    while (ret == 0 && __atomic_load_n(&R->stop, __ATOMIC_RELAXED) == 0)
+    {
+        k = __atomic_fetch_add(&R->next, 1, __ATOMIC_RELAXED);
+
+        if (k >= R->bounds_sz)
+        {
+            break;
+        }
+
+        ptr = R->data + R->bounds[k];
+        end = R->data + R->bounds[k + 1];
+
+        while (ret == 0 && stream_token(R, &ptr, end, &B.tokens[n]))
+        {
+            if (++n == R->batch_sz)
+            {
+                ret = stream_deliver(R, &B, n);
+                n = 0;
+            }
+        }
+
+        if (ret == 0 && n > 0)
+        {
+            ret = stream_deliver(R, &B, n);
+            n = 0;
+        }
+    }
+
+    /* the first to stop the stream decides how it ended; the only error a
+     * worker meets is running out of memory */
+    if (ret != 0 &&
+        __atomic_compare_exchange_n(&R->stop, &expected, ret, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+        ret < 0)
+    {
+        R->err = MACAROON_OUT_OF_MEMORY;
+    }
+
+    macaroon_dealloc(NULL, B.tokens);
+    macaroon_dealloc(NULL, B.num_caveats);
+    macaroon_dealloc(NULL, B.body_sz);
+    macaroon_dealloc(NULL, B.MS);
+    macaroon_dealloc(NULL, B.arena);
+    return NULL;
+}
+
+MACAROON_API int
+macaroon_stream_read(const unsigned char* data, size_t data_sz,
+                     enum macaroon_stream_framing framing,
+                     unsigned flags, size_t num_threads, size_t batch_sz,
+                     int (*cb)(void* arg, size_t offset, struct macaroon** MS, size_t MS_sz),
+                     void* arg,
+                     enum macaroon_returncode* err)
+{
+    struct stream_reader R;
+
+    macaroon_memzero(&R, sizeof(R));
+    R.data = data;
+    R.data_sz = data_sz;
+    R.framing = framing;
+    R.flags = flags;
+    R.batch_sz = batch_sz > 0 ? batch_sz : 1;
+    R.cb = cb;
+    R.arg = arg;
+    R.err = MACAROON_SUCCESS;
+
+    if (stream_bounds(&R) < 0)
+    {
+        macaroon_dealloc(NULL, R.bounds);
+        *err = R.err;
+        return -1;
+    }
+
+    stream_run(stream_read_worker, &R, stream_threads(num_threads));
+    macaroon_dealloc(NULL, R.bounds);
+    *err = R.err;
+    return R.stop;
+}
+
+struct stream_writer
+{
+    const struct macaroon* const* MS;
+    size_t MS_sz;
+    enum macaroon_format format;
+    enum macaroon_stream_framing framing;
+    int (*cb)(void* arg, const unsigned char* data, size_t data_sz);
+    void* arg;
+    /* claimed atomically */
+    size_t next;
+    /* chunks before this one have been handed to cb; guarded by mtx */
+    size_t written;
+    int stop;
+    enum macaroon_returncode err;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+};
+
+/* serialize the k'th chunk into buf; the number of bytes, or 0 on error */
+static size_t
+stream_encode(const struct stream_writer* W, size_t k,
+              unsigned char** buf, size_t* buf_sz,
+              enum macaroon_returncode* err)
+{
+    const size_t first = k * STREAM_WRITE_SZ;
+    const size_t last = first + STREAM_WRITE_SZ < W->MS_sz ? first + STREAM_WRITE_SZ : W->MS_sz;
+    unsigned char* ptr = NULL;
+    size_t hint = 0;
+    size_t sz = 0;
+    size_t len = 0;
+    size_t i;
+
+    for (i = first; i < last; ++i)
+    {
+        hint = macaroon_serialize_size_hint(W->MS[i], W->format);
+
+        if (hint == 0)
+        {
+            *err = MACAROON_UNSUPPORTED_FORMAT;
+            return 0;
+        }
+
+        sz += hint + (W->framing == MACAROON_STREAM_LENGTH ? varint_length(hint) : 1);
+    }
+
+    if (stream_reserve(buf, buf_sz, sz) < 0)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return 0;
+    }
+
+    for (i = first, ptr = *buf; i < last; ++i)
+    {
+        hint = macaroon_serialize_size_hint(W->MS[i], W->format);
+
+        if (W->framing == MACAROON_STREAM_LINES)
+        {
+            len = macaroon_serialize(W->MS[i], W->format, ptr, hint, err);
+            ptr += len;
+            *ptr++ = '\n';
+        }
+        else
+        {
+            /* the hint may overestimate; close the gap once the length is known */
+            len = macaroon_serialize(W->MS[i], W->format, ptr + varint_length(hint), hint, err);
+
+            if (varint_length(len) < varint_length(hint))
+            {
+                memmove(ptr + varint_length(len), ptr + varint_length(hint), len);
+            }
+
+            ptr = packvarint(len, ptr) + len;
+        }
+
+        if (len == 0)
+        {
+            return 0;
+        }
+    }
+
+    return ptr - *buf;
+}
+
+static void*
+stream_write_worker(void* arg)
+{
+    struct stream_writer* W = arg;
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+    unsigned char* buf = NULL;
+    size_t buf_sz = 0;
+    size_t sz = 0;
+    size_t k;
+
+    while (1)
+    {
+        k = __atomic_fetch_add(&W->next, 1, __ATOMIC_RELAXED);
+
+        if (k * STREAM_WRITE_SZ >= W->MS_sz)
+        {
+            break;
+        }
+
+        sz = __atomic_load_n(&W->stop, __ATOMIC_RELAXED) ? 0 : stream_encode(W, k, &buf, &buf_sz, &err);
+
+        /* chunks go to the callback in order, one at a time */
+        pthread_mutex_lock(&W->mtx);
+
+        while (W->written != k && W->stop == 0)
+        {
+            pthread_cond_wait(&W->cond, &W->mtx);
+        }
+
+        if (W->stop == 0 && sz == 0)
+        {
+            W->err = err;
+            __atomic_store_n(&W->stop, -1, __ATOMIC_RELAXED);
+        }
+        else if (W->stop == 0 && W->cb(W->arg, buf, sz) != 0)
+        {
+            __atomic_store_n(&W->stop, 1, __ATOMIC_RELAXED);
+        }
+
+        ++W->written;
+        pthread_cond_broadcast(&W->cond);
+        pthread_mutex_unlock(&W->mtx);
+
+        if (__atomic_load_n(&W->stop, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    macaroon_dealloc(NULL, buf);
+    return NULL;
+}
+
+MACAROON_API int
+macaroon_stream_write(const struct macaroon* const* MS, size_t MS_sz,
+                      enum macaroon_format f,
+                      enum macaroon_stream_framing framing,
+                      size_t num_threads,
+                      int (*cb)(void* arg, const unsigned char* data, size_t data_sz),
+                      void* arg,
+                      enum macaroon_returncode* err)
+{
+    struct stream_writer W;
+
+    /* only the text formats are free of newlines */
+    if (framing == MACAROON_STREAM_LINES &&
+        f != MACAROON_V1 && f != MACAROON_V2J && f != MACAROON_V2_B64URL)
+    {
+        *err = MACAROON_UNSUPPORTED_FORMAT;
+        return -1;
+    }
+
+    macaroon_memzero(&W, sizeof(W));
+    W.MS = MS;
+    W.MS_sz = MS_sz;
+    W.format = f;
+    W.framing = framing;
+    W.cb = cb;
+    W.arg = arg;
+    W.err = MACAROON_SUCCESS;
+    pthread_mutex_init(&W.mtx, NULL);
+    pthread_cond_init(&W.cond, NULL);
+    stream_run(stream_write_worker, &W, stream_threads(num_threads));
+    pthread_cond_destroy(&W.cond);
+    pthread_mutex_destroy(&W.mtx);
+    *err = W.err;
+    return W.stop;
+}
@@ -0,0 +1,206 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+#define IDENTIFIER "keyid"
+
+static const char b64url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static struct macaroon*
+create(unsigned num_caveats)
+{
+    struct macaroon* M = create_root(LOCATION, IDENTIFIER);
+    char pred[32];
+    unsigned i;
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        /* vary the length so every remainder mod 3 comes up */
+        memset(pred, 'x', sizeof(pred));
+        memcpy(pred, "account = ", 10);
+        M = add_first_party(M, U(pred), 10 + i % 7);
+    }
+
+    if (num_caveats % 2)
+    {
+        M = add_third_party(M, "http://auth.example/", "third party key", "third party id");
+    }
+
+    return M;
+}
+
+/* exactly the base64url of V2, which decodes to the same macaroon */
+static void
+round_trip(const struct macaroon* M)
+{
+    enum macaroon_returncode err;
+    size_t v2_sz = macaroon_serialize_size_hint(M, MACAROON_V2);
+    size_t sz = macaroon_serialize_size_hint(M, MACAROON_V2_B64URL);
+    unsigned char* v2 = malloc(v2_sz);
+    unsigned char* buf = malloc(sz + 3);
+    unsigned char* into = malloc(4096);
+    struct macaroon* N = NULL;
+    size_t i;
+
+    assert(v2 && buf && into);
+    assert(macaroon_serialize(M, MACAROON_V2, v2, v2_sz, &err) == v2_sz);
+    assert(sz == v2_sz / 3 * 4 + (v2_sz % 3 ? v2_sz % 3 + 1 : 0));
+    assert(macaroon_serialize(M, MACAROON_V2_B64URL, buf, sz - 1, &err) == 0);
+    assert(err == MACAROON_BUF_TOO_SMALL);
+    assert(macaroon_serialize(M, MACAROON_V2_B64URL, buf, sz, &err) == sz);
+    assert(buf[0] == 'A');
+
+    for (i = 0; i < sz; ++i)
+    {
+        assert(strchr(b64url, buf[i]));
+    }
+
+    for (i = 0; i < v2_sz; i += 3)
+    {
+        size_t n = v2_sz - i < 3 ? v2_sz - i : 3;
+        unsigned long bits = (unsigned long)v2[i] << 16;
+        bits |= n > 1 ? (unsigned long)v2[i + 1] << 8 : 0;
+        bits |= n > 2 ? v2[i + 2] : 0;
+        assert(buf[i / 3 * 4] == b64url[(bits >> 18) & 63]);
+        assert(buf[i / 3 * 4 + 1] == b64url[(bits >> 12) & 63]);
+        assert(n < 2 || buf[i / 3 * 4 + 2] == b64url[(bits >> 6) & 63]);
+        assert(n < 3 || buf[i / 3 * 4 + 3] == b64url[bits & 63]);
+    }
+
+    N = macaroon_deserialize(buf, sz, &err);
+    assert(N && macaroon_cmp(M, N) == 0);
+    macaroon_destroy(N);
+    assert(macaroon_deserialize_size(buf, sz, &err) <= 4096);
+    N = macaroon_deserialize_into(buf, sz, into, 4096, &err);
+    assert(N && macaroon_cmp(M, N) == 0);
+
+    /* padding is optional, but must be right if present */
+    memset(buf + sz, '=', 3);
+
+    if (sz % 4)
+    {
+        assert((N = macaroon_deserialize(buf, sz + 4 - sz % 4, &err)));
+        assert(macaroon_cmp(M, N) == 0);
+        macaroon_destroy(N);
+        assert(!macaroon_deserialize(buf, sz + 5 - sz % 4, &err));
+        assert(err == MACAROON_INVALID);
+    }
+
+    if (sz % 4 != 2)
+    {
+        assert(!macaroon_deserialize(buf, sz + 1 + (sz % 4 == 3), &err));
+    }
+
+    free(v2);
+    free(buf);
+    free(into);
+}
+
+static void
+mutations(const struct macaroon* M)
+{
+    enum macaroon_returncode err;
+    size_t sz = macaroon_serialize_size_hint(M, MACAROON_V2_B64URL);
+    unsigned char* buf = malloc(sz);
+    unsigned char* copy = malloc(sz);
+    struct macaroon* N = NULL;
+    size_t i;
+    unsigned j;
+
+    assert(buf && copy);
+    assert(macaroon_serialize(M, MACAROON_V2_B64URL, buf, sz, &err) == sz);
+
+    for (i = 0; i < sz; ++i)
+    {
+        N = macaroon_deserialize(buf, i, &err);
+        assert(!N || macaroon_cmp(M, N) != 0);
+        macaroon_destroy(N);
+
+        for (j = 0; j < 8; ++j)
+        {
+            memcpy(copy, buf, sz);
+            copy[i] = j < 4 ? "=+/ "[j] : b64url[(i * 7 + j * 13) % 64];
+            N = macaroon_deserialize(copy, sz, &err);
+            assert(!N || copy[i] == buf[i] || macaroon_cmp(M, N) != 0);
+            macaroon_destroy(N);
+        }
+    }
+
+    free(buf);
+    free(copy);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = NULL;
+    struct macaroon_lazy* L = NULL;
+    const unsigned char* id = NULL;
+    size_t id_sz = 0;
+    unsigned char buf[512];
+    size_t sz;
+    unsigned i;
+    (void) argc;
+    (void) argv;
+
+    for (i = 0; i < 16; ++i)
+    {
+        M = create(i);
+        round_trip(M);
+        macaroon_destroy(M);
+    }
+
+    M = create(3);
+    mutations(M);
+
+    /* lazy deserialization decodes it up front */
+    sz = macaroon_serialize(M, MACAROON_V2_B64URL, buf, sizeof(buf), &err);
+    assert(sz > 0);
+    L = macaroon_lazy_deserialize(buf, sz, &err);
+    assert(L);
+    macaroon_lazy_identifier(L, &id, &id_sz);
+    assert(id_sz == STRLENOF(IDENTIFIER) && memcmp(id, IDENTIFIER, id_sz) == 0);
+    assert(macaroon_cmp(M, macaroon_lazy_macaroon(L, &err)) == 0);
+    macaroon_lazy_destroy(L);
+    macaroon_destroy(M);
+    return EXIT_SUCCESS;
+}
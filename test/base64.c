@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 1996 by Internet Software Consortium.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+/*
+ * Portions Copyright (c) 1995 by International Business Machines, Inc.
+ *
+ * International Business Machines, Inc. (hereinafter called IBM) grants
+ * permission under its copyrights to use, copy, modify, and distribute this
+ * Software with or without fee, provided that the above copyright notice and
+ * all paragraphs of this notice appear in all copies, and that the name of IBM
+ * not be used in connection with the marketing of any product incorporating
+ * the Software or modifications thereof, without specific, written prior
+ * permission.
+ *
+ * To the extent it has a right to do so, IBM grants an immunity from suit
+ * under its patents, if any, for the use, sale or manufacture of products to
+ * the extent that such products are used for performing Domain Name System
+ * dynamic updates in TCP/IP networks by means of the Software.  No immunity is
+ * granted for any product per se or for any other function of any product.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", AND IBM DISCLAIMS ALL WARRANTIES,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE.  IN NO EVENT SHALL IBM BE LIABLE FOR ANY SPECIAL,
+ * DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE, EVEN
+ * IF IBM IS APPRISED OF THE POSSIBILITY OF SUCH DAMAGES.
+ */
+
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+/* macaroons */
+#include "base64.h"
+
+/* The character-at-a-time codec from OpenBSD that base64.c replaced, kept as
+ * the reference the table-driven one must agree with.
+ */
+static const char Base64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const char Pad64 = '=';
+
+static int
+ref_b64_ntop(unsigned char const *src, size_t srclength,
+    char *target, size_t targsize)
+{
+	size_t datalength = 0;
+	unsigned char input[3];
+	unsigned char output[4];
+	size_t i;
+
+	while (2 < srclength) {
+		input[0] = *src++;
+		input[1] = *src++;
+		input[2] = *src++;
+		srclength -= 3;
+
+		output[0] = input[0] >> 2;
+		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
+		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
+		output[3] = input[2] & 0x3f;
+
+		if (datalength + 4 > targsize)
+			return (-1);
+		target[datalength++] = Base64[output[0]];
+		target[datalength++] = Base64[output[1]];
+		target[datalength++] = Base64[output[2]];
+		target[datalength++] = Base64[output[3]];
+	}
+    
+	/* Now we worry about padding. */
+	if (0 != srclength) {
+		/* Get what's left. */
+		input[0] = input[1] = input[2] = '\0';
+		for (i = 0; i < srclength; i++)
+			input[i] = *src++;
+	
+		output[0] = input[0] >> 2;
+		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
+		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
+
+		if (datalength + 4 > targsize)
+			return (-1);
+		target[datalength++] = Base64[output[0]];
+		target[datalength++] = Base64[output[1]];
+        if (srclength != 1)
+			target[datalength++] = Base64[output[2]];
+	}
+	if (datalength >= targsize)
+		return (-1);
+	target[datalength] = '\0';	/* Returned value doesn't count \0. */
+	return (datalength);
+}
+
+static int
+ref_b64_pton(char const *src, unsigned char *target, size_t targsize)
+{
+    size_t tarindex;
+	int state, ch;
+	unsigned char nextbyte;
+	char *pos;
+
+	state = 0;
+	tarindex = 0;
+
+	while ((ch = (unsigned char)*src++) != '\0') {
+		if (isspace(ch))	/* Skip whitespace anywhere. */
+			continue;
+
+		if (ch == Pad64)
+			break;
+
+		if (ch == '+')
+			ch = '-';
+
+		if (ch == '/')
+			ch = '_';
+
+		pos = strchr(Base64, ch);
+		if (pos == 0) 		/* A non-base64 character. */
+			return (-1);
+
+		switch (state) {
+		case 0:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex] = (pos - Base64) << 2;
+			}
+			state = 1;
+			break;
+		case 1:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex]   |=  (pos - Base64) >> 4;
+				nextbyte = ((pos - Base64) & 0x0f) << 4;
+				if (tarindex + 1 < targsize)
+					target[tarindex+1] = nextbyte;
+				else if (nextbyte)
+					return (-1);
+			}
+			tarindex++;
+			state = 2;
+			break;
+		case 2:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex]   |=  (pos - Base64) >> 2;
+				nextbyte = ((pos - Base64) & 0x03) << 6;
+				if (tarindex + 1 < targsize)
+					target[tarindex+1] = nextbyte;
+				else if (nextbyte)
+					return (-1);
+			}
+			tarindex++;
+			state = 3;
+			break;
+		case 3:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex] |= (pos - Base64);
+			}
+			tarindex++;
+			state = 0;
+			break;
+        default:
+            break;
+		}
+	}
+
+	/* Skip padding and whitespace */
+	if (ch == Pad64) {
+		while (*src != '\0') {
+			if (!isspace(*src) && *src != Pad64) {
+				return (-1);
+			}
+			++src;
+		}
+	}
+
+	if (target && tarindex < targsize &&
+	    target[tarindex] != 0 && state != 0) {
+		return (-1);
+	}
+
+	return (tarindex);
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static unsigned
+rand_below(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+/* mostly valid base64, with whitespace, padding and garbage mixed in */
+static void
+rand_input(char *buf, size_t sz)
+{
+	static const char chars[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/-_";
+	static const char other[] = " \t\n\v\f\r=.*\x80\xff";
+	size_t i;
+
+	for (i = 0; i < sz; ++i) {
+		if (rand_below(8) != 0)
+			buf[i] = chars[rand_below(sizeof(chars) - 1)];
+		else if (rand_below(16) != 0)
+			buf[i] = other[rand_below(sizeof(other) - 1)];
+		else
+			buf[i] = '\0';
+	}
+
+	buf[sz] = '\0';
+}
+
+static void
+fuzz_pton(unsigned iterations)
+{
+	char src[64];
+	unsigned char lhs[64];
+	unsigned char rhs[64];
+	size_t targsize;
+	int lrc;
+	int rrc;
+	unsigned i;
+
+	for (i = 0; i < iterations; ++i) {
+		rand_input(src, rand_below(sizeof(src)));
+		/* often a valid quantum-aligned prefix, so decoding gets far */
+		if (rand_below(2) == 0)
+			src[strlen(src) / 4 * 4] = '\0';
+		targsize = rand_below(sizeof(lhs));
+		memset(lhs, 0, sizeof(lhs));
+		memset(rhs, 0, sizeof(rhs));
+		lrc = b64_pton(src, lhs, targsize);
+		rrc = ref_b64_pton(src, rhs, targsize);
+		assert(lrc == rrc);
+		assert(lrc < 0 || memcmp(lhs, rhs, lrc) == 0);
+	}
+}
+
+static void
+fuzz_ntop(unsigned iterations)
+{
+	unsigned char src[48];
+	char lhs[80];
+	char rhs[80];
+	size_t srclength;
+	size_t targsize;
+	int lrc;
+	int rrc;
+	unsigned i;
+	size_t j;
+
+	for (i = 0; i < iterations; ++i) {
+		srclength = rand_below(sizeof(src));
+		for (j = 0; j < srclength; ++j)
+			src[j] = rand_below(256);
+		targsize = rand_below(sizeof(lhs));
+		lrc = b64_ntop(src, srclength, lhs, targsize);
+		rrc = ref_b64_ntop(src, srclength, rhs, targsize);
+		/* the reference wanted room for padding it never wrote */
+		assert(rrc < 0 || lrc == rrc);
+		assert(rrc < 0 || strcmp(lhs, rhs) == 0);
+		assert(lrc >= 0 || rrc < 0);
+	}
+}
+
+static void
+round_trip(unsigned flags)
+{
+	unsigned char src[64];
+	unsigned char dst[64];
+	char enc[128];
+	unsigned char inplace[128];
+	size_t srclength;
+	int rc;
+	size_t j;
+
+	for (srclength = 0; srclength < sizeof(src); ++srclength) {
+		for (j = 0; j < srclength; ++j)
+			src[j] = rand_below(256);
+		rc = b64_encode(src, srclength, enc, sizeof(enc), flags);
+		assert(rc >= 0 && (size_t)rc == strlen(enc));
+		assert(!(flags & B64_PADDED) || rc % 4 == 0);
+		assert(b64_decode(enc, rc, dst, sizeof(dst), flags) == (int)srclength);
+		assert(memcmp(src, dst, srclength) == 0);
+		assert(b64_decode(enc, rc, dst, sizeof(dst), B64_TOLERANT) == (int)srclength);
+		assert(memcmp(src, dst, srclength) == 0);
+		assert(srclength == 0 ||
+		    b64_decode(enc, rc, dst, srclength - 1, flags) < 0);
+		if (flags & B64_PADDED)
+			continue;
+		/* unterminated, in place from the end of the target */
+		memcpy(inplace + rc - srclength, src, srclength);
+		assert(b64_encode(inplace + rc - srclength, srclength,
+		    (char *)inplace, rc, flags | B64_UNTERMINATED) == rc);
+		assert(memcmp(inplace, enc, rc) == 0);
+		assert(rc == 0 || b64_encode(src, srclength, (char *)inplace,
+		    rc - 1, flags | B64_UNTERMINATED) < 0);
+	}
+}
+
+static int
+strict(const char *src, unsigned flags)
+{
+	unsigned char dst[64];
+	return b64_decode(src, strlen(src), dst, sizeof(dst), flags);
+}
+
+int
+main(int argc, const char* argv[])
+{
+	unsigned char dst[8];
+	(void)argc;
+	(void)argv;
+
+	fuzz_pton(200000);
+	fuzz_ntop(200000);
+	round_trip(B64_URL);
+	round_trip(B64_URL | B64_PADDED);
+	round_trip(B64_STD);
+	round_trip(B64_STD | B64_PADDED);
+
+	assert(strict("QUJD", B64_URL) == 3);
+	assert(strict("QQ", B64_URL) == 1);
+	assert(strict("QQ==", B64_URL | B64_PADDED) == 1);
+	assert(strict("QUI=", B64_URL | B64_PADDED) == 2);
+	/* padding must match the mode */
+	assert(strict("QQ", B64_URL | B64_PADDED) < 0);
+	assert(strict("QQ==", B64_URL) < 0);
+	assert(strict("QQ=", B64_URL | B64_PADDED) < 0);
+	assert(strict("QQ===", B64_URL | B64_PADDED) < 0);
+	assert(strict("QUJD====", B64_URL | B64_PADDED) < 0);
+	/* no stray bits, characters, or whitespace */
+	assert(strict("QR", B64_URL) < 0);
+	assert(strict("Q", B64_URL) < 0);
+	assert(strict("QU JD", B64_URL) < 0);
+	assert(strict("QU JD", B64_TOLERANT) == 3);
+	/* alphabets */
+	assert(strict("-_-_", B64_URL) == 3);
+	assert(strict("-_-_", B64_STD) < 0);
+	assert(strict("+/+/", B64_STD) == 3);
+	assert(strict("+/+/", B64_URL) < 0);
+	assert(strict("+/-_", B64_STD | B64_URL) == 3);
+	/* an explicit length need not end at a NUL */
+	assert(b64_decode("QUJDREVG", 4, dst, sizeof(dst), B64_URL) == 3);
+	assert(memcmp(dst, "ABC", 3) == 0);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+#define IDENTIFIER "keyid"
+
+void
+builder_first_party(unsigned num_caveats)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = NULL;
+    struct macaroon* N = NULL;
+    struct macaroon_builder* B = NULL;
+    unsigned char* buf1 = NULL;
+    unsigned char* buf2 = NULL;
+    size_t sz1;
+    size_t sz2;
+    char pred[64];
+    unsigned i;
+
+    M = create_root(LOCATION, IDENTIFIER);
+    B = macaroon_builder_create(U(LOCATION), STRLENOF(LOCATION),
+                                U(KEY), STRLENOF(KEY),
+                                U(IDENTIFIER), STRLENOF(IDENTIFIER), &err);
+    assert(B);
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        snprintf(pred, sizeof(pred), "caveat %u = %u", i, i * 7919);
+        M = add_first_party(M, U(pred), strlen(pred));
+        assert(macaroon_builder_add_first_party_caveat(B, U(pred), strlen(pred), &err) == 0);
+    }
+
+    N = macaroon_builder_finalize(B, &err);
+    assert(N);
+    assert(macaroon_cmp(M, N) == 0);
+
+    sz1 = macaroon_serialize_size_hint(M, MACAROON_V2);
+    sz2 = macaroon_builder_serialize_size_hint(B, MACAROON_V2);
+    assert(sz1 == sz2);
+    buf1 = malloc(sz1);
+    buf2 = malloc(sz2);
+    assert(buf1 && buf2);
+    sz1 = macaroon_serialize(M, MACAROON_V2, buf1, sz1, &err);
+    sz2 = macaroon_builder_serialize(B, MACAROON_V2, buf2, sz2, &err);
+    assert(sz1 > 0 && sz1 == sz2);
+    assert(memcmp(buf1, buf2, sz1) == 0);
+    free(buf1);
+    free(buf2);
+
+    macaroon_destroy(M);
+    macaroon_destroy(N);
+    macaroon_builder_destroy(B);
+}
+
+void
+bulk_first_party(unsigned num_caveats)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = NULL;
+    struct macaroon* N = NULL;
+    struct macaroon* T = NULL;
+    const unsigned char* preds[64];
+    size_t pred_szs[64];
+    char storage[64][32];
+    unsigned i;
+
+    assert(num_caveats <= 64);
+    M = add_first_party(create_root(LOCATION, IDENTIFIER), U("time < 2020"), 11);
+    N = macaroon_copy(M, &err);
+    assert(N);
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        snprintf(storage[i], sizeof(storage[i]), "policy %u", i);
+        preds[i] = U(storage[i]);
+        pred_szs[i] = strlen(storage[i]);
+        M = add_first_party(M, preds[i], pred_szs[i]);
+    }
+
+    T = macaroon_add_first_party_caveats(N, preds, pred_szs, num_caveats, &err);
+    assert(T);
+    assert(macaroon_cmp(M, T) == 0);
+    macaroon_destroy(M);
+    macaroon_destroy(N);
+    macaroon_destroy(T);
+}
+
+void
+builder_from_existing(void)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = NULL;
+    struct macaroon* N = NULL;
+    struct macaroon* D = NULL;
+    struct macaroon* DP = NULL;
+    struct macaroon_builder* B = NULL;
+    struct macaroon_verifier* V = NULL;
+    struct macaroon* MS[1];
+
+    M = create_root(LOCATION, IDENTIFIER);
+    B = macaroon_builder_from(M, &err);
+    assert(B);
+    assert(macaroon_builder_add_first_party_caveat(B, U("account = 3735928559"), 20, &err) == 0);
+    assert(macaroon_builder_add_third_party_caveat(B, U("http://auth.mybank/"), 19,
+                                                   U("3rd party key"), 13,
+                                                   U("this was how we remind auth of key/pred"), 39,
+                                                   &err) == 0);
+    N = macaroon_builder_finalize(B, &err);
+    assert(N);
+    assert(macaroon_num_third_party_caveats(N) == 1);
+
+    D = macaroon_create(U("http://auth.mybank/"), 19,
+                        U("3rd party key"), 13,
+                        U("this was how we remind auth of key/pred"), 39, &err);
+    assert(D);
+    DP = macaroon_prepare_for_request(N, D, &err);
+    assert(DP);
+
+    V = macaroon_verifier_create();
+    assert(V);
+    assert(macaroon_verifier_satisfy_exact(V, U("account = 3735928559"), 20, &err) == 0);
+    MS[0] = DP;
+    assert(macaroon_verify(V, N, U(KEY), STRLENOF(KEY), MS, 1, &err) == 0);
+
+    macaroon_verifier_destroy(V);
+    macaroon_destroy(M);
+    macaroon_destroy(N);
+    macaroon_destroy(D);
+    macaroon_destroy(DP);
+    macaroon_builder_destroy(B);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    (void)argc;
+    (void)argv;
+    builder_first_party(0);
+    builder_first_party(1);
+    builder_first_party(50);
+    builder_first_party(1000);
+    bulk_first_party(0);
+    bulk_first_party(1);
+    bulk_first_party(10);
+    bulk_first_party(64);
+    builder_from_existing();
+    return 0;
+}
@@ -0,0 +1,232 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+#define AUTH "http://auth.example.org/"
+#define NUM_DISCHARGES 4
+
+static struct macaroon* root;
+static struct macaroon* bound[NUM_DISCHARGES];
+
+/* a root with NUM_DISCHARGES third-party caveats, all at AUTH, and their
+ * discharges bound to it */
+static void
+setup(void)
+{
+    enum macaroon_returncode err;
+    struct macaroon* D[NUM_DISCHARGES];
+    char key[32];
+    char id[32];
+    unsigned i;
+
+    root = add_first_party(create_root(LOCATION, "root"), U("account = 3735928559"), 20);
+
+    for (i = 0; i < NUM_DISCHARGES; ++i)
+    {
+        snprintf(key, sizeof(key), "discharge key %u", i);
+        snprintf(id, sizeof(id), "discharge %u", i);
+        root = add_third_party(root, AUTH, key, id);
+        D[i] = macaroon_create(U(AUTH), STRLENOF(AUTH),
+                               U(key), strlen(key),
+                               U(id), strlen(id), &err);
+        assert(D[i]);
+        D[i] = add_first_party(D[i], U("time < 2030-01-01"), 17);
+    }
+
+    assert(macaroon_prepare_for_request_batch(root, (const struct macaroon* const*)D,
+                                              NUM_DISCHARGES, bound, &err) == 0);
+
+    for (i = 0; i < NUM_DISCHARGES; ++i)
+    {
+        macaroon_destroy(D[i]);
+    }
+}
+
+static unsigned char*
+bundle(size_t n, size_t* sz)
+{
+    enum macaroon_returncode err;
+    const struct macaroon* const* D = (const struct macaroon* const*)bound;
+    unsigned char* buf = NULL;
+
+    *sz = macaroon_bundle_serialize_size_hint(root, D, n);
+    assert(*sz > 0);
+    buf = malloc(*sz);
+    assert(buf);
+    assert(macaroon_bundle_serialize(root, D, n, buf, *sz - 1, &err) == 0);
+    assert(err == MACAROON_BUF_TOO_SMALL);
+    assert(macaroon_bundle_serialize(root, D, n, buf, *sz, &err) == *sz);
+    return buf;
+}
+
+static int
+satisfy_all(void* f, const unsigned char* pred, size_t pred_sz)
+{
+    (void) f;
+    (void) pred;
+    (void) pred_sz;
+    return 0;
+}
+
+static void
+round_trip(size_t n)
+{
+    enum macaroon_returncode err;
+    struct macaroon_verifier* V = NULL;
+    struct macaroon* M = NULL;
+    struct macaroon** D = NULL;
+    size_t D_sz = 0;
+    size_t sz = 0;
+    size_t separate = macaroon_serialize_size_hint(root, MACAROON_V2);
+    unsigned char* buf = bundle(n, &sz);
+    size_t i;
+
+    M = macaroon_bundle_deserialize(buf, sz, &D, &D_sz, &err);
+    assert(M);
+    assert(D_sz == n);
+    assert((n == 0) == (D == NULL));
+    assert(macaroon_cmp(M, root) == 0);
+
+    for (i = 0; i < n; ++i)
+    {
+        assert(macaroon_cmp(D[i], bound[i]) == 0);
+        separate += macaroon_serialize_size_hint(bound[i], MACAROON_V2);
+    }
+
+    /* the shared location pays for itself once it repeats */
+    assert(n < 2 || sz < separate);
+
+    V = macaroon_verifier_create();
+    assert(V);
+    assert(macaroon_verifier_satisfy_general(V, satisfy_all, NULL, &err) == 0);
+    assert(macaroon_verify(V, M, U(KEY), STRLENOF(KEY), D, D_sz, &err) == (n == NUM_DISCHARGES ? 0 : -1));
+    macaroon_verifier_destroy(V);
+
+    /* the root goes first; the block outlives it for the discharges */
+    macaroon_destroy(M);
+
+    for (i = 0; i < n; ++i)
+    {
+        assert(macaroon_cmp(D[i], bound[i]) == 0);
+        macaroon_destroy(D[i]);
+    }
+
+    free(buf);
+}
+
+static void
+malformed(void)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = NULL;
+    struct macaroon** D = NULL;
+    size_t D_sz = 0;
+    size_t sz = 0;
+    unsigned char* buf = bundle(NUM_DISCHARGES, &sz);
+    unsigned char* copy = malloc(sz + 1);
+    size_t i;
+    size_t j;
+
+    assert(copy);
+
+    /* neither a prefix nor a trailing byte parses */
+    for (i = 0; i <= sz; ++i)
+    {
+        memcpy(copy, buf, sz);
+        copy[sz] = 0;
+        assert(macaroon_bundle_deserialize(copy, i == sz ? sz + 1 : i, &D, &D_sz, &err) == NULL);
+        assert(err == MACAROON_INVALID);
+    }
+
+    /* a bundle is not a macaroon */
+    assert(macaroon_deserialize(buf, sz, &err) == NULL);
+
+    /* flipped bytes either fail or parse into something destroyable */
+    for (i = 0; i < sz; ++i)
+    {
+        for (j = 1; j < 256; j <<= 1)
+        {
+            memcpy(copy, buf, sz);
+            copy[i] ^= j;
+            M = macaroon_bundle_deserialize(copy, sz, &D, &D_sz, &err);
+
+            if (!M)
+            {
+                continue;
+            }
+
+            while (D_sz > 0)
+            {
+                macaroon_destroy(D[--D_sz]);
+            }
+
+            macaroon_destroy(M);
+        }
+    }
+
+    free(copy);
+    free(buf);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    size_t i;
+
+    setup();
+
+    for (i = 0; i <= NUM_DISCHARGES; ++i)
+    {
+        round_trip(i);
+    }
+
+    malformed();
+    macaroon_destroy(root);
+
+    for (i = 0; i < NUM_DISCHARGES; ++i)
+    {
+        macaroon_destroy(bound[i]);
+    }
+
+    (void) argc;
+    (void) argv;
+    return EXIT_SUCCESS;
+}
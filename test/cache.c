@@ -0,0 +1,132 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+/* the cached form must match a freshly prepared and serialized discharge */
+static void
+check_bound(struct macaroon_request_cache* C,
+            const struct macaroon* M, const struct macaroon* D,
+            enum macaroon_format f)
+{
+    enum macaroon_returncode err;
+    const struct macaroon* B = NULL;
+    struct macaroon* P = NULL;
+    const unsigned char* data = NULL;
+    size_t data_sz = 0;
+    unsigned char buf[1024];
+    size_t sz = 0;
+
+    assert(macaroon_request_cache_get(C, M, D, &B, &data, &data_sz, &err) == 0);
+    P = macaroon_prepare_for_request(M, D, &err);
+    assert(P);
+    assert(macaroon_cmp(B, P) == 0);
+    sz = macaroon_serialize(P, f, buf, sizeof(buf), &err);
+    assert(sz > 0 && sz == data_sz && memcmp(buf, data, sz) == 0);
+    macaroon_destroy(P);
+}
+
+static void
+cache(size_t num_entries, enum macaroon_format f)
+{
+    enum macaroon_returncode err;
+    struct macaroon_request_cache* C = macaroon_request_cache_create(num_entries, f);
+    struct macaroon* M = create_root(LOCATION, "root");
+    struct macaroon* N = NULL;
+    struct macaroon* D1 = create_root(LOCATION, "discharge 1");
+    struct macaroon* D2 = create_root(LOCATION, "discharge 2");
+    struct macaroon* DA = create_root("http://a.example/", "discharge 1");
+    struct macaroon* DB = create_root("http://b.example/", "discharge 1");
+    const struct macaroon* B1 = NULL;
+    const struct macaroon* B2 = NULL;
+    const unsigned char* data1 = NULL;
+    const unsigned char* data2 = NULL;
+    size_t data1_sz = 0;
+    size_t data2_sz = 0;
+
+    assert(C);
+    check_bound(C, M, D1, f);
+    check_bound(C, M, D2, f);
+    check_bound(C, M, D1, f);
+
+    /* a hit hands back the same entry */
+    assert(macaroon_request_cache_get(C, M, D1, &B1, &data1, &data1_sz, &err) == 0);
+    assert(macaroon_request_cache_get(C, M, D1, &B2, &data2, &data2_sz, &err) == 0);
+    assert(B1 == B2 && data1 == data2 && data1_sz == data2_sz);
+
+    /* an attenuated root changes the key */
+    N = macaroon_add_first_party_caveat(M, U("account = 1"), 11, &err);
+    assert(N);
+    check_bound(C, N, D1, f);
+    check_bound(C, M, D1, f);
+
+    /* a retained bound discharge survives eviction */
+    assert(macaroon_request_cache_get(C, M, D2, &B1, &data1, &data1_sz, &err) == 0);
+    B1 = macaroon_retain(B1);
+    check_bound(C, N, D2, f);
+    check_bound(C, M, D1, f);
+    assert(macaroon_num_third_party_caveats(B1) == 0);
+    macaroon_release(B1);
+
+    /* the signature does not cover a discharge's location */
+    check_bound(C, M, DA, f);
+    check_bound(C, M, DB, f);
+    check_bound(C, M, DA, f);
+
+    assert(macaroon_request_cache_get(C, M, D1, NULL, &data1, &data1_sz, &err) == 0);
+    macaroon_request_cache_destroy(C);
+    macaroon_destroy(M);
+    macaroon_destroy(N);
+    macaroon_destroy(D1);
+    macaroon_destroy(D2);
+    macaroon_destroy(DA);
+    macaroon_destroy(DB);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    (void)argc;
+    (void)argv;
+    assert(macaroon_request_cache_create(0, MACAROON_V2) == NULL);
+    cache(1, MACAROON_V1);
+    cache(1, MACAROON_V2);
+    cache(64, MACAROON_V1);
+    cache(64, MACAROON_V2);
+    return 0;
+}
@@ -0,0 +1,261 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+#define IDENTIFIER "keyid"
+
+/* caveat i is third-party when i % 3 == 2 */
+static struct macaroon*
+attenuate(struct macaroon* M, unsigned i, int shared)
+{
+    enum macaroon_returncode err;
+    struct macaroon* T = NULL;
+    char pred[32];
+    char loc[32];
+
+    if (i % 3 == 2)
+    {
+        snprintf(loc, sizeof(loc), "http://tp%u.example/", i);
+        snprintf(pred, sizeof(pred), "third party id %u", i);
+        return add_third_party(M, loc, "third party key", pred);
+    }
+
+    snprintf(pred, sizeof(pred), "caveat = %u", i);
+
+    if (!shared)
+    {
+        return add_first_party(M, U(pred), strlen(pred));
+    }
+
+    T = macaroon_add_first_party_caveat_shared(M, U(pred), strlen(pred), &err);
+    assert(T);
+    macaroon_destroy(M);
+    return T;
+}
+
+static struct macaroon*
+create(unsigned num_caveats, int shared)
+{
+    struct macaroon* M = create_root(LOCATION, IDENTIFIER);
+    unsigned i;
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        M = attenuate(M, i, shared);
+    }
+
+    return M;
+}
+
+static void
+check_caveat(const struct macaroon_caveat* C, unsigned i)
+{
+    char pred[32];
+    char loc[32];
+
+    if (i % 3 == 2)
+    {
+        snprintf(loc, sizeof(loc), "http://tp%u.example/", i);
+        snprintf(pred, sizeof(pred), "third party id %u", i);
+        assert(C->cl_sz == strlen(loc) && memcmp(C->cl, loc, C->cl_sz) == 0);
+        assert(C->vid_sz > 0);
+    }
+    else
+    {
+        snprintf(pred, sizeof(pred), "caveat = %u", i);
+        assert(C->vid_sz == 0 && C->cl_sz == 0);
+    }
+
+    assert(C->cid_sz == strlen(pred) && memcmp(C->cid, pred, C->cid_sz) == 0);
+}
+
+/* the cursor, the bulk call and the third-party accessors all agree */
+static void
+check(const struct macaroon* M, unsigned num_caveats)
+{
+    struct macaroon_caveat_cursor C;
+    struct macaroon_caveat caveat;
+    struct macaroon_caveat* caveats = malloc((num_caveats + 1) * sizeof(*caveats));
+    const unsigned char* loc;
+    const unsigned char* id;
+    size_t loc_sz;
+    size_t id_sz;
+    unsigned third = 0;
+    unsigned i;
+    size_t first;
+
+    assert(caveats);
+    assert(macaroon_num_caveats(M) == num_caveats);
+    macaroon_caveat_cursor_init(&C, M);
+
+    for (i = 0; macaroon_caveat_cursor_next(&C, &caveat) == 0; ++i)
+    {
+        check_caveat(&caveat, i);
+
+        if (caveat.vid_sz > 0)
+        {
+            assert(macaroon_third_party_caveat(M, third, &loc, &loc_sz, &id, &id_sz) == 0);
+            assert(loc == caveat.cl && loc_sz == caveat.cl_sz);
+            assert(id == caveat.cid && id_sz == caveat.cid_sz);
+            ++third;
+        }
+    }
+
+    assert(i == num_caveats);
+    assert(macaroon_caveat_cursor_next(&C, &caveat) < 0);
+    assert(macaroon_num_third_party_caveats(M) == third);
+    assert(macaroon_third_party_caveat(M, third, &loc, &loc_sz, &id, &id_sz) < 0);
+
+    assert(macaroon_caveats(M, 0, caveats, num_caveats + 1) == num_caveats);
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        check_caveat(&caveats[i], i);
+    }
+
+    /* windows at every offset, including past the end */
+    for (first = 0; first <= num_caveats + 1; first += 1 + num_caveats / 7)
+    {
+        size_t n = macaroon_caveats(M, first, caveats, 3);
+        assert(n == (first >= num_caveats ? 0 : num_caveats - first < 3 ? num_caveats - first : 3));
+
+        for (i = 0; i < n; ++i)
+        {
+            check_caveat(&caveats[i], first + i);
+        }
+    }
+
+    free(caveats);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = NULL;
+    struct macaroon* N = NULL;
+    struct macaroon_caveat_cursor C;
+    struct macaroon_caveat caveat;
+    struct macaroon_caveat* caveats = NULL;
+    unsigned char* buf = NULL;
+    size_t sz;
+    unsigned num_caveats;
+    unsigned i;
+    (void) argc;
+    (void) argv;
+
+    for (num_caveats = 0; num_caveats < 40; num_caveats += 3)
+    {
+        M = create(num_caveats, 0);
+        check(M, num_caveats);
+
+        N = macaroon_compact(M, &err);
+        assert(N);
+        check(N, num_caveats);
+        macaroon_destroy(N);
+
+        sz = macaroon_serialize_size_hint(M, MACAROON_V2);
+        buf = malloc(sz);
+        assert(buf);
+        assert(macaroon_serialize(M, MACAROON_V2, buf, sz, &err) == sz);
+        N = macaroon_deserialize_view(buf, sz, &err);
+        assert(N);
+        check(N, num_caveats);
+        macaroon_destroy(N);
+        free(buf);
+        macaroon_destroy(M);
+
+        /* shared attenuations over plain and compact macaroons */
+        M = create(num_caveats, 1);
+        check(M, num_caveats);
+        N = macaroon_compact(M, &err);
+        assert(N);
+        macaroon_destroy(M);
+        M = attenuate(N, num_caveats, 1);
+        M = attenuate(M, num_caveats + 1, 1);
+        check(M, num_caveats + 2);
+        macaroon_destroy(M);
+    }
+
+    /* a long chain of shared attenuations reads without rewalking it */
+    M = create(0, 1);
+
+    for (num_caveats = 0; num_caveats < 20000; ++num_caveats)
+    {
+        M = attenuate(M, num_caveats * 3, 1);
+    }
+
+    caveats = malloc(num_caveats * sizeof(*caveats));
+    assert(caveats);
+    assert(macaroon_caveats(M, 0, caveats, num_caveats) == num_caveats);
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        check_caveat(&caveats[i], i * 3);
+    }
+
+    macaroon_caveat_cursor_init(&C, M);
+
+    for (i = 0; macaroon_caveat_cursor_next(&C, &caveat) == 0; ++i)
+    {
+        check_caveat(&caveat, i * 3);
+    }
+
+    assert(i == num_caveats);
+    assert(macaroon_num_third_party_caveats(M) == 0);
+
+    /* and serializes and copies in one pass too */
+    sz = macaroon_serialize_size_hint(M, MACAROON_V2);
+    buf = malloc(sz);
+    assert(buf);
+    sz = macaroon_serialize(M, MACAROON_V2, buf, sz, &err);
+    assert(sz > 0);
+    N = macaroon_deserialize(buf, sz, &err);
+    assert(N && macaroon_cmp(M, N) == 0);
+    macaroon_destroy(N);
+    N = macaroon_copy(M, &err);
+    assert(N && macaroon_cmp(M, N) == 0);
+    macaroon_destroy(N);
+    free(buf);
+    free(caveats);
+    macaroon_destroy(M);
+    return EXIT_SUCCESS;
+}
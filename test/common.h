@@ -0,0 +1,91 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef macaroons_test_common_h_
+#define macaroons_test_common_h_
+
+/* Helpers shared by the tests of the public API.  A test may define KEY or
+ * LOCATION before including this to mint its macaroons differently.
+ */
+
+/* C */
+#include <assert.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+
+#ifndef KEY
+#define KEY "this is the key"
+#endif
+#ifndef LOCATION
+#define LOCATION "http://example.org/"
+#endif
+#define STRLENOF(x) (sizeof(x) - 1)
+#define U(x) ((const unsigned char*)(x))
+/* not every test uses every helper */
+#define TEST_HELPER static __attribute__ ((unused))
+
+/* a macaroon at location with identifier id, minted with KEY */
+TEST_HELPER struct macaroon*
+create_root(const char* location, const char* id)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = macaroon_create(U(location), strlen(location),
+                                         U(KEY), STRLENOF(KEY),
+                                         U(id), strlen(id), &err);
+    assert(M);
+    return M;
+}
+
+/* M with a first-party caveat added; M is destroyed */
+TEST_HELPER struct macaroon*
+add_first_party(struct macaroon* M, const unsigned char* pred, size_t pred_sz)
+{
+    enum macaroon_returncode err;
+    struct macaroon* T = macaroon_add_first_party_caveat(M, pred, pred_sz, &err);
+    assert(T);
+    macaroon_destroy(M);
+    return T;
+}
+
+/* M with a third-party caveat added; M is destroyed */
+TEST_HELPER struct macaroon*
+add_third_party(struct macaroon* M, const char* location,
+                const char* key, const char* id)
+{
+    enum macaroon_returncode err;
+    struct macaroon* T = macaroon_add_third_party_caveat(M, U(location), strlen(location),
+                                                         U(key), strlen(key),
+                                                         U(id), strlen(id), &err);
+    assert(T);
+    macaroon_destroy(M);
+    return T;
+}
+
+#endif /* macaroons_test_common_h_ */
@@ -0,0 +1,759 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "base64.h"
+
+#define STRLENOF(x) (sizeof(x) - 1)
+#define U(x) ((const unsigned char*)(x))
+#define MAX_CAVEATS 8
+
+struct field
+{
+    const unsigned char* data;
+    size_t size;
+};
+
+struct fields
+{
+    struct field location;
+    struct field identifier;
+    struct field signature;
+    size_t num_caveats;
+    struct field cid[MAX_CAVEATS];
+    struct field vid[MAX_CAVEATS];
+    struct field cl[MAX_CAVEATS];
+};
+
+/* The parser that v2.c replaced, kept as the reference the new one must agree
+ * with.  It parses a writable copy of the input in place and reports slices of
+ * that copy.  Only what would crash or read uninitialized memory has changed:
+ * it checks bounds before reading the version and every string's opening
+ * quote, and a missing location is empty.
+ */
+
+static void
+ref_skip_whitespace(char** ptr, char* end)
+{
+    while (*ptr < end && isspace((unsigned char)**ptr))
+    {
+        ++*ptr;
+    }
+}
+
+static int
+ref_string(char** ptr, char* end, struct field* s)
+{
+    if (*ptr >= end || **ptr != '"') return -1;
+    ++*ptr;
+    s->data = (const unsigned char*)*ptr;
+
+    while (*ptr < end)
+    {
+        if (**ptr == '\\')
+        {
+            if (*ptr + 1 >= end) return -1;
+
+            if ((*ptr)[1] == 'u')
+            {
+                if (*ptr + 6 >= end) return -1;
+                *ptr += 6;
+            }
+            else
+            {
+                *ptr += 2;
+            }
+        }
+        else if (**ptr == '"')
+        {
+            break;
+        }
+        else
+        {
+            ++*ptr;
+        }
+    }
+
+    if (*ptr >= end) return -1;
+    **ptr = '\0';
+    s->size = (const unsigned char*)*ptr - s->data;
+    ++*ptr;
+    return 0;
+}
+
+static int
+ref_b64_decode(struct field* s)
+{
+    unsigned char* tmp = malloc(s->size + 1);
+    int ret;
+    assert(tmp);
+    ret = b64_pton((const char*)s->data, tmp, s->size);
+
+    if (ret >= 0)
+    {
+        memmove((unsigned char*)(uintptr_t)s->data, tmp, ret);
+        s->size = ret;
+    }
+
+    free(tmp);
+    return ret < 0 ? -1 : 0;
+}
+
+/* parse a key and the colon after it */
+static int
+ref_pair(char** ptr, char* end, struct field* key)
+{
+    ref_skip_whitespace(ptr, end);
+    if (ref_string(ptr, end, key) < 0) return -1;
+    ref_skip_whitespace(ptr, end);
+    if (*ptr >= end || **ptr != ':') return -1;
+    ++*ptr;
+    ref_skip_whitespace(ptr, end);
+    return 0;
+}
+
+static int
+ref_value(char** ptr, char* end, const struct field* key, char x,
+          struct field* s, int* seen)
+{
+    if (key->size == 1 && key->data[0] == x)
+    {
+        if (*seen || ref_string(ptr, end, s) < 0) return -1;
+        *seen = 1;
+        return 1;
+    }
+
+    if (key->size == 3 && key->data[0] == x && memcmp(key->data + 1, "64", 2) == 0)
+    {
+        if (*seen || ref_string(ptr, end, s) < 0 || ref_b64_decode(s) < 0) return -1;
+        *seen = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+ref_caveat(char** ptr, char* end, struct fields* F)
+{
+    const size_t n = F->num_caveats;
+    struct field key;
+    int seen_cid = 0;
+    int seen_vid = 0;
+    int seen_cl = 0;
+    int first = 1;
+    int rc;
+
+    if (*ptr >= end || **ptr != '{') return -1;
+    ++*ptr;
+
+    while (*ptr < end)
+    {
+        ref_skip_whitespace(ptr, end);
+        if (*ptr < end && **ptr == '}') break;
+
+        if (!first)
+        {
+            if (*ptr >= end || **ptr != ',') return -1;
+            ++*ptr;
+        }
+
+        first = 0;
+        if (ref_pair(ptr, end, &key) < 0) return -1;
+
+        if ((rc = ref_value(ptr, end, &key, 'i', &F->cid[n], &seen_cid)) == 0 &&
+            (rc = ref_value(ptr, end, &key, 'l', &F->cl[n], &seen_cl)) == 0 &&
+            (rc = ref_value(ptr, end, &key, 'v', &F->vid[n], &seen_vid)) == 0)
+        {
+            return -1;
+        }
+
+        if (rc < 0) return -1;
+    }
+
+    if (*ptr >= end || !seen_cid) return -1;
+    ++*ptr;
+    return 0;
+}
+
+static int
+ref_caveats(char** ptr, char* end, struct fields* F)
+{
+    if (*ptr >= end || **ptr != '[') return -1;
+    ++*ptr;
+    ref_skip_whitespace(ptr, end);
+
+    while (*ptr < end)
+    {
+        if (**ptr == ']') break;
+        if (F->num_caveats == MAX_CAVEATS) return -1;
+        if (ref_caveat(ptr, end, F) < 0) return -1;
+        ++F->num_caveats;
+        ref_skip_whitespace(ptr, end);
+        if (*ptr >= end) return -1;
+
+        if (**ptr == ',')
+        {
+            ++*ptr;
+            ref_skip_whitespace(ptr, end);
+        }
+        else if (**ptr != ']')
+        {
+            return -1;
+        }
+    }
+
+    if (*ptr >= end) return -1;
+    ++*ptr;
+    return 0;
+}
+
+static int
+ref_macaroon(char* ptr, char* end, struct fields* F)
+{
+    struct field key;
+    int seen_location = 0;
+    int seen_identifier = 0;
+    int seen_signature = 0;
+    int seen_caveats = 0;
+    int first = 1;
+    int rc;
+
+    memset(F, 0, sizeof(*F));
+    ref_skip_whitespace(&ptr, end);
+    if (ptr >= end || *ptr != '{') return -1;
+    ++ptr;
+
+    while (ptr < end)
+    {
+        ref_skip_whitespace(&ptr, end);
+        if (ptr < end && *ptr == '}') break;
+
+        if (!first)
+        {
+            if (ptr >= end || *ptr != ',') return -1;
+            ++ptr;
+        }
+
+        first = 0;
+        if (ref_pair(&ptr, end, &key) < 0) return -1;
+
+        if (key.size == 1 && key.data[0] == 'v')
+        {
+            if (ptr >= end || *ptr != '2') return -1;
+            ++ptr;
+            ref_skip_whitespace(&ptr, end);
+            continue;
+        }
+
+        if (key.size == 1 && key.data[0] == 'c')
+        {
+            if (seen_caveats || ref_caveats(&ptr, end, F) < 0) return -1;
+            seen_caveats = 1;
+            continue;
+        }
+
+        if ((rc = ref_value(&ptr, end, &key, 'i', &F->identifier, &seen_identifier)) == 0 &&
+            (rc = ref_value(&ptr, end, &key, 'l', &F->location, &seen_location)) == 0 &&
+            (rc = ref_value(&ptr, end, &key, 's', &F->signature, &seen_signature)) == 0)
+        {
+            return -1;
+        }
+
+        if (rc < 0) return -1;
+    }
+
+    if (ptr >= end) return -1;
+    ++ptr;
+    ref_skip_whitespace(&ptr, end);
+    if (ptr != end) return -1;
+    return seen_signature && seen_identifier && seen_caveats ? 0 : -1;
+}
+
+/* build the macaroon F describes by way of the binary format */
+static unsigned char*
+v2_field(unsigned char* ptr, unsigned type, const struct field* f, int required)
+{
+    size_t sz = f->size;
+
+    if (!required && !sz)
+    {
+        return ptr;
+    }
+
+    *ptr++ = type;
+
+    do
+    {
+        *ptr++ = (sz & 0x7f) | (sz > 0x7f ? 0x80 : 0);
+        sz >>= 7;
+    }
+    while (sz);
+
+    memmove(ptr, f->data, f->size);
+    return ptr + f->size;
+}
+
+static struct macaroon*
+from_fields(const struct fields* F)
+{
+    size_t sz = 64 + F->location.size + F->identifier.size + F->signature.size;
+    unsigned char* buf;
+    unsigned char* ptr;
+    struct macaroon* M;
+    enum macaroon_returncode err;
+    size_t i;
+
+    for (i = 0; i < F->num_caveats; ++i)
+    {
+        sz += 32 + F->cid[i].size + F->vid[i].size + F->cl[i].size;
+    }
+
+    buf = malloc(sz);
+    assert(buf);
+    ptr = buf;
+    *ptr++ = 2;
+    ptr = v2_field(ptr, 1, &F->location, 0);
+    ptr = v2_field(ptr, 2, &F->identifier, 1);
+    *ptr++ = 0;
+
+    for (i = 0; i < F->num_caveats; ++i)
+    {
+        ptr = v2_field(ptr, 1, &F->cl[i], 0);
+        ptr = v2_field(ptr, 2, &F->cid[i], 1);
+        ptr = v2_field(ptr, 4, &F->vid[i], 0);
+        *ptr++ = 0;
+    }
+
+    *ptr++ = 0;
+    ptr = v2_field(ptr, 6, &F->signature, 1);
+    assert((size_t)(ptr - buf) <= sz);
+    M = macaroon_deserialize(buf, ptr - buf, &err);
+    free(buf);
+    return M;
+}
+
+static struct macaroon*
+parse(const char* json, size_t json_sz)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = macaroon_deserialize(U(json), json_sz, &err);
+    assert(M || err == MACAROON_INVALID);
+    return M;
+}
+
+static int
+equivalent(const char* lhs, const char* rhs)
+{
+    struct macaroon* L = parse(lhs, strlen(lhs));
+    struct macaroon* R = parse(rhs, strlen(rhs));
+    int ret = L && R && macaroon_cmp(L, R) == 0;
+    macaroon_destroy(L);
+    macaroon_destroy(R);
+    return ret;
+}
+
+static int
+rejects(const char* json)
+{
+    struct macaroon* M = parse(json, strlen(json));
+    macaroon_destroy(M);
+    return M == NULL;
+}
+
+#define SIG "\"s64\":\"fN7nklEcW8b1KEhYBd_psk54XijiqZMB-dcRxgnjjvc\""
+#define SIG_STD "\"s64\":\"fN7nklEcW8b1KEhYBd/psk54XijiqZMB+dcRxgnjjvc=\""
+
+/* the serialization is exactly the size hinted, and parses back to M */
+static void
+serializes(const struct macaroon* M)
+{
+    enum macaroon_returncode err;
+    size_t sz = 0;
+    unsigned char* buf = macaroon_serialize_alloc(M, MACAROON_V2J, &sz, &err);
+    struct macaroon* N;
+
+    assert(buf);
+    assert(sz == macaroon_serialize_size_hint(M, MACAROON_V2J));
+    assert(macaroon_serialize(M, MACAROON_V2J, buf, sz - 1, &err) == 0);
+    assert(err == MACAROON_BUF_TOO_SMALL);
+    N = parse((const char*)buf, sz);
+    assert(N && macaroon_cmp(M, N) == 0);
+    macaroon_destroy(N);
+    macaroon_free(buf);
+}
+
+static void
+serializes_as(const char* id, size_t id_sz, const char* expected)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = macaroon_create(U("http://example.org/"), 19, U("key"), 3,
+                                         U(id), id_sz, &err);
+    size_t sz = 0;
+    unsigned char* buf;
+
+    assert(M);
+    buf = macaroon_serialize_alloc(M, MACAROON_V2J, &sz, &err);
+    assert(buf && sz > strlen(expected) && memcmp(buf, expected, strlen(expected)) == 0);
+    serializes(M);
+    macaroon_free(buf);
+    macaroon_destroy(M);
+}
+
+static void
+known_answers(void)
+{
+    /* the equivalent encodings from doc/format.txt */
+    const char* ou = "{\"v\":2,\"i\":\"x\",\"c\":[{\"i\":\"Ou?T\"}]," SIG "}";
+    assert(equivalent(ou, "{\"v\":2,\"i\":\"x\",\"c\":[{\"i64\":\"T3U/VA==\"}]," SIG "}"));
+    assert(equivalent(ou, "{\"v\":2,\"i\":\"x\",\"c\":[{\"i64\":\"T3U_VA==\"}]," SIG "}"));
+    assert(equivalent(ou, "{\"v\":2,\"i\":\"x\",\"c\":[{\"i64\":\"T3U/VA\"}]," SIG "}"));
+    assert(equivalent(ou, "{\"v\":2,\"i\":\"x\",\"c\":[{\"i64\":\"T3U_VA\"}]," SIG "}"));
+    assert(equivalent(ou, "{\"v\":2,\"i\":\"x\",\"c\":[{\"i64\":\"T3U\\/VA\"}]," SIG "}"));
+    assert(equivalent(ou, "{\"v\":\"2\",\"i\":\"x\",\"c\":[{\"i\":\"\\u004fu?T\"}]," SIG_STD "}"));
+    assert(equivalent(ou, "{\r\n\t\"c\" : [ { \"i\" : \"Ou?T\" } ] , " SIG " , \"i\":\"x\" } "));
+    assert(rejects("{\"v\":2,\"i\":\"x\",\"c\":[{\"i\":\"foo\",\"i64\":\"Zm9v\"}]," SIG "}"));
+
+    /* escapes decode to the bytes they stand for */
+    assert(equivalent("{\"i\":\"\\\"\\\\\\/\\b\\f\\n\\r\\t\",\"c\":[]," SIG "}",
+                      "{\"i64\":\"IlwvCAwKDQk=\",\"c\":[]," SIG "}"));
+    assert(equivalent("{\"i\":\"\\u00e9\\u20ac\\ud83d\\ude00\",\"c\":[]," SIG "}",
+                      "{\"i\":\"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\",\"c\":[]," SIG "}"));
+    assert(equivalent("{\"i\":\"\\u00E9\",\"c\":[]," SIG "}",
+                      "{\"i\":\"\\u00e9\",\"c\":[]," SIG "}"));
+    assert(equivalent("{\"\\u0069\":\"x\",\"c\":[]," SIG "}",
+                      "{\"i\":\"x\",\"c\":[]," SIG "}"));
+
+    /* only what must be escaped is, and only invalid UTF-8 falls back to
+     * base64 */
+    serializes_as("a\"b\\\n\x01\x7f/\xc3\xa9", 10,
+                  "{\"v\":2,\"l\":\"http://example.org/\",\"i\":\"a\\\"b\\\\\\n\\u0001\x7f/\xc3\xa9\",\"c\":[],\"s64\":\"");
+    serializes_as("\xff", 1, "{\"v\":2,\"l\":\"http://example.org/\",\"i64\":\"_w\",");
+    serializes_as("\xc0\x80", 2, "{\"v\":2,\"l\":\"http://example.org/\",\"i64\":\"wIA\",");
+    serializes_as("\xed\xa0\x80", 3, "{\"v\":2,\"l\":\"http://example.org/\",\"i64\":\"7aCA\",");
+    serializes_as("\xf0\x9f\x98", 3, "{\"v\":2,\"l\":\"http://example.org/\",\"i64\":\"8J-Y\",");
+
+    /* malformed documents */
+    assert(rejects(""));
+    assert(rejects("{}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[]}"));
+    assert(rejects("{\"i\":\"x\"," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[],\"s\":\"short\"}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[]," SIG "} x"));
+    assert(rejects("{\"i\":\"x\",\"c\":[]," SIG ",}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[{}]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[{\"l\":\"y\"}]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[{\"i\":\"y\"},]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[{\"i\":\"y\"} {\"i\":\"z\"}]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[],\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"i64\":\"eA\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"v\":3,\"i\":\"x\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"v\":\"23\",\"i\":\"x\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"a\nb\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"\\x\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"\\u00\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"\\ud83d\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"\\ude00\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[]," SIG "\\"));
+    assert(rejects("{\"i64\":\"eA=\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i64\":\"eB\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i64\":\"e A\",\"c\":[]," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[],\"q\":\"\"," SIG "}"));
+    assert(rejects("{\"i\":\"x\",\"c\":[],\"i6\":\"\"," SIG "}"));
+}
+
+/* random documents, with every value escaped at random, must decode to what
+ * was encoded
+ */
+static size_t
+random_bytes(unsigned char* buf, size_t max)
+{
+    static const char interesting[] = "\"\\/\b\f\n\r\t\x01\x1f\x7f ";
+    size_t sz = rand() % max;
+    size_t i;
+
+    for (i = 0; i < sz; ++i)
+    {
+        switch (rand() % 4)
+        {
+            case 0: buf[i] = interesting[rand() % STRLENOF(interesting)]; break;
+            case 1: buf[i] = 0x80 + rand() % 0x80; break;
+            default: buf[i] = 'a' + rand() % 26; break;
+        }
+    }
+
+    return sz;
+}
+
+static char*
+emit(char* ptr, const char* key, const struct field* f)
+{
+    size_t i;
+    int b64 = rand() % 3 == 0;
+
+    /* bytes above 0x7f only pass through as a string if they are valid UTF-8 */
+    for (i = 0; i < f->size; ++i)
+    {
+        b64 |= f->data[i] > 0x7f;
+    }
+
+    ptr += sprintf(ptr, "\"%s%s\":\"", key, b64 ? "64" : "");
+
+    if (b64)
+    {
+        int rc = b64_encode(f->data, f->size, ptr, 4 * f->size + 8,
+                            rand() % 2 ? B64_URL : B64_STD | (rand() % 2 ? B64_PADDED : 0));
+        assert(rc >= 0);
+        ptr += rc;
+    }
+    else
+    {
+        for (i = 0; i < f->size; ++i)
+        {
+            const unsigned char c = f->data[i];
+
+            if (c < 0x20 || c == '"' || c == '\\' || rand() % 8 == 0)
+            {
+                ptr += sprintf(ptr, rand() % 2 ? "\\u%04x" : "\\u%04X", c);
+            }
+            else if (c == '/' && rand() % 2)
+            {
+                ptr += sprintf(ptr, "\\/");
+            }
+            else
+            {
+                *ptr++ = c;
+            }
+        }
+    }
+
+    *ptr++ = '"';
+    return ptr;
+}
+
+static void
+round_trips(unsigned iterations)
+{
+    unsigned char bytes[MAX_CAVEATS * 3 + 3][16];
+    unsigned char sig[32];
+    char* json = malloc(65536);
+    struct fields F;
+    unsigned i;
+    size_t c;
+    assert(json);
+
+    for (i = 0; i < iterations; ++i)
+    {
+        char* ptr = json;
+        struct macaroon* M;
+        struct macaroon* N;
+
+        memset(&F, 0, sizeof(F));
+        F.location.data = bytes[0];
+        F.location.size = random_bytes(bytes[0], 16);
+        F.identifier.data = bytes[1];
+        F.identifier.size = random_bytes(bytes[1], 16);
+
+        for (c = 0; c < sizeof(sig); ++c)
+        {
+            sig[c] = rand();
+        }
+
+        F.signature.data = sig;
+        F.signature.size = sizeof(sig);
+        F.num_caveats = rand() % MAX_CAVEATS;
+        ptr += sprintf(ptr, "{\"v\":2,");
+        ptr = emit(ptr, "i", &F.identifier);
+
+        if (F.location.size)
+        {
+            *ptr++ = ',';
+            ptr = emit(ptr, "l", &F.location);
+        }
+
+        ptr += sprintf(ptr, ",\"c\":[");
+
+        for (c = 0; c < F.num_caveats; ++c)
+        {
+            F.cid[c].data = bytes[3 * c + 2];
+            F.cid[c].size = 1 + random_bytes(bytes[3 * c + 2], 15);
+            bytes[3 * c + 2][0] = 'c';
+            ptr += sprintf(ptr, "%s{", c ? "," : "");
+            ptr = emit(ptr, "i", &F.cid[c]);
+
+            if (rand() % 2)
+            {
+                F.vid[c].data = bytes[3 * c + 3];
+                F.vid[c].size = 1 + random_bytes(bytes[3 * c + 3], 15);
+                F.cl[c].data = bytes[3 * c + 4];
+                F.cl[c].size = 1 + random_bytes(bytes[3 * c + 4], 15);
+                *ptr++ = ',';
+                ptr = emit(ptr, "v", &F.vid[c]);
+                *ptr++ = ',';
+                ptr = emit(ptr, "l", &F.cl[c]);
+            }
+
+            *ptr++ = '}';
+        }
+
+        ptr += sprintf(ptr, "],");
+        ptr = emit(ptr, "s", &F.signature);
+        *ptr++ = '}';
+
+        M = parse(json, ptr - json);
+        N = from_fields(&F);
+        assert(M && N && macaroon_cmp(M, N) == 0);
+        macaroon_destroy(M);
+        serializes(N);
+        macaroon_destroy(N);
+    }
+
+    free(json);
+}
+
+/* mutated documents must be accepted or rejected exactly as the reference
+ * does, and decode to the same macaroon; the alphabet leaves out whitespace,
+ * backslashes and padding, where the reference is knowingly more lenient
+ */
+static const char* const seeds[] = {
+    "{\"v\":2,\"l\":\"http://example.org/\",\"i\":\"keyid\",\"c\":[]," SIG "}",
+    "{\"v\":2,\"i64\":\"a2V5aWQ\",\"c\":[{\"i\":\"account = 3735928559\"},{\"i\":\"user = alice\"}]," SIG "}",
+    "{ \"c\" : [ { \"i\" : \"third\" , \"v64\" : \"dmlk\" , \"l\" : \"there\" } ] , \"i\" : \"id\" , \"s\" : \"0123456789abcdef0123456789abcdef\" }",
+};
+
+static int
+trailing_comma(const char* json, size_t sz)
+{
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < sz; ++i)
+    {
+        for (j = i + 1; json[i] == ',' && j < sz && isspace((unsigned char)json[j]); ++j)
+        {
+        }
+
+        if (json[i] == ',' && j < sz && json[j] == ']')
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+mutations(unsigned iterations)
+{
+    static const char alphabet[] = "{}[]:,\"2vilcs64aAzZ09+/-_";
+    char json[512];
+    char copy[512];
+    struct fields F;
+    unsigned i;
+
+    for (i = 0; i < iterations; ++i)
+    {
+        const char* seed = seeds[rand() % (sizeof(seeds) / sizeof(seeds[0]))];
+        size_t sz = strlen(seed);
+        unsigned n = rand() % 4;
+        struct macaroon* M;
+        struct macaroon* N;
+        int ref;
+
+        memmove(json, seed, sz);
+
+        while (n--)
+        {
+            json[rand() % sz] = alphabet[rand() % STRLENOF(alphabet)];
+        }
+
+        if (rand() % 4 == 0)
+        {
+            sz = rand() % sz;
+        }
+
+        memmove(copy, json, sz);
+        ref = ref_macaroon(copy, copy + sz, &F);
+
+        /* the reference never checked the signature's length, and allowed a
+         * trailing comma in the caveat list */
+        if (ref == 0 && F.signature.size != 32)
+        {
+            ref = -1;
+        }
+
+        M = parse(json, sz);
+
+        if (ref == 0 && !M && trailing_comma(json, sz))
+        {
+            ref = -1;
+        }
+
+        assert((ref == 0) == (M != NULL));
+
+        if (M && (N = from_fields(&F)))
+        {
+            assert(macaroon_cmp(M, N) == 0);
+            macaroon_destroy(N);
+        }
+
+        macaroon_destroy(M);
+    }
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    (void)argc;
+    (void)argv;
+
+    if (!macaroon_deserialize(U("{}"), 2, &err) && err == MACAROON_NO_JSON_SUPPORT)
+    {
+        return 77;
+    }
+
+    srand(0x6a736f6e);
+    known_answers();
+    round_trips(10000);
+    mutations(100000);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+static struct macaroon*
+create(void)
+{
+    struct macaroon* M = create_root(LOCATION, "keyid \"{[\\");
+    char caveat[200];
+    unsigned i;
+
+    /* long enough that field lengths need multi-byte varints */
+    for (i = 0; i < 20; ++i)
+    {
+        memset(caveat, 'a' + i, sizeof(caveat));
+        M = add_first_party(M, U(caveat), i == 0 ? sizeof(caveat) : 64);
+    }
+
+    return add_third_party(M, "remote", "shared", "3rd}]\"");
+}
+
+/* feed the token and a trailer in random chunks; the parser must stop exactly
+ * at the end of the token
+ */
+static void
+chunked(const struct macaroon* M, enum macaroon_format f, unsigned seed)
+{
+    enum macaroon_returncode err;
+    struct macaroon_parser* P = macaroon_parser_create(65536);
+    unsigned char* tmp;
+    unsigned char* buf;
+    size_t sz = 0;
+    size_t off = 0;
+    size_t consumed;
+    int rc = 0;
+    struct macaroon* N;
+
+    srand(seed);
+    tmp = macaroon_serialize_alloc(M, f, &sz, &err);
+    assert(tmp && P);
+    buf = malloc(sz + 3);
+    assert(buf);
+    memmove(buf, tmp, sz);
+    memmove(buf + sz, "\x02{x", 3);
+    macaroon_free(tmp);
+
+    while (off < (f == MACAROON_V1 ? sz : sz + 3))
+    {
+        size_t chunk = 1 + rand() % 64;
+        size_t end = f == MACAROON_V1 ? sz : sz + 3;
+        chunk = chunk < end - off ? chunk : end - off;
+        rc = macaroon_parser_feed(P, buf + off, chunk, &consumed, &err);
+        assert(rc >= 0 && consumed <= chunk);
+        off += consumed;
+
+        if (rc == 1)
+        {
+            break;
+        }
+
+        assert(consumed == chunk);
+    }
+
+    assert(f == MACAROON_V1 ? rc == 0 : rc == 1);
+    assert(off == sz);
+    N = macaroon_parser_finish(P, &err);
+    assert(N && macaroon_cmp(M, N) == 0);
+    macaroon_destroy(N);
+
+    /* a truncated token is not a macaroon, and the parser is reusable */
+    if (f != MACAROON_V1)
+    {
+        assert(macaroon_parser_feed(P, buf, sz - 1, &consumed, &err) == 0);
+        assert(consumed == sz - 1);
+        assert(macaroon_parser_finish(P, &err) == NULL && err == MACAROON_INVALID);
+        assert(macaroon_parser_feed(P, buf, sz, &consumed, &err) == 1);
+        N = macaroon_parser_finish(P, &err);
+        assert(N && macaroon_cmp(M, N) == 0);
+        macaroon_destroy(N);
+    }
+
+    macaroon_parser_destroy(P);
+
+    /* the cap bounds what is buffered, and the failure holds until finish */
+    P = macaroon_parser_create(sz - 1);
+    assert(P);
+    assert(macaroon_parser_feed(P, buf, sz, &consumed, &err) < 0 && err == MACAROON_INVALID);
+    err = MACAROON_SUCCESS;
+    assert(macaroon_parser_feed(P, buf, 1, &consumed, &err) < 0 && err == MACAROON_INVALID);
+    assert(consumed == 0);
+    assert(macaroon_parser_finish(P, &err) == NULL && err == MACAROON_INVALID);
+
+    if (f != MACAROON_V1)
+    {
+        assert(macaroon_parser_feed(P, buf, sz - 1, &consumed, &err) == 0);
+        assert(macaroon_parser_finish(P, &err) == NULL && err == MACAROON_INVALID);
+    }
+
+    macaroon_parser_destroy(P);
+    free(buf);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    struct macaroon_parser* P;
+    struct macaroon* M = create();
+    size_t consumed;
+    unsigned seed;
+    (void)argc;
+    (void)argv;
+
+    for (seed = 0; seed < 64; ++seed)
+    {
+        chunked(M, MACAROON_V1, seed);
+        chunked(M, MACAROON_V2, seed);
+
+        if (macaroon_serialize_size_hint(M, MACAROON_V2J))
+        {
+            chunked(M, MACAROON_V2J, seed);
+        }
+    }
+
+    /* a V2 length beyond the cap fails before the payload arrives */
+    P = macaroon_parser_create(1024);
+    assert(P);
+    assert(macaroon_parser_feed(P, U("\x02\x02\xff\xff\x03"), 5, &consumed, &err) < 0);
+    macaroon_parser_destroy(P);
+
+    P = macaroon_parser_create(1024);
+    assert(P);
+    assert(macaroon_parser_finish(P, &err) == NULL && err == MACAROON_INVALID);
+
+    if (macaroon_serialize_size_hint(M, MACAROON_V2J))
+    {
+        assert(macaroon_parser_feed(P, U("{}}"), 3, &consumed, &err) == 1 && consumed == 2);
+        assert(macaroon_parser_finish(P, &err) == NULL && err == MACAROON_INVALID);
+    }
+
+    macaroon_parser_destroy(P);
+    macaroon_destroy(M);
+    return 0;
+}
@@ -0,0 +1,365 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+#define IDENTIFIER "keyid"
+
+static struct macaroon*
+create_with_caveats(unsigned num_caveats, size_t caveat_sz)
+{
+    struct macaroon* M = create_root(LOCATION, IDENTIFIER);
+    char* pred = malloc(caveat_sz + 1);
+    unsigned i;
+
+    assert(pred);
+
+    for (i = 0; i < num_caveats; ++i)
+    {
+        memset(pred, 'a' + i % 26, caveat_sz);
+        snprintf(pred, caveat_sz + 1, "caveat %u", i);
+        pred[strlen(pred)] = ' ';
+        M = add_first_party(M, U(pred), caveat_sz);
+    }
+
+    free(pred);
+    return add_third_party(M, "http://auth.example/", "third party key", "third party id");
+}
+
+/* the iovecs for N gather to the V2 serialization of M */
+static void
+check_iov(const struct macaroon* M, const struct macaroon* N)
+{
+    enum macaroon_returncode err;
+    struct iovec* iov = NULL;
+    unsigned char* scratch = NULL;
+    size_t iov_sz = 0;
+    size_t scratch_sz = 0;
+    size_t sz = macaroon_serialize_size_hint(M, MACAROON_V2);
+    unsigned char* buf = malloc(sz);
+    size_t off = 0;
+    size_t i;
+
+    assert(buf);
+    assert(macaroon_serialize(M, MACAROON_V2, buf, sz, &err) == sz);
+    assert(macaroon_serialize_iov(N, MACAROON_V2, NULL, &iov_sz, NULL, &scratch_sz, &err) < 0);
+    assert(err == MACAROON_BUF_TOO_SMALL);
+    iov = malloc(iov_sz * sizeof(struct iovec));
+    scratch = malloc(scratch_sz);
+    assert(iov && scratch);
+    assert(macaroon_serialize_iov(N, MACAROON_V2, iov, &iov_sz, scratch, &scratch_sz, &err) == 0);
+
+    for (i = 0; i < iov_sz; ++i)
+    {
+        assert(iov[i].iov_len > 0);
+        assert(off + iov[i].iov_len <= sz);
+        assert(memcmp(buf + off, iov[i].iov_base, iov[i].iov_len) == 0);
+        off += iov[i].iov_len;
+    }
+
+    assert(off == sz);
+    free(buf);
+    free(iov);
+    free(scratch);
+}
+
+/* the same macaroon in two representations must be indistinguishable */
+static void
+check_equivalent(const struct macaroon* M, const struct macaroon* N)
+{
+    enum macaroon_returncode err;
+    enum macaroon_format formats[] = {MACAROON_V1, MACAROON_V2};
+    unsigned char* buf1;
+    unsigned char* buf2;
+    const unsigned char* loc1;
+    const unsigned char* loc2;
+    const unsigned char* id1;
+    const unsigned char* id2;
+    size_t loc1_sz, loc2_sz, id1_sz, id2_sz;
+    size_t sz1;
+    size_t sz2;
+    unsigned i;
+
+    assert(macaroon_cmp(M, N) == 0);
+    assert(macaroon_num_third_party_caveats(M) == macaroon_num_third_party_caveats(N));
+    assert(macaroon_third_party_caveat(M, 0, &loc1, &loc1_sz, &id1, &id1_sz) == 0);
+    assert(macaroon_third_party_caveat(N, 0, &loc2, &loc2_sz, &id2, &id2_sz) == 0);
+    assert(loc1_sz == loc2_sz && memcmp(loc1, loc2, loc1_sz) == 0);
+    assert(id1_sz == id2_sz && memcmp(id1, id2, id1_sz) == 0);
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+    {
+        sz1 = macaroon_serialize_size_hint(M, formats[i]);
+        sz2 = macaroon_serialize_size_hint(N, formats[i]);
+        assert(sz1 == sz2);
+        buf1 = malloc(sz1);
+        buf2 = malloc(sz2);
+        assert(buf1 && buf2);
+        sz1 = macaroon_serialize(M, formats[i], buf1, sz1, &err);
+        sz2 = macaroon_serialize(N, formats[i], buf2, sz2, &err);
+        assert(sz1 > 0 && sz1 == sz2 && memcmp(buf1, buf2, sz1) == 0);
+        free(buf1);
+        free(buf2);
+    }
+
+    check_iov(M, N);
+}
+
+static void
+compact(unsigned num_caveats, size_t caveat_sz)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = create_with_caveats(num_caveats, caveat_sz);
+    struct macaroon* C = macaroon_compact(M, &err);
+    struct macaroon* D = NULL;
+    assert(C);
+    check_equivalent(M, C);
+
+    /* derived macaroons and copies of a compact macaroon are ordinary */
+    D = macaroon_add_first_party_caveat(C, U("derived"), 7, &err);
+    assert(D);
+    macaroon_destroy(M);
+    M = macaroon_add_first_party_caveat(C, U("derived"), 7, &err);
+    assert(M);
+    check_equivalent(M, D);
+    macaroon_destroy(D);
+    D = macaroon_copy(C, &err);
+    assert(D);
+    check_equivalent(C, D);
+
+    macaroon_destroy(D);
+    macaroon_destroy(C);
+    macaroon_destroy(M);
+}
+
+static void
+shared(unsigned num_caveats, unsigned depth)
+{
+    enum macaroon_returncode err;
+    struct macaroon* P = create_with_caveats(num_caveats, 32);
+    struct macaroon* M = NULL;
+    struct macaroon* S = NULL;
+    struct macaroon* T = NULL;
+    struct macaroon* C = NULL;
+    char pred[32];
+    unsigned i;
+
+    M = macaroon_copy(P, &err);
+    S = macaroon_copy(P, &err);
+    assert(M && S);
+
+    for (i = 0; i < depth; ++i)
+    {
+        snprintf(pred, sizeof(pred), "depth = %u", i);
+        M = add_first_party(M, U(pred), strlen(pred));
+        T = macaroon_add_first_party_caveat_shared(S, U(pred), strlen(pred), &err);
+        assert(T);
+        /* the child keeps its parent alive */
+        macaroon_destroy(S);
+        S = T;
+    }
+
+    check_equivalent(M, S);
+    C = macaroon_copy(S, &err);
+    assert(C);
+    check_equivalent(M, C);
+    macaroon_destroy(C);
+    C = macaroon_compact(S, &err);
+    assert(C);
+    check_equivalent(M, C);
+    macaroon_destroy(C);
+
+    /* siblings sharing one parent */
+    C = macaroon_add_first_party_caveat_shared(P, U("sibling = 1"), 11, &err);
+    T = macaroon_add_first_party_caveat_shared(P, U("sibling = 2"), 11, &err);
+    assert(C && T);
+    macaroon_destroy(P);
+    P = macaroon_add_first_party_caveat_shared(C, U("sibling = 1"), 11, &err);
+    assert(P);
+    macaroon_destroy(P);
+    macaroon_destroy(C);
+    macaroon_destroy(T);
+
+    macaroon_destroy(M);
+    macaroon_destroy(S);
+}
+
+static void
+batch(unsigned n)
+{
+    enum macaroon_returncode err;
+    struct macaroon* M = create_with_caveats(3, 16);
+    struct macaroon* D[16];
+    struct macaroon* B[16];
+    struct macaroon* P = NULL;
+    const struct macaroon* R = NULL;
+    unsigned char buf1[4096];
+    unsigned char buf2[4096];
+    size_t sz1 = 0;
+    size_t sz2 = 0;
+    unsigned i;
+
+    assert(n <= 16);
+
+    for (i = 0; i < n; ++i)
+    {
+        D[i] = create_with_caveats(i, 8 * i);
+    }
+
+    assert(macaroon_prepare_for_request_batch(M, (const struct macaroon* const*)D, n, B, &err) == 0);
+
+    for (i = 0; i < n; ++i)
+    {
+        P = macaroon_prepare_for_request(M, D[i], &err);
+        assert(P);
+        check_equivalent(B[i], P);
+        sz1 = macaroon_serialize(P, MACAROON_V2, buf1, sizeof(buf1), &err);
+        sz2 = macaroon_serialize_for_request(M, D[i], MACAROON_V2, buf2, sizeof(buf2), &err);
+        assert(sz1 > 0 && sz1 == sz2 && memcmp(buf1, buf2, sz1) == 0);
+        sz1 = macaroon_serialize(P, MACAROON_V1, buf1, sizeof(buf1), &err);
+        sz2 = macaroon_serialize_for_request(M, D[i], MACAROON_V1, buf2, sizeof(buf2), &err);
+        assert(sz1 > 0 && sz1 == sz2 && memcmp(buf1, buf2, sz1) == 0);
+        macaroon_destroy(P);
+    }
+
+    /* the block outlives whichever member is destroyed first */
+    if (n > 1)
+    {
+        R = macaroon_retain(B[n - 1]);
+        macaroon_destroy(B[0]);
+        macaroon_destroy(B[n - 1]);
+        check_equivalent(R, R);
+        macaroon_release(R);
+        B[0] = B[n - 1] = NULL;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        macaroon_destroy(B[i]);
+        macaroon_destroy(D[i]);
+    }
+
+    macaroon_destroy(M);
+}
+
+#define THREADS 8
+#define ROUNDS 1000
+
+static void*
+reader(void* arg)
+{
+    const struct macaroon* M = arg;
+    const unsigned char* sig = NULL;
+    size_t sig_sz = 0;
+    unsigned i;
+
+    for (i = 0; i < ROUNDS; ++i)
+    {
+        const struct macaroon* R = macaroon_retain(M);
+        assert(R == M);
+        macaroon_signature(R, &sig, &sig_sz);
+        assert(sig_sz == 32);
+        macaroon_release(R);
+    }
+
+    /* drop the reference taken for this thread */
+    macaroon_release(M);
+    return NULL;
+}
+
+static void
+retained(void)
+{
+    enum macaroon_returncode err;
+    pthread_t threads[THREADS];
+    struct macaroon* M = create_with_caveats(10, 32);
+    unsigned char buf[2048];
+    size_t mem[256];
+    const struct macaroon* V = NULL;
+    size_t sz = 0;
+    unsigned i;
+
+    for (i = 0; i < THREADS; ++i)
+    {
+        macaroon_retain(M);
+        assert(pthread_create(&threads[i], NULL, reader, M) == 0);
+    }
+
+    /* the creator's reference may go first */
+    macaroon_destroy(M);
+
+    for (i = 0; i < THREADS; ++i)
+    {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* caller memory is not counted */
+    M = create_with_caveats(2, 8);
+    sz = macaroon_serialize(M, MACAROON_V2, buf, sizeof(buf), &err);
+    assert(sz > 0);
+    V = macaroon_deserialize_into(buf, sz, mem, sizeof(mem), &err);
+    assert(V);
+    assert(macaroon_retain(V) == V);
+    macaroon_release(V);
+    macaroon_release(V);
+    macaroon_destroy(M);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    (void)argc;
+    (void)argv;
+    compact(0, 0);
+    compact(10, 32);
+    compact(200, 64);
+    /* a body past 64KB switches to 32-bit offsets */
+    compact(4, 30000);
+    shared(0, 1);
+    shared(10, 1);
+    shared(10, 50);
+    retained();
+    batch(0);
+    batch(1);
+    batch(8);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "slab.h"
+
+/* port.c scrubs with explicit_bzero; a plain memset will do here */
+void
+macaroon_memzero(void* data, size_t data_sz)
+{
+    memset(data, 0, data_sz);
+}
+
+static void
+fill(unsigned char* p, size_t sz)
+{
+    size_t i;
+
+    for (i = 0; i < sz; ++i)
+    {
+        p[i] = (unsigned char)(i + 1);
+    }
+}
+
+static void
+check_zero(const unsigned char* p, size_t sz)
+{
+    size_t i;
+
+    for (i = 0; i < sz; ++i)
+    {
+        assert(p[i] == 0);
+    }
+}
+
+/* a freed block comes back for the next request of its class, scrubbed */
+static void
+reuse(size_t sz)
+{
+    unsigned char* p = macaroon_slab_alloc(sz);
+    unsigned char* q = NULL;
+
+    assert(p);
+    assert((uintptr_t)p % sizeof(void*) == 0);
+    fill(p, sz);
+    macaroon_slab_free(p);
+    q = macaroon_slab_alloc(sz);
+    assert(q == p);
+    check_zero(q, sz);
+    macaroon_slab_free(q);
+}
+
+static void
+grow(void)
+{
+    unsigned char* p = macaroon_slab_alloc(10);
+    size_t i;
+
+    assert(p);
+    fill(p, 10);
+    /* within the class: no move */
+    assert(macaroon_slab_realloc(p, MACAROON_SLAB_MIN) == p);
+    p = macaroon_slab_realloc(p, 3 * MACAROON_SLAB_MAX);
+    assert(p);
+
+    for (i = 0; i < 10; ++i)
+    {
+        assert(p[i] == (unsigned char)(i + 1));
+    }
+
+    macaroon_slab_free(p);
+    p = macaroon_slab_realloc(NULL, 100);
+    assert(p);
+    macaroon_slab_free(p);
+    macaroon_slab_free(NULL);
+}
+
+static void
+shrink(void)
+{
+    unsigned char* p = macaroon_slab_alloc(MACAROON_SLAB_MAX);
+    unsigned char* q = NULL;
+    size_t i;
+
+    assert(p);
+    fill(p, MACAROON_SLAB_MAX);
+    /* still more than half used: no move */
+    assert(macaroon_slab_realloc(p, MACAROON_SLAB_MAX / 2 + 1) == p);
+    /* a smaller class, keeping the prefix */
+    q = macaroon_slab_realloc(p, 266);
+    assert(q && q != p);
+
+    for (i = 0; i < 266; ++i)
+    {
+        assert(q[i] == (unsigned char)(i + 1));
+    }
+
+    /* and back out of the cache when asked for that class */
+    assert(macaroon_slab_alloc(MACAROON_SLAB_MAX) == p);
+    macaroon_slab_free(p);
+    macaroon_slab_free(q);
+
+    /* large blocks shrink in place or through the system */
+    p = macaroon_slab_alloc(4 * MACAROON_SLAB_MAX);
+    assert(p);
+    fill(p, 4 * MACAROON_SLAB_MAX);
+    p = macaroon_slab_realloc(p, 100);
+    assert(p);
+
+    for (i = 0; i < 100; ++i)
+    {
+        assert(p[i] == (unsigned char)(i + 1));
+    }
+
+    macaroon_slab_free(p);
+}
+
+static void
+limit(void)
+{
+    unsigned char* blocks[64];
+    unsigned i;
+
+    /* more than the limit may be live; only the excess is released on free */
+    macaroon_set_slab_limit(4 * MACAROON_SLAB_MAX);
+
+    for (i = 0; i < 64; ++i)
+    {
+        blocks[i] = macaroon_slab_alloc(MACAROON_SLAB_MAX);
+        assert(blocks[i]);
+    }
+
+    for (i = 0; i < 64; ++i)
+    {
+        macaroon_slab_free(blocks[i]);
+    }
+
+    macaroon_set_slab_limit(0);
+    blocks[0] = macaroon_slab_alloc(MACAROON_SLAB_MIN);
+    macaroon_slab_free(blocks[0]);
+    macaroon_set_slab_limit(MACAROON_SLAB_LIMIT);
+}
+
+/* a thread's cache is released when it exits */
+static void*
+worker(void* arg)
+{
+    unsigned i;
+    (void) arg;
+
+    for (i = 0; i < 100; ++i)
+    {
+        macaroon_slab_free(macaroon_slab_alloc(i * 40));
+    }
+
+    reuse(100);
+    return NULL;
+}
+
+int
+main(int argc, const char* argv[])
+{
+    pthread_t threads[4];
+    unsigned i;
+    (void)argc;
+    (void)argv;
+    reuse(1);
+    reuse(MACAROON_SLAB_MIN);
+    reuse(MACAROON_SLAB_MIN + 1);
+    reuse(MACAROON_SLAB_MAX);
+    grow();
+    shrink();
+    limit();
+
+    for (i = 0; i < 4; ++i)
+    {
+        assert(pthread_create(&threads[i], NULL, worker, NULL) == 0);
+    }
+
+    for (i = 0; i < 4; ++i)
+    {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    return 0;
+}
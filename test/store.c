@@ -0,0 +1,138 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+#define NUM_MACAROONS 1000
+
+static struct macaroon*
+create(unsigned i, const char* caveat)
+{
+    char id[32];
+
+    snprintf(id, sizeof(id), "id %u", i);
+    return add_first_party(create_root(LOCATION, id), U(caveat), strlen(caveat));
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    char path[] = "test-store.XXXXXX";
+    struct macaroon** macaroons = malloc(NUM_MACAROONS * sizeof(struct macaroon*));
+    struct macaroon_store_builder* B = NULL;
+    struct macaroon_store* S = NULL;
+    struct macaroon* M = NULL;
+    struct macaroon* dup = NULL;
+    char id[32];
+    FILE* fp = NULL;
+    int fd = mkstemp(path);
+    unsigned i;
+
+    assert(macaroons && fd >= 0);
+    close(fd);
+
+    /* an empty store is valid */
+    B = macaroon_store_builder_create(path, &err);
+    assert(B);
+    assert(macaroon_store_builder_finish(B, &err) == 0);
+    S = macaroon_store_open(path, &err);
+    assert(S && macaroon_store_size(S) == 0);
+    assert(macaroon_store_get(S, U("id 0"), 4, &err) == NULL && err == MACAROON_SUCCESS);
+    macaroon_store_close(S);
+
+    B = macaroon_store_builder_create(path, &err);
+    assert(B);
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        macaroons[i] = create(i, "first");
+        assert(macaroon_store_builder_add(B, macaroons[i], &err) == 0);
+    }
+
+    /* the first macaroon added with an identifier wins */
+    dup = create(7, "second");
+    assert(macaroon_store_builder_add(B, dup, &err) == 0);
+
+    /* unfinished stores do not open */
+    assert(macaroon_store_open(path, &err) == NULL);
+    assert(macaroon_store_builder_finish(B, &err) == 0);
+
+    S = macaroon_store_open(path, &err);
+    assert(S);
+    assert(macaroon_store_size(S) == NUM_MACAROONS + 1);
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        snprintf(id, sizeof(id), "id %u", i);
+        M = macaroon_store_get(S, U(id), strlen(id), &err);
+        assert(M);
+        assert(macaroon_cmp(M, macaroons[i]) == 0);
+        macaroon_destroy(M);
+    }
+
+    assert(macaroon_store_get(S, U("id 1000000"), 10, &err) == NULL);
+    assert(err == MACAROON_SUCCESS);
+    macaroon_store_close(S);
+
+    /* a truncated file is rejected */
+    fp = fopen(path, "r+b");
+    assert(fp);
+    assert(ftruncate(fileno(fp), 100) == 0);
+    fclose(fp);
+    assert(macaroon_store_open(path, &err) == NULL);
+    assert(err == MACAROON_INVALID);
+
+    assert(macaroon_store_open("/nonexistent/store", &err) == NULL);
+    assert(macaroon_store_builder_create("/nonexistent/store", &err) == NULL);
+    unlink(path);
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        macaroon_destroy(macaroons[i]);
+    }
+
+    macaroon_destroy(dup);
+    free(macaroons);
+    (void) argc;
+    (void) argv;
+    return EXIT_SUCCESS;
+}
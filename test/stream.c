@@ -0,0 +1,260 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* macaroons */
+#include "macaroons.h"
+#include "common.h"
+
+/* enough to span several chunks of the reader */
+#define NUM_MACAROONS 20000
+
+static struct macaroon** macaroons;
+static unsigned* seen;
+
+struct output
+{
+    unsigned char* data;
+    size_t size;
+    size_t cap;
+};
+
+static int
+collect(void* arg, const unsigned char* data, size_t data_sz)
+{
+    struct output* out = arg;
+
+    while (out->size + data_sz > out->cap)
+    {
+        out->cap = out->cap ? out->cap * 2 : 4096;
+        out->data = realloc(out->data, out->cap);
+        assert(out->data);
+    }
+
+    memcpy(out->data + out->size, data, data_sz);
+    out->size += data_sz;
+    return 0;
+}
+
+static void
+setup(void)
+{
+    char id[32];
+    unsigned i;
+    unsigned j;
+
+    macaroons = malloc(NUM_MACAROONS * sizeof(struct macaroon*));
+    seen = malloc(NUM_MACAROONS * sizeof(unsigned));
+    assert(macaroons && seen);
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        snprintf(id, sizeof(id), "token %u", i);
+        macaroons[i] = create_root(LOCATION, id);
+
+        for (j = 0; j < i % 4; ++j)
+        {
+            macaroons[i] = add_first_party(macaroons[i], U("account = 3735928559"), 20);
+        }
+    }
+}
+
+/* the stream, written one macaroon at a time */
+static void
+expected(enum macaroon_format f, enum macaroon_stream_framing framing, struct output* out)
+{
+    enum macaroon_returncode err;
+    unsigned char buf[1024];
+    unsigned char len[2];
+    size_t sz;
+    unsigned i;
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        sz = macaroon_serialize(macaroons[i], f, buf, sizeof(buf), &err);
+        assert(sz > 0 && sz < 16384);
+
+        if (framing == MACAROON_STREAM_LENGTH)
+        {
+            len[0] = sz < 128 ? sz : (sz & 0x7f) | 0x80;
+            len[1] = sz >> 7;
+            collect(out, len, sz < 128 ? 1 : 2);
+        }
+
+        collect(out, buf, sz);
+
+        if (framing == MACAROON_STREAM_LINES)
+        {
+            collect(out, U("\n"), 1);
+        }
+    }
+}
+
+static int
+check(void* arg, size_t offset, struct macaroon** MS, size_t MS_sz)
+{
+    const unsigned char* id = NULL;
+    size_t id_sz = 0;
+    char digits[16];
+    unsigned idx;
+    size_t i;
+
+    for (i = 0; i < MS_sz; ++i)
+    {
+        if (!MS[i])
+        {
+            __atomic_add_fetch((unsigned*)arg, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        macaroon_identifier(MS[i], &id, &id_sz);
+        assert(id_sz > 6 && id_sz < 6 + sizeof(digits) && memcmp(id, "token ", 6) == 0);
+        memcpy(digits, id + 6, id_sz - 6);
+        digits[id_sz - 6] = '\0';
+        idx = (unsigned)strtoul(digits, NULL, 10);
+        assert(idx < NUM_MACAROONS);
+        assert(macaroon_cmp(MS[i], macaroons[idx]) == 0);
+        __atomic_add_fetch(&seen[idx], 1, __ATOMIC_RELAXED);
+    }
+
+    (void) offset;
+    return 0;
+}
+
+static int
+stop(void* arg, size_t offset, struct macaroon** MS, size_t MS_sz)
+{
+    (void) arg;
+    (void) offset;
+    (void) MS;
+    (void) MS_sz;
+    return 1;
+}
+
+static void
+read_all(const struct output* out, enum macaroon_stream_framing framing,
+         unsigned flags, unsigned invalid)
+{
+    enum macaroon_returncode err;
+    unsigned failed = 0;
+    unsigned i;
+
+    memset(seen, 0, NUM_MACAROONS * sizeof(unsigned));
+    assert(macaroon_stream_read(out->data, out->size, framing, flags, 4, 64,
+                                check, &failed, &err) == 0);
+    assert(failed == invalid);
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        assert(seen[i] == 1);
+    }
+}
+
+static void
+round_trip(enum macaroon_format f, enum macaroon_stream_framing framing, unsigned flags)
+{
+    enum macaroon_returncode err;
+    struct output out;
+    struct output ref;
+
+    memset(&out, 0, sizeof(out));
+    memset(&ref, 0, sizeof(ref));
+    assert(macaroon_stream_write((const struct macaroon* const*)macaroons, NUM_MACAROONS,
+                                 f, framing, 4, collect, &out, &err) == 0);
+    expected(f, framing, &ref);
+    assert(out.size == ref.size && memcmp(out.data, ref.data, out.size) == 0);
+    read_all(&out, framing, flags, 0);
+    assert(macaroon_stream_read(out.data, out.size, framing, flags, 4, 64,
+                                stop, NULL, &err) == 1);
+
+    if (framing == MACAROON_STREAM_LENGTH)
+    {
+        assert(macaroon_stream_read(out.data, out.size - 1, framing, flags, 4, 64,
+                                    check, NULL, &err) == -1);
+        assert(err == MACAROON_INVALID);
+    }
+    else
+    {
+        /* blank lines are skipped, CRLF is accepted, and junk is reported */
+        collect(&out, U("\r\n\nnot a macaroon\n"), 18);
+        read_all(&out, framing, flags, 1);
+    }
+
+    free(out.data);
+    free(ref.data);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    struct output out;
+    unsigned i;
+
+    setup();
+    round_trip(MACAROON_V1, MACAROON_STREAM_LINES, 0);
+    round_trip(MACAROON_V1, MACAROON_STREAM_LENGTH, 0);
+    round_trip(MACAROON_V2, MACAROON_STREAM_LENGTH, 0);
+    round_trip(MACAROON_V2, MACAROON_STREAM_LENGTH, MACAROON_STREAM_VIEWS);
+    round_trip(MACAROON_V2_B64URL, MACAROON_STREAM_LINES, 0);
+
+    if (macaroon_serialize_size_hint(macaroons[0], MACAROON_V2J) > 0)
+    {
+        round_trip(MACAROON_V2J, MACAROON_STREAM_LINES, 0);
+    }
+
+    /* binary V2 and V2D may contain newlines */
+    memset(&out, 0, sizeof(out));
+    assert(macaroon_stream_write((const struct macaroon* const*)macaroons, NUM_MACAROONS,
+                                 MACAROON_V2, MACAROON_STREAM_LINES, 4, collect, &out, &err) == -1);
+    assert(err == MACAROON_UNSUPPORTED_FORMAT);
+    assert(macaroon_stream_write((const struct macaroon* const*)macaroons, NUM_MACAROONS,
+                                 MACAROON_V2D, MACAROON_STREAM_LINES, 4, collect, &out, &err) == -1);
+    assert(err == MACAROON_UNSUPPORTED_FORMAT);
+    assert(macaroon_stream_read(U(""), 0, MACAROON_STREAM_LINES, 0, 0, 0, stop, NULL, &err) == 0);
+
+    for (i = 0; i < NUM_MACAROONS; ++i)
+    {
+        macaroon_destroy(macaroons[i]);
+    }
+
+    free(macaroons);
+    free(seen);
+    (void) argc;
+    (void) argv;
+    return EXIT_SUCCESS;
+}
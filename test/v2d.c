@@ -0,0 +1,333 @@
+/* Copyright (c) 2016, Robert Escriva
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of this project nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/* need to rely upon assert always asserting */
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+/* C */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* macaroons */
+#include "macaroons.h"
+
+/* Run with "bench [n]" to compare the sizes and speeds of V1, V2 and V2D on n
+ * tokens of the corpus below.
+ */
+
+#define LOCATION "https://storage.internal.example.com/"
+#define AUTH "https://auth.internal.example.com/"
+#define NUM_MACAROONS 1000
+
+#include "common.h"
+
+static const char dictionary_v1[] =
+    "# storage tokens\n"
+    "version 1\n"
+    "https://storage.internal.example.com/\n"
+    "https://auth.internal.example.com/\n"
+    "service = storage.internal.example\n"
+    "region = \n"
+    "region = us-east-1\n"
+    "account = \n"
+    "time < 20\n"
+    "op in \n"
+    "op in read,write\n";
+
+static const char dictionary_v2[] =
+    "version 2\r\n"
+    "https://storage.internal.example.com/\r\n"
+    "service = storage.internal.example\r\n"
+    "region = \r\n";
+
+static const char* const regions[] = {"us-east-1", "us-west-2", "eu-central-1"};
+static const char* const ops[] = {"read", "read,write", "list"};
+
+/* a token like the ones storage services hand out */
+static struct macaroon*
+create(unsigned i)
+{
+    struct macaroon* M = NULL;
+    char id[64];
+    char caveats[5][64];
+    unsigned j;
+
+    snprintf(id, sizeof(id), "%08x-%04x-4a1b-9c3d-%012x", i * 2654435761U, i & 0xffff, i);
+    snprintf(caveats[0], 64, "service = storage.internal.example");
+    snprintf(caveats[1], 64, "region = %s", regions[i % 3]);
+    snprintf(caveats[2], 64, "account = %u", 100000 + i * 7919);
+    snprintf(caveats[3], 64, "time < 2030-%02u-%02uT00:00:00Z", 1 + i % 12, 1 + i % 28);
+    snprintf(caveats[4], 64, "op in %s", ops[i % 3]);
+    M = create_root(LOCATION, id);
+
+    for (j = 0; j < 5; ++j)
+    {
+        M = add_first_party(M, U(caveats[j]), strlen(caveats[j]));
+    }
+
+    return add_third_party(M, AUTH, "third party key", id);
+}
+
+static int
+load(const char* contents, enum macaroon_returncode* err)
+{
+    char path[] = "test-dictionary.XXXXXX";
+    int fd = mkstemp(path);
+    int ret;
+
+    assert(fd >= 0);
+    assert(write(fd, contents, strlen(contents)) == (ssize_t)strlen(contents));
+    close(fd);
+    ret = macaroon_dictionary_load(path, err);
+    unlink(path);
+    return ret;
+}
+
+static int
+satisfy_all(void* f, const unsigned char* pred, size_t pred_sz)
+{
+    (void) f;
+    (void) pred;
+    (void) pred_sz;
+    return 0;
+}
+
+/* V2D round trips to the same macaroon, which still verifies */
+static size_t
+round_trip(const struct macaroon* M, const struct macaroon_verifier* V)
+{
+    enum macaroon_returncode err;
+    unsigned char buf[1024];
+    unsigned char into[2048];
+    size_t sz = macaroon_serialize_size_hint(M, MACAROON_V2D);
+    struct macaroon* N = NULL;
+
+    assert(sz > 0 && sz <= sizeof(buf));
+    assert(macaroon_serialize(M, MACAROON_V2D, buf, sz - 1, &err) == 0);
+    assert(err == MACAROON_BUF_TOO_SMALL);
+    assert(macaroon_serialize(M, MACAROON_V2D, buf, sz, &err) == sz);
+    N = macaroon_deserialize(buf, sz, &err);
+    assert(N);
+    assert(macaroon_cmp(M, N) == 0);
+    assert(macaroon_verify(V, N, U(KEY), STRLENOF(KEY), NULL, 0, &err) == -1);
+    macaroon_destroy(N);
+
+    assert(macaroon_deserialize_size(buf, sz, &err) <= sizeof(into));
+    N = macaroon_deserialize_into(buf, sz, into, sizeof(into), &err);
+    assert(N && macaroon_cmp(M, N) == 0);
+    return sz;
+}
+
+static void
+mutations(const struct macaroon* M)
+{
+    enum macaroon_returncode err;
+    unsigned char buf[1024];
+    unsigned char copy[1024];
+    size_t sz = macaroon_serialize(M, MACAROON_V2D, buf, sizeof(buf), &err);
+    struct macaroon* N = NULL;
+    size_t i;
+    unsigned j;
+
+    assert(sz > 0);
+
+    /* a dictionary that is not loaded */
+    memcpy(copy, buf, sz);
+    copy[1] = 200;
+    assert(macaroon_deserialize(copy, sz, &err) == NULL);
+    assert(err == MACAROON_UNSUPPORTED_FORMAT);
+
+    for (i = 0; i < sz; ++i)
+    {
+        assert(macaroon_deserialize(buf, i, &err) == NULL);
+
+        for (j = 1; j < 256; j <<= 1)
+        {
+            memcpy(copy, buf, sz);
+            copy[i] ^= j;
+            N = macaroon_deserialize(copy, sz, &err);
+            macaroon_destroy(N);
+        }
+    }
+}
+
+static double
+elapsed(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+static void
+bench(struct macaroon** MS, size_t n)
+{
+    enum macaroon_returncode err;
+    const enum macaroon_format formats[] = {MACAROON_V1, MACAROON_V2, MACAROON_V2D};
+    const char* const names[] = {"v1", "v2", "v2d"};
+    unsigned char* buf = malloc(n * 1024);
+    size_t* sizes = malloc(n * sizeof(size_t));
+    struct timespec start;
+    double ser_ns;
+    double de_ns;
+    size_t total;
+    size_t off;
+    size_t i;
+    unsigned f;
+
+    assert(buf && sizes);
+
+    for (f = 0; f < 3; ++f)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0, total = 0; i < n; ++i)
+        {
+            sizes[i] = macaroon_serialize(MS[i], formats[f], buf + total, 1024, &err);
+            assert(sizes[i] > 0);
+            total += sizes[i];
+        }
+
+        ser_ns = elapsed(&start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0, off = 0; i < n; off += sizes[i], ++i)
+        {
+            struct macaroon* M = macaroon_deserialize(buf + off, sizes[i], &err);
+            assert(M);
+            macaroon_destroy(M);
+        }
+
+        de_ns = elapsed(&start);
+        printf("%-4s %7.1f bytes/token %8.1f ns serialize %8.1f ns deserialize\n",
+               names[f], (double)total / n, ser_ns / n, de_ns / n);
+    }
+
+    free(sizes);
+    free(buf);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    enum macaroon_returncode err;
+    struct macaroon_verifier* V = NULL;
+    struct macaroon** MS = NULL;
+    unsigned char buf[1024];
+    size_t n = NUM_MACAROONS;
+    size_t v2_sz = 0;
+    size_t v2d_sz = 0;
+    struct macaroon* M = NULL;
+    size_t sz;
+    size_t i;
+
+    if (argc > 2)
+    {
+        n = strtoul(argv[2], NULL, 10);
+    }
+
+    MS = malloc(n * sizeof(struct macaroon*));
+    assert(MS && n > 0);
+
+    for (i = 0; i < n; ++i)
+    {
+        MS[i] = create(i);
+    }
+
+    /* nothing to write with until a dictionary is loaded */
+    assert(macaroon_serialize_size_hint(MS[0], MACAROON_V2D) == 0);
+    assert(macaroon_serialize(MS[0], MACAROON_V2D, buf, sizeof(buf), &err) == 0);
+    assert(err == MACAROON_UNSUPPORTED_FORMAT);
+
+    assert(load("region = \n", &err) == -1 && err == MACAROON_INVALID);
+    assert(load("version 0\n", &err) == -1);
+    assert(load("version 256\n", &err) == -1);
+    assert(macaroon_dictionary_load("/nonexistent/dictionary", &err) == -1);
+    assert(load(dictionary_v1, &err) == 1);
+    assert(load(dictionary_v1, &err) == 1);
+    assert(load("version 1\nsomething else\n", &err) == -1);
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench(MS, n);
+        goto done;
+    }
+
+    V = macaroon_verifier_create();
+    assert(V);
+    assert(macaroon_verifier_satisfy_general(V, satisfy_all, NULL, &err) == 0);
+
+    for (i = 0; i < n; ++i)
+    {
+        v2d_sz += round_trip(MS[i], V);
+        v2_sz += macaroon_serialize_size_hint(MS[i], MACAROON_V2);
+    }
+
+    assert(v2d_sz * 3 < v2_sz * 2);
+    mutations(MS[0]);
+
+    /* tokens written with an older dictionary remain readable */
+    sz = macaroon_serialize(MS[1], MACAROON_V2D, buf, sizeof(buf), &err);
+    assert(sz > 0 && buf[1] == 1);
+    assert(load(dictionary_v2, &err) == 2);
+    M = macaroon_deserialize(buf, sz, &err);
+    assert(M && macaroon_cmp(M, MS[1]) == 0);
+    macaroon_destroy(M);
+    sz = macaroon_serialize(MS[1], MACAROON_V2D, buf, sizeof(buf), &err);
+    assert(sz > 0 && buf[1] == 2);
+    round_trip(MS[1], V);
+
+    /* loading a version again writes with it; writers may name one */
+    assert(load(dictionary_v1, &err) == 1);
+    sz = macaroon_serialize(MS[1], MACAROON_V2D, buf, sizeof(buf), &err);
+    assert(sz > 0 && buf[1] == 1);
+    sz = macaroon_serialize_size_hint_dictionary(MS[1], 2);
+    assert(macaroon_serialize_dictionary(MS[1], 2, buf, sizeof(buf), &err) == sz);
+    assert(sz > 0 && buf[1] == 2);
+    M = macaroon_deserialize(buf, sz, &err);
+    assert(M && macaroon_cmp(M, MS[1]) == 0);
+    macaroon_destroy(M);
+    assert(macaroon_serialize_size_hint_dictionary(MS[1], 3) == 0);
+    assert(macaroon_serialize_dictionary(MS[1], 3, buf, sizeof(buf), &err) == 0);
+    assert(err == MACAROON_UNSUPPORTED_FORMAT);
+    macaroon_verifier_destroy(V);
+
+done:
+    for (i = 0; i < n; ++i)
+    {
+        macaroon_destroy(MS[i]);
+    }
+
+    free(MS);
+    return EXIT_SUCCESS;
+}
@@ -63,7 +63,9 @@ encoded_size(enum encoding encoding, size_t data_sz)
 static size_t
 macaroon_inner_size_hint(const struct macaroon* M)
 {
-    size_t i;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
     size_t sz = PACKET_SIZE(LOCATION, M->location.size)
               + PACKET_SIZE(IDENTIFIER, M->identifier.size)
               + PACKET_SIZE(SIGNATURE, M->signature.size);
@@ -71,20 +73,25 @@ macaroon_inner_size_hint(const struct macaroon* M)
     assert(M);
     VALIDATE(M);
 
-    for (i = 0; i < M->num_caveats; ++i)
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
     {
-        sz += PACKET_SIZE(CID, M->caveats[i].cid.size);
-        sz += PACKET_SIZE(VID, M->caveats[i].vid.size);
-        sz += PACKET_SIZE(CL, M->caveats[i].cl.size);
+        sz += PACKET_SIZE(CID, C->cid.size);
+        sz += PACKET_SIZE(VID, C->vid.size);
+        sz += PACKET_SIZE(CL, C->cl.size);
     }
 
+    caveat_walk_done(&W);
     return sz;
 }
 
 static size_t
 macaroon_inner_size_hint_ascii(const struct macaroon* M)
 {
-    size_t i;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
     size_t sz = PACKET_SIZE(LOCATION, M->location.size)
               + PACKET_SIZE(IDENTIFIER, M->identifier.size)
               + PACKET_SIZE(SIGNATURE, encoded_size(ENCODING_HEX, M->signature.size));
@@ -92,13 +99,16 @@ macaroon_inner_size_hint_ascii(const struct macaroon* M)
     assert(M);
     VALIDATE(M);
 
-    for (i = 0; i < M->num_caveats; ++i)
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
     {
-        sz += PACKET_SIZE(CID, M->caveats[i].cid.size);
-        sz += PACKET_SIZE(VID, encoded_size(ENCODING_BASE64, M->caveats[i].vid.size));
-        sz += PACKET_SIZE(CL, M->caveats[i].cl.size);
+        sz += PACKET_SIZE(CID, C->cid.size);
+        sz += PACKET_SIZE(VID, encoded_size(ENCODING_BASE64, C->vid.size));
+        sz += PACKET_SIZE(CL, C->cl.size);
     }
 
+    caveat_walk_done(&W);
     return sz;
 }
 
@@ -108,16 +118,79 @@ macaroon_serialize_size_hint_v1(const struct macaroon* M)
     return encoded_size(ENCODING_BASE64, macaroon_inner_size_hint(M)) + 1;
 }
 
+/* A streaming base64 writer:  whole triples are encoded straight into the
+ * output and at most two bytes are carried over to the next write.
+ */
+struct v1_writer
+{
+    char* ptr;
+    char* end;
+    unsigned char carry[3];
+    size_t carry_sz;
+};
+
+static void
+v1_writer_write(struct v1_writer* w, const unsigned char* data, size_t sz)
+{
+    size_t amt;
+    int rc;
+
+    while (w->carry_sz > 0 && w->carry_sz < 3 && sz > 0)
+    {
+        w->carry[w->carry_sz++] = *data++;
+        --sz;
+    }
+
+    if (w->carry_sz == 3)
+    {
+        rc = b64_encode(w->carry, 3, w->ptr, w->end - w->ptr, B64_URL);
+        assert(rc == 4);
+        w->ptr += rc;
+        w->carry_sz = 0;
+    }
+
+    amt = sz - sz % 3;
+
+    if (amt)
+    {
+        rc = b64_encode(data, amt, w->ptr, w->end - w->ptr, B64_URL);
+        assert(rc >= 0);
+        w->ptr += rc;
+        data += amt;
+        sz -= amt;
+    }
+
+    memmove(w->carry + w->carry_sz, data, sz);
+    w->carry_sz += sz;
+}
+
+static void
+v1_writer_packet(struct v1_writer* w, const char* key, size_t key_sz,
+                 const struct slice* from)
+{
+    /* identifier is the longest key */
+    unsigned char header[PACKET_PREFIX + IDENTIFIER_SZ + 1];
+    assert(key_sz <= IDENTIFIER_SZ);
+
+    packet_header(PACKET_PREFIX + key_sz + from->size + 2, header);
+    memmove(header + PACKET_PREFIX, key, key_sz);
+    header[PACKET_PREFIX + key_sz] = ' ';
+    v1_writer_write(w, header, PACKET_PREFIX + key_sz + 1);
+    v1_writer_write(w, from->data, from->size);
+    v1_writer_write(w, (const unsigned char*)"\n", 1);
+}
+
 int
 macaroon_serialize_v1(const struct macaroon* M,
                       char* data, size_t data_sz,
                       enum macaroon_returncode* err)
 {
     const size_t sz = macaroon_serialize_size_hint_v1(M);
-    size_t i;
-    unsigned char* tmp = NULL;
-    unsigned char* ptr = NULL;
-    int rc = 0;
+    struct v1_writer w;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
+    int rc;
 
     if (data_sz < sz)
     {
@@ -125,39 +198,36 @@ macaroon_serialize_v1(const struct macaroon* M,
         return -1;
     }
 
-    tmp = malloc(sizeof(unsigned char) * sz);
+    w.ptr = data;
+    w.end = data + data_sz;
+    w.carry_sz = 0;
+    v1_writer_packet(&w, LOCATION, LOCATION_SZ, &M->location);
+    v1_writer_packet(&w, IDENTIFIER, IDENTIFIER_SZ, &M->identifier);
 
-    if (!tmp)
-    {
-        *err = MACAROON_OUT_OF_MEMORY;
-        return -1;
-    }
+    caveat_walk_init(&W, M);
 
-    ptr = tmp;
-    ptr = serialize_slice_as_packet(LOCATION, LOCATION_SZ, &M->location, ptr);
-    ptr = serialize_slice_as_packet(IDENTIFIER, IDENTIFIER_SZ, &M->identifier, ptr);
-
-    for (i = 0; i < M->num_caveats; ++i)
+    while ((C = caveat_walk_next(&W, &ctmp)))
     {
-        if (M->caveats[i].cid.size)
+        if (C->cid.size)
         {
-            ptr = serialize_slice_as_packet(CID, CID_SZ, &M->caveats[i].cid, ptr);
+            v1_writer_packet(&w, CID, CID_SZ, &C->cid);
         }
 
-        if (M->caveats[i].vid.size)
+        if (C->vid.size)
         {
-            ptr = serialize_slice_as_packet(VID, VID_SZ, &M->caveats[i].vid, ptr);
+            v1_writer_packet(&w, VID, VID_SZ, &C->vid);
         }
 
-        if (M->caveats[i].cl.size)
+        if (C->cl.size)
         {
-            ptr = serialize_slice_as_packet(CL, CL_SZ, &M->caveats[i].cl, ptr);
+            v1_writer_packet(&w, CL, CL_SZ, &C->cl);
         }
     }
 
-    ptr = serialize_slice_as_packet(SIGNATURE, SIGNATURE_SZ, &M->signature, ptr);
-    rc = b64_ntop(tmp, ptr - tmp, data, data_sz);
-    free(tmp);
+    caveat_walk_done(&W);
+
+    v1_writer_packet(&w, SIGNATURE, SIGNATURE_SZ, &M->signature);
+    rc = b64_encode(w.carry, w.carry_sz, w.ptr, w.end - w.ptr, B64_URL);
 
     if (rc < 0)
     {
@@ -168,93 +238,345 @@ macaroon_serialize_v1(const struct macaroon* M,
     return 0;
 }
 
-struct macaroon*
-macaroon_deserialize_v1(const char* _data, const size_t _data_sz, enum macaroon_returncode* err)
+static void
+v1_reader_init(struct v1_reader* r, const char* data, size_t data_sz)
 {
-    size_t num_pkts = 0;
-    struct packet pkt = EMPTY_PACKET;
-    unsigned char* data = NULL;
-    const unsigned char* end = NULL;
-    const unsigned char* rptr = NULL;
-    unsigned char* wptr = NULL;
-    const unsigned char* tmp = NULL;
-    const unsigned char* sig;
-    const unsigned char* key;
-    const unsigned char* val;
-    size_t data_sz;
-    size_t key_sz;
-    size_t val_sz;
-    int b64_sz;
-    struct macaroon* M;
+    r->ptr = data;
+    r->end = data + data_sz;
+    r->quantum_off = 0;
+    r->quantum_sz = 0;
+}
 
-    data = malloc(sizeof(unsigned char) * _data_sz);
+/* Decode the next quantum; 1 on success, 0 at end of input, -1 if malformed.
+ * Characters are classed and decoded as b64_decode with B64_TOLERANT does.
+ */
+static int
+v1_reader_refill(struct v1_reader* r)
+{
+    char q[4];
+    size_t n = 0;
+    unsigned cls;
+    int rc;
 
-    if (!data)
+    r->quantum_off = 0;
+    r->quantum_sz = 0;
+
+    while (n < 4 && r->ptr < r->end && *r->ptr != '\0')
     {
-        *err = MACAROON_OUT_OF_MEMORY;
-        return NULL;
+        cls = b64_class(*r->ptr);
+
+        if (cls == B64_CLASS_VALUE)
+        {
+            q[n++] = *r->ptr++;
+        }
+        else if (cls == B64_CLASS_SPACE)
+        {
+            ++r->ptr;
+        }
+        else if (cls == B64_CLASS_PAD)
+        {
+            /* only padding and whitespace may follow padding */
+            for (; r->ptr < r->end && *r->ptr != '\0'; ++r->ptr)
+            {
+                cls = b64_class(*r->ptr);
+
+                if (cls != B64_CLASS_PAD && cls != B64_CLASS_SPACE)
+                {
+                    return -1;
+                }
+            }
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    if (n < 2)
+    {
+        /* a lone zero character is ignored, as b64_decode ignores it */
+        return n == 0 || q[0] == 'A' ? 0 : -1;
     }
 
-    b64_sz = b64_pton(_data, data, _data_sz);
+    rc = b64_decode_quantum(q, n, r->quantum, B64_STD | B64_URL);
 
-    if (b64_sz <= 0)
+    if (rc < 0)
     {
-        *err = MACAROON_INVALID;
-        free(data);
-        return NULL;
+        return -1;
     }
 
-    if (data[0] == '{')
+    r->quantum_sz = rc;
+    return 1;
+}
+
+/* read up to sz decoded bytes into out (or discard them if out is NULL);
+ * returns the number of bytes read, or -1 if the input is malformed
+ */
+static long
+v1_reader_read(struct v1_reader* r, unsigned char* out, size_t sz)
+{
+    size_t done = 0;
+    size_t amt;
+    int rc;
+
+    while (done < sz)
     {
-        *err = MACAROON_NO_JSON_SUPPORT;
-        free(data);
-        return NULL;
+        if (r->quantum_off == r->quantum_sz)
+        {
+            rc = v1_reader_refill(r);
+
+            if (rc < 0)
+            {
+                return -1;
+            }
+
+            if (rc == 0)
+            {
+                break;
+            }
+        }
+
+        amt = r->quantum_sz - r->quantum_off;
+        amt = amt < sz - done ? amt : sz - done;
+
+        if (out)
+        {
+            memmove(out + done, r->quantum + r->quantum_off, amt);
+        }
+
+        r->quantum_off += amt;
+        done += amt;
     }
 
-    data_sz = b64_sz;
-    rptr = data;
-    end = rptr + data_sz;
+    return done;
+}
+
+/* read the next packet's prefix into prefix and return its size, including the
+ * prefix; 0 at end of input, -1 if malformed
+ */
+static long
+v1_reader_packet(struct v1_reader* r, unsigned char* prefix)
+{
+    long amt;
+    long sz;
+
+    amt = v1_reader_read(r, prefix, PACKET_PREFIX);
 
-    while (rptr && rptr < end)
+    if (amt <= 0)
     {
-        rptr = parse_packet(rptr, end, &pkt);
+        return amt;
+    }
+
+    if (amt != PACKET_PREFIX)
+    {
+        return -1;
+    }
+
+    sz = parse_packet_prefix(prefix);
+
+    return sz < PACKET_PREFIX ? -1 : sz;
+}
+
+/* Walk the packets of a V1 token after the num_pkts that r has passed,
+ * decoding them into buf unless it is NULL, in which case they are only
+ * measured.  buf must hold everything r can decode.  Caveat identifier
+ * packets are counted as they go by, as they bound the caveats the token
+ * holds.
+ */
+static int
+v1_scan(struct v1_reader* r, size_t num_pkts, unsigned char* buf,
+        size_t* num_caveats, size_t* body_sz,
+        enum macaroon_returncode* err)
+{
+    unsigned char head[PACKET_PREFIX + CID_SZ + 1];
+    unsigned char* pkt;
+    size_t num_cids = 0;
+    size_t total = 0;
+    long key_sz;
+    long pkt_sz;
+
+    memset(head, 0, sizeof(head));
+
+    while (1)
+    {
+        pkt = buf ? buf + total : head;
+        pkt_sz = v1_reader_packet(r, pkt);
+
+        if (pkt_sz == 0)
+        {
+            break;
+        }
+
+        if (num_pkts == 0 && pkt[0] == '{')
+        {
+            *err = MACAROON_NO_JSON_SUPPORT;
+            return -1;
+        }
+
+        if (pkt_sz < 0)
+        {
+            *err = MACAROON_INVALID;
+            return -1;
+        }
+
+        /* the key and its space, then the rest */
+        key_sz = pkt_sz - PACKET_PREFIX < (long)CID_SZ + 1 ? pkt_sz - PACKET_PREFIX : (long)CID_SZ + 1;
+
+        if (v1_reader_read(r, pkt + PACKET_PREFIX, key_sz) != key_sz ||
+            v1_reader_read(r, buf ? pkt + PACKET_PREFIX + key_sz : NULL,
+                           pkt_sz - PACKET_PREFIX - key_sz) != pkt_sz - PACKET_PREFIX - key_sz)
+        {
+            *err = MACAROON_INVALID;
+            return -1;
+        }
+
+        if (key_sz == (long)CID_SZ + 1 &&
+            memcmp(pkt + PACKET_PREFIX, CID, CID_SZ) == 0 &&
+            pkt[PACKET_PREFIX + CID_SZ] == ' ')
+        {
+            ++num_cids;
+        }
+
+        total += pkt_sz;
         ++num_pkts;
     }
 
-    if (!rptr || num_pkts < 3)
+    if (num_pkts < 3)
     {
         *err = MACAROON_INVALID;
-        free(data);
-        return NULL;
+        return -1;
+    }
+
+    *num_caveats = num_cids;
+    *body_sz = total;
+    return 0;
+}
+
+int
+macaroon_deserialize_measure_v1(const char* data, size_t data_sz,
+                                size_t* num_caveats, size_t* body_sz,
+                                enum macaroon_returncode* err)
+{
+    struct v1_reader r;
+    v1_reader_init(&r, data, data_sz);
+    return v1_scan(&r, 0, NULL, num_caveats, body_sz, err);
+}
+
+/* The header grows a packet at a time, as each packet's size is known only
+ * once the one before it is decoded. */
+unsigned char*
+macaroon_deserialize_header_v1(const char* data, size_t data_sz, size_t hdr_off,
+                               struct v1_reader* r, size_t* hdr_sz,
+                               struct slice* location, struct slice* identifier,
+                               enum macaroon_returncode* err)
+{
+    struct packet pkt = EMPTY_PACKET;
+    unsigned char prefix[PACKET_PREFIX];
+    unsigned char* buf = NULL;
+    unsigned char* tmp = NULL;
+    const unsigned char* rptr;
+    size_t off = 0;
+    long pkt_sz;
+    int i;
+
+    v1_reader_init(r, data, data_sz);
+    memset(prefix, 0, sizeof(prefix));
+    *err = MACAROON_INVALID;
+
+    for (i = 0; i < 2; ++i)
+    {
+        pkt_sz = v1_reader_packet(r, prefix);
+
+        if (i == 0 && prefix[0] == '{')
+        {
+            *err = MACAROON_NO_JSON_SUPPORT;
+            goto fail;
+        }
+
+        if (pkt_sz <= 0)
+        {
+            goto fail;
+        }
+
+        tmp = macaroon_realloc(NULL, buf, hdr_off + off + pkt_sz);
+
+        if (!tmp)
+        {
+            *err = MACAROON_OUT_OF_MEMORY;
+            goto fail;
+        }
+
+        buf = tmp;
+        memmove(buf + hdr_off + off, prefix, PACKET_PREFIX);
+
+        if (v1_reader_read(r, buf + hdr_off + off + PACKET_PREFIX,
+                           pkt_sz - PACKET_PREFIX) != pkt_sz - PACKET_PREFIX)
+        {
+            goto fail;
+        }
+
+        off += pkt_sz;
     }
 
-    assert(num_pkts < data_sz);
-    M = macaroon_malloc((num_pkts - 3/*loc,id,sig*/), data_sz, &wptr);
+    rptr = parse_packet(buf + hdr_off, buf + hdr_off + off, &pkt);
 
-    if (!M)
+    if (!rptr || parse_location_packet(&pkt, &location->data, &location->size) < 0)
     {
-        *err = MACAROON_OUT_OF_MEMORY;
-        free(data);
-        return NULL;
+        goto fail;
+    }
+
+    rptr = parse_packet(rptr, buf + hdr_off + off, &pkt);
+
+    if (!rptr || parse_identifier_packet(&pkt, &identifier->data, &identifier->size) < 0)
+    {
+        goto fail;
     }
 
-    rptr = data;
+    *hdr_sz = off;
+    *err = MACAROON_SUCCESS;
+    return buf;
+
+fail:
+    macaroon_dealloc(NULL, buf);
+    return NULL;
+}
+
+/* parse the decoded packets in src, copying their values to body, which may
+ * be src itself; every value moves towards the front, so writes never
+ * overtake reads.  num_caveats is the capacity of M's caveat array.
+ */
+static int
+v1_parse_body(struct macaroon* M, size_t num_caveats,
+              const unsigned char* src, size_t src_sz,
+              unsigned char* body,
+              enum macaroon_returncode* err)
+{
+    struct packet pkt = EMPTY_PACKET;
+    const unsigned char* end = NULL;
+    const unsigned char* rptr = NULL;
+    unsigned char* wptr = NULL;
+    const unsigned char* tmp = NULL;
+    const unsigned char* sig;
+    const unsigned char* key;
+    const unsigned char* val;
+    size_t key_sz;
+    size_t val_sz;
+
+    rptr = src;
+    wptr = body;
+    end = src + src_sz;
     *err = MACAROON_INVALID;
 
     /* location */
     if (copy_if_parses(&rptr, end, parse_location_packet, &M->location, &wptr) < 0)
     {
-        free(M);
-        free(data);
-        return NULL;
+        return -1;
     }
 
     /* identifier */
     if (copy_if_parses(&rptr, end, parse_identifier_packet, &M->identifier, &wptr) < 0)
     {
-        free(M);
-        free(data);
-        return NULL;
+        return -1;
     }
 
     M->num_caveats = 0;
@@ -263,7 +585,7 @@ macaroon_deserialize_v1(const char* _data, const size_t _data_sz, enum macaroon_
     {
         tmp = parse_packet(rptr, end, &pkt);
 
-        if (parse_kv_packet(&pkt, &key, &key_sz, &val, &val_sz) < 0)
+        if (!tmp || parse_kv_packet(&pkt, &key, &key_sz, &val, &val_sz) < 0)
         {
             break;
         }
@@ -272,6 +594,11 @@ macaroon_deserialize_v1(const char* _data, const size_t _data_sz, enum macaroon_
         {
             if (M->caveats[M->num_caveats].cid.size)
             {
+                if (M->num_caveats + 1 >= num_caveats)
+                {
+                    return -1;
+                }
+
                 ++M->num_caveats;
             }
 
@@ -281,9 +608,7 @@ macaroon_deserialize_v1(const char* _data, const size_t _data_sz, enum macaroon_
         {
             if (M->caveats[M->num_caveats].vid.size)
             {
-                free(M);
-                free(data);
-                return NULL;
+                return -1;
             }
 
             wptr = copy_to_slice(val, val_sz, &M->caveats[M->num_caveats].vid, wptr);
@@ -292,9 +617,7 @@ macaroon_deserialize_v1(const char* _data, const size_t _data_sz, enum macaroon_
         {
             if (M->caveats[M->num_caveats].cl.size)
             {
-                free(M);
-                free(data);
-                return NULL;
+                return -1;
             }
 
             wptr = copy_to_slice(val, val_sz, &M->caveats[M->num_caveats].cl, wptr);
@@ -316,27 +639,142 @@ macaroon_deserialize_v1(const char* _data, const size_t _data_sz, enum macaroon_
 
     /* signature */
     rptr = parse_packet(rptr, end, &pkt);
-    assert(rptr);
 
-    if (parse_signature_packet(&pkt, &sig) < 0)
+    if (!rptr || parse_signature_packet(&pkt, &sig) < 0)
     {
-        free(M);
-        free(data);
-        return NULL;
+        return -1;
     }
 
     wptr = copy_to_slice(sig, MACAROON_HASH_BYTES, &M->signature, wptr);
 
+    /* anything after the signature must still be well-formed packets */
+    while (rptr < end)
+    {
+        rptr = parse_packet(rptr, end, &pkt);
+
+        if (!rptr || pkt.size < PACKET_PREFIX)
+        {
+            return -1;
+        }
+    }
+
     if (macaroon_validate(M) < 0)
     {
-        free(M);
-        free(data);
-        return NULL;
+        return -1;
     }
 
-    free(data);
     *err = MACAROON_SUCCESS;
+    return 0;
+}
+
+/* The packets are decoded straight into the body and compacted in place. */
+int
+macaroon_deserialize_fill_v1(const char* _data, size_t _data_sz,
+                             struct macaroon* M, size_t num_caveats,
+                             unsigned char* body, size_t body_sz,
+                             enum macaroon_returncode* err)
+{
+    struct v1_reader r;
+    v1_reader_init(&r, _data, _data_sz);
+
+    if (v1_reader_read(&r, body, body_sz) != (long)body_sz)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return v1_parse_body(M, num_caveats, body, body_sz, body, err);
+}
+
+/* Tokens that decode to at most this many bytes are decoded once, onto the
+ * stack, and parsed straight into their macaroon; longer ones are measured and
+ * then decoded into place.  Either way the macaroon is sized exactly.
+ */
+#define V1_SCRATCH_SZ 2048
+
+/* the hdr_pkts packets in hdr were decoded already, and start reads the rest */
+static struct macaroon*
+v1_deserialize(const unsigned char* hdr, size_t hdr_sz, size_t hdr_pkts,
+               const struct v1_reader* start,
+               const struct macaroon_allocator* A,
+               enum macaroon_returncode* err)
+{
+    unsigned char scratch[V1_SCRATCH_SZ];
+    /* every four characters decode to at most three bytes, and a trailing
+     * partial quantum to at most two */
+    const size_t decoded_max = hdr_sz + start->quantum_sz - start->quantum_off +
+                               ((size_t)(start->end - start->ptr) / 4 + 1) * 3;
+    unsigned char* src = decoded_max <= V1_SCRATCH_SZ ? scratch : NULL;
+    struct v1_reader r = *start;
+    struct macaroon* M = NULL;
+    unsigned char* body = NULL;
+    size_t num_caveats = 0;
+    size_t rest_sz = 0;
+
+    if (src && hdr_sz > 0)
+    {
+        memmove(src, hdr, hdr_sz);
+    }
+
+    if (v1_scan(&r, hdr_pkts, src ? src + hdr_sz : NULL, &num_caveats, &rest_sz, err) < 0)
+    {
+        return NULL;
+    }
+
+    M = macaroon_malloc(A, num_caveats, hdr_sz + rest_sz, &body);
+
+    if (!M)
+    {
+        *err = MACAROON_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    if (!src)
+    {
+        if (hdr_sz > 0)
+        {
+            memmove(body, hdr, hdr_sz);
+        }
+
+        r = *start;
+        src = body;
+
+        if (v1_reader_read(&r, body + hdr_sz, rest_sz) != (long)rest_sz)
+        {
+            goto fail;
+        }
+    }
+
+    if (v1_parse_body(M, num_caveats, src, hdr_sz + rest_sz, body, err) < 0)
+    {
+        goto fail;
+    }
+
     return M;
+
+fail:
+    *err = MACAROON_INVALID;
+    macaroon_destroy(M);
+    return NULL;
+}
+
+struct macaroon*
+macaroon_deserialize_v1(const char* data, size_t data_sz,
+                        const struct macaroon_allocator* A,
+                        enum macaroon_returncode* err)
+{
+    struct v1_reader r;
+    v1_reader_init(&r, data, data_sz);
+    return v1_deserialize(NULL, 0, 0, &r, A, err);
+}
+
+struct macaroon*
+macaroon_deserialize_resume_v1(const unsigned char* hdr, size_t hdr_sz,
+                               const struct v1_reader* r,
+                               const struct macaroon_allocator* A,
+                               enum macaroon_returncode* err)
+{
+    return v1_deserialize(hdr, hdr_sz, 2, r, A, err);
 }
 
 size_t
@@ -353,7 +791,8 @@ macaroon_inspect_size_hint_v1(const struct macaroon* M)
  * responsible for freeing it.
  */
 static int
-encode(enum encoding encoding, 
+encode(const struct macaroon_allocator* A,
+       enum encoding encoding,
        const unsigned char* val, size_t val_sz,
        const unsigned char** result, size_t* result_sz,
        enum macaroon_returncode* err)
@@ -366,7 +805,7 @@ encode(enum encoding encoding,
         return 0;
     }
     enc_sz = encoded_size(encoding, val_sz);
-    enc = malloc(enc_sz + 1);
+    enc = macaroon_alloc(A, enc_sz + 1);
     if (enc == NULL)
     {
         *err = MACAROON_OUT_OF_MEMORY;
@@ -378,6 +817,7 @@ encode(enum encoding encoding,
         enc_sz = b64_ntop(val, val_sz, enc, enc_sz + 1);
         if (enc_sz < 0)
         {
+            macaroon_dealloc(A, enc);
             *err = MACAROON_BUF_TOO_SMALL;
             return -1;
         }
@@ -395,7 +835,8 @@ encode(enum encoding encoding,
 }
 
 static char*
-inspect_packet(const char* key,
+inspect_packet(const struct macaroon_allocator* A,
+               const char* key,
                const struct slice* from,
                enum encoding encoding,
                char* ptr, char* ptr_end,
@@ -405,7 +846,7 @@ inspect_packet(const char* key,
     size_t key_sz = strlen(key);
     size_t enc_sz = 0;
     size_t total_sz = 0;
-    if (encode(encoding, from->data, from->size, &enc_val, &enc_sz, err) < 0)
+    if (encode(A, encoding, from->data, from->size, &enc_val, &enc_sz, err) < 0)
     {
         return NULL;
     }
@@ -420,7 +861,7 @@ inspect_packet(const char* key,
 
     if (enc_val != from->data)
     {
-        free((void *)enc_val);
+        macaroon_dealloc(A, (void *)enc_val);
     }
     return ptr + total_sz;
 }
@@ -431,7 +872,9 @@ macaroon_inspect_v1(const struct macaroon* M,
                     enum macaroon_returncode* err)
 {
     const size_t sz = macaroon_inspect_size_hint(M);
-    size_t i = 0;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
     char* ptr = data;
     char* ptr_end = data + data_sz;
 
@@ -441,48 +884,57 @@ macaroon_inspect_v1(const struct macaroon* M,
         return -1;
     }
 
-    ptr = inspect_packet(LOCATION, &M->location, ENCODING_RAW, ptr, ptr_end, err);
+    ptr = inspect_packet(M->allocator, LOCATION, &M->location, ENCODING_RAW, ptr, ptr_end, err);
     if (ptr == NULL)
     {
         return -1;
     }
-    ptr = inspect_packet(IDENTIFIER, &M->identifier, ENCODING_RAW, ptr, ptr_end, err);
+    ptr = inspect_packet(M->allocator, IDENTIFIER, &M->identifier, ENCODING_RAW, ptr, ptr_end, err);
     if (ptr == NULL)
     {
         return -1;
     }
 
-    for (i = 0; i < M->num_caveats; ++i)
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
     {
-        if (M->caveats[i].cid.size)
+        if (C->cid.size)
         {
-            ptr = inspect_packet(CID, &M->caveats[i].cid, ENCODING_RAW, ptr, ptr_end, err);
+            ptr = inspect_packet(M->allocator, CID, &C->cid, ENCODING_RAW, ptr, ptr_end, err);
             if (ptr == NULL)
             {
-                return -1;
+                break;
             }
         }
 
-        if (M->caveats[i].vid.size)
+        if (C->vid.size)
         {
-            ptr = inspect_packet(VID, &M->caveats[i].vid, ENCODING_BASE64, ptr, ptr_end, err);
+            ptr = inspect_packet(M->allocator, VID, &C->vid, ENCODING_BASE64, ptr, ptr_end, err);
             if (ptr == NULL)
             {
-                return -1;
+                break;
             }
         }
 
-        if (M->caveats[i].cl.size)
+        if (C->cl.size)
         {
-            ptr = inspect_packet(CL, &M->caveats[i].cl, ENCODING_RAW, ptr, ptr_end, err);
+            ptr = inspect_packet(M->allocator, CL, &C->cl, ENCODING_RAW, ptr, ptr_end, err);
             if (ptr == NULL)
             {
-                return -1;
+                break;
             }
         }
     }
 
-    ptr = inspect_packet(SIGNATURE, &M->signature, ENCODING_HEX, ptr, ptr_end, err);
+    caveat_walk_done(&W);
+
+    if (ptr == NULL)
+    {
+        return -1;
+    }
+
+    ptr = inspect_packet(M->allocator, SIGNATURE, &M->signature, ENCODING_HEX, ptr, ptr_end, err);
     if (ptr == NULL)
     {
         return -1;
@@ -46,8 +46,57 @@ macaroon_serialize_v1(const struct macaroon* M,
                       char* data, size_t data_sz,
                       enum macaroon_returncode* err);
 
+/* count the caveats and body bytes a V1 macaroon needs, without allocating;
+ * the caveats are bounded by its caveat identifier packets */
+int
+macaroon_deserialize_measure_v1(const char* data, size_t data_sz,
+                                size_t* num_caveats, size_t* body_sz,
+                                enum macaroon_returncode* err);
+
+/* A bounded base64 reader that yields the decoded stream a quantum at a
+ * time.  It accepts exactly what b64_pton accepts, but stops at the end of
+ * the buffer rather than relying upon a trailing NUL.
+ */
+struct v1_reader
+{
+    const char* ptr;
+    const char* end;
+    unsigned char quantum[3];
+    size_t quantum_off;
+    size_t quantum_sz;
+};
+
+/* Decode only the location and identifier packets, once, into an allocation
+ * of hdr_off bytes followed by hdr_sz bytes of packets, which location and
+ * identifier point into.  r is left at the first caveat, for
+ * macaroon_deserialize_resume_v1.  Returns the allocation, or NULL.
+ */
+unsigned char*
+macaroon_deserialize_header_v1(const char* data, size_t data_sz, size_t hdr_off,
+                               struct v1_reader* r, size_t* hdr_sz,
+                               struct slice* location, struct slice* identifier,
+                               enum macaroon_returncode* err);
+
+/* finish what macaroon_deserialize_header_v1 began: hdr holds the hdr_sz bytes
+ * it decoded, and r reads the rest */
+struct macaroon*
+macaroon_deserialize_resume_v1(const unsigned char* hdr, size_t hdr_sz,
+                               const struct v1_reader* r,
+                               const struct macaroon_allocator* A,
+                               enum macaroon_returncode* err);
+
+/* decode and parse into a single allocation, sized exactly */
 struct macaroon*
-macaroon_deserialize_v1(const char* _data, const size_t sz, enum macaroon_returncode* err);
+macaroon_deserialize_v1(const char* data, size_t data_sz,
+                        const struct macaroon_allocator* A,
+                        enum macaroon_returncode* err);
+
+/* fill M, laid out with the measured sizes, from data */
+int
+macaroon_deserialize_fill_v1(const char* data, size_t data_sz,
+                             struct macaroon* M, size_t num_caveats,
+                             unsigned char* body, size_t body_sz,
+                             enum macaroon_returncode* err);
 
 size_t
 macaroon_inspect_size_hint_v1(const struct macaroon* M);
@@ -28,7 +28,6 @@
 
 /* C */
 #include <assert.h>
-#include <ctype.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -36,12 +35,18 @@
 #include "v2.h"
 #include "base64.h"
 #include "constants.h"
+#include "dictionary.h"
 #include "varint.h"
 
 #define TYPE_LOCATION 1
 #define TYPE_IDENTIFIER 2
 #define TYPE_VID 4
 #define TYPE_SIGNATURE 6
+/* bundles only: a location given as an index into the shared strings */
+#define TYPE_LOCATION_REF 8
+/* V2D only: a field given as a dictionary entry followed by more bytes */
+#define TYPE_LOCATION_DICT 9
+#define TYPE_IDENTIFIER_DICT 10
 #define EOS 0
 
 #define ENC_STR 1
@@ -51,6 +56,8 @@ struct field
 {
     uint8_t type;
     struct slice data;
+    /* V2D only: a dictionary entry that goes before data */
+    struct slice prefix;
 };
 
 size_t
@@ -65,56 +72,245 @@ optional_field_size(const struct slice* f)
     return f->size ? required_field_size(f) : 0;
 }
 
-size_t
-macaroon_serialize_size_hint_v2(const struct macaroon* M)
+int
+bundle_string_cmp(const void* lhs, const void* rhs)
 {
-    size_t i;
-    size_t sz = 4 /* 1 for version, 3 for 3 EOS markers */
-              + optional_field_size(&M->location)
+    const struct slice* l = lhs;
+    const struct slice* r = rhs;
+
+    if (l->size != r->size)
+    {
+        return l->size < r->size ? -1 : 1;
+    }
+
+    return memcmp(l->data, r->data, l->size);
+}
+
+/* What a V2 encoding may refer to instead of writing bytes out: a bundle's
+ * shared strings, or a V2D dictionary.  NULL for plain V2.
+ */
+struct v2_refs
+{
+    const struct slice* strings;
+    size_t strings_sz;
+    const struct macaroon_dictionary* dict;
+};
+
+/* index of f among the shared strings, or -1 if it is written literally */
+static int
+location_ref(const struct slice* f, const struct v2_refs* R)
+{
+    const struct slice* s = NULL;
+
+    if (!R || R->strings_sz == 0 || f->size == 0)
+    {
+        return -1;
+    }
+
+    s = bsearch(f, R->strings, R->strings_sz, sizeof(struct slice), bundle_string_cmp);
+    return s ? (int)(s - R->strings) : -1;
+}
+
+/* The dictionary entry to write f as, followed by the rest of f, or
+ * DICTIONARY_NONE if that would be no shorter than f written out.
+ */
+static size_t
+dictionary_ref(const struct slice* f, const struct v2_refs* R, size_t* payload_sz)
+{
+    size_t idx;
+
+    if (!R || !R->dict || f->size == 0)
+    {
+        return DICTIONARY_NONE;
+    }
+
+    idx = macaroon_dictionary_match(R->dict, f);
+
+    if (idx == DICTIONARY_NONE)
+    {
+        return DICTIONARY_NONE;
+    }
+
+    *payload_sz = varint_length(idx) + f->size - R->dict->entries[idx].size;
+    return 1 + varint_length(*payload_sz) + *payload_sz < required_field_size(f)
+         ? idx : DICTIONARY_NONE;
+}
+
+static size_t
+dictionary_field_size(const struct slice* f, const struct v2_refs* R, size_t sz)
+{
+    size_t payload_sz = 0;
+
+    if (dictionary_ref(f, R, &payload_sz) == DICTIONARY_NONE)
+    {
+        return sz;
+    }
+
+    return 1 + varint_length(payload_sz) + payload_sz;
+}
+
+static size_t
+location_field_size(const struct slice* f, const struct v2_refs* R)
+{
+    /* type, length and a one-byte index */
+    if (location_ref(f, R) >= 0)
+    {
+        return 3;
+    }
+
+    return dictionary_field_size(f, R, optional_field_size(f));
+}
+
+static size_t
+v2_size(const struct macaroon* M, const struct v2_refs* R)
+{
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
+    size_t sz = 3 /* version, EOS after the header, EOS after the caveats */
+              + (R && R->dict ? 1 : 0) /* dictionary version */
+              + location_field_size(&M->location, R)
               + required_field_size(&M->identifier)
               + required_field_size(&M->signature);
 
-    for (i = 0; i < M->num_caveats; ++i)
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
     {
-        sz += optional_field_size(&M->caveats[i].cl);
-        sz += required_field_size(&M->caveats[i].cid);
-        sz += optional_field_size(&M->caveats[i].vid);
+        sz += location_field_size(&C->cl, R);
+        sz += dictionary_field_size(&C->cid, R, required_field_size(&C->cid));
+        sz += optional_field_size(&C->vid);
         sz += 1 /* EOS */;
     }
 
+    caveat_walk_done(&W);
+
     return sz;
 }
 
-int
-emit_required_field(uint8_t type, const struct slice* f,
-                    unsigned char** ptr,
-                    unsigned char* const end)
-{
-    const size_t sz = 1 + varint_length(f->size) + f->size;
-    if (*ptr + sz > end) return -1;
-    **ptr = type;
-    ++*ptr;
-    *ptr = packvarint(f->size, *ptr);
-    memmove(*ptr, f->data, f->size);
-    *ptr += f->size;
-    return 0;
+size_t
+macaroon_serialize_size_hint_v2(const struct macaroon* M)
+{
+    return v2_size(M, NULL);
 }
 
-int
-emit_optional_field(uint8_t type, const struct slice* f,
-                    unsigned char** ptr,
-                    unsigned char* const end)
+size_t
+macaroon_serialize_size_bundled_v2(const struct macaroon* M,
+                                   const struct slice* strings, size_t strings_sz)
 {
-    return f->size ? emit_required_field(type, f, ptr, end) : 0;
+    struct v2_refs R = {strings, strings_sz, NULL};
+    return v2_size(M, &R);
 }
 
-int
-emit_eos(unsigned char** ptr, unsigned char* const end)
+static const struct macaroon_dictionary*
+v2d_dictionary(unsigned version)
 {
-    if (*ptr >= end) return -1;
-    **ptr = EOS;
-    ++*ptr;
-    return 0;
+    return version ? macaroon_dictionary_find(version) : macaroon_dictionary_current();
+}
+
+size_t
+macaroon_serialize_size_hint_v2d(const struct macaroon* M, unsigned version)
+{
+    struct v2_refs R = {NULL, 0, v2d_dictionary(version)};
+    return R.dict ? v2_size(M, &R) : 0;
+}
+
+/* the emitters write without bounds checks; callers size the buffer with
+ * macaroon_serialize_size_hint_v2, which is exact */
+unsigned char*
+emit_required_field(uint8_t type, const struct slice* f, unsigned char* ptr)
+{
+    *ptr = type;
+    ++ptr;
+    ptr = packvarint(f->size, ptr);
+    memmove(ptr, f->data, f->size);
+    return ptr + f->size;
+}
+
+unsigned char*
+emit_optional_field(uint8_t type, const struct slice* f, unsigned char* ptr)
+{
+    return f->size ? emit_required_field(type, f, ptr) : ptr;
+}
+
+/* f as a dictionary reference of dict_type, if that is shorter, or as emit
+ * would write it */
+static unsigned char*
+emit_dictionary_field(uint8_t dict_type, const struct slice* f,
+                      const struct v2_refs* R,
+                      unsigned char* (*emit)(uint8_t, const struct slice*, unsigned char*),
+                      uint8_t type, unsigned char* ptr)
+{
+    size_t payload_sz = 0;
+    const size_t idx = dictionary_ref(f, R, &payload_sz);
+    size_t prefix_sz;
+
+    if (idx == DICTIONARY_NONE)
+    {
+        return emit(type, f, ptr);
+    }
+
+    prefix_sz = R->dict->entries[idx].size;
+    *ptr++ = dict_type;
+    ptr = packvarint(payload_sz, ptr);
+    ptr = packvarint(idx, ptr);
+    memmove(ptr, f->data + prefix_sz, f->size - prefix_sz);
+    return ptr + f->size - prefix_sz;
+}
+
+static unsigned char*
+emit_location(const struct slice* f, const struct v2_refs* R, unsigned char* ptr)
+{
+    const int idx = location_ref(f, R);
+
+    if (idx < 0)
+    {
+        return emit_dictionary_field(TYPE_LOCATION_DICT, f, R,
+                                     emit_optional_field, TYPE_LOCATION, ptr);
+    }
+
+    *ptr++ = TYPE_LOCATION_REF;
+    *ptr++ = 1;
+    *ptr++ = (unsigned char)idx;
+    return ptr;
+}
+
+static unsigned char*
+v2_emit(const struct macaroon* M, const struct v2_refs* R, unsigned char* ptr)
+{
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
+
+    if (R && R->dict)
+    {
+        *ptr++ = MACAROON_V2D_VERSION;
+        *ptr++ = (unsigned char)R->dict->version;
+    }
+    else
+    {
+        *ptr++ = 2;
+    }
+
+    ptr = emit_location(&M->location, R, ptr);
+    ptr = emit_required_field(TYPE_IDENTIFIER, &M->identifier, ptr);
+    *ptr++ = EOS;
+
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
+    {
+        ptr = emit_location(&C->cl, R, ptr);
+        ptr = emit_dictionary_field(TYPE_IDENTIFIER_DICT, &C->cid, R,
+                                    emit_required_field, TYPE_IDENTIFIER, ptr);
+        ptr = emit_optional_field(TYPE_VID, &C->vid, ptr);
+        *ptr++ = EOS;
+    }
+
+    caveat_walk_done(&W);
+
+    *ptr++ = EOS;
+    return emit_required_field(TYPE_SIGNATURE, &M->signature, ptr);
 }
 
 size_t
@@ -122,32 +318,198 @@ macaroon_serialize_v2(const struct macaroon* M,
                       unsigned char* data, size_t data_sz,
                       enum macaroon_returncode* err)
 {
+    const size_t sz = macaroon_serialize_size_hint_v2(M);
     unsigned char* ptr = data;
-    unsigned char* const end = ptr + data_sz;
-    size_t i;
-    if (ptr >= end) goto emit_buf_too_small;
-    *ptr = 2;
-    ++ptr;
-    if (emit_optional_field(TYPE_LOCATION, &M->location, &ptr, end) < 0) goto emit_buf_too_small;
-    if (emit_required_field(TYPE_IDENTIFIER, &M->identifier, &ptr, end) < 0) goto emit_buf_too_small;
-    if (emit_eos(&ptr, end) < 0) goto emit_buf_too_small;
 
-    for (i = 0; i < M->num_caveats; ++i)
+    if (data_sz < sz)
     {
-        const struct caveat* C = &M->caveats[i];
-        if (emit_optional_field(TYPE_LOCATION, &C->cl, &ptr, end) < 0) goto emit_buf_too_small;
-        if (emit_required_field(TYPE_IDENTIFIER, &C->cid, &ptr, end) < 0) goto emit_buf_too_small;
-        if (emit_optional_field(TYPE_VID, &C->vid, &ptr, end) < 0) goto emit_buf_too_small;
-        if (emit_eos(&ptr, end) < 0) goto emit_buf_too_small;
+        *err = MACAROON_BUF_TOO_SMALL;
+        return 0;
     }
 
-    if (emit_eos(&ptr, end) < 0) goto emit_buf_too_small;
-    if (emit_required_field(TYPE_SIGNATURE, &M->signature, &ptr, end) < 0) goto emit_buf_too_small;
-    return ptr - data;
+    ptr = v2_emit(M, NULL, ptr);
+    assert(ptr == data + sz);
+    return sz;
+}
+
+unsigned char*
+macaroon_serialize_bundled_v2(const struct macaroon* M,
+                              const struct slice* strings, size_t strings_sz,
+                              unsigned char* ptr)
+{
+    struct v2_refs R = {strings, strings_sz, NULL};
+    return v2_emit(M, &R, ptr);
+}
 
-emit_buf_too_small:
-    *err = MACAROON_BUF_TOO_SMALL;
-    return 0;
+size_t
+macaroon_serialize_v2d(const struct macaroon* M, unsigned version,
+                       unsigned char* data, size_t data_sz,
+                       enum macaroon_returncode* err)
+{
+    /* one snapshot of the dictionary for sizing and writing */
+    struct v2_refs R = {NULL, 0, v2d_dictionary(version)};
+    size_t sz;
+    unsigned char* ptr = data;
+
+    if (!R.dict)
+    {
+        *err = MACAROON_UNSUPPORTED_FORMAT;
+        return 0;
+    }
+
+    sz = v2_size(M, &R);
+
+    if (data_sz < sz)
+    {
+        *err = MACAROON_BUF_TOO_SMALL;
+        return 0;
+    }
+
+    ptr = v2_emit(M, &R, ptr);
+    assert(ptr == data + sz);
+    return sz;
+}
+
+static size_t
+b64_size(size_t sz)
+{
+    return sz / 3 * 4 + (sz % 3 ? sz % 3 + 1 : 0);
+}
+
+size_t
+macaroon_serialize_size_hint_v2_b64(const struct macaroon* M)
+{
+    return b64_size(v2_size(M, NULL));
+}
+
+size_t
+macaroon_serialize_v2_b64(const struct macaroon* M,
+                          unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err)
+{
+    const size_t sz = v2_size(M, NULL);
+    const size_t enc_sz = b64_size(sz);
+    unsigned char* ptr = NULL;
+    int ret;
+
+    if (data_sz < enc_sz)
+    {
+        *err = MACAROON_BUF_TOO_SMALL;
+        return 0;
+    }
+
+    /* emit to the end of the buffer and encode forward over it */
+    ptr = v2_emit(M, NULL, data + enc_sz - sz);
+    assert(ptr == data + enc_sz);
+    ret = b64_encode(data + enc_sz - sz, sz, (char*)data, enc_sz,
+                     B64_URL | B64_UNTERMINATED);
+    assert(ret >= 0 && (size_t)ret == enc_sz);
+    (void) ret;
+    return enc_sz;
+}
+
+struct v2_iov
+{
+    struct iovec* iov;
+    size_t iov_cap;
+    size_t iov_used;
+    unsigned char* scratch;
+    size_t scratch_cap;
+    size_t scratch_used;
+    /* scratch bytes before this are already covered by an iovec */
+    size_t pending;
+};
+
+static void
+iov_push(struct v2_iov* V, const unsigned char* base, size_t len)
+{
+    if (V->iov && V->iov_used < V->iov_cap)
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+        V->iov[V->iov_used].iov_base = (void*)base;
+#pragma GCC diagnostic pop
+        V->iov[V->iov_used].iov_len = len;
+    }
+
+    ++V->iov_used;
+}
+
+static void
+iov_header(struct v2_iov* V, const unsigned char* hdr, size_t hdr_sz)
+{
+    if (V->scratch && V->scratch_used + hdr_sz <= V->scratch_cap)
+    {
+        memmove(V->scratch + V->scratch_used, hdr, hdr_sz);
+    }
+
+    V->scratch_used += hdr_sz;
+}
+
+/* cover the scratch bytes written since the last data iovec */
+static void
+iov_flush(struct v2_iov* V)
+{
+    if (V->scratch_used > V->pending)
+    {
+        iov_push(V, V->scratch ? V->scratch + V->pending : NULL,
+                 V->scratch_used - V->pending);
+        V->pending = V->scratch_used;
+    }
+}
+
+static void
+iov_required_field(struct v2_iov* V, uint8_t type, const struct slice* f)
+{
+    unsigned char hdr[1 + VARINT_MAX_SIZE];
+    hdr[0] = type;
+    iov_header(V, hdr, packvarint(f->size, hdr + 1) - hdr);
+    if (!f->size) return;
+    iov_flush(V);
+    iov_push(V, f->data, f->size);
+}
+
+static void
+iov_optional_field(struct v2_iov* V, uint8_t type, const struct slice* f)
+{
+    if (f->size) iov_required_field(V, type, f);
+}
+
+int
+macaroon_serialize_iov_v2(const struct macaroon* M,
+                          struct iovec* iov, size_t* iov_sz,
+                          unsigned char* scratch, size_t* scratch_sz)
+{
+    struct v2_iov V = {iov, *iov_sz, 0, scratch, *scratch_sz, 0, 0};
+    const unsigned char version = 2;
+    const unsigned char eos = EOS;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
+
+    iov_header(&V, &version, 1);
+    iov_optional_field(&V, TYPE_LOCATION, &M->location);
+    iov_required_field(&V, TYPE_IDENTIFIER, &M->identifier);
+    iov_header(&V, &eos, 1);
+
+    caveat_walk_init(&W, M);
+
+    while ((C = caveat_walk_next(&W, &ctmp)))
+    {
+        iov_optional_field(&V, TYPE_LOCATION, &C->cl);
+        iov_required_field(&V, TYPE_IDENTIFIER, &C->cid);
+        iov_optional_field(&V, TYPE_VID, &C->vid);
+        iov_header(&V, &eos, 1);
+    }
+
+    caveat_walk_done(&W);
+
+    iov_header(&V, &eos, 1);
+    iov_required_field(&V, TYPE_SIGNATURE, &M->signature);
+    iov_flush(&V);
+    *iov_sz = V.iov_used;
+    *scratch_sz = V.scratch_used;
+    return V.iov_used <= V.iov_cap && V.scratch_used <= V.scratch_cap ? 0 : -1;
 }
 
 int
@@ -168,6 +530,8 @@ parse_field(const unsigned char** _data,
     parsed->type = field & 0xffU;
     parsed->data.data = data;
     parsed->data.size = length;
+    parsed->prefix.data = NULL;
+    parsed->prefix.size = 0;
     data += length;
     assert(data <= end);
     *_data = data;
@@ -188,6 +552,8 @@ parse_optional_field(const unsigned char** data,
         parsed->type = type;
         parsed->data.data = NULL;
         parsed->data.size = 0;
+        parsed->prefix.data = NULL;
+        parsed->prefix.size = 0;
         return 0;
     }
 
@@ -223,30 +589,132 @@ parse_eos(const unsigned char** data, const unsigned char* const end)
     return ret;
 }
 
-struct macaroon*
-macaroon_deserialize_v2(const unsigned char* data, size_t data_sz,
-                        enum macaroon_returncode* err)
+/* copy into the body at ptr, or borrow the input bytes if there is no body */
+static unsigned char*
+v2_slice(const struct slice* from, struct slice* to, unsigned char* ptr)
 {
-    const unsigned char* const end = data + data_sz;
-    size_t i;
-
-    if (data >= end || *data != 2)
+    if (!ptr)
     {
-        *err = MACAROON_INVALID;
+        *to = *from;
         return NULL;
     }
 
-    ++data;
-    struct caveat* caveats = malloc(sizeof(struct caveat) * 4);
-    size_t caveats_cap = 4;
-    size_t caveats_sz = 0;
+    return copy_slice(from, to, ptr);
+}
 
-    struct field location;
-    struct field identifier;
-    if (parse_optional_field(&data, end, TYPE_LOCATION, &location) < 0) goto parse_invalid;
-    if (parse_required_field(&data, end, TYPE_IDENTIFIER, &identifier) < 0) goto parse_invalid;
-    if (parse_eos(&data, end) < 0) goto parse_invalid;
-    size_t body_sz = location.data.size + identifier.data.size;
+/* Parse a field written as a dictionary entry of dict_type, giving it type.
+ * Returns 1 if it was one, 0 if the next field is something else, and -1 on
+ * error.
+ */
+static int
+parse_dictionary_field(const unsigned char** data,
+                       const unsigned char* const end,
+                       const struct v2_refs* R,
+                       uint8_t dict_type, uint8_t type,
+                       struct field* parsed)
+{
+    struct field ref;
+    const unsigned char* ptr;
+    const unsigned char* ref_end;
+    uint64_t idx = 0;
+
+    if (!R || !R->dict || *data >= end || **data != dict_type)
+    {
+        return 0;
+    }
+
+    if (parse_field(data, end, &ref) < 0) return -1;
+    ref_end = ref.data.data + ref.data.size;
+    ptr = unpackvarint(ref.data.data, ref_end, &idx);
+    if (!ptr || idx >= R->dict->num_entries) return -1;
+    parsed->type = type;
+    parsed->prefix = R->dict->entries[idx];
+    parsed->data.data = ptr;
+    parsed->data.size = ref_end - ptr;
+    return 1;
+}
+
+/* Parse an optional location, which within a bundle may instead reference one
+ * of the shared strings.  Returns 1 for a reference, which is not part of the
+ * body, 0 for a literal, absent or dictionary location, and -1 on error.
+ */
+static int
+parse_location(const unsigned char** data,
+               const unsigned char* const end,
+               const struct v2_refs* R,
+               struct field* parsed)
+{
+    struct field ref;
+    int ret = parse_dictionary_field(data, end, R, TYPE_LOCATION_DICT, TYPE_LOCATION, parsed);
+
+    if (ret != 0)
+    {
+        return ret < 0 ? -1 : 0;
+    }
+
+    if (!R || R->strings_sz == 0 || *data >= end || **data != TYPE_LOCATION_REF)
+    {
+        return parse_optional_field(data, end, TYPE_LOCATION, parsed);
+    }
+
+    if (parse_field(data, end, &ref) < 0) return -1;
+    if (ref.data.size != 1 || ref.data.data[0] >= R->strings_sz) return -1;
+    parsed->type = TYPE_LOCATION;
+    parsed->data = R->strings[ref.data.data[0]];
+    parsed->prefix.data = NULL;
+    parsed->prefix.size = 0;
+    return 1;
+}
+
+static size_t
+field_body_size(int shared, const struct field* f)
+{
+    return shared ? 0 : f->prefix.size + f->data.size;
+}
+
+/* Place a field in M: shared locations point at the bundle's strings,
+ * dictionary references are expanded into the body, and the rest are copied
+ * or borrowed as v2_slice does.
+ */
+static unsigned char*
+v2_field(int shared, const struct field* f, struct slice* to, unsigned char* ptr)
+{
+    if (shared)
+    {
+        *to = f->data;
+        return ptr;
+    }
+
+    if (f->prefix.size == 0)
+    {
+        return v2_slice(&f->data, to, ptr);
+    }
+
+    /* expanded fields have no bytes to borrow */
+    assert(ptr);
+    to->data = ptr;
+    to->size = f->prefix.size + f->data.size;
+    memmove(ptr, f->prefix.data, f->prefix.size);
+    memmove(ptr + f->prefix.size, f->data.data, f->data.size);
+    return ptr + to->size;
+}
+
+/* The caveats and signature of a V2 or V2D macaroon, from data on.  On entry
+ * *body_sz holds the body bytes its header took, and on success the total.
+ * The caps are as for parse_v2.
+ */
+static int
+parse_v2_caveats(const unsigned char* data, const unsigned char* const end,
+                 const struct v2_refs* R,
+                 struct macaroon* M, unsigned char* ptr,
+                 size_t caveats_cap, size_t body_cap,
+                 size_t* num_caveats, size_t* body_sz)
+{
+    size_t caveats_sz = 0;
+    size_t sz = *body_sz;
+    size_t field_sz;
+    int shared;
+    int ret;
 
     while (data < end && *data != EOS)
     {
@@ -254,77 +722,566 @@ macaroon_deserialize_v2(const unsigned char* data, size_t data_sz,
         struct field cid;
         struct field vid;
 
-        if (parse_optional_field(&data, end, TYPE_LOCATION, &cl) < 0) goto parse_invalid;
-        if (parse_required_field(&data, end, TYPE_IDENTIFIER, &cid) < 0) goto parse_invalid;
-        if (parse_optional_field(&data, end, TYPE_VID, &vid) < 0) goto parse_invalid;
-        if (parse_eos(&data, end) < 0) goto parse_invalid;
-
-        if (caveats_sz == caveats_cap)
+        shared = parse_location(&data, end, R, &cl);
+        if (shared < 0) return -1;
+        ret = parse_dictionary_field(&data, end, R, TYPE_IDENTIFIER_DICT, TYPE_IDENTIFIER, &cid);
+        if (ret < 0) return -1;
+        if (ret == 0 && parse_required_field(&data, end, TYPE_IDENTIFIER, &cid) < 0) return -1;
+        if (parse_optional_field(&data, end, TYPE_VID, &vid) < 0) return -1;
+        if (parse_eos(&data, end) < 0) return -1;
+        field_sz = field_body_size(0, &cid) + vid.data.size + field_body_size(shared, &cl);
+        if (caveats_sz >= caveats_cap || field_sz > body_cap - sz) return -1;
+
+        if (M)
         {
-            caveats_cap *= 2;
-            struct caveat* tmp = realloc(caveats, sizeof(struct caveat) * caveats_cap);
-            if (!tmp) goto parse_invalid;
-            caveats = tmp;
+            ptr = v2_field(0, &cid, &M->caveats[caveats_sz].cid, ptr);
+            ptr = v2_slice(&vid.data, &M->caveats[caveats_sz].vid, ptr);
+            ptr = v2_field(shared, &cl, &M->caveats[caveats_sz].cl, ptr);
         }
 
-        caveats[caveats_sz].cid = cid.data;
-        caveats[caveats_sz].vid = vid.data;
-        caveats[caveats_sz].cl = cl.data;
         ++caveats_sz;
-        body_sz += cid.data.size + vid.data.size + cl.data.size;
+        sz += field_sz;
     }
 
-    if (parse_eos(&data, end) < 0) goto parse_invalid;
+    if (parse_eos(&data, end) < 0) return -1;
     struct field signature;
-    if (parse_required_field(&data, end, TYPE_SIGNATURE, &signature) < 0) goto parse_invalid;
-    body_sz += signature.data.size;
+    if (parse_required_field(&data, end, TYPE_SIGNATURE, &signature) < 0) return -1;
+    if (signature.data.size > body_cap - sz) return -1;
+    sz += signature.data.size;
+
+    if (M)
+    {
+        ptr = v2_slice(&signature.data, &M->signature, ptr);
+        M->num_caveats = caveats_sz;
+    }
+
+    *num_caveats = caveats_sz;
+    *body_sz = sz;
+    return 0;
+}
+
+/* Walk a V2 or V2D macaroon.  With M == NULL this only counts caveats and body
+ * bytes; otherwise it fills M, and *num_caveats and *body_sz hold on entry the
+ * sizes M was laid out with.  The walk fails rather than exceed them, as data
+ * may have changed since it was measured.  Fields are copied to ptr, or point
+ * into data if ptr is NULL.  Locations that reference a bundle's strings point
+ * there and are not counted; dictionary references count and are copied in
+ * full.
+ */
+static int
+parse_v2(const unsigned char* data, size_t data_sz,
+         const struct v2_refs* R,
+         struct macaroon* M, unsigned char* ptr,
+         size_t* num_caveats, size_t* body_sz)
+{
+    const unsigned char* const end = data + data_sz;
+    const size_t caveats_cap = M ? *num_caveats : SIZE_MAX;
+    const size_t body_cap = M && ptr ? *body_sz : SIZE_MAX;
+
+    if (R && R->dict)
+    {
+        if (end - data < 2 || data[0] != MACAROON_V2D_VERSION || data[1] != R->dict->version) return -1;
+        data += 2;
+    }
+    else
+    {
+        if (data >= end || *data != 2) return -1;
+        ++data;
+    }
+
+    struct field location;
+    struct field identifier;
+    int shared = parse_location(&data, end, R, &location);
+    if (shared < 0) return -1;
+    if (parse_required_field(&data, end, TYPE_IDENTIFIER, &identifier) < 0) return -1;
+    if (parse_eos(&data, end) < 0) return -1;
+    size_t sz = field_body_size(shared, &location) + identifier.data.size;
+    if (sz > body_cap) return -1;
+
+    if (M)
+    {
+        ptr = v2_field(shared, &location, &M->location, ptr);
+        ptr = v2_slice(&identifier.data, &M->identifier, ptr);
+    }
+
+    *body_sz = sz;
+    return parse_v2_caveats(data, end, R, M, ptr, caveats_cap, body_cap,
+                            num_caveats, body_sz);
+}
 
+int
+macaroon_deserialize_header_v2(const unsigned char* data, size_t data_sz,
+                               struct slice* location, struct slice* identifier,
+                               size_t* caveats_off,
+                               enum macaroon_returncode* err)
+{
+    const unsigned char* const start = data;
+    const unsigned char* const end = data + data_sz;
+    struct field loc;
+    struct field id;
+    *err = MACAROON_INVALID;
+
+    if (data >= end || *data != 2) return -1;
+    ++data;
+    if (parse_optional_field(&data, end, TYPE_LOCATION, &loc) < 0) return -1;
+    if (parse_required_field(&data, end, TYPE_IDENTIFIER, &id) < 0) return -1;
+    if (parse_eos(&data, end) < 0) return -1;
+
+    *location = loc.data;
+    *identifier = id.data;
+    *caveats_off = data - start;
+    *err = MACAROON_SUCCESS;
+    return 0;
+}
+
+struct macaroon*
+macaroon_deserialize_resume_v2(const unsigned char* data, size_t data_sz,
+                               const struct slice* location,
+                               const struct slice* identifier,
+                               size_t caveats_off,
+                               enum macaroon_returncode* err)
+{
+    const unsigned char* const end = data + data_sz;
+    struct macaroon* M = NULL;
     unsigned char* ptr = NULL;
-    struct macaroon* M = macaroon_malloc(caveats_sz, body_sz, &ptr);
+    size_t num_caveats = 0;
+    size_t caveats_sz = 0;
+    size_t sz = 0;
+
+    if (caveats_off > data_sz ||
+        parse_v2_caveats(data + caveats_off, end, NULL, NULL, NULL,
+                         SIZE_MAX, SIZE_MAX, &num_caveats, &sz) < 0)
+    {
+        *err = MACAROON_INVALID;
+        return NULL;
+    }
+
+    M = macaroon_malloc(NULL, num_caveats, 0, &ptr);
 
     if (!M)
     {
         *err = MACAROON_OUT_OF_MEMORY;
-        goto parse_error;
+        return NULL;
     }
 
-    ptr = copy_slice(&location.data, &M->location, ptr);
-    ptr = copy_slice(&identifier.data, &M->identifier, ptr);
-    ptr = copy_slice(&signature.data, &M->signature, ptr);
-    M->num_caveats = caveats_sz;
+    M->location = *location;
+    M->identifier = *identifier;
+    sz = 0;
 
-    for (i = 0; i < caveats_sz; ++i)
+    if (parse_v2_caveats(data + caveats_off, end, NULL, M, NULL,
+                         num_caveats, SIZE_MAX, &caveats_sz, &sz) < 0 ||
+        caveats_sz != num_caveats)
     {
-        ptr = copy_slice(&caveats[i].cid, &M->caveats[i].cid, ptr);
-        ptr = copy_slice(&caveats[i].vid, &M->caveats[i].vid, ptr);
-        ptr = copy_slice(&caveats[i].cl, &M->caveats[i].cl, ptr);
+        *err = MACAROON_INVALID;
+        macaroon_destroy(M);
+        return NULL;
     }
 
-    free(caveats);
     return M;
+}
 
-parse_invalid:
-    *err = MACAROON_INVALID;
-parse_error:
-    if (caveats)
+int
+macaroon_deserialize_measure_v2(const unsigned char* data, size_t data_sz,
+                                size_t* num_caveats, size_t* body_sz,
+                                enum macaroon_returncode* err)
+{
+    if (parse_v2(data, data_sz, NULL, NULL, NULL, num_caveats, body_sz) < 0)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+macaroon_deserialize_fill_v2(const unsigned char* data, size_t data_sz,
+                             struct macaroon* M, size_t num_caveats,
+                             unsigned char* body, size_t body_sz,
+                             enum macaroon_returncode* err)
+{
+    size_t caveats_sz = num_caveats;
+    size_t sz = body_sz;
+
+    if (parse_v2(data, data_sz, NULL, M, body, &caveats_sz, &sz) < 0 ||
+        caveats_sz != num_caveats || sz != body_sz)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+macaroon_deserialize_borrow_v2(const unsigned char* data, size_t data_sz,
+                               struct macaroon* M, size_t num_caveats,
+                               enum macaroon_returncode* err)
+{
+    size_t caveats_sz = num_caveats;
+    size_t sz = 0;
+
+    if (parse_v2(data, data_sz, NULL, M, NULL, &caveats_sz, &sz) < 0 ||
+        caveats_sz != num_caveats)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+macaroon_deserialize_measure_bundled_v2(const unsigned char* data, size_t data_sz,
+                                        const struct slice* strings, size_t strings_sz,
+                                        size_t* num_caveats, size_t* body_sz,
+                                        enum macaroon_returncode* err)
+{
+    struct v2_refs R = {strings, strings_sz, NULL};
+
+    if (parse_v2(data, data_sz, &R, NULL, NULL, num_caveats, body_sz) < 0)
     {
-        free(caveats);
+        *err = MACAROON_INVALID;
+        return -1;
     }
 
-    return NULL;
+    return 0;
+}
+
+int
+macaroon_deserialize_fill_bundled_v2(const unsigned char* data, size_t data_sz,
+                                     const struct slice* strings, size_t strings_sz,
+                                     struct macaroon* M, size_t num_caveats,
+                                     unsigned char* body, size_t body_sz,
+                                     enum macaroon_returncode* err)
+{
+    struct v2_refs R = {strings, strings_sz, NULL};
+    size_t caveats_sz = num_caveats;
+    size_t sz = body_sz;
+
+    if (parse_v2(data, data_sz, &R, M, body, &caveats_sz, &sz) < 0 ||
+        caveats_sz != num_caveats || sz != body_sz)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the refs for a V2D token, naming the dictionary it was written with */
+static int
+v2d_refs(const unsigned char* data, size_t data_sz,
+         struct v2_refs* R, enum macaroon_returncode* err)
+{
+    R->strings = NULL;
+    R->strings_sz = 0;
+    R->dict = data_sz >= 2 ? macaroon_dictionary_find(data[1]) : NULL;
+
+    if (!R->dict)
+    {
+        *err = data_sz >= 2 ? MACAROON_UNSUPPORTED_FORMAT : MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+macaroon_deserialize_measure_v2d(const unsigned char* data, size_t data_sz,
+                                 size_t* num_caveats, size_t* body_sz,
+                                 enum macaroon_returncode* err)
+{
+    struct v2_refs R;
+
+    if (v2d_refs(data, data_sz, &R, err) < 0)
+    {
+        return -1;
+    }
+
+    if (parse_v2(data, data_sz, &R, NULL, NULL, num_caveats, body_sz) < 0)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+macaroon_deserialize_fill_v2d(const unsigned char* data, size_t data_sz,
+                              struct macaroon* M, size_t num_caveats,
+                              unsigned char* body, size_t body_sz,
+                              enum macaroon_returncode* err)
+{
+    struct v2_refs R;
+    size_t caveats_sz = num_caveats;
+    size_t sz = body_sz;
+
+    if (v2d_refs(data, data_sz, &R, err) < 0 ||
+        parse_v2(data, data_sz, &R, M, body, &caveats_sz, &sz) < 0 ||
+        caveats_sz != num_caveats || sz != body_sz)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A base64 V2 token is walked where it lies: measuring decodes only the
+ * quanta that hold field types and lengths and steps over field contents,
+ * and filling decodes the whole token once, into the body, and borrows from
+ * it there.
+ */
+struct b64_cursor
+{
+    const unsigned char* data;
+    size_t data_sz; /* characters, without padding */
+    size_t sz; /* decoded bytes */
+    size_t off;
+    /* the decoded quantum ends here; off only moves forward, so it holds the
+     * byte at off whenever off is short of this */
+    size_t quantum_end;
+    unsigned char quantum[3];
+};
+
+static int
+b64_cursor_init(struct b64_cursor* C, const unsigned char* data, size_t data_sz)
+{
+    size_t pads = 0;
+
+    while (pads < 2 && data_sz > 0 && data[data_sz - 1] == '=')
+    {
+        --data_sz;
+        ++pads;
+    }
+
+    if (data_sz % 4 == 1 || (pads > 0 && (data_sz + pads) % 4 != 0))
+    {
+        return -1;
+    }
+
+    C->data = data;
+    C->data_sz = data_sz;
+    C->sz = data_sz / 4 * 3 + (data_sz % 4 ? data_sz % 4 - 1 : 0);
+    C->off = 0;
+    C->quantum_end = 0;
+    return 0;
+}
+
+/* the byte at the cursor, or -1 at the end or in a malformed quantum */
+static int
+b64_peek(struct b64_cursor* C)
+{
+    const size_t q = C->off / 3;
+    size_t chars;
+
+    if (C->off < C->quantum_end)
+    {
+        return C->quantum[3 - (C->quantum_end - C->off)];
+    }
+
+    if (C->off >= C->sz)
+    {
+        return -1;
+    }
+
+    chars = C->data_sz - q * 4;
+    chars = chars < 4 ? chars : 4;
+
+    if (b64_decode_quantum((const char*)C->data + q * 4, chars,
+                           C->quantum, B64_URL) < 0)
+    {
+        return -1;
+    }
+
+    C->quantum_end = q * 3 + 3;
+    return C->quantum[C->off - q * 3];
+}
+
+static int
+b64_next(struct b64_cursor* C)
+{
+    int ret = b64_peek(C);
+    C->off += ret >= 0;
+    return ret;
+}
+
+static int
+b64_varint(struct b64_cursor* C, uint64_t* value)
+{
+    uint64_t result = 0;
+    unsigned int shift;
+    int byte;
+
+    for (shift = 0; shift <= 63; shift += 7)
+    {
+        byte = b64_next(C);
+        if (byte < 0) return -1;
+        result |= ((uint64_t)byte & 127) << shift;
+
+        if (!(byte & 128))
+        {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* step over a field of type as parse_optional_field or parse_required_field
+ * would parse it */
+static int
+b64_field(struct b64_cursor* C, uint8_t type, int optional)
+{
+    uint64_t field = 0;
+    uint64_t length = 0;
+    const int next = b64_peek(C);
+
+    if (next < 0) return -1;
+    if (next != type) return optional ? 0 : -1;
+    if (b64_varint(C, &field) < 0 || b64_varint(C, &length) < 0) return -1;
+    if (length > C->sz - C->off) return -1;
+    C->off += length;
+    return 0;
+}
+
+static int
+b64_walk(struct b64_cursor* C, size_t* num_caveats)
+{
+    size_t caveats_sz = 0;
+
+    if (b64_next(C) != 2) return -1;
+    if (b64_field(C, TYPE_LOCATION, 1) < 0) return -1;
+    if (b64_field(C, TYPE_IDENTIFIER, 0) < 0) return -1;
+    if (b64_next(C) != EOS) return -1;
+
+    while (b64_peek(C) > 0)
+    {
+        if (b64_field(C, TYPE_LOCATION, 1) < 0) return -1;
+        if (b64_field(C, TYPE_IDENTIFIER, 0) < 0) return -1;
+        if (b64_field(C, TYPE_VID, 1) < 0) return -1;
+        if (b64_next(C) != EOS) return -1;
+        ++caveats_sz;
+    }
+
+    if (b64_next(C) != EOS) return -1;
+    if (b64_field(C, TYPE_SIGNATURE, 0) < 0) return -1;
+    *num_caveats = caveats_sz;
+    return 0;
+}
+
+int
+macaroon_deserialize_measure_v2_b64(const unsigned char* data, size_t data_sz,
+                                    size_t* num_caveats, size_t* body_sz,
+                                    enum macaroon_returncode* err)
+{
+    struct b64_cursor C;
+
+    if (b64_cursor_init(&C, data, data_sz) < 0 ||
+        b64_walk(&C, num_caveats) < 0)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    *body_sz = C.sz;
+    return 0;
+}
+
+int
+macaroon_deserialize_fill_v2_b64(const unsigned char* data, size_t data_sz,
+                                 struct macaroon* M, size_t num_caveats,
+                                 unsigned char* body, size_t body_sz,
+                                 enum macaroon_returncode* err)
+{
+    struct b64_cursor C;
+    size_t caveats_sz = num_caveats;
+    size_t sz = 0;
+
+    /* the walk in measure skipped field contents, so this is where the
+     * characters and the final quantum's spare bits are checked */
+    if (b64_cursor_init(&C, data, data_sz) < 0 || C.sz != body_sz ||
+        b64_decode((const char*)data, C.data_sz, body, body_sz, B64_URL) != (int)body_sz ||
+        parse_v2(body, body_sz, NULL, M, NULL, &caveats_sz, &sz) < 0 ||
+        caveats_sz != num_caveats)
+    {
+        *err = MACAROON_INVALID;
+        return -1;
+    }
+
+    return 0;
 }
 
 #define JSON_START "{\"v\":2"
 #define JSON_CAVEATS_START ",\"c\":["
 #define JSON_CAVEATS_FINISH "],"
 
-/* size prior to 64 suffix */
-#define JSON_MAX_FIELD_SIZE 1
+#define JSON_SPACE 1 /* JSON whitespace */
+#define JSON_STOP 2 /* ends a run of plain characters in a string */
+
+static const unsigned char json_class[256] = {
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 2, 2, 3, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    1, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#define JSON_ONES 0x0101010101010101ULL
+#define JSON_HIGHS 0x8080808080808080ULL
+#define JSON_HAS_LESS(X, N) (((X) - JSON_ONES * (N)) & ~(X) & JSON_HIGHS)
+#define JSON_HAS_ZERO(X) JSON_HAS_LESS(X, 1)
+
+/* skip plain string characters, eight at a time where possible */
+static const unsigned char*
+json_plain(const unsigned char* ptr, const unsigned char* end)
+{
+    uint64_t x;
+
+    while (end - ptr >= 8)
+    {
+        memcpy(&x, ptr, sizeof(x));
+
+        if (JSON_HAS_ZERO(x ^ (JSON_ONES * '"')) |
+            JSON_HAS_ZERO(x ^ (JSON_ONES * '\\')) |
+            JSON_HAS_LESS(x, 0x20))
+        {
+            break;
+        }
+
+        ptr += 8;
+    }
+
+    while (ptr < end && !(json_class[*ptr] & JSON_STOP))
+    {
+        ++ptr;
+    }
+
+    return ptr;
+}
+
+/* Fields are written as JSON strings when they are valid UTF-8, escaping
+ * only what must be escaped, and otherwise as their *64 base64 form.  The
+ * size hint makes the same choices, so it is exact.
+ */
 
-const char*
+static const char*
 json_field_type(uint8_t type)
 {
-    /* If you elongate these strings, update JSON_MAX_FIELD_SIZE */
     switch (type)
     {
         case TYPE_LOCATION:
@@ -340,10 +1297,9 @@ json_field_type(uint8_t type)
     }
 }
 
-const char*
+static const char*
 json_field_type_b64(uint8_t type)
 {
-    /* If you elongate these strings, update JSON_MAX_FIELD_SIZE */
     switch (type)
     {
         case TYPE_LOCATION:
@@ -359,192 +1315,248 @@ json_field_type_b64(uint8_t type)
     }
 }
 
-const char*
-json_field_type_encoded(uint8_t type, int encoding)
+static const char*
+json_field_type_encoded(uint8_t type, int encoding)
+{
+    switch (encoding)
+    {
+        case ENC_STR:
+            return json_field_type(type);
+        case ENC_B64:
+            return json_field_type_b64(type);
+        default:
+            return NULL;
+    }
+}
+
+/* checks for well-formed UTF-8, skipping ASCII eight bytes at a time */
+static int
+json_is_utf8(const unsigned char* ptr, const unsigned char* end)
+{
+    unsigned char lo;
+    unsigned char hi;
+    size_t n;
+    size_t i;
+    uint64_t x;
+
+    while (ptr < end)
+    {
+        if (end - ptr >= 8)
+        {
+            memcpy(&x, ptr, sizeof(x));
+
+            if (!(x & JSON_HIGHS))
+            {
+                ptr += 8;
+                continue;
+            }
+        }
+
+        lo = 0x80;
+        hi = 0xbf;
+
+        if (*ptr < 0x80) n = 0;
+        else if (*ptr >= 0xc2 && *ptr <= 0xdf) n = 1;
+        else if (*ptr == 0xe0) n = 2, lo = 0xa0;
+        else if (*ptr == 0xed) n = 2, hi = 0x9f;
+        else if (*ptr >= 0xe1 && *ptr <= 0xef) n = 2;
+        else if (*ptr == 0xf0) n = 3, lo = 0x90;
+        else if (*ptr >= 0xf1 && *ptr <= 0xf3) n = 3;
+        else if (*ptr == 0xf4) n = 3, hi = 0x8f;
+        else return 0;
+
+        if (n > 0)
+        {
+            if ((size_t)(end - ptr) <= n) return 0;
+            if (ptr[1] < lo || ptr[1] > hi) return 0;
+
+            for (i = 2; i <= n; ++i)
+            {
+                if ((ptr[i] & 0xc0) != 0x80) return 0;
+            }
+        }
+
+        ptr += n + 1;
+    }
+
+    return 1;
+}
+
+static int
+json_encoding(const struct slice* f)
+{
+    return json_is_utf8(f->data, f->data + f->size) ? ENC_STR : ENC_B64;
+}
+
+/* the character after the backslash, or 0 for a \u00XX escape */
+static unsigned char
+json_short_escape(unsigned char c)
+{
+    switch (c)
+    {
+        case '"': return '"';
+        case '\\': return '\\';
+        case '\b': return 'b';
+        case '\f': return 'f';
+        case '\n': return 'n';
+        case '\r': return 'r';
+        case '\t': return 't';
+        default: return 0;
+    }
+}
+
+static size_t
+json_escaped_size(const unsigned char* ptr, const unsigned char* end)
 {
-    switch (encoding)
+    size_t sz = end - ptr;
+
+    while ((ptr = json_plain(ptr, end)) < end)
     {
-        case ENC_STR:
-            return json_field_type(type);
-        case ENC_B64:
-            return json_field_type_b64(type);
-        default:
-            return NULL;
+        sz += json_short_escape(*ptr) ? 1 : 5;
+        ++ptr;
     }
+
+    return sz;
 }
 
-size_t
-json_required_field_size(int encoding, const struct slice* f)
+static size_t
+json_required_field_size(int comma, uint8_t type, int encoding,
+                         const struct slice* f)
 {
+    const size_t sz = (comma ? 1 : 0)
+                    + 5 /* quote field + quote value + colon */
+                    + strlen(json_field_type_encoded(type, encoding));
+
     switch (encoding)
     {
         case ENC_STR:
-            return 6 + JSON_MAX_FIELD_SIZE + f->size;
+            return sz + json_escaped_size(f->data, f->data + f->size);
         case ENC_B64:
-            return 6 + JSON_MAX_FIELD_SIZE + 2 + (8 * f->size + 7) / 6;
+            return sz + (4 * f->size + 2) / 3;
         default:
             abort();
     }
 }
 
-size_t
-json_optional_field_size(int encoding, const struct slice* f)
+static size_t
+json_optional_field_size(int comma, uint8_t type, const struct slice* f)
 {
-    return f->size ? json_required_field_size(encoding, f) : 0;
+    return f->size ? json_required_field_size(comma, type, json_encoding(f), f) : 0;
 }
 
 size_t
 macaroon_serialize_size_hint_v2j(const struct macaroon* M)
 {
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
     size_t i;
     size_t sz = STRLENOF(JSON_START)
               + STRLENOF(JSON_CAVEATS_START)
               + STRLENOF(JSON_CAVEATS_FINISH)
               + 1 /* finishing */
-              + json_optional_field_size(ENC_STR, &M->location)
-              + json_required_field_size(ENC_STR, &M->identifier)
-              + json_required_field_size(ENC_B64, &M->signature);
+              + json_optional_field_size(1, TYPE_LOCATION, &M->location)
+              + json_required_field_size(1, TYPE_IDENTIFIER, json_encoding(&M->identifier), &M->identifier)
+              + json_required_field_size(0, TYPE_SIGNATURE, ENC_B64, &M->signature);
+
+    caveat_walk_init(&W, M);
 
-    for (i = 0; i < M->num_caveats; ++i)
+    for (i = 0; (C = caveat_walk_next(&W, &ctmp)); ++i)
     {
-        sz += 3; /* ,{} */
-        sz += json_optional_field_size(ENC_STR, &M->caveats[i].cl);
-        sz += json_required_field_size(ENC_STR, &M->caveats[i].cid);
-        sz += json_optional_field_size(ENC_STR, &M->caveats[i].vid);
+        sz += i > 0 ? 3 : 2; /* ,{} */
+        sz += json_required_field_size(0, TYPE_IDENTIFIER, json_encoding(&C->cid), &C->cid);
+        sz += json_optional_field_size(1, TYPE_LOCATION, &C->cl);
+        sz += json_optional_field_size(1, TYPE_VID, &C->vid);
     }
 
-    return sz;
-}
+    caveat_walk_done(&W);
 
-void
-json_emit_char(unsigned char c,
-               unsigned char** ptr,
-               unsigned char* const end)
-{
-    assert(*ptr < end);
-    **ptr = c;
-    ++*ptr;
+    return sz;
 }
 
-int
-json_emit_string(const char* str, size_t str_sz,
-                 unsigned char** ptr,
-                 unsigned char* const end)
-{
-    if (*ptr + str_sz + 2 > end) return -1;
-    json_emit_char('"', ptr, end);
-    memmove(*ptr, str, str_sz);
-    *ptr += str_sz;
-    json_emit_char('"', ptr, end);
-    return 0;
-}
+/* The emitters below assume the size hint has been checked against the
+ * buffer, and return the end of what they wrote.
+ */
 
-int
-json_emit_string_b64(const char* str, size_t str_sz,
-                     unsigned char** ptr,
-                     unsigned char* const end)
+static unsigned char*
+json_emit_escaped(const unsigned char* ptr, const unsigned char* end,
+                  unsigned char* out)
 {
-    const size_t b64_sz = (str_sz * 8 + 7) / 6;
-    if (*ptr + b64_sz + 2 > end) return -1;
-    json_emit_char('"', ptr, end);
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpointer-sign"
-    int ret = b64_ntop(str, str_sz, *ptr, end - *ptr);
-    if (ret < 0) return -1;
-    *ptr += ret;
-#pragma GCC diagnostic pop
-    json_emit_char('"', ptr, end);
-    return 0;
-}
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* run;
+    unsigned char esc;
 
-int
-json_emit_encoded_string(int encoding,
-                         const char* str, size_t str_sz,
-                         unsigned char** ptr,
-                         unsigned char* const end)
-{
-    switch (encoding)
+    while (ptr < end)
     {
-        case ENC_STR:
-            /* XXX check that it is UTF-8 and switch to other case if not */
-            /* XXX if the above XXX is addressed, remember to adjust sz hint */
-            return json_emit_string(str, str_sz, ptr, end);
-        case ENC_B64:
-            return json_emit_string_b64(str, str_sz, ptr, end);
-        default:
-            return -1;
-    }
-}
+        run = ptr;
+        ptr = json_plain(ptr, end);
+        memmove(out, run, ptr - run);
+        out += ptr - run;
 
-int
-json_emit_required_field(int comma, int encoding, uint8_t _type,
-                         const struct slice* f,
-                         unsigned char** ptr,
-                         unsigned char* const end)
-{
-    const char* type = json_field_type_encoded(_type, encoding);
-    assert(type);
-    const size_t type_sz = strlen(type);
-    const size_t sz = 6/*quote field + quote value + colon + comma */
-                    + type_sz + f->size;
-    if (*ptr + sz > end) return -1;
-    if (comma) json_emit_char(',', ptr, end);
-    if (json_emit_string(type, type_sz, ptr, end) < 0) return -1;
-    json_emit_char(':', ptr, end);
-    if (json_emit_encoded_string(encoding, (const char*)f->data, f->size, ptr, end) < 0) return -1;
-    assert(*ptr <= end);
-    return 0;
-}
+        if (ptr >= end)
+        {
+            break;
+        }
 
-int
-json_emit_optional_field(int comma, int encoding, uint8_t type,
-                         const struct slice* f,
-                         unsigned char** ptr,
-                         unsigned char* const end)
-{
-    return f->size ? json_emit_required_field(comma, encoding, type, f, ptr, end) : 0;
-}
+        esc = json_short_escape(*ptr);
+        *out++ = '\\';
 
-int
-json_emit_start(unsigned char** ptr,
-                unsigned char* const end)
-{
-    const size_t sz = STRLENOF(JSON_START);
-    if (*ptr + sz > end) return -1;
-    memmove(*ptr, JSON_START, sz);
-    *ptr += sz;
-    return 0;
-}
+        if (esc)
+        {
+            *out++ = esc;
+        }
+        else
+        {
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex[*ptr >> 4];
+            *out++ = hex[*ptr & 15];
+        }
 
-int
-json_emit_finish(unsigned char** ptr,
-                 unsigned char* const end)
-{
-    if (*ptr >= end) return -1;
-    json_emit_char('}', ptr, end);
-    return 0;
+        ++ptr;
+    }
+
+    return out;
 }
 
-int
-json_emit_caveats_start(unsigned char** ptr,
-                        unsigned char* const end)
+static unsigned char*
+json_emit_required_field(int comma, uint8_t type, int encoding,
+                         const struct slice* f, unsigned char* out)
 {
-    const size_t sz = STRLENOF(JSON_CAVEATS_START);
-    if (*ptr + sz > end) return -1;
-    memmove(*ptr, JSON_CAVEATS_START, sz);
-    *ptr += sz;
-    return 0;
+    const char* key = json_field_type_encoded(type, encoding);
+    const size_t key_sz = strlen(key);
+    int rc;
+
+    if (comma) *out++ = ',';
+    *out++ = '"';
+    memmove(out, key, key_sz);
+    out += key_sz;
+    *out++ = '"';
+    *out++ = ':';
+    *out++ = '"';
+
+    if (encoding == ENC_STR)
+    {
+        out = json_emit_escaped(f->data, f->data + f->size, out);
+    }
+    else
+    {
+        /* the NUL b64_encode appends lands where the closing quote goes */
+        rc = b64_encode(f->data, f->size, (char*)out, (4 * f->size + 2) / 3 + 1, B64_URL);
+        assert(rc >= 0);
+        out += rc;
+    }
+
+    *out++ = '"';
+    return out;
 }
 
-int
-json_emit_caveats_finish(unsigned char** ptr,
-                         unsigned char* const end)
+static unsigned char*
+json_emit_optional_field(int comma, uint8_t type,
+                         const struct slice* f, unsigned char* out)
 {
-    const size_t sz = STRLENOF(JSON_CAVEATS_FINISH);
-    if (*ptr + sz > end) return -1;
-    memmove(*ptr, JSON_CAVEATS_FINISH, sz);
-    *ptr += sz;
-    return 0;
+    return f->size ? json_emit_required_field(comma, type, json_encoding(f), f, out) : out;
 }
 
 size_t
@@ -552,497 +1564,441 @@ macaroon_serialize_v2j(const struct macaroon* M,
                        unsigned char* data, size_t data_sz,
                        enum macaroon_returncode* err)
 {
+    const size_t sz = macaroon_serialize_size_hint_v2j(M);
     unsigned char* ptr = data;
-    unsigned char* const end = ptr + data_sz;
+    struct caveat_walk W;
+    const struct caveat* C;
+    struct caveat ctmp;
     size_t i;
-    if (ptr >= end) goto json_emit_buf_too_small;
-    if (json_emit_start(&ptr, end) < 0) goto json_emit_buf_too_small;
-    if (json_emit_optional_field(1, ENC_STR, TYPE_LOCATION, &M->location, &ptr, end) < 0) goto json_emit_buf_too_small;
-    if (json_emit_required_field(1, ENC_STR, TYPE_IDENTIFIER, &M->identifier, &ptr, end) < 0) goto json_emit_buf_too_small;
-    if (json_emit_caveats_start(&ptr, end) < 0) goto json_emit_buf_too_small;
-
-    for (i = 0; i < M->num_caveats; ++i)
-    {
-        const struct caveat* C = &M->caveats[i];
-        if (ptr + 3 >= end) goto json_emit_buf_too_small;
-        if (i > 0) json_emit_char(',', &ptr, end);
-        json_emit_char('{', &ptr, end);
-        if (json_emit_required_field(0, ENC_STR, TYPE_IDENTIFIER, &C->cid, &ptr, end) < 0) goto json_emit_buf_too_small;
-        if (json_emit_optional_field(1, ENC_STR, TYPE_LOCATION, &C->cl, &ptr, end) < 0) goto json_emit_buf_too_small;
-        if (json_emit_optional_field(1, ENC_STR, TYPE_VID, &C->vid, &ptr, end) < 0) goto json_emit_buf_too_small;
-        if (ptr >= end) goto json_emit_buf_too_small;
-        json_emit_char('}', &ptr, end);
-    }
-
-    if (json_emit_caveats_finish(&ptr, end) < 0) goto json_emit_buf_too_small;
-    if (json_emit_required_field(0, ENC_B64, TYPE_SIGNATURE, &M->signature, &ptr, end) < 0) goto json_emit_buf_too_small;
-    if (json_emit_finish(&ptr, end) < 0) goto json_emit_buf_too_small;
-    return ptr - data;
-
-json_emit_buf_too_small:
-    *err = MACAROON_BUF_TOO_SMALL;
-    return 0;
+
+    if (data_sz < sz)
+    {
+        *err = MACAROON_BUF_TOO_SMALL;
+        return 0;
+    }
+
+    memmove(ptr, JSON_START, STRLENOF(JSON_START));
+    ptr += STRLENOF(JSON_START);
+    ptr = json_emit_optional_field(1, TYPE_LOCATION, &M->location, ptr);
+    ptr = json_emit_required_field(1, TYPE_IDENTIFIER, json_encoding(&M->identifier), &M->identifier, ptr);
+    memmove(ptr, JSON_CAVEATS_START, STRLENOF(JSON_CAVEATS_START));
+    ptr += STRLENOF(JSON_CAVEATS_START);
+
+    caveat_walk_init(&W, M);
+
+    for (i = 0; (C = caveat_walk_next(&W, &ctmp)); ++i)
+    {
+        if (i > 0) *ptr++ = ',';
+        *ptr++ = '{';
+        ptr = json_emit_required_field(0, TYPE_IDENTIFIER, json_encoding(&C->cid), &C->cid, ptr);
+        ptr = json_emit_optional_field(1, TYPE_LOCATION, &C->cl, ptr);
+        ptr = json_emit_optional_field(1, TYPE_VID, &C->vid, ptr);
+        *ptr++ = '}';
+    }
+
+    caveat_walk_done(&W);
+
+    memmove(ptr, JSON_CAVEATS_FINISH, STRLENOF(JSON_CAVEATS_FINISH));
+    ptr += STRLENOF(JSON_CAVEATS_FINISH);
+    ptr = json_emit_required_field(0, TYPE_SIGNATURE, ENC_B64, &M->signature, ptr);
+    *ptr++ = '}';
+    assert(ptr == data + sz);
+    return sz;
 }
 
-/* all but the top level parsing function only changes "err" if it's not
- * MACAROON_INVALID; it's assumed to already equal that.
+/* JSON is parsed in two passes over the caller's buffer, neither of which
+ * copies it.  The first indexes the structural characters outside of strings
+ * to find how many caveats there are; the second validates the document and
+ * decodes every value, escapes and base64 included, straight into the body of
+ * a single allocation.  No value decodes to more bytes than its JSON text, so
+ * the input's size bounds the body.
  */
 
-void
-j2b_skip_whitespace(char** ptr, char* end)
+/* the number of objects outside of strings, or -1 if a string never ends */
+static long
+j2b_count_objects(const unsigned char* ptr, const unsigned char* end)
 {
-    while (*ptr < end)
+    long objects = 0;
+
+    while (ptr < end)
     {
-        if (!isspace(**ptr))
+        if (*ptr == '{')
         {
-            break;
+            ++objects;
         }
+        else if (*ptr == '"')
+        {
+            ++ptr;
+
+            while ((ptr = json_plain(ptr, end)) < end && *ptr != '"')
+            {
+                if (*ptr == '\\' && ++ptr >= end) return -1;
+                ++ptr;
+            }
 
-        ++*ptr;
+            if (ptr >= end) return -1;
+        }
+
+        ++ptr;
     }
+
+    return objects;
 }
 
-int
-j2b_string(char** ptr, char* end,
-           enum macaroon_returncode* err, struct slice* s)
+struct j2b
 {
-    *err = MACAROON_INVALID;
-    assert(*ptr < end);
-    assert(**ptr == '"');
-    ++*ptr;
-    s->data = (const unsigned char*)*ptr;
+    const unsigned char* ptr;
+    const unsigned char* end;
+    unsigned char* wptr; /* the next free byte of the body */
+    unsigned char* wend;
+};
 
-    while (*ptr < end)
+static void
+j2b_skip_whitespace(struct j2b* j)
+{
+    while (j->ptr < j->end && (json_class[*j->ptr] & JSON_SPACE))
     {
-        if (**ptr == '\\')
-        {
-            if (*ptr + 1 >= end)
-            {
-                return -1;
-            }
+        ++j->ptr;
+    }
+}
 
-            if ((*ptr)[1] == 'u')
-            {
-                if (*ptr + 6 >= end)
-                {
-                    return -1;
-                }
+/* consume ch, and any whitespace before it, if it is next */
+static int
+j2b_expect(struct j2b* j, unsigned char ch)
+{
+    j2b_skip_whitespace(j);
+    if (j->ptr >= j->end || *j->ptr != ch) return -1;
+    ++j->ptr;
+    return 0;
+}
 
-                *ptr += 6;
-            }
-            else
-            {
-                *ptr += 2;
-            }
-        }
-        else if (**ptr == '"')
-        {
-            break;
-        }
-        else
-        {
-            ++*ptr;
-        }
-    }
+static int
+j2b_hex4(const unsigned char* ptr, uint32_t* cp)
+{
+    size_t i;
+    *cp = 0;
 
-    if (*ptr >= end)
+    for (i = 0; i < 4; ++i)
     {
-        return -1;
+        const unsigned char c = ptr[i];
+        *cp <<= 4;
+
+        if (c >= '0' && c <= '9') *cp |= c - '0';
+        else if (c >= 'a' && c <= 'f') *cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *cp |= c - 'A' + 10;
+        else return -1;
     }
 
-    **ptr = '\0';
-    s->size = (const unsigned char*)*ptr - s->data;
-    ++*ptr;
     return 0;
 }
 
-int
-j2b_b64_decode(struct slice* s)
+/* decode the \u escape(s) at j->ptr as UTF-8 into out */
+static unsigned char*
+j2b_unicode(struct j2b* j, unsigned char* out, unsigned char* out_end)
 {
-    int ret;
-    unsigned char* tmp = malloc(s->size);
-    if (!tmp) return -1;
-    ret = b64_pton((const char*)s->data, tmp, s->size);
+    uint32_t cp;
+    uint32_t lo;
+
+    if (j->end - j->ptr < 6 || j2b_hex4(j->ptr + 2, &cp) < 0) return NULL;
+    j->ptr += 6;
 
-    if (ret >= 0)
+    if (cp >= 0xdc00 && cp <= 0xdfff) return NULL;
+
+    if (cp >= 0xd800 && cp <= 0xdbff)
     {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wcast-qual"
-        memmove((unsigned char*)s->data, tmp, ret);
-#pragma GCC diagnostic pop
-        s->size = ret;
-        ret = 0;
+        if (j->end - j->ptr < 6 || j->ptr[0] != '\\' || j->ptr[1] != 'u' ||
+            j2b_hex4(j->ptr + 2, &lo) < 0 || lo < 0xdc00 || lo > 0xdfff)
+        {
+            return NULL;
+        }
+
+        j->ptr += 6;
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+    }
+
+    if (cp < 0x80)
+    {
+        if (out_end - out < 1) return NULL;
+        *out++ = cp;
+    }
+    else if (cp < 0x800)
+    {
+        if (out_end - out < 2) return NULL;
+        *out++ = 0xc0 | (cp >> 6);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    else if (cp < 0x10000)
+    {
+        if (out_end - out < 3) return NULL;
+        *out++ = 0xe0 | (cp >> 12);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
     }
     else
     {
-        ret = -1;
+        if (out_end - out < 4) return NULL;
+        *out++ = 0xf0 | (cp >> 18);
+        *out++ = 0x80 | ((cp >> 12) & 0x3f);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
     }
 
-    free(tmp);
-    return ret;
+    return out;
 }
 
-int
-j2b_caveat(char** ptr, char* end, enum macaroon_returncode* err, struct caveat* caveat)
+/* decode the string at j->ptr into out and return the end of what was
+ * written, or NULL if it is malformed or does not fit
+ */
+static unsigned char*
+j2b_string(struct j2b* j, unsigned char* out, unsigned char* out_end)
 {
-    struct slice s = EMPTY_SLICE;
-    struct slice cl = EMPTY_SLICE;
-    struct slice cid = EMPTY_SLICE;
-    struct slice vid = EMPTY_SLICE;
-    int seen_cl = 0;
-    int seen_cid = 0;
-    int seen_vid = 0;
+    const unsigned char* run;
 
-    if (*ptr >= end) return -1;
-    if (**ptr != '{') return -1;
-    ++*ptr;
-    int first = 1;
+    if (j->ptr >= j->end || *j->ptr != '"') return NULL;
+    ++j->ptr;
 
-    while (*ptr < end)
+    while (1)
     {
-        j2b_skip_whitespace(ptr, end);
+        run = j->ptr;
+        j->ptr = json_plain(j->ptr, j->end);
+        if (out_end - out < j->ptr - run) return NULL;
+        memmove(out, run, j->ptr - run);
+        out += j->ptr - run;
 
-        if (*ptr < end && **ptr == '}')
-        {
-            break;
-        }
+        if (j->ptr >= j->end || *j->ptr < 0x20) return NULL;
 
-        if (!first)
+        if (*j->ptr == '"')
         {
-            if (*ptr >= end || **ptr != ',') return -1;
-            ++*ptr;
+            ++j->ptr;
+            return out;
         }
 
-        first = 0;
-        j2b_skip_whitespace(ptr, end);
+        if (j->end - j->ptr < 2) return NULL;
 
-        if (*ptr >= end || **ptr != '"' ||
-            j2b_string(ptr, end, err, &s) < 0)
+        if (j->ptr[1] == 'u')
         {
-            return -1;
+            out = j2b_unicode(j, out, out_end);
+            if (!out) return NULL;
+            continue;
         }
 
-        j2b_skip_whitespace(ptr, end);
-        if (*ptr >= end || **ptr != ':') return -1;
-        ++*ptr;
-        j2b_skip_whitespace(ptr, end);
+        if (out >= out_end) return NULL;
 
-        if (s.size == 1 && memcmp("i", s.data, s.size) == 0)
-        {
-            if (seen_cid) return -1;
-            if (j2b_string(ptr, end, err, &cid) < 0) return -1;
-            seen_cid = 1;
-        }
-        else if (s.size == 1 && memcmp("l", s.data, s.size) == 0)
-        {
-            if (seen_cl) return -1;
-            if (j2b_string(ptr, end, err, &cl) < 0) return -1;
-            seen_cl = 1;
-        }
-        else if (s.size == 1 && memcmp("v", s.data, s.size) == 0)
+        switch (j->ptr[1])
         {
-            if (seen_vid) return -1;
-            if (j2b_string(ptr, end, err, &vid) < 0) return -1;
-            seen_vid = 1;
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            default: return NULL;
         }
-        else if (s.size == 3 && memcmp("i64", s.data, s.size) == 0)
-        {
-            if (seen_cid) return -1;
-            if (j2b_string(ptr, end, err, &cid) < 0) return -1;
-            seen_cid = 1;
 
-            if (j2b_b64_decode(&cid) < 0)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                return -1;
-            }
-        }
-        else if (s.size == 3 && memcmp("l64", s.data, s.size) == 0)
-        {
-            if (seen_cl) return -1;
-            if (j2b_string(ptr, end, err, &cl) < 0) return -1;
-            seen_cl = 1;
+        j->ptr += 2;
+    }
+}
 
-            if (j2b_b64_decode(&cl) < 0)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                return -1;
-            }
-        }
-        else if (s.size == 3 && memcmp("v64", s.data, s.size) == 0)
-        {
-            if (seen_vid) return -1;
-            if (j2b_string(ptr, end, err, &vid) < 0) return -1;
-            seen_vid = 1;
+/* decode a value into the body, base64-decoding it if b64 is set */
+static int
+j2b_value(struct j2b* j, int b64, struct slice* s)
+{
+    unsigned char* const start = j->wptr;
+    unsigned char* end;
+    unsigned flags = B64_STD | B64_URL;
+    int sz;
 
-            if (j2b_b64_decode(&vid) < 0)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                return -1;
-            }
-        }
-        else
-        {
-            return -1;
-        }
+    if (s->data) return -1; /* each field at most once, in any encoding */
+    j2b_skip_whitespace(j);
+    end = j2b_string(j, start, j->wend);
+    if (!end) return -1;
+
+    if (b64)
+    {
+        if (end > start && end[-1] == '=') flags |= B64_PADDED;
+        sz = b64_decode((const char*)start, end - start, start, end - start, flags);
+        if (sz < 0) return -1;
+        end = start + sz;
     }
 
-    if (*ptr >= end) return -1;
-    ++*ptr;
-    if (!seen_cid) return -1;
-    caveat->cid = cid;
-    caveat->vid = vid;
-    caveat->cl = cl;
+    s->data = start;
+    s->size = end - start;
+    j->wptr = end;
     return 0;
 }
 
-int
-j2b_caveats(char** ptr, char* end, enum macaroon_returncode* err,
-            struct caveat** caveats, size_t* caveats_sz)
+/* read a key and classify it as the field x (0), x64 (1), or neither (-1) */
+static int
+j2b_key(struct j2b* j, char* x)
 {
-    struct caveat* tmp = NULL;
-    size_t caveats_cap = 4;
-    *caveats_sz = 0;
-    *caveats = malloc(sizeof(struct caveat) * caveats_cap);
+    unsigned char key[3];
+    unsigned char* end;
+
+    j2b_skip_whitespace(j);
+    end = j2b_string(j, key, key + sizeof(key));
+    if (!end || end == key || j2b_expect(j, ':') < 0) return -1;
+    *x = key[0];
+    if (end - key == 1) return 0;
+    if (end - key == 3 && key[1] == '6' && key[2] == '4') return 1;
+    return -1;
+}
 
-    if (!*caveats)
-    {
-        *err = MACAROON_OUT_OF_MEMORY;
-        return -1;
-    }
+static int
+j2b_caveat(struct j2b* j, struct caveat* C)
+{
+    struct slice* s;
+    char x;
+    int b64;
 
-    if (*ptr >= end || **ptr != '[') return -1;
-    ++*ptr;
-    j2b_skip_whitespace(ptr, end);
+    if (j2b_expect(j, '{') < 0) return -1;
 
-    while (*ptr < end)
+    do
     {
-        if (**ptr == ']') break;
+        if ((b64 = j2b_key(j, &x)) < 0) return -1;
 
-        if (*caveats_sz == caveats_cap)
+        switch (x)
         {
-            caveats_cap = caveats_cap + (caveats_cap >> 1);
-            tmp = realloc(*caveats, sizeof(struct caveat) * caveats_cap);
+            case 'i': s = &C->cid; break;
+            case 'l': s = &C->cl; break;
+            case 'v': s = &C->vid; break;
+            default: return -1;
+        }
 
-            if (!tmp)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                return -1;
-            }
+        if (j2b_value(j, b64, s) < 0) return -1;
+    }
+    while (j2b_expect(j, ',') == 0);
 
-            *caveats = tmp;
-        }
+    if (j2b_expect(j, '}') < 0) return -1;
+    return C->cid.data ? 0 : -1;
+}
 
-        if (j2b_caveat(ptr, end, err, *caveats + *caveats_sz) < 0) return -1;
-        ++*caveats_sz;
-        j2b_skip_whitespace(ptr, end);
-        if (*ptr >= end) return -1;
+static int
+j2b_caveats(struct j2b* j, struct macaroon* M, size_t num_caveats)
+{
+    if (j2b_expect(j, '[') < 0) return -1;
+    if (j2b_expect(j, ']') == 0) return 0;
 
-        if (**ptr == ',')
-        {
-            ++*ptr;
-            j2b_skip_whitespace(ptr, end);
-        }
-        else  if (**ptr != ']')
-        {
-            return -1;;
-        }
+    do
+    {
+        if (M->num_caveats >= num_caveats) return -1;
+        if (j2b_caveat(j, &M->caveats[M->num_caveats]) < 0) return -1;
+        ++M->num_caveats;
     }
+    while (j2b_expect(j, ',') == 0);
 
-    if (*ptr >= end) return -1;
-    ++*ptr;
-    return 0;
+    return j2b_expect(j, ']');
 }
 
-struct macaroon*
-j2b_macaroon(char** ptr, char* end,
-             enum macaroon_returncode* err)
+/* the version is 2, either as a number or as a string */
+static int
+j2b_version(struct j2b* j)
 {
-    struct macaroon* M = NULL;
-    struct slice s;
-    struct slice location;
-    struct slice identifier;
-    struct slice signature;
-    int seen_location = 0;
-    int seen_identifier = 0;
-    int seen_signature = 0;
-    int seen_caveats = 0;
-    /* allocated by j2b_caveats */
-    struct caveat* caveats = NULL;
-    size_t caveats_sz = 0;
-    size_t i = 0;
+    unsigned char v[1];
 
-    *err = MACAROON_INVALID;
-    j2b_skip_whitespace(ptr, end);
-    if (*ptr >= end) goto invalid;
-    if (**ptr != '{') goto invalid;
-    ++*ptr;
-    int first = 1;
+    j2b_skip_whitespace(j);
 
-    while (*ptr < end)
+    if (j->ptr < j->end && *j->ptr == '2')
     {
-        j2b_skip_whitespace(ptr, end);
-
-        if (*ptr < end && **ptr == '}')
-        {
-            break;
-        }
+        ++j->ptr;
+        return 0;
+    }
 
-        if (!first)
-        {
-            if (*ptr >= end || **ptr != ',') goto invalid;
-            ++*ptr;
-        }
+    return j2b_string(j, v, v + sizeof(v)) == v + 1 && v[0] == '2' ? 0 : -1;
+}
 
-        first = 0;
-        j2b_skip_whitespace(ptr, end);
+static int
+j2b_macaroon(struct j2b* j, struct macaroon* M, size_t num_caveats)
+{
+    int seen_version = 0;
+    int seen_caveats = 0;
+    char x;
+    int b64;
 
-        if (*ptr >= end || **ptr != '"' ||
-            j2b_string(ptr, end, err, &s) < 0)
-        {
-            goto invalid;
-        }
+    if (j2b_expect(j, '{') < 0) return -1;
 
-        j2b_skip_whitespace(ptr, end);
-        if (*ptr >= end || **ptr != ':') goto invalid;
-        ++*ptr;
-        j2b_skip_whitespace(ptr, end);
+    do
+    {
+        if ((b64 = j2b_key(j, &x)) < 0) return -1;
 
-        if (s.size == 1 && memcmp("v", s.data, s.size) == 0)
-        {
-            if (**ptr != '2') goto invalid;
-            ++*ptr;
-            j2b_skip_whitespace(ptr, end);
-        }
-        else if (s.size == 1 && memcmp("i", s.data, s.size) == 0)
-        {
-            if (seen_identifier) goto invalid;
-            if (j2b_string(ptr, end, err, &identifier) < 0) goto invalid;
-            seen_identifier = 1;
-        }
-        else if (s.size == 1 && memcmp("l", s.data, s.size) == 0)
+        if (x == 'v' && !b64)
         {
-            if (seen_location) goto invalid;
-            if (j2b_string(ptr, end, err, &location) < 0) goto invalid;
-            seen_location = 1;
+            if (seen_version || j2b_version(j) < 0) return -1;
+            seen_version = 1;
         }
-        else if (s.size == 1 && memcmp("s", s.data, s.size) == 0)
+        else if (x == 'c' && !b64)
         {
-            if (seen_signature) goto invalid;
-            if (j2b_string(ptr, end, err, &signature) < 0) goto invalid;
-            seen_signature = 1;
-        }
-        else if (s.size == 1 && memcmp("c", s.data, s.size) == 0)
-        {
-            if (seen_caveats) goto invalid;
+            if (seen_caveats || j2b_caveats(j, M, num_caveats) < 0) return -1;
             seen_caveats = 1;
-            if (j2b_caveats(ptr, end, err, &caveats, &caveats_sz) < 0) goto error;
         }
-        else if (s.size == 3 && memcmp("i64", s.data, s.size) == 0)
+        else if (x == 'i')
         {
-            if (seen_identifier) goto invalid;
-            if (j2b_string(ptr, end, err, &identifier) < 0) goto invalid;
-            seen_identifier = 1;
-
-            if (j2b_b64_decode(&identifier) < 0)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                goto error;
-            }
+            if (j2b_value(j, b64, &M->identifier) < 0) return -1;
         }
-        else if (s.size == 3 && memcmp("l64", s.data, s.size) == 0)
+        else if (x == 'l')
         {
-            if (seen_location) goto invalid;
-            if (j2b_string(ptr, end, err, &location) < 0) goto invalid;
-            seen_location = 1;
-
-            if (j2b_b64_decode(&location) < 0)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                goto error;
-            }
+            if (j2b_value(j, b64, &M->location) < 0) return -1;
         }
-        else if (s.size == 3 && memcmp("s64", s.data, s.size) == 0)
+        else if (x == 's')
         {
-            if (seen_signature) goto invalid;
-            if (j2b_string(ptr, end, err, &signature) < 0) goto invalid;
-            seen_signature = 1;
-
-            if (j2b_b64_decode(&signature) < 0)
-            {
-                *err = MACAROON_OUT_OF_MEMORY;
-                goto error;
-            }
+            if (j2b_value(j, b64, &M->signature) < 0) return -1;
         }
         else
         {
-            goto invalid;
+            return -1;
         }
     }
+    while (j2b_expect(j, ',') == 0);
 
-    /* on a good exit ptr will point to '}', so error out it doesn't, advance
-     * it, skip the whitespace, and error out if there are trailing characters
-     */
-    if (*ptr >= end) goto invalid;
-    ++*ptr;
-    j2b_skip_whitespace(ptr, end);
-    if (*ptr != end) goto invalid;
-
-    /* sanity check */
-    if (!seen_signature || !seen_identifier || !seen_caveats) goto invalid;
-
-    unsigned char* write = NULL;
-    M = macaroon_malloc(caveats_sz, 10000/*body_sz*/, &write);
-
-    if (!M)
-    {
-        *err = MACAROON_OUT_OF_MEMORY;
-        goto error;
-    }
-
-    write = copy_slice(&location, &M->location, write);
-    write = copy_slice(&identifier, &M->identifier, write);
-    write = copy_slice(&signature, &M->signature, write);
-    M->num_caveats = caveats_sz;
-
-    for (i = 0; i < caveats_sz; ++i)
-    {
-        write = copy_slice(&caveats[i].cid, &M->caveats[i].cid, write);
-        write = copy_slice(&caveats[i].vid, &M->caveats[i].vid, write);
-        write = copy_slice(&caveats[i].cl, &M->caveats[i].cl, write);
-    }
-
-    free(caveats);
-    return M;
+    if (j2b_expect(j, '}') < 0) return -1;
+    j2b_skip_whitespace(j);
+    if (j->ptr != j->end) return -1;
 
-invalid:
-    *err = MACAROON_INVALID;
-error:
-    if (caveats)
+    if (!M->identifier.data || !seen_caveats ||
+        M->signature.size != MACAROON_HASH_BYTES)
     {
-        free(caveats);
+        return -1;
     }
 
-    return NULL;
+    return macaroon_validate(M);
 }
 
 struct macaroon*
 macaroon_deserialize_v2j(const unsigned char* data, size_t data_sz,
+                         const struct macaroon_allocator* A,
                          enum macaroon_returncode* err)
 {
     struct macaroon* M = NULL;
-    char* copy = malloc(data_sz);
-    char* ptr = copy;
-    char* const end = ptr + data_sz;
+    struct j2b j;
+    unsigned char* body = NULL;
+    long objects = j2b_count_objects(data, data + data_sz);
+
+    if (objects < 1)
+    {
+        *err = MACAROON_INVALID;
+        return NULL;
+    }
 
-    if (!copy)
+    M = macaroon_malloc(A, objects - 1, data_sz, &body);
+
+    if (!M)
     {
         *err = MACAROON_OUT_OF_MEMORY;
         return NULL;
     }
 
-    memmove(copy, data, data_sz);
-    M = j2b_macaroon(&ptr, end, err);
-    free(copy);
+    j.ptr = data;
+    j.end = data + data_sz;
+    j.wptr = body;
+    j.wend = body + data_sz;
+
+    if (j2b_macaroon(&j, M, objects - 1) < 0)
+    {
+        macaroon_destroy(M);
+        *err = MACAROON_INVALID;
+        return NULL;
+    }
+
     return M;
 }
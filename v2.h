@@ -31,6 +31,7 @@
 
 /* C */
 #include <stdlib.h>
+#include <sys/uio.h>
 
 /* macaroons */
 #include "base64.h"
@@ -46,9 +47,140 @@ macaroon_serialize_v2(const struct macaroon* M,
                       unsigned char* data, size_t data_sz,
                       enum macaroon_returncode* err);
 
+/* describe M as header fragments written to scratch, interleaved with iovecs
+ * that point into M; 0 if the capacities in iov_sz/scratch_sz sufficed, -1 if
+ * not, and either way they come back holding the amounts needed */
+int
+macaroon_serialize_iov_v2(const struct macaroon* M,
+                          struct iovec* iov, size_t* iov_sz,
+                          unsigned char* scratch, size_t* scratch_sz);
+
+/* parse only the location and identifier, which point into data, and say
+ * where the caveats begin */
+int
+macaroon_deserialize_header_v2(const unsigned char* data, size_t data_sz,
+                               struct slice* location, struct slice* identifier,
+                               size_t* caveats_off,
+                               enum macaroon_returncode* err);
+
+/* as macaroon_deserialize_view, for a V2 macaroon whose location and
+ * identifier macaroon_deserialize_header_v2 has parsed; only the caveats and
+ * signature, from caveats_off on, are parsed again */
 struct macaroon*
-macaroon_deserialize_v2(const unsigned char* data, size_t data_sz,
-                        enum macaroon_returncode* err);
+macaroon_deserialize_resume_v2(const unsigned char* data, size_t data_sz,
+                               const struct slice* location,
+                               const struct slice* identifier,
+                               size_t caveats_off,
+                               enum macaroon_returncode* err);
+
+/* count the caveats and body bytes a V2 macaroon needs, without allocating */
+int
+macaroon_deserialize_measure_v2(const unsigned char* data, size_t data_sz,
+                                size_t* num_caveats, size_t* body_sz,
+                                enum macaroon_returncode* err);
+
+/* fill M, laid out with the measured sizes, from data; MACAROON_INVALID if
+ * data no longer matches them */
+int
+macaroon_deserialize_fill_v2(const unsigned char* data, size_t data_sz,
+                             struct macaroon* M, size_t num_caveats,
+                             unsigned char* body, size_t body_sz,
+                             enum macaroon_returncode* err);
+
+/* fill M with slices that point into data rather than copies */
+int
+macaroon_deserialize_borrow_v2(const unsigned char* data, size_t data_sz,
+                               struct macaroon* M, size_t num_caveats,
+                               enum macaroon_returncode* err);
+
+/* Bundles frame V2 macaroons in which a location may instead be a one-byte
+ * index into up to MACAROON_BUNDLE_MAX_STRINGS strings shared by the bundle.
+ * The serializing side keeps the strings sorted with bundle_string_cmp.
+ */
+#define MACAROON_BUNDLE_VERSION 0x82
+#define MACAROON_BUNDLE_MAX_STRINGS 128
+
+int
+bundle_string_cmp(const void* lhs, const void* rhs);
+
+size_t
+macaroon_serialize_size_bundled_v2(const struct macaroon* M,
+                                   const struct slice* strings, size_t strings_sz);
+
+/* unchecked; writes exactly macaroon_serialize_size_bundled_v2 bytes */
+unsigned char*
+macaroon_serialize_bundled_v2(const struct macaroon* M,
+                              const struct slice* strings, size_t strings_sz,
+                              unsigned char* ptr);
+
+/* as measure_v2, except referenced locations are not counted in body_sz */
+int
+macaroon_deserialize_measure_bundled_v2(const unsigned char* data, size_t data_sz,
+                                        const struct slice* strings, size_t strings_sz,
+                                        size_t* num_caveats, size_t* body_sz,
+                                        enum macaroon_returncode* err);
+
+/* as fill_v2, with referenced locations pointing into strings */
+int
+macaroon_deserialize_fill_bundled_v2(const unsigned char* data, size_t data_sz,
+                                     const struct slice* strings, size_t strings_sz,
+                                     struct macaroon* M, size_t num_caveats,
+                                     unsigned char* body, size_t body_sz,
+                                     enum macaroon_returncode* err);
+
+/* MACAROON_V2D is V2 behind its own version byte and the version of the
+ * dictionary it was written with.  Caveat ids and locations may be given as
+ * a dictionary entry followed by the rest of their bytes.  Writing uses the
+ * loaded dictionary with the version, or the current one for version 0;
+ * reading needs the one the token names.
+ */
+#define MACAROON_V2D_VERSION 0x03
+
+size_t
+macaroon_serialize_size_hint_v2d(const struct macaroon* M, unsigned version);
+
+size_t
+macaroon_serialize_v2d(const struct macaroon* M, unsigned version,
+                       unsigned char* data, size_t data_sz,
+                       enum macaroon_returncode* err);
+
+int
+macaroon_deserialize_measure_v2d(const unsigned char* data, size_t data_sz,
+                                 size_t* num_caveats, size_t* body_sz,
+                                 enum macaroon_returncode* err);
+
+int
+macaroon_deserialize_fill_v2d(const unsigned char* data, size_t data_sz,
+                              struct macaroon* M, size_t num_caveats,
+                              unsigned char* body, size_t body_sz,
+                              enum macaroon_returncode* err);
+
+/* MACAROON_V2_B64URL is V2 in the URL-safe base64 alphabet, written without
+ * padding and read with or without it.  The version byte's top six bits are
+ * clear, so these tokens begin with 'A'; V1 tokens begin with a hex digit and
+ * never do.  Deserializing decodes straight into the macaroon's body, which
+ * is measured as the decoded size, and the fields borrow from there.
+ */
+#define MACAROON_V2_B64URL_LEAD 'A'
+
+size_t
+macaroon_serialize_size_hint_v2_b64(const struct macaroon* M);
+
+size_t
+macaroon_serialize_v2_b64(const struct macaroon* M,
+                          unsigned char* data, size_t data_sz,
+                          enum macaroon_returncode* err);
+
+int
+macaroon_deserialize_measure_v2_b64(const unsigned char* data, size_t data_sz,
+                                    size_t* num_caveats, size_t* body_sz,
+                                    enum macaroon_returncode* err);
+
+int
+macaroon_deserialize_fill_v2_b64(const unsigned char* data, size_t data_sz,
+                                 struct macaroon* M, size_t num_caveats,
+                                 unsigned char* body, size_t body_sz,
+                                 enum macaroon_returncode* err);
 
 size_t
 macaroon_serialize_size_hint_v2j(const struct macaroon* M);
@@ -60,6 +192,7 @@ macaroon_serialize_v2j(const struct macaroon* M,
 
 struct macaroon*
 macaroon_deserialize_v2j(const unsigned char* data, size_t data_sz,
+                         const struct macaroon_allocator* A,
                          enum macaroon_returncode* err);
 
 #endif /* macaroons_v2_h_ */